@@ -1,13 +1,331 @@
 #include "hooking.h"
 #include "alloc.h"
 #include <Windows.h>
+#include "pipe.h"
 
 #ifdef USE_PRIVATE_HEAP
+#ifdef USE_SLAB_ALLOCATOR
+//
+// Small blocks are handed out from per-thread free lists, one per size
+// class, so the common case touches neither a lock nor the last error.  The
+// free lists are refilled from (and drained to) a central list per class,
+// which in turn is fed by carving up slabs of an address range reserved up
+// front.  A slab only ever holds blocks of one class, so the class of a
+// block is found from its address when it gets freed.  Blocks freed by
+// another thread than the one that allocated them simply join the freeing
+// thread's list.
+//
+
+#define SLAB_SIZE (64 * 1024)
+#ifdef _WIN64
+#define SLAB_ARENA_SIZE (128 * 1024 * 1024)
+#else
+#define SLAB_ARENA_SIZE (16 * 1024 * 1024)
+#endif
+#define SLAB_COUNT (SLAB_ARENA_SIZE / SLAB_SIZE)
+
+// blocks a thread keeps per class before giving some back, and how many
+// move between a thread and the central list at a time
+#define CACHE_MAX 64
+#define CACHE_BATCH 32
+
+// TEB->TlsSlots, read directly so that the fast path leaves the last error
+// alone without saving it
+#ifdef _WIN64
+#define TEB_TLS_SLOTS 0x1480
+#else
+#define TEB_TLS_SLOTS 0xe10
+#endif
+// marks a thread whose cache is gone, its blocks go straight to the
+// central lists
+#define CACHE_DETACHED ((alloc_cache_t *)1)
+
+static const unsigned short g_class_sizes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, CM_SLAB_MAX_SIZE
+};
+#define CLASS_COUNT (sizeof(g_class_sizes) / sizeof(g_class_sizes[0]))
+
+typedef struct _free_block_t {
+	struct _free_block_t *next;
+} free_block_t;
+
+typedef struct _alloc_class_t {
+	CRITICAL_SECTION lock;
+	free_block_t *free;
+	// what's left of the slab being carved up
+	char *carve;
+	char *carve_end;
+} alloc_class_t;
+
+typedef struct _alloc_cache_t {
+	free_block_t *free[CLASS_COUNT];
+	unsigned int count[CLASS_COUNT];
+} alloc_cache_t;
+
+#ifdef CM_ALLOC_STATS
+typedef struct _alloc_stats_t {
+	volatile LONG allocs;
+	volatile LONG frees;
+	volatile LONG refills;
+	volatile LONG drains;
+} alloc_stats_t;
+
+static alloc_stats_t g_class_stats[CLASS_COUNT];
+static volatile LONG g_heap_allocs;
+static volatile LONG g_heap_frees;
+#define STAT_INC(x) InterlockedIncrement(&(x))
+#else
+#define STAT_INC(x)
+#endif
+
+static char *g_arena;
+static volatile LONG g_slabs_used;
+static unsigned char g_slab_class[SLAB_COUNT];
+static alloc_class_t g_classes[CLASS_COUNT];
+// size class of each multiple of 16 bytes up to CM_SLAB_MAX_SIZE
+static unsigned char g_size_class[CM_SLAB_MAX_SIZE / 16 + 1];
+static DWORD g_tls_alloc_index = TLS_OUT_OF_INDEXES;
+
+void cm_alloc_init(void)
+{
+	PVOID BaseAddress = NULL;
+	SIZE_T RegionSize = SLAB_ARENA_SIZE;
+	unsigned int i, cls;
+
+	for (i = 0, cls = 0; i <= CM_SLAB_MAX_SIZE / 16; i++) {
+		while (g_class_sizes[cls] < i * 16)
+			cls++;
+		g_size_class[i] = cls;
+	}
+	for (cls = 0; cls < CLASS_COUNT; cls++)
+		InitializeCriticalSection(&g_classes[cls].lock);
+
+	// only the first 64 slots can be read straight from the TEB
+	g_tls_alloc_index = TlsAlloc();
+	if (g_tls_alloc_index >= TLS_MINIMUM_AVAILABLE)
+		return;
+
+	if (pNtAllocateVirtualMemory(GetCurrentProcess(), &BaseAddress, 0, &RegionSize, MEM_RESERVE, PAGE_NOACCESS) < 0)
+		return;
+	g_arena = (char *)BaseAddress;
+}
+
+static __inline BOOLEAN in_arena(const void *ptr)
+{
+	return g_arena != NULL && (ULONG_PTR)ptr - (ULONG_PTR)g_arena < SLAB_ARENA_SIZE;
+}
+
+static __inline unsigned int block_class(const void *ptr)
+{
+	return g_slab_class[((ULONG_PTR)ptr - (ULONG_PTR)g_arena) / SLAB_SIZE];
+}
+
+static alloc_cache_t *thread_cache(void)
+{
+	alloc_cache_t **slot = (alloc_cache_t **)((char *)NtCurrentTeb() + TEB_TLS_SLOTS) + g_tls_alloc_index;
+	alloc_cache_t *cache = *slot;
+	lasterror_t lasterror;
+
+	if (cache == CACHE_DETACHED)
+		return NULL;
+	if (cache != NULL)
+		return cache;
+
+	get_lasterrors(&lasterror);
+	cache = (alloc_cache_t *)HeapAlloc(g_heap, HEAP_ZERO_MEMORY, sizeof(alloc_cache_t));
+	*slot = cache;
+	set_lasterrors(&lasterror);
+	return cache;
+}
+
+// takes a new slab for cls, called with the class lock held
+static BOOLEAN new_slab(alloc_class_t *c, unsigned int cls)
+{
+	PVOID BaseAddress;
+	SIZE_T RegionSize = SLAB_SIZE;
+	LONG idx;
+	lasterror_t lasterror;
+	BOOLEAN ret = FALSE;
+
+	if (g_slabs_used >= SLAB_COUNT)
+		return FALSE;
+	idx = InterlockedIncrement(&g_slabs_used) - 1;
+	if (idx >= SLAB_COUNT)
+		return FALSE;
+
+	get_lasterrors(&lasterror);
+	BaseAddress = g_arena + idx * SLAB_SIZE;
+	if (pNtAllocateVirtualMemory(GetCurrentProcess(), &BaseAddress, 0, &RegionSize, MEM_COMMIT, PAGE_READWRITE) >= 0) {
+		g_slab_class[idx] = (unsigned char)cls;
+		c->carve = g_arena + idx * SLAB_SIZE;
+		c->carve_end = c->carve + SLAB_SIZE - SLAB_SIZE % g_class_sizes[cls];
+		ret = TRUE;
+	}
+	set_lasterrors(&lasterror);
+	return ret;
+}
+
+// moves up to max blocks of the central list (or fresh ones) to *list,
+// returns how many it moved
+static unsigned int central_take(unsigned int cls, free_block_t **list, unsigned int max)
+{
+	alloc_class_t *c = &g_classes[cls];
+	free_block_t *b;
+	unsigned int n = 0;
+
+	EnterCriticalSection(&c->lock);
+	while (n < max && c->free != NULL) {
+		b = c->free;
+		c->free = b->next;
+		b->next = *list;
+		*list = b;
+		n++;
+	}
+	while (n < max) {
+		if (c->carve == c->carve_end && !new_slab(c, cls))
+			break;
+		b = (free_block_t *)c->carve;
+		c->carve += g_class_sizes[cls];
+		b->next = *list;
+		*list = b;
+		n++;
+	}
+	LeaveCriticalSection(&c->lock);
+	return n;
+}
+
+// head..tail is a chain of blocks of cls
+static void central_give(unsigned int cls, free_block_t *head, free_block_t *tail)
+{
+	alloc_class_t *c = &g_classes[cls];
+
+	EnterCriticalSection(&c->lock);
+	tail->next = c->free;
+	c->free = head;
+	LeaveCriticalSection(&c->lock);
+}
+
+static void *slab_alloc(size_t size)
+{
+	alloc_cache_t *cache;
+	free_block_t *b;
+	unsigned int cls;
+
+	if (g_arena == NULL || (cache = thread_cache()) == NULL)
+		return NULL;
+
+	cls = g_size_class[(size + 15) / 16];
+	if (cache->free[cls] == NULL) {
+		cache->count[cls] = central_take(cls, &cache->free[cls], CACHE_BATCH);
+		STAT_INC(g_class_stats[cls].refills);
+		if (cache->count[cls] == 0)
+			return NULL;
+	}
+
+	b = cache->free[cls];
+	cache->free[cls] = b->next;
+	cache->count[cls]--;
+	STAT_INC(g_class_stats[cls].allocs);
+	return b;
+}
+
+static void slab_free(void *ptr)
+{
+	alloc_cache_t *cache = thread_cache();
+	free_block_t *b = (free_block_t *)ptr, *tail;
+	unsigned int cls = block_class(ptr), i;
+
+	STAT_INC(g_class_stats[cls].frees);
+
+	if (cache == NULL) {
+		central_give(cls, b, b);
+		return;
+	}
+
+	b->next = cache->free[cls];
+	cache->free[cls] = b;
+	if (++cache->count[cls] <= CACHE_MAX)
+		return;
+
+	// keep the most recently freed blocks, they're the likeliest to be warm
+	for (i = 1, tail = b; i < CACHE_MAX - CACHE_BATCH; i++)
+		tail = tail->next;
+	b = tail->next;
+	tail->next = NULL;
+	for (i = 1, tail = b; tail->next != NULL; i++)
+		tail = tail->next;
+	cache->count[cls] -= i;
+	central_give(cls, b, tail);
+	STAT_INC(g_class_stats[cls].drains);
+}
+
+void cm_alloc_thread_detach(void)
+{
+	alloc_cache_t **slot, *cache;
+	free_block_t *tail;
+	unsigned int cls;
+
+	if (g_arena == NULL)
+		return;
+
+	slot = (alloc_cache_t **)((char *)NtCurrentTeb() + TEB_TLS_SLOTS) + g_tls_alloc_index;
+	cache = *slot;
+	// allocations made later on during the detach skip the cache
+	*slot = CACHE_DETACHED;
+	if (cache == NULL || cache == CACHE_DETACHED)
+		return;
+
+	for (cls = 0; cls < CLASS_COUNT; cls++) {
+		if (cache->free[cls] == NULL)
+			continue;
+		for (tail = cache->free[cls]; tail->next != NULL; tail = tail->next);
+		central_give(cls, cache->free[cls], tail);
+	}
+	HeapFree(g_heap, 0, cache);
+}
+
+void cm_alloc_report(void)
+{
+#ifdef CM_ALLOC_STATS
+	unsigned int cls;
+	LONG slabs = g_slabs_used < SLAB_COUNT ? g_slabs_used : SLAB_COUNT;
+
+	for (cls = 0; cls < CLASS_COUNT; cls++) {
+		alloc_stats_t *s = &g_class_stats[cls];
+		if (s->allocs == 0)
+			continue;
+		pipe("INFO:Allocator: %d byte blocks, %d allocations, %d frees, %d refills, %d drains",
+			g_class_sizes[cls], s->allocs, s->frees, s->refills, s->drains);
+	}
+	pipe("INFO:Allocator: %d of %d slabs used, %d heap allocations, %d heap frees",
+		slabs, SLAB_COUNT, g_heap_allocs, g_heap_frees);
+#endif
+}
+#else
+void cm_alloc_init(void)
+{
+}
+
+void cm_alloc_thread_detach(void)
+{
+}
+
+void cm_alloc_report(void)
+{
+}
+#endif
+
 void *cm_alloc(size_t size)
 {
 	void *ret;
 	lasterror_t lasterror;
 
+#ifdef USE_SLAB_ALLOCATOR
+	if (size <= CM_SLAB_MAX_SIZE && (ret = slab_alloc(size)) != NULL)
+		return ret;
+	STAT_INC(g_heap_allocs);
+#endif
+
 	get_lasterrors(&lasterror);
 	ret = HeapAlloc(g_heap, 0, size);
 	set_lasterrors(&lasterror);
@@ -19,6 +337,16 @@ void *cm_calloc(size_t count, size_t size)
 	void *ret;
 	lasterror_t lasterror;
 
+#ifdef USE_SLAB_ALLOCATOR
+	if (size && count > (size_t)-1 / size)
+		return NULL;
+	if (count * size <= CM_SLAB_MAX_SIZE && (ret = slab_alloc(count * size)) != NULL) {
+		memset(ret, 0, count * size);
+		return ret;
+	}
+	STAT_INC(g_heap_allocs);
+#endif
+
 	get_lasterrors(&lasterror);
 	ret = HeapAlloc(g_heap, HEAP_ZERO_MEMORY, count * size);
 	set_lasterrors(&lasterror);
@@ -29,6 +357,23 @@ void *cm_realloc(void *ptr, size_t size)
 {
 	void *ret;
 	lasterror_t lasterror;
+
+#ifdef USE_SLAB_ALLOCATOR
+	if (ptr == NULL)
+		return cm_alloc(size);
+	if (in_arena(ptr)) {
+		size_t oldsize = g_class_sizes[block_class(ptr)];
+		if (size <= oldsize)
+			return ptr;
+		ret = cm_alloc(size);
+		if (ret != NULL) {
+			memcpy(ret, ptr, oldsize);
+			slab_free(ptr);
+		}
+		return ret;
+	}
+#endif
+
 	get_lasterrors(&lasterror);
 	ret = HeapReAlloc(g_heap, 0, ptr, size);
 	set_lasterrors(&lasterror);
@@ -38,6 +383,17 @@ void *cm_realloc(void *ptr, size_t size)
 void cm_free(void *ptr)
 {
 	lasterror_t lasterror;
+
+#ifdef USE_SLAB_ALLOCATOR
+	if (ptr == NULL)
+		return;
+	if (in_arena(ptr)) {
+		slab_free(ptr);
+		return;
+	}
+	STAT_INC(g_heap_frees);
+#endif
+
 	get_lasterrors(&lasterror);
 	HeapFree(g_heap, 0, ptr);
 	set_lasterrors(&lasterror);
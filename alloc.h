@@ -23,6 +23,15 @@ extern _NtFreeVirtualMemory pNtFreeVirtualMemory;
 
 #ifdef USE_PRIVATE_HEAP
 extern HANDLE g_heap;
+
+// blocks of up to CM_SLAB_MAX_SIZE bytes come from per-thread caches of
+// fixed size classes instead of the private heap, see alloc.c
+#define USE_SLAB_ALLOCATOR
+#define CM_SLAB_MAX_SIZE 2048
+
+// counts allocations per size class, sent to the analyzer by
+// cm_alloc_report() when the process exits
+//#define CM_ALLOC_STATS
 #else
 struct cm_alloc_header {
 	DWORD Magic;
@@ -41,6 +50,9 @@ extern void *cm_realloc(void *ptr, size_t size);
 extern void cm_free(void *ptr);
 #ifdef USE_PRIVATE_HEAP
 extern void *cm_calloc(size_t count, size_t size);
+extern void cm_alloc_init(void);
+extern void cm_alloc_thread_detach(void);
+extern void cm_alloc_report(void);
 #else
 static __inline void *cm_calloc(size_t count, size_t size)
 {
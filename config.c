@@ -20,6 +20,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ntapi.h"
 #include "config.h"
 #include "misc.h"
+#include "hooking.h"
+#include "ignore.h"
+
+static int hook_profile_from_name(const char *name, unsigned int *profile)
+{
+	if (!strcmp(name, "minimal"))
+		*profile = HOOK_PROFILE_MINIMAL;
+	else if (!strcmp(name, "network"))
+		*profile = HOOK_PROFILE_NETWORK;
+	else if (!strcmp(name, "default") || !strcmp(name, "full"))
+		*profile = HOOK_PROFILE_DEFAULT;
+	else
+		return 0;
+	return 1;
+}
 
 int read_config(void)
 {
@@ -27,6 +42,15 @@ int read_config(void)
     char buf[512], config_fname[MAX_PATH];
 	FILE *fp;
 	unsigned int i;
+	// per-process hook profiles take priority over the global one
+	int process_profile = 0;
+	const wchar_t *our_process_name;
+
+	g_config.hook_profile = HOOK_PROFILE_DEFAULT;
+	strcpy(g_config.hook_profile_name, "default");
+
+	our_process_name = wcsrchr(our_process_path, L'\\');
+	our_process_name = our_process_name ? our_process_name + 1 : our_process_path;
 
     sprintf(config_fname, "C:\\%u.ini", GetCurrentProcessId());
 
@@ -121,6 +145,46 @@ int read_config(void)
 			else if (!strcmp(key, "full-logs")) {
 				g_config.full_logs = value[0] == '1';
 			}
+			else if (!strcmp(key, "full-stacks")) {
+				g_config.full_stacks = value[0] == '1';
+			}
+			else if (!strcmp(key, "stack-table-max")) {
+				g_config.stack_table_max = atoi(value) * 1024;
+			}
+			else if (!strcmp(key, "hook-profile")) {
+				if (!process_profile && hook_profile_from_name(value, &g_config.hook_profile))
+					strncpy(g_config.hook_profile_name, value,
+						ARRAYSIZE(g_config.hook_profile_name) - 1);
+			}
+			else if (!strncmp(key, "hook-profile-", 13)) {
+				// e.g. hook-profile-svchost.exe=minimal
+				const char *procname = key + 13;
+				unsigned int len = (unsigned int)strlen(procname);
+				if (len == wcslen(our_process_name)) {
+					for (i = 0; i < len; i++) {
+						if (towlower(our_process_name[i]) != (wchar_t)tolower((unsigned char)procname[i]))
+							break;
+					}
+					if (i == len && hook_profile_from_name(value, &g_config.hook_profile)) {
+						strncpy(g_config.hook_profile_name, value,
+							ARRAYSIZE(g_config.hook_profile_name) - 1);
+						process_profile = 1;
+					}
+				}
+			}
+			else if (!strcmp(key, "lazy-hooks")) {
+				g_config.lazy_hooks = value[0] == '1';
+			}
+			else if (!strcmp(key, "ignore-file")) {
+				// one rule per line, e.g. ignore-file=C:\Windows\Prefetch\*
+				add_ignore_ruleA(IGNORE_LIST_FILE, value);
+			}
+			else if (!strcmp(key, "ignore-process")) {
+				add_ignore_ruleA(IGNORE_LIST_PROCESS, value);
+			}
+			else if (!strcmp(key, "ignore-key")) {
+				add_ignore_ruleA(IGNORE_LIST_KEY, value);
+			}
 			else if (!strcmp(key, "terminate-event")) {
 				strncpy(g_config.terminate_event_name, value,
 					ARRAYSIZE(g_config.terminate_event_name));
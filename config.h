@@ -52,6 +52,20 @@ struct _g_config {
 	// do we want to ignore "file of interest" and other forms of log reduction?
 	int full_logs;
 
+	// do we capture the full call stack of every logged API call?
+	int full_stacks;
+
+	// upper bound in bytes for the table of unique call stacks
+	unsigned int stack_table_max;
+
+	// HOOK_CAT_* mask of the hooks to install (see HOOK_PROFILE_*)
+	unsigned int hook_profile;
+	char hook_profile_name[32];
+
+	// only hook most libraries once the program uses them, see
+	// lazy_hooks_resolved() in cuckoomon.c
+	int lazy_hooks;
+
     // how many milliseconds since startup
     unsigned int startup_time;
 
@@ -0,0 +1,233 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "ntapi.h"
+#include <sddl.h>
+#include "hooking.h"
+#include "log.h"
+#include "pipe.h"
+#include "config.h"
+#include "control.h"
+#include "ignore.h"
+
+#define CONTROL_BUFSIZE 512
+
+hook_t *get_hook_by_name(const char *funcname);
+int hook_is_required(const hook_t *h);
+
+// only local SYSTEM and administrators may open the pipe, which is where
+// the analyzer runs.  A monitored process running as administrator gets
+// past that, so the client's pid is checked against the analyzer's too
+#define CONTROL_PIPE_SDDL "D:P(D;;GA;;;NU)(A;;GA;;;SY)(A;;GA;;;BA)"
+
+// bounds of the pause between failing ConnectNamedPipe() calls, in ms
+#define CONTROL_BACKOFF_MIN 10
+#define CONTROL_BACKOFF_MAX 5000
+
+typedef BOOL (WINAPI *_GetNamedPipeClientProcessId)(HANDLE Pipe, PULONG ClientProcessId);
+
+static HANDLE g_control_thread_handle;
+static char g_control_pipename[MAX_PATH];
+static _GetNamedPipeClientProcessId pGetNamedPipeClientProcessId;
+
+// log counts at the time of the previous command
+static unsigned int g_last_counts[LOG_MAX_INDEX];
+static DWORD g_last_tick;
+
+static void control_hook(const char *arg, int enable, char *reply, int replylen)
+{
+	unsigned int total = 0, api = 0;
+	unsigned int count;
+	const char *funcname = arg;
+	hook_t *h;
+	DWORD now, elapsed;
+	int index;
+	int i;
+
+	if (arg[0] == '#') {
+		index = atoi(arg + 1);
+		funcname = log_event_name(index);
+		if (funcname == NULL) {
+			_snprintf(reply, replylen, "ERROR:Unknown index %s", arg + 1);
+			return;
+		}
+	}
+	else {
+		index = log_index_from_name(funcname);
+	}
+
+	h = get_hook_by_name(funcname);
+	if (h == NULL) {
+		_snprintf(reply, replylen, "ERROR:Unknown hook %s", funcname);
+		return;
+	}
+
+	if (!enable && hook_is_required(h)) {
+		_snprintf(reply, replylen, "ERROR:Hook %s can't be disabled", funcname);
+		return;
+	}
+
+	if (hook_set_enabled(h, enable) < 0) {
+		_snprintf(reply, replylen, "ERROR:Unable to toggle hook %s", funcname);
+		return;
+	}
+
+	now = GetTickCount();
+	elapsed = now - g_last_tick;
+	if (elapsed == 0)
+		elapsed = 1;
+
+	for (i = 0; i < LOG_MAX_INDEX; i++) {
+		count = log_event_count(i);
+		if (i == index)
+			api = count - g_last_counts[i];
+		total += count - g_last_counts[i];
+		g_last_counts[i] = count;
+	}
+	g_last_tick = now;
+
+	_snprintf(reply, replylen, "OK:%s:%u:%u", funcname,
+		(unsigned int)((ULONGLONG)api * 1000 / elapsed),
+		(unsigned int)((ULONGLONG)total * 1000 / elapsed));
+}
+
+static void control_command(char *cmd, char *reply, int replylen)
+{
+	if (!strncmp(cmd, "HOOK_DISABLE:", 13))
+		control_hook(cmd + 13, 0, reply, replylen);
+	else if (!strncmp(cmd, "HOOK_ENABLE:", 12))
+		control_hook(cmd + 12, 1, reply, replylen);
+	else
+		_snprintf(reply, replylen, "ERROR:Unknown command");
+	reply[replylen - 1] = '\0';
+}
+
+static HANDLE create_control_pipe(void)
+{
+	SECURITY_ATTRIBUTES sa;
+	PSECURITY_DESCRIPTOR sd = NULL;
+	HANDLE pipehandle;
+
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(CONTROL_PIPE_SDDL,
+		SDDL_REVISION_1, &sd, NULL))
+		return INVALID_HANDLE_VALUE;
+
+	sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+	sa.bInheritHandle = FALSE;
+	sa.lpSecurityDescriptor = sd;
+
+	pipehandle = CreateNamedPipeA(g_control_pipename, PIPE_ACCESS_DUPLEX,
+		PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT, 1,
+		CONTROL_BUFSIZE, CONTROL_BUFSIZE, 0, &sa);
+
+	LocalFree(sd);
+	return pipehandle;
+}
+
+// TRUE unless we can tell the client isn't the analyzer, Windows XP
+// doesn't say who's on the other end
+static BOOL control_client_allowed(HANDLE pipehandle)
+{
+	ULONG pid;
+
+	if (pGetNamedPipeClientProcessId == NULL)
+		return TRUE;
+	if (!pGetNamedPipeClientProcessId(pipehandle, &pid))
+		return FALSE;
+	return is_protected_pid(pid);
+}
+
+static DWORD WINAPI _control_thread(LPVOID param)
+{
+	HANDLE pipehandle = (HANDLE)param;
+	char cmd[CONTROL_BUFSIZE];
+	char reply[CONTROL_BUFSIZE];
+	DWORD bytes;
+	DWORD backoff = 0;
+
+	hook_disable();
+
+	while (1) {
+		if (ConnectNamedPipe(pipehandle, NULL) || GetLastError() == ERROR_PIPE_CONNECTED) {
+			backoff = 0;
+			if (!control_client_allowed(pipehandle)) {
+				_snprintf(reply, sizeof(reply), "ERROR:Access denied");
+				reply[sizeof(reply) - 1] = '\0';
+				WriteFile(pipehandle, reply, (DWORD)strlen(reply), &bytes, NULL);
+				FlushFileBuffers(pipehandle);
+			}
+			else if (ReadFile(pipehandle, cmd, sizeof(cmd) - 1, &bytes, NULL)) {
+				cmd[bytes] = '\0';
+				control_command(cmd, reply, sizeof(reply));
+				WriteFile(pipehandle, reply, (DWORD)strlen(reply), &bytes, NULL);
+				FlushFileBuffers(pipehandle);
+			}
+		}
+		// the client was gone before we got to it
+		else if (GetLastError() == ERROR_NO_DATA) {
+			backoff = 0;
+		}
+		// most likely our handle got closed from under us, don't spin on
+		// it but wait a bit longer every time and start over with a new pipe
+		else {
+			backoff = backoff ? min(backoff * 2, CONTROL_BACKOFF_MAX) : CONTROL_BACKOFF_MIN;
+			Sleep(backoff);
+			CloseHandle(pipehandle);
+			pipehandle = create_control_pipe();
+			if (pipehandle == INVALID_HANDLE_VALUE) {
+				pipehandle = NULL;
+				continue;
+			}
+		}
+		DisconnectNamedPipe(pipehandle);
+	}
+
+	return 0;
+}
+
+int control_init()
+{
+	HANDLE pipehandle;
+
+	if (g_config.pipe_name[0] == '\0')
+		return 0;
+
+	_snprintf(g_control_pipename, sizeof(g_control_pipename), "%s_%u", g_config.pipe_name, GetCurrentProcessId());
+	g_control_pipename[sizeof(g_control_pipename) - 1] = '\0';
+
+	*(FARPROC *)&pGetNamedPipeClientProcessId = GetProcAddress(GetModuleHandleA("kernel32"), "GetNamedPipeClientProcessId");
+
+	pipehandle = create_control_pipe();
+	if (pipehandle == INVALID_HANDLE_VALUE) {
+		pipe("WARNING:Unable to create control pipe %z", g_control_pipename);
+		return -1;
+	}
+
+	g_last_tick = GetTickCount();
+
+	g_control_thread_handle =
+		CreateThread(NULL, 0, &_control_thread, pipehandle, 0, NULL);
+
+	if (g_control_thread_handle != NULL)
+		return 0;
+
+	pipe("CRITICAL:Error initializing control pipe thread!");
+	CloseHandle(pipehandle);
+	return -1;
+}
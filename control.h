@@ -0,0 +1,37 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//
+// Control pipe
+//
+// The analyzer can connect to the pipe named <pipe name>_<pid> and send one
+// of the following commands per message:
+//
+// HOOK_DISABLE:<name>   -> stop handling the given API
+// HOOK_ENABLE:<name>    -> resume handling the given API
+//
+// where <name> is either the API name (e.g. NtReadFile) or #<index> with the
+// index used in the "I" field of the logged API calls.  Hooks the handle
+// and memory bookkeeping depends on (NtClose, NtTerminateThread, ...) can't
+// be disabled.  The reply is either
+// OK:<name>:<api events/sec>:<total events/sec> with the rates measured since
+// the previous command, so the analyzer can see what disabling an API saves,
+// or ERROR:<reason>.
+//
+
+int control_init();
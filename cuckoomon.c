@@ -26,9 +26,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "pipe.h"
 #include "ignore.h"
 #include "hook_file.h"
+#include "handles.h"
+#include "pathcache.h"
 #include "hook_sleep.h"
 #include "config.h"
 #include "unhook.h"
+#include "control.h"
+#include "exports.h"
 #include "bson.h"
 
 // Allow debug mode to be turned on at compilation time.
@@ -40,11 +44,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 #define HOOK(library, funcname) {L###library, #funcname, NULL, \
-    &New_##funcname, (void **) &Old_##funcname}
+    &New_##funcname, (void **) &Old_##funcname, FALSE, FALSE, FALSE, \
+    HOOK_CATEGORY}
 
 #define HOOK2(library, funcname, recursion) {L###library, #funcname, NULL, \
-    &New2_##funcname, (void **) &Old2_##funcname, recursion}
-
+    &New2_##funcname, (void **) &Old2_##funcname, recursion, FALSE, TRUE, \
+    HOOK_CATEGORY}
+
+// for hooks that have side effects besides logging (process injection,
+// dropped file tracking, hiding, faked results, resuming logging), these
+// still run while logging is suspended, see hook_create_pre_tramp
+#define HOOK_ALWAYS(library, funcname) {L###library, #funcname, NULL, \
+    &New_##funcname, (void **) &Old_##funcname, FALSE, FALSE, TRUE, \
+    HOOK_CATEGORY}
+
+// for hooks that never log and pass the original results through unchanged,
+// see hook_create_pre_tramp; the lean recursion check it gets would let a
+// result faking handler (like the time hooks) apply its change twice
+#define HOOK_NOCALLER(library, funcname) {L###library, #funcname, NULL, \
+    &New_##funcname, (void **) &Old_##funcname, FALSE, TRUE, TRUE, \
+    HOOK_CATEGORY}
+
+// every hook gets the HOOK_CAT_* of the section it is listed in, which is
+// redefined at the start of each section below
 static hook_t g_hooks[] = {
 
     //
@@ -58,58 +80,63 @@ static hook_t g_hooks[] = {
     //
     // In other words, do *NOT* place "special" hooks behind "normal" hooks.
     //
+#define HOOK_CATEGORY HOOK_CAT_CORE
 
 	HOOK2(ntdll, LdrLoadDll, TRUE),
     HOOK2(kernel32, CreateProcessInternalW, TRUE),
+	// resume logging, hide the analyzer's files and feed the file dumping,
+	// so they're part of every profile.  Only logged with HOOK_CAT_FILE
+	HOOK_ALWAYS(ntdll, NtCreateFile),
+	HOOK_ALWAYS(ntdll, NtOpenFile),
 
 	// COM object creation hook
 	HOOK2(ole32, CoCreateInstance, TRUE),
 	//
     // File Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_FILE
 	HOOK(ntdll, NtQueryAttributesFile),
 	HOOK(ntdll, NtQueryFullAttributesFile),
-	HOOK(ntdll, NtCreateFile),
-    HOOK(ntdll, NtOpenFile),
     HOOK(ntdll, NtReadFile),
-    HOOK(ntdll, NtWriteFile),
-    HOOK(ntdll, NtDeleteFile),
-    HOOK(ntdll, NtDeviceIoControlFile),
+    HOOK_ALWAYS(ntdll, NtWriteFile),
+    HOOK_ALWAYS(ntdll, NtDeleteFile),
+    HOOK_ALWAYS(ntdll, NtDeviceIoControlFile),
     HOOK(ntdll, NtQueryDirectoryFile),
     HOOK(ntdll, NtQueryInformationFile),
-    HOOK(ntdll, NtSetInformationFile),
+    HOOK_ALWAYS(ntdll, NtSetInformationFile),
     HOOK(ntdll, NtOpenDirectoryObject),
     HOOK(ntdll, NtCreateDirectoryObject),
 
     // CreateDirectoryExA calls CreateDirectoryExW
     // CreateDirectoryW does not call CreateDirectoryExW
-    HOOK(kernel32, CreateDirectoryW),
-    HOOK(kernel32, CreateDirectoryExW),
+    HOOK_ALWAYS(kernel32, CreateDirectoryW),
+    HOOK_ALWAYS(kernel32, CreateDirectoryExW),
 
-    HOOK(kernel32, RemoveDirectoryA),
-    HOOK(kernel32, RemoveDirectoryW),
+    HOOK_ALWAYS(kernel32, RemoveDirectoryA),
+    HOOK_ALWAYS(kernel32, RemoveDirectoryW),
 
     // lowest variant of MoveFile()
-    HOOK(kernel32, MoveFileWithProgressW),
+    HOOK_ALWAYS(kernel32, MoveFileWithProgressW),
 
     HOOK(kernel32, FindFirstFileExA),
     HOOK(kernel32, FindFirstFileExW),
 
     // Covered by NtCreateFile() but still grap this information
-    HOOK(kernel32, CopyFileA),
-    HOOK(kernel32, CopyFileW),
-    HOOK(kernel32, CopyFileExW),
+    HOOK_ALWAYS(kernel32, CopyFileA),
+    HOOK_ALWAYS(kernel32, CopyFileW),
+    HOOK_ALWAYS(kernel32, CopyFileExW),
 
     // Covered by NtSetInformationFile() but still grab this information
-    HOOK(kernel32, DeleteFileA),
-    HOOK(kernel32, DeleteFileW),
+    HOOK_ALWAYS(kernel32, DeleteFileA),
+    HOOK_ALWAYS(kernel32, DeleteFileW),
 
     HOOK(kernel32, GetDiskFreeSpaceExA),
     HOOK(kernel32, GetDiskFreeSpaceExW),
     HOOK(kernel32, GetDiskFreeSpaceA),
     HOOK(kernel32, GetDiskFreeSpaceW),
 
-	HOOK(kernel32, GetVolumeNameForVolumeMountPointW),
+	HOOK_ALWAYS(kernel32, GetVolumeNameForVolumeMountPointW),
 
 	HOOK(shell32, SHGetFolderPathW),
 
@@ -123,12 +150,14 @@ static hook_t g_hooks[] = {
     // A as well as the W versions. In other words, we have to hook all the
     // ascii *and* unicode APIs of those functions.
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_REGISTRY
 
-    HOOK(advapi32, RegOpenKeyExA),
-    HOOK(advapi32, RegOpenKeyExW),
+    HOOK_ALWAYS(advapi32, RegOpenKeyExA),
+    HOOK_ALWAYS(advapi32, RegOpenKeyExW),
 
-    HOOK(advapi32, RegCreateKeyExA),
-    HOOK(advapi32, RegCreateKeyExW),
+    HOOK_ALWAYS(advapi32, RegCreateKeyExA),
+    HOOK_ALWAYS(advapi32, RegCreateKeyExW),
 
     // Note that RegDeleteKeyEx() is available for 64bit XP/Vista+
     HOOK(advapi32, RegDeleteKeyA),
@@ -146,8 +175,8 @@ static hook_t g_hooks[] = {
     HOOK(advapi32, RegSetValueExA),
     HOOK(advapi32, RegSetValueExW),
 
-    HOOK(advapi32, RegQueryValueExA),
-    HOOK(advapi32, RegQueryValueExW),
+    HOOK_ALWAYS(advapi32, RegQueryValueExA),
+    HOOK_ALWAYS(advapi32, RegQueryValueExW),
 
     HOOK(advapi32, RegDeleteValueA),
     HOOK(advapi32, RegDeleteValueW),
@@ -155,21 +184,21 @@ static hook_t g_hooks[] = {
     HOOK(advapi32, RegQueryInfoKeyA),
     HOOK(advapi32, RegQueryInfoKeyW),
 
-    HOOK(advapi32, RegCloseKey),
+    HOOK_ALWAYS(advapi32, RegCloseKey),
 
     //
     // Native Registry Hooks
     //
 
-	HOOK(ntdll, NtCreateKey),
-    HOOK(ntdll, NtOpenKey),
-    HOOK(ntdll, NtOpenKeyEx),
+	HOOK_ALWAYS(ntdll, NtCreateKey),
+    HOOK_ALWAYS(ntdll, NtOpenKey),
+    HOOK_ALWAYS(ntdll, NtOpenKeyEx),
 	HOOK(ntdll, NtRenameKey),
     HOOK(ntdll, NtReplaceKey),
     HOOK(ntdll, NtEnumerateKey),
     HOOK(ntdll, NtEnumerateValueKey),
 	HOOK(ntdll, NtSetValueKey),
-	HOOK(ntdll, NtQueryValueKey),
+	HOOK_ALWAYS(ntdll, NtQueryValueKey),
     HOOK(ntdll, NtQueryMultipleValueKey),
     HOOK(ntdll, NtDeleteKey),
 	HOOK(ntdll, NtDeleteValueKey),
@@ -183,6 +212,8 @@ static hook_t g_hooks[] = {
     //
     // Window Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_WINDOW
 
 	// can't use these until we come up with a fool-proof method of logging them,
 	// as they might not return as in the upatre downloader
@@ -194,41 +225,45 @@ static hook_t g_hooks[] = {
     HOOK(user32, FindWindowExA),
     HOOK(user32, FindWindowExW),
     HOOK(user32, EnumWindows),
-	HOOK(user32, SendNotifyMessageA),
-	HOOK(user32, SendNotifyMessageW),
+	HOOK_ALWAYS(user32, SendNotifyMessageA),
+	HOOK_ALWAYS(user32, SendNotifyMessageW),
 
     //
     // Sync Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_SYNC
 
-    HOOK(ntdll, NtCreateMutant),
-    HOOK(ntdll, NtOpenMutant),
-	HOOK(ntdll, NtCreateEvent),
-	HOOK(ntdll, NtOpenEvent),
+    HOOK_ALWAYS(ntdll, NtCreateMutant),
+    HOOK_ALWAYS(ntdll, NtOpenMutant),
+	HOOK_ALWAYS(ntdll, NtCreateEvent),
+	HOOK_ALWAYS(ntdll, NtOpenEvent),
 	HOOK(ntdll, NtCreateNamedPipeFile),
     //
     // Process Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_PROCESS
 
 	HOOK(kernel32, CreateToolhelp32Snapshot),
-	HOOK(kernel32, Process32FirstW),
-	HOOK(kernel32, Process32NextW),
-	HOOK(ntdll, NtCreateProcess),
-    HOOK(ntdll, NtCreateProcessEx),
-    HOOK(ntdll, NtCreateUserProcess),
-    HOOK(ntdll, RtlCreateUserProcess),
-    HOOK(ntdll, NtOpenProcess),
-    HOOK(ntdll, NtTerminateProcess),
-	HOOK(ntdll, NtResumeProcess),
-	HOOK(ntdll, NtCreateSection),
-	HOOK(ntdll, NtDuplicateObject),
+	HOOK_ALWAYS(kernel32, Process32FirstW),
+	HOOK_ALWAYS(kernel32, Process32NextW),
+	HOOK_ALWAYS(ntdll, NtCreateProcess),
+    HOOK_ALWAYS(ntdll, NtCreateProcessEx),
+    HOOK_ALWAYS(ntdll, NtCreateUserProcess),
+    HOOK_ALWAYS(ntdll, RtlCreateUserProcess),
+    HOOK_ALWAYS(ntdll, NtOpenProcess),
+    HOOK_ALWAYS(ntdll, NtTerminateProcess),
+	HOOK_ALWAYS(ntdll, NtResumeProcess),
+	HOOK_ALWAYS(ntdll, NtCreateSection),
+	HOOK_ALWAYS(ntdll, NtDuplicateObject),
     HOOK(ntdll, NtMakeTemporaryObject),
     HOOK(ntdll, NtMakePermanentObject),
-    HOOK(ntdll, NtOpenSection),
-    HOOK(ntdll, NtMapViewOfSection),
+    HOOK_ALWAYS(ntdll, NtOpenSection),
+    HOOK_ALWAYS(ntdll, NtMapViewOfSection),
 	HOOK(kernel32, WaitForDebugEvent),
 	HOOK(ntdll, DbgUiWaitStateChange),
-	HOOK(ntdll, RtlDispatchException),
+	HOOK_ALWAYS(ntdll, RtlDispatchException),
 
     // all variants of ShellExecute end up in ShellExecuteExW
     HOOK(shell32, ShellExecuteExW),
@@ -236,10 +271,10 @@ static hook_t g_hooks[] = {
     HOOK(ntdll, NtAllocateVirtualMemory),
     HOOK(ntdll, NtReadVirtualMemory),
     HOOK(kernel32, ReadProcessMemory),
-    HOOK(ntdll, NtWriteVirtualMemory),
-    HOOK(kernel32, WriteProcessMemory),
-    HOOK(ntdll, NtProtectVirtualMemory),
-    HOOK(kernel32, VirtualProtectEx),
+    HOOK_ALWAYS(ntdll, NtWriteVirtualMemory),
+    HOOK_ALWAYS(kernel32, WriteProcessMemory),
+    HOOK_ALWAYS(ntdll, NtProtectVirtualMemory),
+    HOOK_ALWAYS(kernel32, VirtualProtectEx),
     HOOK(ntdll, NtFreeVirtualMemory),
     //HOOK(kernel32, VirtualFreeEx),
 	
@@ -247,22 +282,26 @@ static hook_t g_hooks[] = {
     //
     // Thread Hooks
     //
-	HOOK(ntdll, NtQueueApcThread),
-    HOOK(ntdll, NtCreateThread),
-    HOOK(ntdll, NtCreateThreadEx),
-    HOOK(ntdll, NtOpenThread),
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_THREAD
+	HOOK_ALWAYS(ntdll, NtQueueApcThread),
+    HOOK_ALWAYS(ntdll, NtCreateThread),
+    HOOK_ALWAYS(ntdll, NtCreateThreadEx),
+    HOOK_ALWAYS(ntdll, NtOpenThread),
     HOOK(ntdll, NtGetContextThread),
-    HOOK(ntdll, NtSetContextThread),
-    HOOK(ntdll, NtSuspendThread),
-    HOOK(ntdll, NtResumeThread),
-    HOOK(ntdll, NtTerminateThread),
-    HOOK(kernel32, CreateThread),
-    HOOK(kernel32, CreateRemoteThread),
-    HOOK(ntdll, RtlCreateUserThread),
+    HOOK_ALWAYS(ntdll, NtSetContextThread),
+    HOOK_ALWAYS(ntdll, NtSuspendThread),
+    HOOK_ALWAYS(ntdll, NtResumeThread),
+    HOOK_ALWAYS(ntdll, NtTerminateThread),
+    HOOK_ALWAYS(kernel32, CreateThread),
+    HOOK_ALWAYS(kernel32, CreateRemoteThread),
+    HOOK_ALWAYS(ntdll, RtlCreateUserThread),
 
 	//
     // Misc Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_MISC
 
 	// for debugging only
 	//HOOK(kernel32, GetLastError),
@@ -270,19 +309,21 @@ static hook_t g_hooks[] = {
 	HOOK(user32, SetWindowsHookExA),
     HOOK(user32, SetWindowsHookExW),
     HOOK(user32, UnhookWindowsHookEx),
-    HOOK(kernel32, SetUnhandledExceptionFilter),
-	HOOK(kernel32, SetErrorMode),
+    HOOK_ALWAYS(kernel32, SetUnhandledExceptionFilter),
+	HOOK_ALWAYS(kernel32, SetErrorMode),
     HOOK(ntdll, LdrGetDllHandle),
     HOOK(ntdll, LdrGetProcedureAddress),
-    HOOK(kernel32, DeviceIoControl),
-    HOOK(user32, ExitWindowsEx),
-    HOOK(kernel32, IsDebuggerPresent),
+    HOOK(ntdll, LdrGetProcedureAddressForCaller),
+    HOOK_ALWAYS(ntdll, LdrUnloadDll),
+    HOOK_ALWAYS(kernel32, DeviceIoControl),
+    HOOK_ALWAYS(user32, ExitWindowsEx),
+    HOOK_ALWAYS(kernel32, IsDebuggerPresent),
     HOOK(advapi32, LookupPrivilegeValueW),
-    HOOK(ntdll, NtClose),
+    HOOK_ALWAYS(ntdll, NtClose),
     HOOK(kernel32, WriteConsoleA),
     HOOK(kernel32, WriteConsoleW),
     HOOK(user32, GetSystemMetrics),
-    HOOK(user32, GetCursorPos),
+    HOOK_ALWAYS(user32, GetCursorPos),
     HOOK(kernel32, GetComputerNameA),
     HOOK(kernel32, GetComputerNameW),
     HOOK(advapi32, GetUserNameA),
@@ -294,23 +335,25 @@ static hook_t g_hooks[] = {
 	//
     // Network Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_NETWORK
 	HOOK(netapi32, NetUserGetInfo),
-    HOOK(urlmon, URLDownloadToFileW),
+    HOOK_ALWAYS(urlmon, URLDownloadToFileW),
 	HOOK(urlmon, ObtainUserAgentString),
 	HOOK(wininet, InternetGetConnectedState),
-    HOOK(wininet, InternetOpenA),
-    HOOK(wininet, InternetOpenW),
-    HOOK(wininet, InternetConnectA),
-    HOOK(wininet, InternetConnectW),
-    HOOK(wininet, InternetOpenUrlA),
-    HOOK(wininet, InternetOpenUrlW),
-    HOOK(wininet, HttpOpenRequestA),
-    HOOK(wininet, HttpOpenRequestW),
+    HOOK_ALWAYS(wininet, InternetOpenA),
+    HOOK_ALWAYS(wininet, InternetOpenW),
+    HOOK_ALWAYS(wininet, InternetConnectA),
+    HOOK_ALWAYS(wininet, InternetConnectW),
+    HOOK_ALWAYS(wininet, InternetOpenUrlA),
+    HOOK_ALWAYS(wininet, InternetOpenUrlW),
+    HOOK_ALWAYS(wininet, HttpOpenRequestA),
+    HOOK_ALWAYS(wininet, HttpOpenRequestW),
     HOOK(wininet, HttpSendRequestA),
     HOOK(wininet, HttpSendRequestW),
     HOOK(wininet, InternetReadFile),
     HOOK(wininet, InternetWriteFile),
-    HOOK(wininet, InternetCloseHandle),
+    HOOK_ALWAYS(wininet, InternetCloseHandle),
 	HOOK(wininet, InternetCrackUrlA),
 	HOOK(wininet, InternetCrackUrlW),
 	HOOK(wininet, InternetSetOptionA),
@@ -329,12 +372,14 @@ static hook_t g_hooks[] = {
     HOOK(dnsapi, DnsQuery_A),
     HOOK(dnsapi, DnsQuery_UTF8),
     HOOK(dnsapi, DnsQuery_W),
-    HOOK(ws2_32, getaddrinfo),
+    HOOK_ALWAYS(ws2_32, getaddrinfo),
     HOOK(ws2_32, GetAddrInfoW),
 
     //
     // Service Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_SERVICE
 
     HOOK(advapi32, OpenSCManagerA),
     HOOK(advapi32, OpenSCManagerW),
@@ -342,51 +387,55 @@ static hook_t g_hooks[] = {
     HOOK(advapi32, CreateServiceW),
     HOOK(advapi32, OpenServiceA),
     HOOK(advapi32, OpenServiceW),
-    HOOK(advapi32, StartServiceA),
-    HOOK(advapi32, StartServiceW),
+    HOOK_ALWAYS(advapi32, StartServiceA),
+    HOOK_ALWAYS(advapi32, StartServiceW),
     HOOK(advapi32, ControlService),
     HOOK(advapi32, DeleteService),
 
     //
     // Sleep Hooks
     //
-    HOOK(ntdll, NtDelayExecution),
-    HOOK(kernel32, GetLocalTime),
-    HOOK(kernel32, GetSystemTime),
-	HOOK(kernel32, GetSystemTimeAsFileTime),
-	HOOK(kernel32, GetTickCount),
-    HOOK(ntdll, NtQuerySystemTime),
-	HOOK(user32, GetLastInputInfo),
-	HOOK(winmm, timeGetTime),
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_SLEEP
+    HOOK_ALWAYS(ntdll, NtDelayExecution),
+    HOOK_ALWAYS(kernel32, GetLocalTime),
+    HOOK_ALWAYS(kernel32, GetSystemTime),
+	HOOK_ALWAYS(kernel32, GetSystemTimeAsFileTime),
+	HOOK_ALWAYS(kernel32, GetTickCount),
+    HOOK_ALWAYS(ntdll, NtQuerySystemTime),
+	HOOK_ALWAYS(user32, GetLastInputInfo),
+	HOOK_ALWAYS(winmm, timeGetTime),
 
 	//
     // Socket Hooks
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_SOCKET
     HOOK(ws2_32, WSAStartup),
-    HOOK(ws2_32, gethostbyname),
-    HOOK(ws2_32, socket),
+    HOOK_ALWAYS(ws2_32, gethostbyname),
+    HOOK_ALWAYS(ws2_32, socket),
     HOOK(ws2_32, connect),
     HOOK(ws2_32, send),
     HOOK(ws2_32, sendto),
     HOOK(ws2_32, recv),
     HOOK(ws2_32, recvfrom),
-    HOOK(ws2_32, accept),
+    HOOK_ALWAYS(ws2_32, accept),
     HOOK(ws2_32, bind),
     HOOK(ws2_32, listen),
     HOOK(ws2_32, select),
     HOOK(ws2_32, setsockopt),
     HOOK(ws2_32, ioctlsocket),
-    HOOK(ws2_32, closesocket),
+    HOOK_ALWAYS(ws2_32, closesocket),
     HOOK(ws2_32, shutdown),
 
-    HOOK(ws2_32, WSAAccept),
+    HOOK_ALWAYS(ws2_32, WSAAccept),
 	HOOK(ws2_32, WSAConnect),
 	HOOK(ws2_32, WSARecv),
     HOOK(ws2_32, WSARecvFrom),
     HOOK(ws2_32, WSASend),
     HOOK(ws2_32, WSASendTo),
-    HOOK(ws2_32, WSASocketA),
-    HOOK(ws2_32, WSASocketW),
+    HOOK_ALWAYS(ws2_32, WSASocketA),
+    HOOK_ALWAYS(ws2_32, WSASocketW),
 
     // HOOK(wsock32, connect),
     // HOOK(wsock32, send),
@@ -397,6 +446,8 @@ static hook_t g_hooks[] = {
     //
     // Crypto Functions
     //
+#undef HOOK_CATEGORY
+#define HOOK_CATEGORY HOOK_CAT_CRYPTO
 
 	HOOK(advapi32, CryptAcquireContextA),
 	HOOK(advapi32, CryptAcquireContextW),
@@ -425,71 +476,701 @@ static hook_t g_hooks[] = {
 #define HOOKTYPE HOOK_HOTPATCH_JMP_INDIRECT
 #endif
 
-void set_hooks_dll(const wchar_t *library)
+hook_t *get_hook_by_name(const char *funcname)
 {
 	int i;
-    for (i = 0; i < ARRAYSIZE(g_hooks); i++) {
-        if(!wcsicmp(g_hooks[i].library, library)) {
-			if (hook_api(&g_hooks[i], HOOKTYPE) < 0)
-				pipe("WARNING:Unable to hook %z", g_hooks[i].funcname);
-        }
-    }
+	for (i = 0; i < ARRAYSIZE(g_hooks); i++) {
+		if (!strcmp(g_hooks[i].funcname, funcname))
+			return &g_hooks[i];
+	}
+	return NULL;
 }
 
-void set_hooks()
+// the hooks lazy hook installation depends on, see lazy_hooks_resolved()
+// and lazy_hooks_unloaded().  GetProcAddress() goes through
+// LdrGetProcedureAddressForCaller on Windows 8 and later
+static int hook_is_lazy_trigger(const hook_t *h)
 {
+	return h->new_func == &New_LdrGetProcedureAddress ||
+		h->new_func == &New_LdrGetProcedureAddressForCaller ||
+		h->new_func == &New_LdrUnloadDll;
+}
 
-	// before modifying any DLLs, let's first freeze all other threads in our process
-	// otherwise our racy modifications can cause the task to crash prematurely
-	// This code itself is racy as additional threads could be created while we're
-	// processing the list, but the risk is at least greatly reduced
-	PHANDLE suspended_threads = (PHANDLE)calloc(4096, sizeof(HANDLE));
-	DWORD num_suspended_threads = 0;
-	DWORD i;
-	HANDLE hSnapShot;
-	THREADENTRY32 threadInfo;
+// hooks the bookkeeping depends on, they're installed whatever the profile
+// and can't be turned off over the control pipe
+int hook_is_required(const hook_t *h)
+{
+	if (g_config.lazy_hooks && hook_is_lazy_trigger(h))
+		return 1;
+	// handles.c would hand out pids of handles that were closed long ago
+	if (h->new_func == &New_NtClose)
+		return 1;
+	// per-thread memory is given back there, see thread_exit_cleanup()
+	if (h->new_func == &New_NtTerminateThread)
+		return 1;
+#ifdef _WIN64
+	// the stack walker's .pdata cache mustn't outlive the images
+	if (h->new_func == &New_LdrUnloadDll)
+		return 1;
+#endif
+	return 0;
+}
+
+// hooks outside of the active hook profile are never installed
+static int hook_in_profile(const hook_t *h)
+{
+	if (hook_is_required(h))
+		return 1;
+	return (h->category & g_config.hook_profile) != 0;
+}
+
+// g_hooks indices grouped by library, so set_hooks_dll() only has to look
+// at the hooks of the DLL that just got loaded
+#define HOOK_LIBRARY_BUCKETS 64
+#define HOOK_LIBRARY_MAX 32
+
+typedef struct _hook_library_t {
+	struct _hook_library_t *next;
+	unsigned int hash;
+	wchar_t name[HOOK_LIBRARY_MAX];
+	unsigned int first;
+	unsigned int count;
+	// lazy hooks of this library are waiting for their first use
+	int pending;
+	// the program used this library, so its hooks are no longer deferred
+	int used;
+	// where the library was mapped when its hooks were deferred
+	HMODULE base;
+} hook_library_t;
+
+static hook_library_t *g_hook_library_buckets[HOOK_LIBRARY_BUCKETS];
+static hook_library_t g_hook_libraries[ARRAYSIZE(g_hooks)];
+static unsigned short g_hook_library_order[ARRAYSIZE(g_hooks)];
+static hook_library_t *g_hook_library_of[ARRAYSIZE(g_hooks)];
+
+// turns "C:\Windows\system32\WS2_32.DLL", "ws2_32.dll" and "ws2_32" all
+// into "ws2_32", returns its hash
+static unsigned int normalize_library_name(const wchar_t *library, wchar_t *out)
+{
+	const wchar_t *p, *end;
+	unsigned int hash = 2166136261u;
+	unsigned int i;
+
+	for (p = library; *p; p++) {
+		if (*p == L'\\' || *p == L'/')
+			library = p + 1;
+	}
+	end = p;
+	if (end - library > 4 && !wcsicmp(end - 4, L".dll"))
+		end -= 4;
+
+	for (i = 0; library < end && i < HOOK_LIBRARY_MAX - 1; i++) {
+		out[i] = towlower(*library++);
+		hash = (hash ^ out[i]) * 16777619u;
+	}
+	out[i] = L'\0';
+	return hash;
+}
+
+static hook_library_t *find_hook_library(const wchar_t *name, unsigned int hash)
+{
+	hook_library_t *lib;
+
+	for (lib = g_hook_library_buckets[hash % HOOK_LIBRARY_BUCKETS]; lib != NULL; lib = lib->next) {
+		if (lib->hash == hash && !wcscmp(lib->name, name))
+			return lib;
+	}
+	return NULL;
+}
+
+// groups the hook table by library, keeping the table order within each
+// library (special hooks have to be placed first)
+static void init_hook_libraries(void)
+{
+	wchar_t name[HOOK_LIBRARY_MAX];
+	unsigned int i, hash, num_libraries = 0, next = 0;
+	hook_library_t *lib;
+
+	for (i = 0; i < ARRAYSIZE(g_hooks); i++) {
+		hash = normalize_library_name(g_hooks[i].library, name);
+		lib = find_hook_library(name, hash);
+		if (lib == NULL) {
+			lib = &g_hook_libraries[num_libraries++];
+			lib->hash = hash;
+			wcscpy(lib->name, name);
+			lib->next = g_hook_library_buckets[hash % HOOK_LIBRARY_BUCKETS];
+			g_hook_library_buckets[hash % HOOK_LIBRARY_BUCKETS] = lib;
+		}
+		lib->count++;
+	}
+
+	for (i = 0; i < num_libraries; i++) {
+		g_hook_libraries[i].first = next;
+		next += g_hook_libraries[i].count;
+		g_hook_libraries[i].count = 0;
+	}
+
+	for (i = 0; i < ARRAYSIZE(g_hooks); i++) {
+		hash = normalize_library_name(g_hooks[i].library, name);
+		lib = find_hook_library(name, hash);
+		g_hook_library_order[lib->first + lib->count++] = (unsigned short)i;
+		g_hook_library_of[i] = lib;
+	}
+}
+
+// lazy hook installation (lazy-hooks=1): the hooks of a library are only
+// placed once the program resolves one of the hooked functions, either
+// through LdrGetProcedureAddress(ForCaller) or an import table.  until then
+// their addresses are kept in an open addressing table.  entries of a
+// library that gets unloaded are replaced by tombstones rather than being
+// removed, so lookups need no lock
+#define LAZY_HOOK_SLOTS 2048
+#define LAZY_HOOK_TOMBSTONE ((void *)1)
+
+typedef struct _lazy_hook_t {
+	void *addr;
+	hook_library_t *lib;
+} lazy_hook_t;
+
+static lazy_hook_t g_lazy_hooks[LAZY_HOOK_SLOTS];
+static CRITICAL_SECTION g_lazy_lock;
+// number of libraries with pending hooks
+static volatile LONG g_lazy_pending;
+
+static unsigned int lazy_hook_slot(void *addr)
+{
+	return (unsigned int)(((ULONG_PTR)addr >> 4) * 2654435761u) & (LAZY_HOOK_SLOTS - 1);
+}
+
+// libraries every process has loaded (and which we use ourselves) gain
+// nothing from waiting, neither do the core hooks, hooks faking results or
+// hooks that have to run even while logging is suspended
+static int hook_is_lazy(const hook_t *h, const hook_library_t *lib)
+{
+	if (!g_config.lazy_hooks || lib->used)
+		return 0;
+	if (h->category == HOOK_CAT_CORE || h->no_caller_info || h->run_while_suspended)
+		return 0;
+	return wcscmp(lib->name, L"ntdll") && wcscmp(lib->name, L"kernel32") &&
+		wcscmp(lib->name, L"kernelbase");
+}
+
+static hook_library_t *lazy_hooks_find(void *addr)
+{
+	unsigned int i, slot = lazy_hook_slot(addr);
+
+	for (i = 0; i < LAZY_HOOK_SLOTS; i++) {
+		if (g_lazy_hooks[slot].addr == NULL)
+			break;
+		if (g_lazy_hooks[slot].addr == addr)
+			return g_lazy_hooks[slot].lib;
+		slot = (slot + 1) & (LAZY_HOOK_SLOTS - 1);
+	}
+	return NULL;
+}
+
+// remembers the address of h instead of hooking it, returns 0 if it has
+// to be hooked right away.  called with g_lazy_lock held
+static int defer_hook(hook_t *h, hook_library_t *lib)
+{
+	MEMORY_BASIC_INFORMATION mbi;
+	lazy_hook_t *entry = NULL;
+	unsigned int i, slot;
+	void *addr = resolve_export(h->library, h->funcname);
+
+	// nothing to hook yet, set_hooks_dll() gets here again once it's loaded
+	if (addr == NULL)
+		return 1;
+
+	slot = lazy_hook_slot(addr);
+	for (i = 0; i < LAZY_HOOK_SLOTS; i++) {
+		if (g_lazy_hooks[slot].addr == addr)
+			goto deferred;
+		if (g_lazy_hooks[slot].addr == LAZY_HOOK_TOMBSTONE && entry == NULL)
+			entry = &g_lazy_hooks[slot];
+		if (g_lazy_hooks[slot].addr == NULL) {
+			if (entry == NULL)
+				entry = &g_lazy_hooks[slot];
+			break;
+		}
+		slot = (slot + 1) & (LAZY_HOOK_SLOTS - 1);
+	}
+	if (entry == NULL)
+		return 0;
+
+	entry->lib = lib;
+	MemoryBarrier();
+	entry->addr = addr;
+
+deferred:
+	if (!lib->pending) {
+		lib->pending = 1;
+		if (VirtualQuery(addr, &mbi, sizeof(mbi)) == sizeof(mbi))
+			lib->base = (HMODULE)mbi.AllocationBase;
+		InterlockedIncrement(&g_lazy_pending);
+	}
+	return 1;
+}
+
+// prepares the pending hooks of lib, called with g_lazy_lock held and a
+// hook stage open (see hook_stage_begin)
+static void install_deferred_hooks(hook_library_t *lib)
+{
+	unsigned int i;
+	hook_t *h;
+
+	lib->used = 1;
+	if (!lib->pending)
+		return;
+	lib->pending = 0;
+	InterlockedDecrement(&g_lazy_pending);
+
+	hook_pool_begin_write();
+
+	for (i = 0; i < lib->count; i++) {
+		h = &g_hooks[g_hook_library_order[lib->first + i]];
+		if (hook_in_profile(h)) {
+			if (hook_api(h, HOOKTYPE) < 0)
+				pipe("WARNING:Unable to hook %z", h->funcname);
+		}
+	}
+
+	hook_pool_end_write();
+}
+
+// modules whose import tables are checked for lazy hooks, the module that
+// was loaded and everything it imports from, directly or not
+#define LAZY_CLOSURE_MAX 256
+
+typedef struct _import_closure_t {
+	HMODULE modules[LAZY_CLOSURE_MAX];
+	unsigned int count;
+} import_closure_t;
+
+// looks up a module the loader has mapped by the name an import descriptor
+// uses for it.  API set names don't match any module, but all of those
+// resolve to libraries that aren't deferred
+static HMODULE find_loaded_module(const char *name)
+{
+	LDR_MODULE *mod; PEB *peb = (PEB *)get_peb();
+	unsigned int i, len;
+
+	for (mod = (LDR_MODULE *)peb->LoaderData->InLoadOrderModuleList.Flink;
+		mod->BaseAddress != NULL;
+		mod = (LDR_MODULE *)mod->InLoadOrderModuleList.Flink) {
+		len = mod->BaseDllName.Length / sizeof(wchar_t);
+		for (i = 0; i < len && name[i] != '\0'; i++) {
+			if (towlower(mod->BaseDllName.Buffer[i]) != towlower((unsigned char)name[i]))
+				break;
+		}
+		if (i == len && name[i] == '\0')
+			return (HMODULE)mod->BaseAddress;
+	}
+	return NULL;
+}
+
+static void import_closure_add(import_closure_t *closure, HMODULE module)
+{
+	unsigned int i;
+
+	if (module == NULL || (ULONG_PTR)module == g_our_dll_base)
+		return;
+	for (i = 0; i < closure->count; i++) {
+		if (closure->modules[i] == module)
+			return;
+	}
+	if (closure->count < LAZY_CLOSURE_MAX)
+		closure->modules[closure->count++] = module;
+}
+
+// returns a library with pending hooks the module imports any of them from,
+// adding the modules it imports from to closure along the way
+static hook_library_t *find_imported_library(HMODULE module, import_closure_t *closure)
+{
+	PIMAGE_DOS_HEADER doshdr = (PIMAGE_DOS_HEADER)module;
+	PIMAGE_NT_HEADERS nthdr = (PIMAGE_NT_HEADERS)((PUCHAR)module + doshdr->e_lfanew);
+	PIMAGE_DATA_DIRECTORY dir = &nthdr->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	PIMAGE_IMPORT_DESCRIPTOR desc;
+	hook_library_t *lib;
+	ULONG_PTR *iat;
+
+	if (dir->VirtualAddress == 0 || dir->Size == 0)
+		return NULL;
+
+	// the loader bound the import address tables before we got here
+	for (desc = (PIMAGE_IMPORT_DESCRIPTOR)((PUCHAR)module + dir->VirtualAddress); desc->Name; desc++) {
+		import_closure_add(closure, find_loaded_module((const char *)module + desc->Name));
+		for (iat = (ULONG_PTR *)((PUCHAR)module + desc->FirstThunk); *iat; iat++) {
+			lib = lazy_hooks_find((void *)*iat);
+			if (lib != NULL && lib->pending)
+				return lib;
+		}
+	}
+	return NULL;
+}
+
+// library may be a full path and may or may not have the .dll extension
+void set_hooks_dll(const wchar_t *library)
+{
+	wchar_t name[HOOK_LIBRARY_MAX];
+	unsigned int i, hash;
+	hook_library_t *lib;
+	hook_t *h;
+
+	hash = normalize_library_name(library, name);
+	lib = find_hook_library(name, hash);
+	if (lib == NULL)
+		return;
+
+	if (g_config.lazy_hooks)
+		EnterCriticalSection(&g_lazy_lock);
+	hook_pool_begin_write();
+
+	for (i = 0; i < lib->count; i++) {
+		h = &g_hooks[g_hook_library_order[lib->first + i]];
+		if (hook_in_profile(h)) {
+			if (hook_is_lazy(h, lib) && defer_hook(h, lib))
+				continue;
+			if (hook_api(h, HOOKTYPE) < 0)
+				pipe("WARNING:Unable to hook %z", h->funcname);
+		}
+	}
+
+	hook_pool_end_write();
+	if (g_config.lazy_hooks)
+		LeaveCriticalSection(&g_lazy_lock);
+}
+
+typedef NTSTATUS(WINAPI *_NtGetNextThread)(HANDLE ProcessHandle, HANDLE ThreadHandle,
+	ACCESS_MASK DesiredAccess, ULONG HandleAttributes, ULONG Flags, PHANDLE NewThreadHandle);
+
+static _NtGetNextThread pNtGetNextThread;
+static _NtQueryInformationThread pNtQueryInformationThread;
+
+// the handles of the threads we suspend go into an array allocated up
+// front, once the first thread is suspended nothing may be called that
+// could wait on a lock it holds (the heap, the handle registry, the pipe)
+#define MAX_SUSPENDED_THREADS 4096
+
+static int add_suspended_thread(PHANDLE threads, DWORD *count, HANDLE thread)
+{
+	if (*count == MAX_SUSPENDED_THREADS)
+		return 0;
+	if (SuspendThread(thread) == (DWORD)-1)
+		return 0;
+	threads[(*count)++] = thread;
+	return 1;
+}
+
+// asks the kernel directly rather than through tid_from_thread_handle(),
+// which takes the handle registry's locks
+static DWORD thread_id(HANDLE thread)
+{
+	THREAD_BASIC_INFORMATION tbi;
+
+	if (pNtQueryInformationThread != NULL &&
+		pNtQueryInformationThread(thread, 0, &tbi, sizeof(tbi), NULL) >= 0)
+		return (DWORD)(ULONG_PTR)tbi.ClientId.UniqueThread;
+	return 0;
+}
+
+// suspends all other threads of our process, returns an array of the
+// suspended threads' handles for resume_threads()
+static PHANDLE suspend_other_threads(DWORD *count)
+{
+	PHANDLE threads = (PHANDLE)VirtualAlloc(NULL, MAX_SUSPENDED_THREADS * sizeof(HANDLE),
+		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 	DWORD our_tid = GetCurrentThreadId();
-	DWORD our_pid = GetCurrentProcessId();
+	HANDLE thread = NULL, next;
+	int kept = 0;
+
+	*count = 0;
+	if (threads == NULL)
+		return NULL;
+
+	if (pNtGetNextThread != NULL) {
+		// Vista+: walk the thread list of our own process directly instead of
+		// snapshotting every thread on the system.  The previous handle is
+		// the cursor, so it can only be closed after the next call
+		while (NT_SUCCESS(pNtGetNextThread(GetCurrentProcess(), thread,
+			THREAD_SUSPEND_RESUME | THREAD_QUERY_INFORMATION, 0, 0, &next))) {
+			if (thread != NULL && !kept)
+				CloseHandle(thread);
+			thread = next;
+			kept = thread_id(next) != our_tid &&
+				add_suspended_thread(threads, count, next);
+		}
+		if (thread != NULL && !kept)
+			CloseHandle(thread);
+	}
+	else {
+		DWORD our_pid = GetCurrentProcessId();
+		THREADENTRY32 threadInfo;
+		HANDLE hSnapShot;
+
+		memset(&threadInfo, 0, sizeof(threadInfo));
+		threadInfo.dwSize = sizeof(threadInfo);
+
+		hSnapShot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+		if (hSnapShot == INVALID_HANDLE_VALUE)
+			return threads;
+		if (Thread32First(hSnapShot, &threadInfo)) {
+			do {
+				if (threadInfo.th32OwnerProcessID != our_pid || threadInfo.th32ThreadID == our_tid)
+					continue;
+				thread = OpenThread(THREAD_SUSPEND_RESUME, FALSE, threadInfo.th32ThreadID);
+				if (thread && !add_suspended_thread(threads, count, thread))
+					CloseHandle(thread);
+			} while (Thread32Next(hSnapShot, &threadInfo));
+		}
+		CloseHandle(hSnapShot);
+	}
+
+	return threads;
+}
+
+static void resume_threads(PHANDLE threads, DWORD count)
+{
+	DWORD i;
+
+	for (i = 0; i < count; i++) {
+		ResumeThread(threads[i]);
+		CloseHandle(threads[i]);
+	}
+	VirtualFree(threads, 0, MEM_RELEASE);
+}
+
+// writes the hooks of the open stage with the other threads suspended, the
+// trampolines were built while they were still running
+static void commit_staged_hooks(void)
+{
+	PHANDLE suspended_threads;
+	DWORD num_suspended_threads;
+
+	// with the other threads stopped at arbitrary points we mustn't run any
+	// hook ourselves: NtProtectVirtualMemory's would walk the stack and
+	// wait for whatever lock a suspended thread holds.  Between suspending
+	// and resuming only memory and page protections are touched
+	hook_disable();
+	suspended_threads = suspend_other_threads(&num_suspended_threads);
+
+	// hooks sharing a page (most of ntdll/kernel32) only change its
+	// protection once
+	hook_batch_begin();
+	hook_stage_commit();
+	hook_batch_end();
+
+	if (suspended_threads != NULL)
+		resume_threads(suspended_threads, num_suspended_threads);
+	hook_enable();
+
+	hook_stage_end();
+}
+
+static void install_lazy_library(hook_library_t *lib)
+{
+	EnterCriticalSection(&g_lazy_lock);
+	if (lib->pending) {
+		// the library may already be in use by other threads
+		hook_stage_begin();
+		install_deferred_hooks(lib);
+		commit_staged_hooks();
+	}
+	lib->used = 1;
+	LeaveCriticalSection(&g_lazy_lock);
+}
+
+// called by the LdrGetProcedureAddress(ForCaller) hooks with the resolved
+// address
+void lazy_hooks_resolved(void *addr)
+{
+	hook_library_t *lib;
+
+	if (g_lazy_pending == 0 || addr == NULL)
+		return;
+
+	lib = lazy_hooks_find(addr);
+	if (lib != NULL && lib->pending)
+		install_lazy_library(lib);
+}
+
+// called by the LdrLoadDll hook for every DLL the program loads, the DLLs
+// it pulled in were bound to our deferred functions as well
+void lazy_hooks_bind_imports(HMODULE module)
+{
+	import_closure_t closure;
+	hook_library_t *lib;
+	unsigned int i;
+
+	if (g_lazy_pending == 0)
+		return;
+
+	closure.count = 0;
+	import_closure_add(&closure, module);
+	for (i = 0; i < closure.count && g_lazy_pending; i++) {
+		while ((lib = find_imported_library(closure.modules[i], &closure)) != NULL)
+			install_lazy_library(lib);
+	}
+}
+
+// called by the LdrUnloadDll hook, forgets the deferred hooks of a library
+// that is gone, whatever gets mapped at its addresses next isn't it
+void lazy_hooks_unloaded(HMODULE module)
+{
+	MEMORY_BASIC_INFORMATION mbi;
+	hook_library_t *lib;
+	unsigned int i, j;
+
+	if (g_lazy_pending == 0)
+		return;
+
+	// only the last reference unmaps it
+	if (VirtualQuery(module, &mbi, sizeof(mbi)) == sizeof(mbi) &&
+		mbi.State != MEM_FREE && mbi.AllocationBase == module)
+		return;
+
+	EnterCriticalSection(&g_lazy_lock);
+	for (i = 0; i < ARRAYSIZE(g_hook_libraries); i++) {
+		lib = &g_hook_libraries[i];
+		if (!lib->pending || lib->base != module)
+			continue;
+		for (j = 0; j < LAZY_HOOK_SLOTS; j++) {
+			if (g_lazy_hooks[j].lib == lib && g_lazy_hooks[j].addr != NULL)
+				g_lazy_hooks[j].addr = LAZY_HOOK_TOMBSTONE;
+		}
+		lib->pending = 0;
+		lib->base = NULL;
+		InterlockedDecrement(&g_lazy_pending);
+	}
+	LeaveCriticalSection(&g_lazy_lock);
+}
+
+void set_hooks()
+{
+	DWORD i;
+	DWORD num_hooks = 0, num_deferred = 0;
+	LARGE_INTEGER freq, start, end;
+	import_closure_t closure;
+	hook_library_t *lib;
 	// the hooks contain executable code as well, so they have to be RWX
 	DWORD old_protect;
 	VirtualProtect(g_hooks, sizeof(g_hooks), PAGE_EXECUTE_READWRITE,
 		&old_protect);
 
+	hook_disable();
 
-	memset(&threadInfo, 0, sizeof(threadInfo));
-	threadInfo.dwSize = sizeof(threadInfo);
+	init_hook_libraries();
+	InitializeCriticalSection(&g_lazy_lock);
 
-	hook_disable();
+	pNtGetNextThread = (_NtGetNextThread)resolve_export(L"ntdll", "NtGetNextThread");
+	pNtQueryInformationThread = (_NtQueryInformationThread)resolve_export(L"ntdll", "NtQueryInformationThread");
 
-	hSnapShot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
-	Thread32First(hSnapShot, &threadInfo);
-	do {
-		if (threadInfo.th32OwnerProcessID != our_pid || threadInfo.th32ThreadID == our_tid || num_suspended_threads >= 4096)
-			continue;
-		suspended_threads[num_suspended_threads] = OpenThread(THREAD_SUSPEND_RESUME, FALSE, threadInfo.th32ThreadID);
-		if (suspended_threads[num_suspended_threads]) {
-			SuspendThread(suspended_threads[num_suspended_threads]);
-			num_suspended_threads++;
+	// lazy hook installation has to see every lookup and unload, whether
+	// logging is suspended or not
+	if (g_config.lazy_hooks) {
+		for (i = 0; i < ARRAYSIZE(g_hooks); i++) {
+			if (hook_is_lazy_trigger(&g_hooks[i]))
+				g_hooks[i].run_while_suspended = TRUE;
 		}
-	} while (Thread32Next(hSnapShot, &threadInfo));
+	}
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+
+	EnterCriticalSection(&g_lazy_lock);
+
+	// the trampolines are built while the other threads keep running, they
+	// are only frozen while the hooks are written (see commit_staged_hooks)
+	// This is racy as additional threads could be created while we're
+	// processing the list, but the risk is at least greatly reduced
+	hook_stage_begin();
+	hook_pool_begin_write();
 
     // now, hook each api :)
     for (i = 0; i < ARRAYSIZE(g_hooks); i++) {
+		if (!hook_in_profile(&g_hooks[i]))
+			continue;
+		if (hook_is_lazy(&g_hooks[i], g_hook_library_of[i]) && defer_hook(&g_hooks[i], g_hook_library_of[i])) {
+			num_deferred++;
+			continue;
+		}
 		//pipe("INFO:Hooking %z", g_hooks[i].funcname);
 		if (hook_api(&g_hooks[i], HOOKTYPE) < 0)
 			pipe("WARNING:Unable to hook %z", g_hooks[i].funcname);
+		num_hooks++;
     }
 
-	for (i = 0; i < num_suspended_threads; i++) {
-		ResumeThread(suspended_threads[i]);
-		CloseHandle(suspended_threads[i]);
+	// nothing writes to the trampolines anymore
+	hook_pool_end_write();
+
+	// the program and the DLLs it imports from were bound before we got here
+	closure.count = 0;
+	import_closure_add(&closure, GetModuleHandle(NULL));
+	for (i = 0; i < closure.count && g_lazy_pending; i++) {
+		while ((lib = find_imported_library(closure.modules[i], &closure)) != NULL)
+			install_deferred_hooks(lib);
 	}
 
-	free(suspended_threads);
+	commit_staged_hooks();
+
+	LeaveCriticalSection(&g_lazy_lock);
+
+	QueryPerformanceCounter(&end);
+
+	// startup cost of the chosen profile, the event volume follows at exit
+	pipe("INFO:Hook profile %z: %d of %d hooks installed in %d us", g_config.hook_profile_name,
+		num_hooks, (int)ARRAYSIZE(g_hooks), (int)((end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart));
+	if (g_config.lazy_hooks)
+		pipe("INFO:Lazy hooks: %d hooks of %d libraries deferred until first use", num_deferred, g_lazy_pending);
 
 	hook_enable();
 }
 
+static DWORD g_profile_start_tick;
+
+// frees what the calling thread allocated for itself.  Release builds
+// unlink us from the loader's module list, so DLL_THREAD_DETACH never
+// arrives there, the NtTerminateThread hook calls this instead when a
+// thread ends itself
+void thread_exit_cleanup(void)
+{
+	hook_info_thread_detach();
+#ifdef USE_PRIVATE_HEAP
+	// last, the above frees through the thread's cache
+	cm_alloc_thread_detach();
+#endif
+}
+
+static void report_event_volume(void)
+{
+	unsigned int total = 0;
+	int i;
+
+	for (i = 0; i < LOG_MAX_INDEX; i++)
+		total += log_event_count(i);
+
+	pipe("INFO:Hook profile %z: %d events logged in %d ms", g_config.hook_profile_name,
+		total, GetTickCount() - g_profile_start_tick);
+}
+
+// sends the statistics gathered over the lifetime of the process, called by
+// the NtTerminateProcess hook as DLL_PROCESS_DETACH doesn't arrive either
+// (and would hold the loader lock)
+void process_exit_report(void)
+{
+	static volatile LONG reported;
+
+	// ExitProcess ends up in NtTerminateProcess twice
+	if (InterlockedExchange(&reported, 1))
+		return;
+
+	report_event_volume();
+	path_cache_report();
+#ifdef USE_PRIVATE_HEAP
+	cm_alloc_report();
+#endif
+}
+
 #if REPORT_EXCEPTIONS
 LONG WINAPI cuckoomon_exception_handler(
 	__in struct _EXCEPTION_POINTERS *ExceptionInfo
@@ -605,6 +1286,7 @@ void init_private_heap(void)
 	bson_set_free_func(free_func);
 #ifdef USE_PRIVATE_HEAP
 	g_heap = HeapCreate(0, 4 * 1024 * 1024, 0);
+	cm_alloc_init();
 #endif
 }
 
@@ -622,6 +1304,9 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID lpReserved)
 		unsigned int i;
 		DWORD pids[MAX_PROTECTED_PIDS];
 		unsigned int length = sizeof(pids);
+		LARGE_INTEGER freq, attach_start, attach_end;
+
+		QueryPerformanceCounter(&attach_start);
 
 		/* we can sometimes be injected twice into a process, say if we queued up an APC that we timed out waiting to
 		   complete, and then did a successful createremotethread, so just do a cheap check for our hooks and fake that
@@ -650,15 +1335,23 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID lpReserved)
 		
 		resolve_runtime_apis();
 
+		exports_init();
+
 		init_private_heap();
 
 		set_os_bitness();
 
 		// initialize file stuff, needs to be performed prior to any file normalization
+		path_cache_init();
 		file_init();
 
+		handles_init();
+		suspended_init();
+
 		get_our_process_path();
 
+		ignore_init();
+
 		g_tls_hook_index = TlsAlloc();
 		if (g_tls_hook_index == TLS_OUT_OF_INDEXES)
 			goto out;
@@ -688,6 +1381,10 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID lpReserved)
 			// if we're not debugging, then failure to read the cuckoomon config should be a critical error
 			goto out;
 #endif
+		// the analyzer may have added to the list
+		if (is_ignored_process())
+			goto out;
+
 		// obtain all protected pids
         pipe2(pids, &length, "GETPIDS");
         for (i = 0; i < length / sizeof(pids[0]); i++) {
@@ -716,14 +1413,26 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID lpReserved)
 		// initialize terminate notification event
 		terminate_event_init();
 
+		// allow the analyzer to turn individual hooks on and off
+		control_init();
+
 		// initialize all hooks
+		g_profile_start_tick = GetTickCount();
         set_hooks();
 
 		// initialize context watchdog
 		//init_watchdog();
 
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&attach_end);
+		pipe("INFO:DllMain to LOADED took %d us",
+			(int)((attach_end.QuadPart - attach_start.QuadPart) * 1000000 / freq.QuadPart));
+
 		notify_successful_load();
     }
+    else if(dwReason == DLL_THREAD_DETACH) {
+		thread_exit_cleanup();
+	}
     else if(dwReason == DLL_PROCESS_DETACH) {
         log_free();
     }
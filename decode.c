@@ -0,0 +1,49 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "decode.h"
+
+// the longest valid x86 instruction
+#define MAX_INSN_LENGTH 15
+
+#include <distorm.h>
+
+int insn_decode(const void *addr, int mode, insn_t *insn)
+{
+	// asking for exactly one instruction makes distorm stop after the
+	// first one, it then reports that the output array is full
+	unsigned int used_instruction_count = 0;
+	_DInst di;
+	_CodeInfo code_info = { 0, 0, (const uint8_t *)addr, MAX_INSN_LENGTH + 1,
+		mode == DECODE_64BIT ? Decode64Bits : Decode32Bits };
+	_DecodeResult ret = distorm_decompose(&code_info, &di, 1,
+		&used_instruction_count);
+
+	memset(insn, 0, sizeof(*insn));
+	if ((ret != DECRES_SUCCESS && ret != DECRES_MEMORYERR) ||
+		used_instruction_count != 1 || di.flags == FLAG_NOT_DECODABLE)
+		return 0;
+
+	insn->size = di.size;
+	if (di.flags & FLAG_RIP_RELATIVE) {
+		insn->rip_relative = 1;
+		insn->imm_size = di.imm_encoded_size;
+	}
+	return insn->size;
+}
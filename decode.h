@@ -0,0 +1,49 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DECODE_H
+#define __DECODE_H
+
+//
+// Instruction Decoder
+//
+// Decodes a single instruction, which is all the trampoline code needs.
+// Backed by distorm, the vendored capstone only has its reduced x86 tables,
+// which get the length of e.g. syscall and movzx wrong.
+//
+
+typedef struct _insn_t {
+	// length of the instruction in bytes
+	unsigned int size;
+
+	// addresses memory relative to the next instruction (x64 only)
+	int rip_relative;
+
+	// for rip relative instructions, the encoded size of the immediate
+	// that follows the 32-bit displacement
+	unsigned int imm_size;
+} insn_t;
+
+#define DECODE_32BIT 0
+#define DECODE_64BIT 1
+
+// decodes the instruction at addr into insn, returns its length or zero if
+// it's not a valid instruction
+int insn_decode(const void *addr, int mode, insn_t *insn);
+
+#endif
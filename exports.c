@@ -0,0 +1,364 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef _WIN32
+#include "ntapi.h"
+#else
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include "exports.h"
+
+// the PE structures are read by offset rather than through the winnt.h
+// types, so this also builds (and can be tested) outside of Windows
+
+static unsigned int rd16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int rd32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned int export_hash(const char *s)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*s) {
+		hash ^= (unsigned char)*s++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+typedef struct _pe_info_t {
+	const unsigned char *base;
+	size_t size;
+	int mapped;
+	const unsigned char *sections;
+	unsigned int num_sections;
+} pe_info_t;
+
+// translates an rva into a pointer to at least len readable bytes, or NULL.
+// avail (optional) receives how many bytes are readable from there on
+static const unsigned char *rva_to_ptr_avail(const pe_info_t *pe, unsigned int rva, unsigned int len, size_t *avail)
+{
+	unsigned int i, va, vsize, rawsize, rawptr;
+	size_t offset = rva, limit = pe->size;
+
+	if (!pe->mapped) {
+		for (i = 0; i < pe->num_sections; i++) {
+			const unsigned char *sec = pe->sections + i * 40;
+			vsize = rd32(sec + 8);
+			va = rd32(sec + 12);
+			rawsize = rd32(sec + 16);
+			rawptr = rd32(sec + 20);
+			if (vsize < rawsize)
+				vsize = rawsize;
+			if (rva >= va && rva - va < vsize) {
+				offset = (size_t)rawptr + (rva - va);
+				// data can't run from one section into the next on disk
+				limit = (size_t)rawptr + rawsize;
+				if (limit > pe->size)
+					limit = pe->size;
+				break;
+			}
+		}
+	}
+
+	if (offset > limit || limit - offset < len)
+		return NULL;
+	if (avail != NULL)
+		*avail = limit - offset;
+	return pe->base + offset;
+}
+
+static const unsigned char *rva_to_ptr(const pe_info_t *pe, unsigned int rva, unsigned int len)
+{
+	return rva_to_ptr_avail(pe, rva, len, NULL);
+}
+
+// returns the string at rva if it's NUL terminated within the image
+static const char *rva_to_str(const pe_info_t *pe, unsigned int rva)
+{
+	size_t avail;
+	const unsigned char *p = rva_to_ptr_avail(pe, rva, 1, &avail);
+
+	if (p == NULL || memchr(p, 0, avail) == NULL)
+		return NULL;
+	return (const char *)p;
+}
+
+export_table_t *exports_parse(const unsigned char *base, size_t size, int mapped)
+{
+	const unsigned char *nt, *opt, *dir, *functions, *names, *ordinals;
+	unsigned int lfanew, magic, numdirs, dirs_off, optsize;
+	unsigned int exp_rva, exp_size, num_functions, num_names;
+	unsigned int nbuckets, i, timestamp, image_size;
+	export_table_t *table;
+	pe_info_t pe;
+
+	if (size < 0x40 && !(mapped && size == 0))
+		return NULL;
+	if (base[0] != 'M' || base[1] != 'Z')
+		return NULL;
+
+	lfanew = rd32(base + 0x3c);
+	if (size == 0) {
+		// a loaded image, take its size from the headers
+		nt = base + lfanew;
+		if (rd32(nt) != 0x00004550)
+			return NULL;
+		size = rd32(nt + 24 + 56);
+	}
+	if (lfanew > size || size - lfanew < 24 + 96)
+		return NULL;
+
+	nt = base + lfanew;
+	if (rd32(nt) != 0x00004550)
+		return NULL;
+	timestamp = rd32(nt + 8);
+	optsize = rd16(nt + 20);
+	opt = nt + 24;
+
+	magic = rd16(opt);
+	if (magic == 0x10b)
+		dirs_off = 96;
+	else if (magic == 0x20b)
+		dirs_off = 112;
+	else
+		return NULL;
+	if ((size_t)(opt - base) + dirs_off + 8 > size)
+		return NULL;
+	numdirs = rd32(opt + dirs_off - 4);
+	image_size = rd32(opt + 56);
+	if (numdirs < 1)
+		return NULL;
+
+	pe.base = base;
+	pe.size = size;
+	pe.mapped = mapped;
+	pe.sections = opt + optsize;
+	pe.num_sections = rd16(nt + 6);
+	if ((size_t)(pe.sections - base) + pe.num_sections * 40 > size)
+		return NULL;
+
+	exp_rva = rd32(opt + dirs_off);
+	exp_size = rd32(opt + dirs_off + 4);
+	if (exp_rva == 0 || exp_size < 40)
+		return NULL;
+
+	dir = rva_to_ptr(&pe, exp_rva, 40);
+	if (dir == NULL)
+		return NULL;
+
+	num_functions = rd32(dir + 20);
+	num_names = rd32(dir + 24);
+	if (num_names > num_functions || num_functions > 0x10000)
+		return NULL;
+
+	functions = rva_to_ptr(&pe, rd32(dir + 28), num_functions * 4);
+	names = rva_to_ptr(&pe, rd32(dir + 32), num_names * 4);
+	ordinals = rva_to_ptr(&pe, rd32(dir + 36), num_names * 2);
+	if (functions == NULL || (num_names && (names == NULL || ordinals == NULL)))
+		return NULL;
+
+	// at most 50% load
+	for (nbuckets = 16; nbuckets < num_names * 2; nbuckets <<= 1);
+
+	table = (export_table_t *)calloc(1, sizeof(export_table_t));
+	if (table == NULL)
+		return NULL;
+	table->buckets = (export_entry_t **)calloc(nbuckets, sizeof(export_entry_t *));
+	table->entries = (export_entry_t *)calloc(num_names ? num_names : 1, sizeof(export_entry_t));
+	if (table->buckets == NULL || table->entries == NULL) {
+		exports_free(table);
+		return NULL;
+	}
+	table->base = base;
+	table->size = size;
+	table->mapped = mapped;
+	table->timestamp = timestamp;
+	table->image_size = image_size;
+	table->bucket_mask = nbuckets - 1;
+
+	for (i = 0; i < num_names; i++) {
+		export_entry_t *e = &table->entries[table->count];
+		unsigned int ordinal = rd16(ordinals + i * 2);
+		unsigned int bucket;
+
+		if (ordinal >= num_functions)
+			continue;
+
+		e->name = rva_to_str(&pe, rd32(names + i * 4));
+		if (e->name == NULL)
+			continue;
+		e->forwarder = NULL;
+		e->rva = rd32(functions + ordinal * 4);
+		if (e->rva == 0)
+			continue;
+		// an rva inside the export directory is a forwarder string
+		if (e->rva >= exp_rva && e->rva - exp_rva < exp_size)
+			e->forwarder = rva_to_str(&pe, e->rva);
+
+		e->hash = export_hash(e->name);
+		bucket = e->hash & table->bucket_mask;
+		e->next = table->buckets[bucket];
+		table->buckets[bucket] = e;
+		table->count++;
+	}
+
+	return table;
+}
+
+void exports_free(export_table_t *table)
+{
+	if (table == NULL)
+		return;
+	free(table->buckets);
+	free(table->entries);
+	free(table);
+}
+
+const export_entry_t *exports_lookup(const export_table_t *table, const char *funcname)
+{
+	unsigned int hash = export_hash(funcname);
+	const export_entry_t *e;
+
+	for (e = table->buckets[hash & table->bucket_mask]; e != NULL; e = e->next) {
+		if (e->hash == hash && !strcmp(e->name, funcname))
+			return e;
+	}
+	return NULL;
+}
+
+#ifdef _WIN32
+
+#define EXPORT_CACHE_MAX 64
+#define EXPORT_MAX_FORWARDS 4
+
+static struct {
+	const unsigned char *base;
+	export_table_t *table;
+} g_export_cache[EXPORT_CACHE_MAX];
+static unsigned int g_export_cache_next;
+static CRITICAL_SECTION g_export_lock;
+
+void exports_init(void)
+{
+	InitializeCriticalSection(&g_export_lock);
+}
+
+// returns the cached export table of the module at base, (re)parsing it if
+// the module at that address isn't the one we parsed before.  called with
+// g_export_lock held
+static export_table_t *export_table_for(const unsigned char *base)
+{
+	const unsigned char *nt = base + rd32(base + 0x3c);
+	unsigned int timestamp = rd32(nt + 8), image_size = rd32(nt + 24 + 56);
+	export_table_t *table;
+	unsigned int i, slot;
+
+	for (i = 0; i < EXPORT_CACHE_MAX; i++) {
+		if (g_export_cache[i].base != base)
+			continue;
+		table = g_export_cache[i].table;
+		if (table->timestamp == timestamp && table->image_size == image_size)
+			return table;
+		// a different module got loaded at the same address
+		exports_free(table);
+		g_export_cache[i].base = NULL;
+		g_export_cache[i].table = NULL;
+	}
+
+	table = exports_parse(base, 0, 1);
+	if (table == NULL)
+		return NULL;
+
+	slot = g_export_cache_next++ % EXPORT_CACHE_MAX;
+	exports_free(g_export_cache[slot].table);
+	g_export_cache[slot].base = base;
+	g_export_cache[slot].table = table;
+	return table;
+}
+
+static void *resolve_export_in(HMODULE mod, const char *funcname, int depth)
+{
+	const export_entry_t *e;
+	export_table_t *table;
+	const char *forwarder = NULL;
+	void *ret = NULL;
+	unsigned int rva = 0;
+
+	EnterCriticalSection(&g_export_lock);
+	table = export_table_for((const unsigned char *)mod);
+	if (table != NULL) {
+		e = exports_lookup(table, funcname);
+		if (e != NULL) {
+			rva = e->rva;
+			forwarder = e->forwarder;
+		}
+	}
+	LeaveCriticalSection(&g_export_lock);
+
+	if (table == NULL)
+		return GetProcAddress(mod, funcname);
+	if (rva == 0)
+		return NULL;
+	if (forwarder == NULL)
+		return (unsigned char *)mod + rva;
+
+	// e.g. kernel32!CreateFileW -> KERNELBASE.CreateFileW
+	if (depth < EXPORT_MAX_FORWARDS) {
+		const char *dot = strrchr(forwarder, '.');
+		wchar_t library[MAX_PATH];
+		unsigned int i, len = (unsigned int)(dot ? dot - forwarder : 0);
+		HMODULE target;
+
+		if (len && len < ARRAYSIZE(library)) {
+			for (i = 0; i < len; i++)
+				library[i] = (wchar_t)(unsigned char)forwarder[i];
+			library[len] = L'\0';
+			target = GetModuleHandleW(library);
+			if (target != NULL) {
+				if (dot[1] == '#')
+					ret = GetProcAddress(target, (LPCSTR)(ULONG_PTR)atoi(dot + 2));
+				else
+					ret = resolve_export_in(target, dot + 1, depth + 1);
+			}
+		}
+	}
+
+	// forwarders we can't follow (e.g. api sets) are left to the loader
+	if (ret == NULL)
+		ret = GetProcAddress(mod, funcname);
+	return ret;
+}
+
+void *resolve_export(const wchar_t *library, const char *funcname)
+{
+	HMODULE mod = GetModuleHandleW(library);
+
+	if (mod == NULL)
+		return NULL;
+	return resolve_export_in(mod, funcname, 0);
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __EXPORTS_H
+#define __EXPORTS_H
+
+#include <stddef.h>
+
+//
+// Export Directory Resolver
+//
+// Parses the export directory of a PE image once into a hash table of
+// its named exports.  The parser itself doesn't depend on the Windows API,
+// so it can be fed an image loaded by the Windows loader (mapped != 0) as
+// well as a raw PE file read from disk (mapped == 0).
+//
+
+typedef struct _export_entry_t {
+	struct _export_entry_t *next;
+	const char *name;
+	unsigned int hash;
+	unsigned int rva;
+	// "DLLNAME.Function" or "DLLNAME.#ordinal" if this export is forwarded
+	const char *forwarder;
+} export_entry_t;
+
+typedef struct _export_table_t {
+	const unsigned char *base;
+	size_t size;
+	int mapped;
+	unsigned int timestamp;
+	unsigned int image_size;
+	unsigned int bucket_mask;
+	export_entry_t **buckets;
+	export_entry_t *entries;
+	unsigned int count;
+} export_table_t;
+
+// returns NULL if the image has no (valid) export directory
+export_table_t *exports_parse(const unsigned char *base, size_t size, int mapped);
+void exports_free(export_table_t *table);
+
+// returns the export named funcname or NULL
+const export_entry_t *exports_lookup(const export_table_t *table, const char *funcname);
+
+#ifdef _WIN32
+void exports_init(void);
+
+// drop-in replacement for GetProcAddress(GetModuleHandleW(library), funcname)
+// which caches the export table of every module it has seen and follows
+// forwarders itself
+void *resolve_export(const wchar_t *library, const char *funcname);
+#endif
+
+#endif
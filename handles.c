@@ -0,0 +1,257 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "ntapi.h"
+#include "hooking.h"
+#include "misc.h"
+#include "lookup.h"
+#include "handles.h"
+
+typedef struct _handle_record_t {
+	unsigned int type;
+	DWORD pid;
+	// only set for thread handles
+	DWORD tid;
+	unsigned int length;
+	wchar_t name[0];
+} handle_record_t;
+
+static lookup_t g_handles;
+static lookup_t g_internet_handles;
+
+static const char *g_handle_type_names[HANDLE_TYPE_MAX] = {
+	"",
+	"File",
+	"Key",
+	"Process",
+	"Thread",
+	"Section",
+	"Mutant",
+	"Event",
+	"Socket",
+	"Internet",
+};
+
+static lookup_t *handle_table(unsigned int type)
+{
+	return type == HANDLE_TYPE_INTERNET ? &g_internet_handles : &g_handles;
+}
+
+void handles_init(void)
+{
+	lookup_init(&g_handles);
+	lookup_init(&g_internet_handles);
+}
+
+const char *handle_type_name(unsigned int type)
+{
+	if (type >= HANDLE_TYPE_MAX)
+		return "";
+	return g_handle_type_names[type];
+}
+
+static void handle_add(HANDLE handle, unsigned int type, DWORD pid,
+	DWORD tid, const wchar_t *name, unsigned int length_in_chars)
+{
+	handle_record_t r;
+	lasterror_t lasterror;
+
+	if (handle == NULL || handle == INVALID_HANDLE_VALUE)
+		return;
+
+	if (name == NULL)
+		length_in_chars = 0;
+
+	get_lasterrors(&lasterror);
+
+	r.type = type;
+	r.pid = pid;
+	r.tid = tid;
+	r.length = length_in_chars;
+
+	// replaces whatever a handle we missed the close of pointed to before,
+	// the name is stored without a terminator
+	lookup_put(handle_table(type), (ULONG_PTR)handle, &r, sizeof(r),
+		name, length_in_chars * sizeof(wchar_t));
+
+	set_lasterrors(&lasterror);
+}
+
+void handle_track(HANDLE handle, unsigned int type, DWORD pid,
+	const wchar_t *name, unsigned int length_in_chars)
+{
+	handle_add(handle, type, pid, 0, name, length_in_chars);
+}
+
+void handle_track_thread(HANDLE handle, DWORD pid, DWORD tid)
+{
+	handle_add(handle, HANDLE_TYPE_THREAD, pid, tid, NULL, 0);
+}
+
+void handle_trackA(HANDLE handle, unsigned int type, const char *name)
+{
+	wchar_t *widename = NULL;
+	unsigned int i, len = 0;
+
+	if (name != NULL) {
+		len = (unsigned int)strlen(name);
+		widename = malloc((len + 1) * sizeof(wchar_t));
+		if (widename == NULL)
+			len = 0;
+		else {
+			for (i = 0; i < len; i++)
+				widename[i] = (wchar_t)(unsigned char)name[i];
+		}
+	}
+
+	handle_track(handle, type, GetCurrentProcessId(), widename, len);
+
+	if (widename)
+		free(widename);
+}
+
+// for named objects, the name is stored just as it gets logged
+void handle_track_objattr(HANDLE handle, unsigned int type,
+	const OBJECT_ATTRIBUTES *obj)
+{
+	const UNICODE_STRING *str = NULL;
+
+	if (obj != NULL)
+		str = obj->ObjectName;
+
+	if (str != NULL && str->Buffer != NULL)
+		handle_track(handle, type, GetCurrentProcessId(), str->Buffer,
+			str->Length / sizeof(wchar_t));
+	else
+		handle_track(handle, type, GetCurrentProcessId(), NULL, 0);
+}
+
+// the path the kernel resolved the new key to, not the one the caller asked
+// for: registry links and wow64 redirection are already applied
+void handle_track_key(HANDLE handle)
+{
+	PKEY_NAME_INFORMATION keybuf = get_keybuf();
+
+	if (keybuf == NULL)
+		return;
+
+	if (get_key_handle_path(handle, keybuf, KEYBUF_SIZE) != NULL)
+		handle_track(handle, HANDLE_TYPE_KEY, GetCurrentProcessId(),
+			keybuf->KeyName, keybuf->KeyNameLength / sizeof(wchar_t));
+	release_keybuf(keybuf);
+}
+
+void handle_untrack(HANDLE handle, unsigned int type)
+{
+	lasterror_t lasterror;
+
+	get_lasterrors(&lasterror);
+	lookup_del(handle_table(type), (ULONG_PTR)handle);
+	set_lasterrors(&lasterror);
+}
+
+// both handles have to be handles of this process
+void handle_duplicate(HANDLE source, HANDLE target)
+{
+	handle_record_t *r;
+	unsigned int size, copied;
+	lasterror_t lasterror;
+
+	if (source == target)
+		return;
+
+	get_lasterrors(&lasterror);
+
+	size = lookup_copy(&g_handles, (ULONG_PTR)source, NULL, 0);
+	if (size == 0) {
+		// the target may have been tracked under an older object
+		lookup_del(&g_handles, (ULONG_PTR)target);
+		goto out;
+	}
+
+	r = malloc(size);
+	if (r == NULL)
+		goto out;
+
+	// the source might have been replaced in between, go with the old size
+	copied = lookup_copy(&g_handles, (ULONG_PTR)source, r, size);
+	if (copied >= sizeof(handle_record_t)) {
+		if (copied < size)
+			size = copied;
+		r->length = min(r->length,
+			(size - sizeof(handle_record_t)) / sizeof(wchar_t));
+		handle_add(target, r->type, r->pid, r->tid, r->name, r->length);
+	}
+	free(r);
+
+out:
+	set_lasterrors(&lasterror);
+}
+
+unsigned int handle_info(HANDLE handle, unsigned int type, DWORD *pid,
+	wchar_t *name, unsigned int namelen)
+{
+	handle_record_t r;
+	unsigned int size;
+	unsigned int ret = HANDLE_TYPE_UNKNOWN;
+	lasterror_t lasterror;
+
+	if (name == NULL)
+		namelen = 0;
+	else if (namelen)
+		name[0] = L'\0';
+
+	get_lasterrors(&lasterror);
+
+	// the name goes straight into the caller's buffer
+	size = lookup_copy_split(handle_table(type), (ULONG_PTR)handle, &r,
+		sizeof(r), name, namelen * sizeof(wchar_t));
+	if (size >= sizeof(r)) {
+		ret = r.type;
+		if (pid != NULL)
+			*pid = r.pid;
+		if (namelen)
+			name[min(r.length, namelen - 1)] = L'\0';
+	}
+
+	set_lasterrors(&lasterror);
+	return ret;
+}
+
+BOOLEAN handle_client_id(HANDLE handle, unsigned int type, DWORD *pid,
+	DWORD *tid)
+{
+	handle_record_t r;
+	lasterror_t lasterror;
+	BOOLEAN ret = FALSE;
+
+	get_lasterrors(&lasterror);
+
+	if (lookup_copy(handle_table(type), (ULONG_PTR)handle, &r, sizeof(r)) >= sizeof(r) &&
+		r.type == type) {
+		if (pid != NULL)
+			*pid = r.pid;
+		if (tid != NULL)
+			*tid = r.tid;
+		ret = TRUE;
+	}
+
+	set_lasterrors(&lasterror);
+	return ret;
+}
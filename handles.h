@@ -0,0 +1,70 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//
+// Handle registry
+//
+// Remembers what the handles of this process refer to, filled in by the
+// create/open hooks so that other hooks can annotate their events without
+// asking the kernel again.  Entries are dropped on NtClose (or the close
+// function of the object), and copied on NtDuplicateObject.
+//
+
+enum {
+	HANDLE_TYPE_UNKNOWN = 0,
+	HANDLE_TYPE_FILE,
+	HANDLE_TYPE_KEY,
+	HANDLE_TYPE_PROCESS,
+	HANDLE_TYPE_THREAD,
+	HANDLE_TYPE_SECTION,
+	HANDLE_TYPE_MUTANT,
+	HANDLE_TYPE_EVENT,
+	HANDLE_TYPE_SOCKET,
+	// wininet handles aren't kernel handles, they are kept apart
+	HANDLE_TYPE_INTERNET,
+	HANDLE_TYPE_MAX
+};
+
+void handles_init(void);
+
+// name is a normalized name (absolute path, full key path, object name, url)
+// and may be NULL.  pid is the process the object belongs to, which is our
+// own pid for anything but process and thread handles
+void handle_track(HANDLE handle, unsigned int type, DWORD pid,
+	const wchar_t *name, unsigned int length_in_chars);
+void handle_track_thread(HANDLE handle, DWORD pid, DWORD tid);
+void handle_trackA(HANDLE handle, unsigned int type, const char *name);
+void handle_track_objattr(HANDLE handle, unsigned int type,
+	const OBJECT_ATTRIBUTES *obj);
+void handle_track_key(HANDLE handle);
+
+void handle_untrack(HANDLE handle, unsigned int type);
+void handle_duplicate(HANDLE source, HANDLE target);
+
+// returns the type of a tracked handle (looking at the wininet handles
+// if type is HANDLE_TYPE_INTERNET, at the kernel handles otherwise) or
+// HANDLE_TYPE_UNKNOWN.  name receives up to namelen - 1 characters
+unsigned int handle_info(HANDLE handle, unsigned int type, DWORD *pid,
+	wchar_t *name, unsigned int namelen);
+
+// returns TRUE and the pid (and tid, for threads) if handle is tracked as
+// an object of the given type
+BOOLEAN handle_client_id(HANDLE handle, unsigned int type, DWORD *pid,
+	DWORD *tid);
+
+const char *handle_type_name(unsigned int type);
@@ -26,6 +26,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "misc.h"
 #include "ignore.h"
 #include "lookup.h"
+#include "handles.h"
+#include "pathcache.h"
+#include "scratch.h"
 #include "config.h"
 
 #define DUMP_FILE_MASK (GENERIC_WRITE | FILE_GENERIC_WRITE | \
@@ -52,24 +55,28 @@ void file_init()
 
 static void new_file_path_ascii(const char *fname)
 {
-	char *absolutename = malloc(32768);
+	scratch_mark_t mark = scratch_mark();
+	char *absolutename = scratch_alloc(32768);
 	if (absolutename != NULL) {
 		unsigned int len;
 		ensure_absolute_ascii_path(absolutename, fname);
 		len = (unsigned int)strlen(absolutename);
 		pipe("FILE_NEW:%s", len, absolutename);
 	}
+	scratch_release(mark);
 }
 
 static void new_file_path_unicode(const wchar_t *fname)
 {
-	wchar_t *absolutename = malloc(32768 * sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *absolutename = scratch_alloc(32768 * sizeof(wchar_t));
 	if (absolutename != NULL) {
 		unsigned int len;
 		ensure_absolute_unicode_path(absolutename, fname);
 		len = lstrlenW(absolutename);
 		pipe("FILE_NEW:%S", len, absolutename);
 	}
+	scratch_release(mark);
 }
 
 static void new_file(const UNICODE_STRING *obj)
@@ -87,14 +94,15 @@ static void new_file(const UNICODE_STRING *obj)
 static void cache_file(HANDLE file_handle, const wchar_t *path,
     unsigned int length_in_chars, unsigned int attributes)
 {
-    file_record_t *r = lookup_add(&g_files, (unsigned int) file_handle,
-        sizeof(file_record_t) + length_in_chars * sizeof(wchar_t) + sizeof(wchar_t));
+	file_record_t r;
 
-	memset(r, 0, sizeof(*r));
-	r->attributes = attributes;
-	r->length = length_in_chars;
+	memset(&r, 0, sizeof(r));
+	r.attributes = attributes;
+	r.length = length_in_chars;
 
-    wcsncpy(r->filename, path, r->length + 1);
+	// path is terminated, the terminator is copied along
+	lookup_put(&g_files, (ULONG_PTR)file_handle, &r, sizeof(r),
+		path, (length_in_chars + 1) * sizeof(wchar_t));
 }
 
 void file_write(HANDLE file_handle)
@@ -104,7 +112,7 @@ void file_write(HANDLE file_handle)
 
 	get_lasterrors(&lasterror);
 
-	r = lookup_get(&g_files, (unsigned int)file_handle, NULL);
+	r = lookup_get(&g_files, (ULONG_PTR)file_handle, NULL);
     if(r != NULL) {
 		UNICODE_STRING str;
 		str.Length = (USHORT)r->length * sizeof(wchar_t);
@@ -115,7 +123,7 @@ void file_write(HANDLE file_handle)
         new_file(&str);
 
         // delete the file record from the list
-        lookup_del(&g_files, (unsigned int) file_handle);
+        lookup_del(&g_files, (ULONG_PTR)file_handle);
     }
 
 	set_lasterrors(&lasterror);
@@ -128,52 +136,72 @@ static void check_for_logging_resumption(const OBJECT_ATTRIBUTES *obj)
 	get_lasterrors(&lasterror);
 
 	if (g_config.file_of_interest && g_config.suspend_logging) {
-		wchar_t *fname = calloc(1, 32768 * sizeof(wchar_t));
-		wchar_t *absolutename = malloc(32768 * sizeof(wchar_t));
-		BOOLEAN ret = FALSE;
+		scratch_mark_t mark = scratch_mark();
+		wchar_t *fname = scratch_calloc(32768 * sizeof(wchar_t));
+		wchar_t *absolutename = scratch_alloc(32768 * sizeof(wchar_t));
 
-		path_from_object_attributes(obj, fname, 32768);
+		if (fname != NULL && absolutename != NULL) {
+			path_from_object_attributes(obj, fname, 32768);
 
-		ensure_absolute_unicode_path(absolutename, fname);
+			ensure_absolute_unicode_path(absolutename, fname);
 
-		if (!wcsicmp(absolutename, g_config.file_of_interest))
-			g_config.suspend_logging = FALSE;
+			if (!wcsicmp(absolutename, g_config.file_of_interest))
+				g_config.suspend_logging = FALSE;
+		}
 
-		free(absolutename);
-		free(fname);
+		scratch_release(mark);
 	}
 
 	set_lasterrors(&lasterror);
 }
 
-static void handle_new_file(HANDLE file_handle, const OBJECT_ATTRIBUTES *obj)
+// registers the handle and, if it was opened for writing, caches the file
+// so that it gets dumped once it is written to.  Only files opened for
+// writing get their path resolved and normalized, everything else is
+// tracked under the name it was opened by, as other named objects are
+static void handle_new_file(HANDLE file_handle, const OBJECT_ATTRIBUTES *obj,
+	BOOLEAN for_writing)
 {
+	wchar_t *fname, *absolutename;
+	unsigned int len;
+	scratch_mark_t mark;
 	lasterror_t lasterror;
 
-	get_lasterrors(&lasterror);
+	if (!for_writing) {
+		handle_track_objattr(file_handle, HANDLE_TYPE_FILE, obj);
+		return;
+	}
 
-    if(is_directory_objattr(obj) == 0) {
+	get_lasterrors(&lasterror);
 
-        wchar_t *fname = calloc(1, 32768 * sizeof(wchar_t));
-		wchar_t *absolutename = calloc(1, 32768 * sizeof(wchar_t));
+	mark = scratch_mark();
+	fname = scratch_alloc(32768 * sizeof(wchar_t));
+	absolutename = scratch_alloc(32768 * sizeof(wchar_t));
 
+	if (fname != NULL) {
 		path_from_object_attributes(obj, fname, 32768);
 
 		if (absolutename != NULL) {
-			unsigned int len;
 			ensure_absolute_unicode_path(absolutename, fname);
 			len = lstrlenW(absolutename);
+			handle_track(file_handle, HANDLE_TYPE_FILE, GetCurrentProcessId(), absolutename, len);
 			// cache this file
-			if (is_ignored_file_unicode(absolutename, len) == 0)
+			if (is_directory_objattr(obj) == 0 &&
+				is_ignored_file_unicode(absolutename, len) == 0)
 				cache_file(file_handle, absolutename, len, obj->Attributes);
-			free(absolutename);
 		}
 		else {
-			if (is_ignored_file_objattr(obj) == 0)
-				cache_file(file_handle, fname, lstrlenW(fname), obj->Attributes);
+			len = lstrlenW(fname);
+			handle_track(file_handle, HANDLE_TYPE_FILE, GetCurrentProcessId(), fname, len);
+			if (is_directory_objattr(obj) == 0 &&
+				is_ignored_file_objattr(obj) == 0)
+				cache_file(file_handle, fname, len, obj->Attributes);
 		}
-		free(fname);
-    }
+	}
+	else
+		handle_track_objattr(file_handle, HANDLE_TYPE_FILE, obj);
+
+	scratch_release(mark);
 
 	set_lasterrors(&lasterror);
 }
@@ -183,14 +211,16 @@ void file_close(HANDLE file_handle)
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
-    lookup_del(&g_files, (unsigned int) file_handle);
+    lookup_del(&g_files, (ULONG_PTR)file_handle);
 	set_lasterrors(&lasterror);
 }
 
 static BOOLEAN is_protected_objattr(POBJECT_ATTRIBUTES obj)
 {
 	wchar_t path[MAX_PATH_PLUS_TOLERANCE];
-	wchar_t *absolutepath = malloc(32768 * sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *absolutepath = scratch_alloc(32768 * sizeof(wchar_t));
+	BOOLEAN ret = FALSE;
 	if (absolutepath) {
 		path_from_object_attributes(obj, path, MAX_PATH_PLUS_TOLERANCE);
 		ensure_absolute_unicode_path(absolutepath, path);
@@ -199,12 +229,11 @@ static BOOLEAN is_protected_objattr(POBJECT_ATTRIBUTES obj)
 			lasterror.NtstatusError = STATUS_ACCESS_DENIED;
 			lasterror.Win32Error = ERROR_ACCESS_DENIED;
 			set_lasterrors(&lasterror);
-			free(absolutepath);
-			return TRUE;
+			ret = TRUE;
 		}
-		free(absolutepath);
 	}
-	return FALSE;
+	scratch_release(mark);
+	return ret;
 }
 
 HOOKDEF(NTSTATUS, WINAPI, NtCreateFile,
@@ -230,11 +259,17 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateFile,
     ret = Old_NtCreateFile(FileHandle, DesiredAccess,
         ObjectAttributes, IoStatusBlock, AllocationSize, FileAttributes,
         ShareAccess | FILE_SHARE_READ, CreateDisposition, CreateOptions, EaBuffer, EaLength);
-    LOQ_ntstatus("filesystem", "PhOiih", "FileHandle", FileHandle, "DesiredAccess", DesiredAccess,
-        "FileName", ObjectAttributes, "CreateDisposition", CreateDisposition,
-        "ShareAccess", ShareAccess, "FileAttributes", FileAttributes);
-    if(NT_SUCCESS(ret) && DesiredAccess & DUMP_FILE_MASK) {
-        handle_new_file(*FileHandle, ObjectAttributes);
+	// a new name can change what the names around it normalize to
+	if (NT_SUCCESS(ret) && IoStatusBlock->Information == FILE_CREATED)
+		path_cache_invalidate();
+	// installed with every hook profile, see the hook table
+	if (g_config.hook_profile & HOOK_CAT_FILE)
+		LOQ_ntstatus("filesystem", "PhOiih", "FileHandle", FileHandle, "DesiredAccess", DesiredAccess,
+			"FileName", ObjectAttributes, "CreateDisposition", CreateDisposition,
+			"ShareAccess", ShareAccess, "FileAttributes", FileAttributes);
+    if(NT_SUCCESS(ret)) {
+        handle_new_file(*FileHandle, ObjectAttributes,
+			(DesiredAccess & DUMP_FILE_MASK) != 0);
     }
     return ret;
 }
@@ -256,10 +291,13 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenFile,
 
 	ret = Old_NtOpenFile(FileHandle, DesiredAccess, ObjectAttributes,
 		IoStatusBlock, ShareAccess | FILE_SHARE_READ, OpenOptions);
-	LOQ_ntstatus("filesystem", "PhOi", "FileHandle", FileHandle, "DesiredAccess", DesiredAccess,
-        "FileName", ObjectAttributes, "ShareAccess", ShareAccess);
-    if(NT_SUCCESS(ret) && DesiredAccess & DUMP_FILE_MASK) {
-        handle_new_file(*FileHandle, ObjectAttributes);
+	// installed with every hook profile, see the hook table
+	if (g_config.hook_profile & HOOK_CAT_FILE)
+		LOQ_ntstatus("filesystem", "PhOi", "FileHandle", FileHandle, "DesiredAccess", DesiredAccess,
+			"FileName", ObjectAttributes, "ShareAccess", ShareAccess);
+    if(NT_SUCCESS(ret)) {
+        handle_new_file(*FileHandle, ObjectAttributes,
+			(DesiredAccess & DUMP_FILE_MASK) != 0);
     }
     return ret;
 }
@@ -277,14 +315,16 @@ HOOKDEF(NTSTATUS, WINAPI, NtReadFile,
 ) {
     NTSTATUS ret = Old_NtReadFile(FileHandle, Event, ApcRoutine, ApcContext,
         IoStatusBlock, Buffer, Length, ByteOffset, Key);
-	wchar_t *fname = calloc(32768, sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *fname = scratch_calloc(32768 * sizeof(wchar_t));
 
-	path_from_handle(FileHandle, fname, 32768);
+	if (fname != NULL)
+		path_from_handle(FileHandle, fname, 32768);
 
 	LOQ_ntstatus("filesystem", "pFbl", "FileHandle", FileHandle,
 		"HandleName", fname, "Buffer", IoStatusBlock->Information, Buffer, "Length", IoStatusBlock->Information);
 
-	free(fname);
+	scratch_release(mark);
 
 	return ret;
 }
@@ -302,14 +342,16 @@ HOOKDEF(NTSTATUS, WINAPI, NtWriteFile,
 ) {
     NTSTATUS ret = Old_NtWriteFile(FileHandle, Event, ApcRoutine, ApcContext,
         IoStatusBlock, Buffer, Length, ByteOffset, Key);
-	wchar_t *fname = calloc(32768, sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *fname = scratch_calloc(32768 * sizeof(wchar_t));
 
-	path_from_handle(FileHandle, fname, 32768);
+	if (fname != NULL)
+		path_from_handle(FileHandle, fname, 32768);
 
 	LOQ_ntstatus("filesystem", "pFbl", "FileHandle", FileHandle,
 		"HandleName", fname, "Buffer", IoStatusBlock->Information, Buffer, "Length", IoStatusBlock->Information);
 
-	free(fname);
+	scratch_release(mark);
 	
 	if(NT_SUCCESS(ret)) {
         file_write(FileHandle);
@@ -321,7 +363,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtDeleteFile,
     __in  POBJECT_ATTRIBUTES ObjectAttributes
 ) {
 	wchar_t path[MAX_PATH_PLUS_TOLERANCE];
-	wchar_t *absolutepath = malloc(32768 * sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *absolutepath = scratch_alloc(32768 * sizeof(wchar_t));
 	NTSTATUS ret;
 
 	path_from_object_attributes(ObjectAttributes, path, MAX_PATH_PLUS_TOLERANCE);
@@ -330,9 +373,11 @@ HOOKDEF(NTSTATUS, WINAPI, NtDeleteFile,
 	pipe("FILE_DEL:%Z", absolutepath);
 
     ret = Old_NtDeleteFile(ObjectAttributes);
+	if (NT_SUCCESS(ret))
+		path_cache_invalidate();
 	LOQ_ntstatus("filesystem", "u", "FileName", absolutepath);
 
-	free(absolutepath);
+	scratch_release(mark);
 
 	return ret;
 }
@@ -449,8 +494,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtSetInformationFile,
     __in   ULONG Length,
     __in   FILE_INFORMATION_CLASS FileInformationClass
 ) {
-	wchar_t *fname = calloc(32768, sizeof(wchar_t));
-	wchar_t *absolutepath = calloc(32768, sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *fname = scratch_calloc(32768 * sizeof(wchar_t));
+	wchar_t *absolutepath = scratch_calloc(32768 * sizeof(wchar_t));
 	BOOL ret;
 
 
@@ -465,11 +511,14 @@ HOOKDEF(NTSTATUS, WINAPI, NtSetInformationFile,
 
     ret = Old_NtSetInformationFile(FileHandle, IoStatusBlock,
         FileInformation, Length, FileInformationClass);
+	if (NT_SUCCESS(ret) && (FileInformationClass == FileRenameInformation ||
+		FileInformationClass == FileLinkInformation ||
+		FileInformationClass == FileDispositionInformation))
+		path_cache_invalidate();
 	LOQ_ntstatus("filesystem", "puib", "FileHandle", FileHandle, "HandleName", absolutepath, "FileInformationClass", FileInformationClass,
         "FileInformation", Length, FileInformation);
 
-	free(fname);
-	free(absolutepath);
+	scratch_release(mark);
 
     return ret;
 }
@@ -503,6 +552,8 @@ HOOKDEF(BOOL, WINAPI, CreateDirectoryW,
     __in_opt  LPSECURITY_ATTRIBUTES lpSecurityAttributes
 ) {
     BOOL ret = Old_CreateDirectoryW(lpPathName, lpSecurityAttributes);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "F", "DirectoryName", lpPathName);
     return ret;
 }
@@ -514,6 +565,8 @@ HOOKDEF(BOOL, WINAPI, CreateDirectoryExW,
 ) {
     BOOL ret = Old_CreateDirectoryExW(lpTemplateDirectory, lpNewDirectory,
         lpSecurityAttributes);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "F", "DirectoryName", lpNewDirectory);
     return ret;
 }
@@ -527,6 +580,8 @@ HOOKDEF(BOOL, WINAPI, RemoveDirectoryA,
 	ensure_absolute_ascii_path(path, lpPathName);
 
     ret = Old_RemoveDirectoryA(lpPathName);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "s", "DirectoryName", path);
 
     return ret;
@@ -535,15 +590,18 @@ HOOKDEF(BOOL, WINAPI, RemoveDirectoryA,
 HOOKDEF(BOOL, WINAPI, RemoveDirectoryW,
     __in  LPWSTR lpPathName
 ) {
-	wchar_t *path = malloc(32768 * sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *path = scratch_alloc(32768 * sizeof(wchar_t));
 	BOOL ret;
 
 	ensure_absolute_unicode_path(path, lpPathName);
 
     ret = Old_RemoveDirectoryW(lpPathName);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "u", "DirectoryName", path);
 
-	free(path);
+	scratch_release(mark);
 
     return ret;
 }
@@ -555,13 +613,16 @@ HOOKDEF(BOOL, WINAPI, MoveFileWithProgressW,
     __in_opt  LPVOID lpData,
     __in      DWORD dwFlags
 ) {
-	wchar_t *path = malloc(32768 * sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *path = scratch_alloc(32768 * sizeof(wchar_t));
 	BOOL ret;
 
 	ensure_absolute_unicode_path(path, lpExistingFileName);
 
     ret = Old_MoveFileWithProgressW(lpExistingFileName, lpNewFileName,
         lpProgressRoutine, lpData, dwFlags);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "uFh", "ExistingFileName", path,
         "NewFileName", lpNewFileName, "Flags", dwFlags);
     if (ret != FALSE) {
@@ -574,7 +635,7 @@ HOOKDEF(BOOL, WINAPI, MoveFileWithProgressW,
 
     }
 
-	free(path);
+	scratch_release(mark);
 
 	return ret;
 }
@@ -614,6 +675,8 @@ HOOKDEF(BOOL, WINAPI, CopyFileA,
 ) {
     BOOL ret = Old_CopyFileA(lpExistingFileName, lpNewFileName,
         bFailIfExists);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "ff", "ExistingFileName", lpExistingFileName,
         "NewFileName", lpNewFileName);
 
@@ -630,6 +693,8 @@ HOOKDEF(BOOL, WINAPI, CopyFileW,
 ) {
     BOOL ret = Old_CopyFileW(lpExistingFileName, lpNewFileName,
         bFailIfExists);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "FF", "ExistingFileName", lpExistingFileName,
         "NewFileName", lpNewFileName);
 
@@ -649,6 +714,8 @@ HOOKDEF(BOOL, WINAPI, CopyFileExW,
 ) {
     BOOL ret = Old_CopyFileExW(lpExistingFileName, lpNewFileName,
         lpProgressRoutine, lpData, pbCancel, dwCopyFlags);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "FFi", "ExistingFileName", lpExistingFileName,
         "NewFileName", lpNewFileName, "CopyFlags", dwCopyFlags);
 
@@ -669,6 +736,8 @@ HOOKDEF(BOOL, WINAPI, DeleteFileA,
 	pipe("FILE_DEL:%z", path);
 
     ret = Old_DeleteFileA(lpFileName);
+	if (ret)
+		path_cache_invalidate();
 	LOQ_bool("filesystem", "s", "FileName", path);
 
     return ret;
@@ -677,7 +746,8 @@ HOOKDEF(BOOL, WINAPI, DeleteFileA,
 HOOKDEF(BOOL, WINAPI, DeleteFileW,
     __in  LPWSTR lpFileName
 ) {
-	wchar_t *path = malloc(32768 * sizeof(wchar_t));
+	scratch_mark_t mark = scratch_mark();
+	wchar_t *path = scratch_alloc(32768 * sizeof(wchar_t));
 	BOOL ret;
 
 	if (path) {
@@ -687,13 +757,15 @@ HOOKDEF(BOOL, WINAPI, DeleteFileW,
 	}
 
     ret = Old_DeleteFileW(lpFileName);
+	if (ret)
+		path_cache_invalidate();
 	if (path) {
 		LOQ_bool("filesystem", "u", "FileName", path);
-		free(path);
 	}
 	else {
 		LOQ_bool("filesystem", "u", "FileName", lpFileName);
 	}
+	scratch_release(mark);
     return ret;
 }
 
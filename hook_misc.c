@@ -23,7 +23,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "pipe.h"
 #include "misc.h"
 #include "hook_file.h"
+#include "handles.h"
 #include "hook_sleep.h"
+#include "config.h"
 
 HOOKDEF(HHOOK, WINAPI, SetWindowsHookExA,
     __in  int idHook,
@@ -116,6 +118,8 @@ HOOKDEF(NTSTATUS, WINAPI, LdrGetDllHandle,
     return ret;
 }
 
+void lazy_hooks_resolved(void *addr);
+
 HOOKDEF(NTSTATUS, WINAPI, LdrGetProcedureAddress,
     __in        HMODULE ModuleHandle,
     __in_opt    PANSI_STRING FunctionName,
@@ -124,13 +128,62 @@ HOOKDEF(NTSTATUS, WINAPI, LdrGetProcedureAddress,
 ) {
     NTSTATUS ret = Old_LdrGetProcedureAddress(ModuleHandle, FunctionName,
         Ordinal, FunctionAddress);
-    LOQ_ntstatus("system", "pSiP", "ModuleHandle", ModuleHandle,
-        "FunctionName", FunctionName != NULL ? FunctionName->Length : 0,
-            FunctionName != NULL ? FunctionName->Buffer : NULL,
-        "Ordinal", Ordinal, "FunctionAddress", FunctionAddress);
+	// with lazy-hooks it is installed outside of the misc hook category too
+	if (g_config.hook_profile & HOOK_CAT_MISC)
+		LOQ_ntstatus("system", "pSiP", "ModuleHandle", ModuleHandle,
+			"FunctionName", FunctionName != NULL ? FunctionName->Length : 0,
+				FunctionName != NULL ? FunctionName->Buffer : NULL,
+			"Ordinal", Ordinal, "FunctionAddress", FunctionAddress);
+	if (NT_SUCCESS(ret))
+		lazy_hooks_resolved(*FunctionAddress);
     return ret;
 }
 
+// what GetProcAddress calls on Windows 8 and later
+HOOKDEF(NTSTATUS, WINAPI, LdrGetProcedureAddressForCaller,
+	__in        HMODULE ModuleHandle,
+	__in_opt    PANSI_STRING FunctionName,
+	__in_opt    WORD Ordinal,
+	__out       PVOID *FunctionAddress,
+	__in        BOOL bValue,
+	__in        PVOID CallbackAddress
+) {
+	NTSTATUS ret = Old_LdrGetProcedureAddressForCaller(ModuleHandle, FunctionName,
+		Ordinal, FunctionAddress, bValue, CallbackAddress);
+	// with lazy-hooks it is installed outside of the misc hook category too
+	if (g_config.hook_profile & HOOK_CAT_MISC)
+		LOQ_ntstatus("system", "pSiP", "ModuleHandle", ModuleHandle,
+			"FunctionName", FunctionName != NULL ? FunctionName->Length : 0,
+				FunctionName != NULL ? FunctionName->Buffer : NULL,
+			"Ordinal", Ordinal, "FunctionAddress", FunctionAddress);
+	if (NT_SUCCESS(ret))
+		lazy_hooks_resolved(*FunctionAddress);
+	return ret;
+}
+
+void lazy_hooks_unloaded(HMODULE module);
+
+HOOKDEF(NTSTATUS, WINAPI, LdrUnloadDll,
+	__in        PVOID DllImageBase
+) {
+	NTSTATUS ret;
+
+#ifdef _WIN64
+	// the images are unmapped before the original function returns
+	pdata_cache_unload_begin();
+#endif
+	ret = Old_LdrUnloadDll(DllImageBase);
+#ifdef _WIN64
+	pdata_cache_unload_end();
+#endif
+	// installed outside of the misc hook category too, see hook_is_required()
+	if (g_config.hook_profile & HOOK_CAT_MISC)
+		LOQ_ntstatus("system", "p", "ModuleHandle", DllImageBase);
+	if (NT_SUCCESS(ret))
+		lazy_hooks_unloaded((HMODULE)DllImageBase);
+	return ret;
+}
+
 HOOKDEF(BOOL, WINAPI, DeviceIoControl,
     __in         HANDLE hDevice,
     __in         DWORD dwIoControlCode,
@@ -226,10 +279,20 @@ HOOKDEF(BOOL, WINAPI, LookupPrivilegeValueW,
 HOOKDEF(NTSTATUS, WINAPI, NtClose,
     __in    HANDLE Handle
 ) {
+	wchar_t name[MAX_PATH_PLUS_TOLERANCE];
+	unsigned int type = handle_info(Handle, HANDLE_TYPE_UNKNOWN, NULL, name, MAX_PATH_PLUS_TOLERANCE);
     NTSTATUS ret = Old_NtClose(Handle);
-    LOQ_ntstatus("system", "p", "Handle", Handle);
+	// closing handles nobody told us about is just noise, unless it fails.
+	// the hook is installed outside of the misc hook category too
+	if ((g_config.hook_profile & HOOK_CAT_MISC) &&
+		(type != HANDLE_TYPE_UNKNOWN || !NT_SUCCESS(ret))) {
+		LOQ_ntstatus("system", "psu", "Handle", Handle, "HandleType", handle_type_name(type),
+			"HandleName", name);
+	}
     if(NT_SUCCESS(ret)) {
         file_close(Handle);
+		if (type != HANDLE_TYPE_UNKNOWN)
+			handle_untrack(Handle, type);
     }
     return ret;
 }
@@ -245,6 +308,27 @@ HOOKDEF(NTSTATUS, WINAPI, NtDuplicateObject,
 	) {
 	NTSTATUS ret = Old_NtDuplicateObject(SourceProcessHandle, SourceHandle, TargetProcessHandle,
 		TargetHandle, DesiredAccess, HandleAttributes, Options);
+	BOOL source_ours = pid_from_process_handle(SourceProcessHandle) == GetCurrentProcessId();
+	HANDLE target = NULL;
+
+	if (NT_SUCCESS(ret) && TargetHandle && TargetProcessHandle &&
+		pid_from_process_handle(TargetProcessHandle) == GetCurrentProcessId())
+		target = *TargetHandle;
+
+	// the new handle value may still be tracked under an object whose
+	// close we missed, no matter which process the source lives in
+	if (target && (!source_ours || target != SourceHandle)) {
+		file_close(target);
+		if (source_ours)
+			handle_duplicate(SourceHandle, target);
+		else
+			handle_untrack(target, HANDLE_TYPE_UNKNOWN);
+	}
+	// the source gets closed even if the duplication fails
+	if (source_ours && (Options & DUPLICATE_CLOSE_SOURCE) && target != SourceHandle) {
+		file_close(SourceHandle);
+		handle_untrack(SourceHandle, HANDLE_TYPE_UNKNOWN);
+	}
 	if (TargetHandle)
 		LOQ_ntstatus("system", "pP", "SourceHandle", SourceHandle, "TargetHandle", TargetHandle);
 	else
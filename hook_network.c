@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "log.h"
 #include "pipe.h"
 #include "config.h"
+#include "handles.h"
 
 HOOKDEF(HINTERNET, WINAPI, WinHttpOpen,
 	_In_opt_ LPCWSTR pwszUserAgent,
@@ -207,6 +208,8 @@ HOOKDEF(HINTERNET, WINAPI, InternetOpenA,
 	LOQ_nonnull("network", "shssh", "Agent", lpszAgent, "AccessType", dwAccessType,
         "ProxyName", lpszProxyName, "ProxyBypass", lpszProxyBypass,
         "Flags", dwFlags);
+    if (ret != NULL)
+        handle_trackA(ret, HANDLE_TYPE_INTERNET, lpszAgent);
     return ret;
 }
 
@@ -226,6 +229,9 @@ HOOKDEF(HINTERNET, WINAPI, InternetOpenW,
 	LOQ_nonnull("network", "uhuuh", "Agent", lpszAgent, "AccessType", dwAccessType,
         "ProxyName", lpszProxyName, "ProxyBypass", lpszProxyBypass,
         "Flags", dwFlags);
+    if (ret != NULL)
+        handle_track(ret, HANDLE_TYPE_INTERNET, GetCurrentProcessId(), lpszAgent,
+            lpszAgent ? lstrlenW(lpszAgent) : 0);
     return ret;
 }
 
@@ -245,6 +251,8 @@ HOOKDEF(HINTERNET, WINAPI, InternetConnectA,
     LOQ_nonnull("network", "psissih", "InternetHandle", hInternet, "ServerName", lpszServerName,
         "ServerPort", nServerPort, "Username", lpszUsername,
         "Password", lpszPassword, "Service", dwService, "Flags", dwFlags);
+    if (ret != NULL)
+        handle_trackA(ret, HANDLE_TYPE_INTERNET, lpszServerName);
     return ret;
 }
 
@@ -264,6 +272,9 @@ HOOKDEF(HINTERNET, WINAPI, InternetConnectW,
     LOQ_nonnull("network", "puiuuih", "InternetHandle", hInternet, "ServerName", lpszServerName,
         "ServerPort", nServerPort, "Username", lpszUsername,
         "Password", lpszPassword, "Service", dwService, "Flags", dwFlags);
+    if (ret != NULL)
+        handle_track(ret, HANDLE_TYPE_INTERNET, GetCurrentProcessId(), lpszServerName,
+            lpszServerName ? lstrlenW(lpszServerName) : 0);
     return ret;
 }
 
@@ -281,6 +292,8 @@ HOOKDEF(HINTERNET, WINAPI, InternetOpenUrlA,
 		dwHeadersLength = (DWORD)strlen(lpszHeaders);
     LOQ_nonnull("network", "psSh", "ConnectionHandle", hInternet, "URL", lpszUrl,
         "Headers", dwHeadersLength, lpszHeaders, "Flags", dwFlags);
+    if (ret != NULL)
+        handle_trackA(ret, HANDLE_TYPE_INTERNET, lpszUrl);
     return ret;
 }
 
@@ -296,6 +309,9 @@ HOOKDEF(HINTERNET, WINAPI, InternetOpenUrlW,
         dwHeadersLength, dwFlags, dwContext);
     LOQ_nonnull("network", "puUh", "ConnectionHandle", hInternet, "URL", lpszUrl,
         "Headers", dwHeadersLength, lpszHeaders, "Flags", dwFlags);
+    if (ret != NULL)
+        handle_track(ret, HANDLE_TYPE_INTERNET, GetCurrentProcessId(), lpszUrl,
+            lpszUrl ? lstrlenW(lpszUrl) : 0);
     return ret;
 }
 
@@ -313,6 +329,8 @@ HOOKDEF(HINTERNET, WINAPI, HttpOpenRequestA,
         lpszVersion, lpszReferer, lplpszAcceptTypes, dwFlags, dwContext);
     LOQ_nonnull("network", "psh", "InternetHandle", hConnect, "Path", lpszObjectName,
         "Flags", dwFlags);
+    if (ret != NULL)
+        handle_trackA(ret, HANDLE_TYPE_INTERNET, lpszObjectName);
     return ret;
 }
 
@@ -330,6 +348,9 @@ HOOKDEF(HINTERNET, WINAPI, HttpOpenRequestW,
         lpszVersion, lpszReferer, lplpszAcceptTypes, dwFlags, dwContext);
     LOQ_nonnull("network", "puh", "InternetHandle", hConnect, "Path", lpszObjectName,
         "Flags", dwFlags);
+    if (ret != NULL)
+        handle_track(ret, HANDLE_TYPE_INTERNET, GetCurrentProcessId(), lpszObjectName,
+            lpszObjectName ? lstrlenW(lpszObjectName) : 0);
     return ret;
 }
 
@@ -395,6 +416,8 @@ HOOKDEF(BOOL, WINAPI, InternetCloseHandle,
 ) {
     BOOL ret = Old_InternetCloseHandle(hInternet);
     LOQ_bool("network", "p", "InternetHandle", hInternet);
+    if (ret)
+        handle_untrack(hInternet, HANDLE_TYPE_INTERNET);
     return ret;
 }
 
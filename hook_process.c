@@ -26,6 +26,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ignore.h"
 #include "hook_sleep.h"
 #include "unhook.h"
+#include "handles.h"
+#include "scratch.h"
 
 HOOKDEF(HANDLE, WINAPI, CreateToolhelp32Snapshot,
 	__in DWORD dwFlags,
@@ -90,8 +92,11 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateProcess,
     LOQ_ntstatus("process", "PphO", "ProcessHandle", ProcessHandle, "ParentHandle", ParentProcess, "DesiredAccess", DesiredAccess,
         "FileName", ObjectAttributes);
     if(NT_SUCCESS(ret)) {
-		DWORD pid = pid_from_process_handle(*ProcessHandle);
-        pipe("PROCESS:%d:%d", is_suspended(pid, 0), pid);
+		DWORD pid = pid_from_process_handle_verified(*ProcessHandle);
+		handle_track(*ProcessHandle, HANDLE_TYPE_PROCESS, pid, NULL, 0);
+		// no threads yet
+		remember_suspended(pid, 0, TRUE);
+        pipe("PROCESS:%d:%d", 1, pid);
         disable_sleep_skip();
     }
     return ret;
@@ -114,8 +119,11 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateProcessEx,
 	LOQ_ntstatus("process", "PphO", "ProcessHandle", ProcessHandle, "ParentHandle", ParentProcess, "DesiredAccess", DesiredAccess,
         "FileName", ObjectAttributes);
     if(NT_SUCCESS(ret)) {
-		DWORD pid = pid_from_process_handle(*ProcessHandle);
-        pipe("PROCESS:%d:%d", is_suspended(pid, 0), pid);
+		DWORD pid = pid_from_process_handle_verified(*ProcessHandle);
+		handle_track(*ProcessHandle, HANDLE_TYPE_PROCESS, pid, NULL, 0);
+		// no threads yet
+		remember_suspended(pid, 0, TRUE);
+        pipe("PROCESS:%d:%d", 1, pid);
         disable_sleep_skip();
     }
     return ret;
@@ -156,9 +164,16 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateUserProcess,
         "ImagePathName", &ProcessParameters->ImagePathName,
         "CommandLine", &ProcessParameters->CommandLine);
     if(NT_SUCCESS(ret)) {
-		DWORD pid = pid_from_process_handle(*ProcessHandle);
-		DWORD tid = tid_from_thread_handle(*ThreadHandle);
-		pipe("PROCESS:%d:%d,%d", is_suspended(pid, tid), pid, tid);
+		DWORD pid = pid_from_process_handle_verified(*ProcessHandle);
+		DWORD tid = tid_from_thread_handle_verified(*ThreadHandle);
+		handle_track(*ProcessHandle, HANDLE_TYPE_PROCESS, pid,
+			ProcessParameters->ImagePathName.Buffer,
+			ProcessParameters->ImagePathName.Length / sizeof(wchar_t));
+		handle_track_thread(*ThreadHandle, pid, tid);
+		// THREAD_CREATE_FLAGS_CREATE_SUSPENDED
+		if (ThreadFlags & 1)
+			remember_suspended(pid, tid, TRUE);
+		pipe("PROCESS:%d:%d,%d", (ThreadFlags & 1) ? 1 : is_suspended(pid, tid), pid, tid);
         disable_sleep_skip();
     }
     return ret;
@@ -183,9 +198,14 @@ HOOKDEF(NTSTATUS, WINAPI, RtlCreateUserProcess,
     LOQ_ntstatus("process", "ohp", "ImagePath", ImagePath, "ObjectAttributes", ObjectAttributes,
         "ParentHandle", ParentProcess);
     if(NT_SUCCESS(ret)) {
-		DWORD pid = pid_from_process_handle(ProcessInformation->ProcessHandle);
-		DWORD tid = tid_from_thread_handle(ProcessInformation->ThreadHandle);
-		pipe("PROCESS:%d:%d,%d", is_suspended(pid, tid), pid, tid);
+		DWORD pid = pid_from_process_handle_verified(ProcessInformation->ProcessHandle);
+		DWORD tid = tid_from_thread_handle_verified(ProcessInformation->ThreadHandle);
+		handle_track(ProcessInformation->ProcessHandle, HANDLE_TYPE_PROCESS, pid,
+			ImagePath->Buffer, ImagePath->Length / sizeof(wchar_t));
+		handle_track_thread(ProcessInformation->ThreadHandle, pid, tid);
+		// the initial thread is always created suspended
+		remember_suspended(pid, tid, TRUE);
+		pipe("PROCESS:%d:%d,%d", 1, pid, tid);
         disable_sleep_skip();
     }
     return ret;
@@ -219,6 +239,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenProcess,
     LOQ_ntstatus("process", "Phi", "ProcessHandle", ProcessHandle,
         "DesiredAccess", DesiredAccess,
         "ProcessIdentifier", pid);
+	if (NT_SUCCESS(ret) && ClientId != NULL)
+		handle_track(*ProcessHandle, HANDLE_TYPE_PROCESS, pid, NULL, 0);
 
 	return ret;
 }
@@ -227,10 +249,12 @@ HOOKDEF(NTSTATUS, WINAPI, NtResumeProcess,
 	__in  HANDLE ProcessHandle
 ) {
 	NTSTATUS ret;
-	DWORD pid = pid_from_process_handle(ProcessHandle);
+	DWORD pid = pid_from_process_handle_verified(ProcessHandle);
 	pipe("RESUME:%d", pid);
 
 	ret = Old_NtResumeProcess(ProcessHandle);
+	if (NT_SUCCESS(ret))
+		forget_suspended_process(pid);
 	LOQ_ntstatus("process", "p", "ProcessHandle", ProcessHandle);
 	return ret;
 }
@@ -238,6 +262,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtResumeProcess,
 
 int process_shutting_down;
 
+void process_exit_report(void);
+
 HOOKDEF(NTSTATUS, WINAPI, NtTerminateProcess,
     __in_opt  HANDLE ProcessHandle,
     __in      NTSTATUS ExitStatus
@@ -245,22 +271,28 @@ HOOKDEF(NTSTATUS, WINAPI, NtTerminateProcess,
 	// Process will terminate. Default logging will not work. Be aware: return value not valid
     NTSTATUS ret = 0;
 	lasterror_t lasterror;
+	DWORD PID = 0;
 
 	get_lasterrors(&lasterror);
     LOQ_ntstatus("process", "ph", "ProcessHandle", ProcessHandle, "ExitCode", ExitStatus);
-	if (ProcessHandle == NULL || GetCurrentProcessId() == GetProcessId(ProcessHandle)) {
+	// a stale registry entry must neither kill our logging nor let a
+	// protected process be terminated
+	if (ProcessHandle != NULL)
+		PID = pid_from_process_handle_verified(ProcessHandle);
+	if (ProcessHandle == NULL || GetCurrentProcessId() == PID) {
+		process_exit_report();
 		pipe("KILL:%d", GetCurrentProcessId());
 		log_free();
 		process_shutting_down = 1;
 	}
 	else {
-		DWORD PID = pid_from_process_handle(ProcessHandle);
 		if (is_protected_pid(PID)) {
 			ret = STATUS_ACCESS_DENIED;
 			LOQ_ntstatus("process", "ph", "ProcessHandle", ProcessHandle, "ExitCode", ExitStatus);
 			return ret;
 		}
 		pipe("KILL:%d", PID);
+		forget_suspended_process(PID);
 	}
 	set_lasterrors(&lasterror);
 
@@ -290,6 +322,22 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateSection,
 		file_write(FileHandle);
 	}
 
+	if (NT_SUCCESS(ret)) {
+		// anonymous sections are named after the file they map, if we know it
+		if (unistr_from_objattr(ObjectAttributes) == NULL && FileHandle) {
+			scratch_mark_t mark = scratch_mark();
+			wchar_t *fname = scratch_alloc(32768 * sizeof(wchar_t));
+			if (fname != NULL) {
+				handle_info(FileHandle, HANDLE_TYPE_FILE, NULL, fname, 32768);
+				handle_track(*SectionHandle, HANDLE_TYPE_SECTION, GetCurrentProcessId(),
+					fname, lstrlenW(fname));
+			}
+			scratch_release(mark);
+		}
+		else
+			handle_track_objattr(*SectionHandle, HANDLE_TYPE_SECTION, ObjectAttributes);
+	}
+
 	return ret;
 }
 
@@ -302,6 +350,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenSection,
         ObjectAttributes);
     LOQ_ntstatus("process", "Ppo", "SectionHandle", SectionHandle, "DesiredAccess", DesiredAccess,
         "ObjectAttributes", ObjectAttributes ? ObjectAttributes->ObjectName : NULL);
+	if (NT_SUCCESS(ret))
+		handle_track_objattr(*SectionHandle, HANDLE_TYPE_SECTION, ObjectAttributes);
     return ret;
 }
 
@@ -329,6 +379,19 @@ HOOKDEF(BOOL, WINAPI, CreateProcessInternalW,
         "ThreadId", lpProcessInformation->dwThreadId,
         "ProcessHandle", lpProcessInformation->hProcess,
         "ThreadHandle", lpProcessInformation->hThread);
+	if (ret) {
+		handle_track(lpProcessInformation->hProcess, HANDLE_TYPE_PROCESS,
+			lpProcessInformation->dwProcessId, lpApplicationName,
+			lpApplicationName ? lstrlenW(lpApplicationName) : 0);
+		handle_track_thread(lpProcessInformation->hThread,
+			lpProcessInformation->dwProcessId, lpProcessInformation->dwThreadId);
+		if (dwCreationFlags & CREATE_SUSPENDED)
+			remember_suspended(lpProcessInformation->dwProcessId,
+				lpProcessInformation->dwThreadId, TRUE);
+		else
+			forget_suspended(lpProcessInformation->dwProcessId,
+				lpProcessInformation->dwThreadId);
+	}
     return ret;
 }
 
@@ -387,7 +450,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtMapViewOfSection,
 	NTSTATUS ret = Old_NtMapViewOfSection(SectionHandle, ProcessHandle,
 		BaseAddress, ZeroBits, CommitSize, SectionOffset, ViewSize,
 		InheritDisposition, AllocationType, Win32Protect);
-	DWORD pid = pid_from_process_handle(ProcessHandle);
+	DWORD pid = pid_from_process_handle_verified(ProcessHandle);
 
 	if ((pid != GetCurrentProcessId()) || Win32Protect != PAGE_READWRITE)
 		LOQ_ntstatus("process", "ppPpPh", "SectionHandle", SectionHandle,
@@ -417,7 +480,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtAllocateVirtualMemory,
         ZeroBits, RegionSize, AllocationType, Protect);
 
 	get_lasterrors(&lasterror);
-	if (Protect != PAGE_READWRITE || GetCurrentProcessId() != GetProcessId(ProcessHandle)) {
+	if (Protect != PAGE_READWRITE || GetCurrentProcessId() != pid_from_process_handle(ProcessHandle)) {
 		LOQ_ntstatus("process", "pPPh", "ProcessHandle", ProcessHandle, "BaseAddress", BaseAddress,
 			"RegionSize", RegionSize, "Protection", Protect);
 	}
@@ -481,7 +544,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtWriteVirtualMemory,
     ret = Old_NtWriteVirtualMemory(ProcessHandle, BaseAddress, Buffer,
         NumberOfBytesToWrite, NumberOfBytesWritten);
 
-	pid = pid_from_process_handle(ProcessHandle);
+	pid = pid_from_process_handle_verified(ProcessHandle);
 
 	if (pid != GetCurrentProcessId()) {
 		LOQ_ntstatus("process", "ppB", "ProcessHandle", ProcessHandle, "BaseAddress", BaseAddress,
@@ -511,7 +574,7 @@ HOOKDEF(BOOL, WINAPI, WriteProcessMemory,
     ret = Old_WriteProcessMemory(hProcess, lpBaseAddress, lpBuffer,
         nSize, lpNumberOfBytesWritten);
 
-	pid = pid_from_process_handle(hProcess);
+	pid = pid_from_process_handle_verified(hProcess);
 
 	if (pid != GetCurrentProcessId()) {
 		LOQ_bool("process", "ppB", "ProcessHandle", hProcess, "BaseAddress", lpBaseAddress,
@@ -535,9 +598,13 @@ HOOKDEF(NTSTATUS, WINAPI, NtProtectVirtualMemory,
 ) {
 	NTSTATUS ret;
 
-	if (NewAccessProtection == PAGE_EXECUTE_READ && BaseAddress && NumberOfBytesToProtect &&
-		GetCurrentProcessId() == GetProcessId(ProcessHandle) && is_in_dll_range((ULONG_PTR)*BaseAddress))
-		restore_hooks_on_range((ULONG_PTR)*BaseAddress, (ULONG_PTR)*BaseAddress + *NumberOfBytesToProtect);
+	if (BaseAddress && NumberOfBytesToProtect && is_in_dll_range((ULONG_PTR)*BaseAddress) &&
+		GetCurrentProcessId() == pid_from_process_handle_verified(ProcessHandle)) {
+		if (NewAccessProtection == PAGE_EXECUTE_READ)
+			restore_hooks_on_range((ULONG_PTR)*BaseAddress, (ULONG_PTR)*BaseAddress + *NumberOfBytesToProtect);
+		else
+			unhook_detect_protect((ULONG_PTR)*BaseAddress, (ULONG_PTR)*BaseAddress + *NumberOfBytesToProtect);
+	}
 	
 	ret = Old_NtProtectVirtualMemory(ProcessHandle, BaseAddress,
         NumberOfBytesToProtect, NewAccessProtection, OldAccessProtection);
@@ -557,9 +624,13 @@ HOOKDEF(BOOL, WINAPI, VirtualProtectEx,
 ) {
 	BOOL ret;
 
-	if (flNewProtect == PAGE_EXECUTE_READ && GetCurrentProcessId() == GetProcessId(hProcess) &&
-		is_in_dll_range((ULONG_PTR)lpAddress))
-		restore_hooks_on_range((ULONG_PTR)lpAddress, (ULONG_PTR)lpAddress + dwSize);
+	if (is_in_dll_range((ULONG_PTR)lpAddress) &&
+		GetCurrentProcessId() == pid_from_process_handle_verified(hProcess)) {
+		if (flNewProtect == PAGE_EXECUTE_READ)
+			restore_hooks_on_range((ULONG_PTR)lpAddress, (ULONG_PTR)lpAddress + dwSize);
+		else
+			unhook_detect_protect((ULONG_PTR)lpAddress, (ULONG_PTR)lpAddress + dwSize);
+	}
 
 	ret = Old_VirtualProtectEx(hProcess, lpAddress, dwSize, flNewProtect,
         lpflOldProtect);
@@ -580,7 +651,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtFreeVirtualMemory,
         RegionSize, FreeType);
 
 	get_lasterrors(&lasterror);
-	if (GetCurrentProcessId() != GetProcessId(ProcessHandle)) {
+	if (GetCurrentProcessId() != pid_from_process_handle(ProcessHandle)) {
 		LOQ_ntstatus("process", "pPPh", "ProcessHandle", ProcessHandle, "BaseAddress", BaseAddress,
 			"RegionSize", RegionSize, "FreeType", FreeType);
 	}
@@ -648,12 +719,14 @@ HOOKDEF(NTSTATUS, WINAPI, DbgUiWaitStateChange,
 			break;
 		case DbgLoadDllStateChange:
 			{
-				wchar_t *fname = calloc(32768, sizeof(wchar_t));
+				scratch_mark_t mark = scratch_mark();
+				wchar_t *fname = scratch_calloc(32768 * sizeof(wchar_t));
 
-				path_from_handle(StateChange->StateInfo.LoadDll.FileHandle, fname, 32768);
+				if (fname != NULL)
+					path_from_handle(StateChange->StateInfo.LoadDll.FileHandle, fname, 32768);
 				// we could continue ourselves here and skip notification to the malware of cuckoomon loading
 				LOQ_ntstatus("process", "iiiF", "NewState", StateChange->NewState, "ProcessId", pid_from_process_handle(StateChange->AppClientId.UniqueProcess), "ThreadId", tid_from_thread_handle(StateChange->AppClientId.UniqueThread), "DllPath", fname);
-				free(fname);
+				scratch_release(mark);
 			}
 			break;
 		default:
@@ -21,6 +21,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hooking.h"
 #include "misc.h"
 #include "log.h"
+#include "handles.h"
+#include "ignore.h"
 
 HOOKDEF(LONG, WINAPI, RegOpenKeyExA,
     __in        HKEY hKey,
@@ -33,6 +35,8 @@ HOOKDEF(LONG, WINAPI, RegOpenKeyExA,
         phkResult);
     LOQ_zero("registry", "psPe", "Registry", hKey, "SubKey", lpSubKey, "Handle", phkResult,
 		"FullName", hKey, lpSubKey);
+	if (ret == ERROR_SUCCESS)
+		handle_track_key(*phkResult);
     return ret;
 }
 
@@ -47,6 +51,8 @@ HOOKDEF(LONG, WINAPI, RegOpenKeyExW,
         phkResult);
     LOQ_zero("registry", "puPE", "Registry", hKey, "SubKey", lpSubKey, "Handle", phkResult,
 		"FullName", hKey, lpSubKey);
+	if (ret == ERROR_SUCCESS)
+		handle_track_key(*phkResult);
 	return ret;
 }
 
@@ -69,6 +75,8 @@ HOOKDEF(LONG, WINAPI, RegCreateKeyExA,
     LOQ_zero("registry", "psshPeI", "Registry", hKey, "SubKey", lpSubKey, "Class", lpClass,
         "Access", samDesired, "Handle", phkResult, "FullName", hKey, lpSubKey,
 		"Disposition", lpdwDisposition);
+	if (ret == ERROR_SUCCESS)
+		handle_track_key(*phkResult);
     return ret;
 }
 
@@ -91,6 +99,8 @@ HOOKDEF(LONG, WINAPI, RegCreateKeyExW,
     LOQ_zero("registry", "puuhPEI", "Registry", hKey, "SubKey", lpSubKey, "Class", lpClass,
         "Access", samDesired, "Handle", phkResult, "FullName", hKey, lpSubKey,
 		"Disposition", lpdwDisposition);
+	if (ret == ERROR_SUCCESS)
+		handle_track_key(*phkResult);
 	return ret;
 }
 
@@ -275,20 +285,20 @@ HOOKDEF(LONG, WINAPI, RegQueryValueExA,
         lpData, lpcbData);
     if(ret == ERROR_SUCCESS && lpType != NULL && lpData != NULL &&
             lpcbData != NULL) {
-		unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-		PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-		wchar_t *keypath = get_full_keyvalue_pathA(hKey, lpValueName, keybuf, allocsize);
+		PKEY_NAME_INFORMATION keybuf = get_keybuf();
+		wchar_t *keypath = get_full_keyvalue_pathA(hKey, lpValueName, keybuf, KEYBUF_SIZE);
 
-		LOQ_zero("registry", "psru", "Handle", hKey, "ValueName", lpValueName,
-			"Data", *lpType, *lpcbData, lpData,
-			"FullName", keypath);
+		if (keypath == NULL || !is_ignored_key_unicode(keypath, lstrlenW(keypath)))
+			LOQ_zero("registry", "psru", "Handle", hKey, "ValueName", lpValueName,
+				"Data", *lpType, *lpcbData, lpData,
+				"FullName", keypath);
 
 		// fake the vendor name
 		if (keypath && *lpcbData >= 13 && !wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 0\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier") && !memcmp(lpData, "QEMU HARDDISK", 13)) {
 			memcpy(lpData, "DELL", 4);
 		}
 
-		free(keybuf);
+		release_keybuf(keybuf);
 	}
     else if (ret == ERROR_MORE_DATA) {
         LOQ_zero("registry", "psPIv", "Handle", hKey, "ValueName", lpValueName,
@@ -316,20 +326,20 @@ HOOKDEF(LONG, WINAPI, RegQueryValueExW,
         lpData, lpcbData);
     if (ret == ERROR_SUCCESS && lpType != NULL && lpData != NULL &&
             lpcbData != NULL) {
-		unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-		PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-		wchar_t *keypath = get_full_keyvalue_pathW(hKey, lpValueName, keybuf, allocsize);
+		PKEY_NAME_INFORMATION keybuf = get_keybuf();
+		wchar_t *keypath = get_full_keyvalue_pathW(hKey, lpValueName, keybuf, KEYBUF_SIZE);
 		
-		LOQ_zero("registry", "puRu", "Handle", hKey, "ValueName", lpValueName,
-            "Data", *lpType, *lpcbData, lpData,
-			"FullName", keypath);
+		if (keypath == NULL || !is_ignored_key_unicode(keypath, lstrlenW(keypath)))
+			LOQ_zero("registry", "puRu", "Handle", hKey, "ValueName", lpValueName,
+				"Data", *lpType, *lpcbData, lpData,
+				"FullName", keypath);
 
 		// fake the vendor name
 		if (keypath && *lpcbData >= 13 && !wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 0\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier") && !memcmp(lpData, "QEMU HARDDISK", 13)) {
 			memcpy(lpData, "DELL", 4);
 		}
 
-		free(keybuf);
+		release_keybuf(keybuf);
 	}
     else if (ret == ERROR_MORE_DATA) {
         LOQ_zero("registry", "puPIV", "Handle", hKey, "ValueName", lpValueName,
@@ -420,5 +430,8 @@ HOOKDEF(LONG, WINAPI, RegCloseKey,
 ) {
     LONG ret = Old_RegCloseKey(hKey);
     LOQ_zero("registry", "p", "Handle", hKey);
+	// the NtClose underneath doesn't go through our hook
+	if (ret == ERROR_SUCCESS)
+		handle_untrack(hKey, HANDLE_TYPE_KEY);
     return ret;
 }
@@ -22,6 +22,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "log.h"
 #include "pipe.h"
 #include "misc.h"
+#include "handles.h"
+#include "ignore.h"
 
 HOOKDEF(NTSTATUS, WINAPI, NtCreateKey,
     __out       PHANDLE KeyHandle,
@@ -41,6 +43,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateKey,
 		"ObjectAttributesName", unistr_from_objattr(ObjectAttributes),
 		"ObjectAttributes", ObjectAttributes, "Class", Class,
 		"Disposition", Disposition);
+	if (NT_SUCCESS(ret))
+		handle_track_key(*KeyHandle);
     return ret;
 }
 
@@ -54,6 +58,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenKey,
 		"ObjectAttributesHandle", handle_from_objattr(ObjectAttributes),
 		"ObjectAttributesName", unistr_from_objattr(ObjectAttributes),
 		"ObjectAttributes", ObjectAttributes);
+	if (NT_SUCCESS(ret))
+		handle_track_key(*KeyHandle);
     return ret;
 }
 
@@ -69,6 +75,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenKeyEx,
 		"ObjectAttributesHandle", handle_from_objattr(ObjectAttributes),
 		"ObjectAttributesName", unistr_from_objattr(ObjectAttributes),
 		"ObjectAttributes", ObjectAttributes);
+	if (NT_SUCCESS(ret))
+		handle_track_key(*KeyHandle);
     return ret;
 }
 
@@ -160,9 +168,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueryValueKey,
         KeyValueInformationClass, KeyValueInformation, Length, ResultLength);
     if(NT_SUCCESS(ret) && KeyValueInformation && 
             *ResultLength >= sizeof(ULONG) * 3) {
-		unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-		PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
-		wchar_t *keypath = get_full_keyvalue_pathUS(KeyHandle, ValueName, keybuf, allocsize);
+		PKEY_NAME_INFORMATION keybuf = get_keybuf();
+		wchar_t *keypath = get_full_keyvalue_pathUS(KeyHandle, ValueName, keybuf, KEYBUF_SIZE);
 		ULONG Type, DataLength = 0; UCHAR *Data = NULL;
 
         // someday add support for Name and NameLength, if there's use for it
@@ -181,9 +188,10 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueryValueKey,
             Data = p->Data;
         }
 
-        LOQ_ntstatus("registry", "poiRu", "KeyHandle", KeyHandle, "ValueName", ValueName,
-            "Type", Type, "Information", Type, DataLength, Data,
-			"FullName", keypath);
+		if (keypath == NULL || !is_ignored_key_unicode(keypath, lstrlenW(keypath)))
+			LOQ_ntstatus("registry", "poiRu", "KeyHandle", KeyHandle, "ValueName", ValueName,
+				"Type", Type, "Information", Type, DataLength, Data,
+				"FullName", keypath);
 
 		// fake the vendor name
 		if (keypath && Data && DataLength >= 13 && !wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 0\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier") && !memcmp(Data, "QEMU HARDDISK", 13)) {
@@ -196,7 +204,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueryValueKey,
 		}
 
 
-		free(keybuf);
+		release_keybuf(keybuf);
 	}
     else {
         LOQ_ntstatus("registry", "pok", "KeyHandle", KeyHandle, "ValueName", ValueName,
@@ -250,14 +258,13 @@ HOOKDEF(NTSTATUS, WINAPI, NtLoadKey,
     __in  POBJECT_ATTRIBUTES TargetKey,
     __in  POBJECT_ATTRIBUTES SourceFile
 ) {
-	unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-	PKEY_NAME_INFORMATION keybuf = calloc(1, allocsize);
+	PKEY_NAME_INFORMATION keybuf = get_keybuf();
 	NTSTATUS ret = Old_NtLoadKey(TargetKey, SourceFile);
     LOQ_ntstatus("registry", "pouO","TargetKeyHandle", handle_from_objattr(TargetKey),
 		"TargetKeyName", unistr_from_objattr(TargetKey),
-		"TargetKey", get_key_path(TargetKey, keybuf, allocsize),
+		"TargetKey", get_key_path(TargetKey, keybuf, KEYBUF_SIZE),
 		"SourceFile", SourceFile);
-	free(keybuf);
+	release_keybuf(keybuf);
     return ret;
 }
 
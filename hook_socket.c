@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hooking.h"
 #include "log.h"
 #include "config.h"
+#include "handles.h"
 
 
 static PVOID alloc_combined_wsabuf(LPWSABUF buf, DWORD count, DWORD *outlen)
@@ -96,6 +97,8 @@ HOOKDEF(SOCKET, WSAAPI, socket,
 ) {
     SOCKET ret = Old_socket(af, type, protocol);
     LOQ_sock("network", "iiii", "af", af, "type", type, "protocol", protocol, "socket", ret);
+    if (ret != INVALID_SOCKET)
+        handle_track((HANDLE)ret, HANDLE_TYPE_SOCKET, GetCurrentProcessId(), NULL, 0);
     return ret;
 }
 
@@ -186,6 +189,8 @@ HOOKDEF(SOCKET, WSAAPI, accept,
     LOQ_sockerr("network", "iisisi", "socket", s, "ClientSocket", ret,
         "ip_accept", ip_s, "port_accept", port_s,
         "ip_client", ip_c, "port_client", port_c);
+    if (ret != INVALID_SOCKET)
+        handle_track((HANDLE)ret, HANDLE_TYPE_SOCKET, GetCurrentProcessId(), NULL, 0);
     return ret;
 }
 
@@ -251,6 +256,8 @@ HOOKDEF(int, WSAAPI, closesocket,
 ) {
     int ret = Old_closesocket(s);
     LOQ_sockerr("network", "i", "socket", s);
+    if (ret == 0)
+        handle_untrack((HANDLE)s, HANDLE_TYPE_SOCKET);
     return ret;
 }
 
@@ -283,6 +290,8 @@ HOOKDEF(SOCKET, WSAAPI, WSAAccept,
     LOQ_sockerr("network", "iisisi", "socket", s, "ClientSocket", ret,
         "ip_accept", ip_s, "port_accept", port_s,
         "ip_client", ip_c, "port_client", port_c);
+    if (ret != INVALID_SOCKET)
+        handle_track((HANDLE)ret, HANDLE_TYPE_SOCKET, GetCurrentProcessId(), NULL, 0);
     return ret;
 }
 
@@ -400,6 +409,8 @@ HOOKDEF(SOCKET, WSAAPI, WSASocketA,
     SOCKET ret = Old_WSASocketA(af, type, protocol, lpProtocolInfo,
         g, dwFlags);
     LOQ_sock("network", "iiii", "af", af, "type", type, "protocol", protocol, "socket", ret);
+    if (ret != INVALID_SOCKET)
+        handle_track((HANDLE)ret, HANDLE_TYPE_SOCKET, GetCurrentProcessId(), NULL, 0);
     return ret;
 }
 
@@ -414,6 +425,8 @@ HOOKDEF(SOCKET, WSAAPI, WSASocketW,
     SOCKET ret = Old_WSASocketW(af, type, protocol, lpProtocolInfo,
         g, dwFlags);
     LOQ_sock("network", "iiii", "af", af, "type", type, "protocol", protocol, "socket", ret);
+    if (ret != INVALID_SOCKET)
+        handle_track((HANDLE)ret, HANDLE_TYPE_SOCKET, GetCurrentProcessId(), NULL, 0);
     return ret;
 }
 
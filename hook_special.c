@@ -24,8 +24,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "hook_sleep.h"
 #include "misc.h"
 #include "config.h"
+#include "scratch.h"
 
 void set_hooks_dll(const wchar_t *library);
+void lazy_hooks_bind_imports(HMODULE module);
 
 HOOKDEF2(NTSTATUS, WINAPI, LdrLoadDll,
     __in_opt    PWCHAR PathToFile,
@@ -55,11 +57,14 @@ HOOKDEF2(NTSTATUS, WINAPI, LdrLoadDll,
 	*/
 	if (!called_by_hook() && wcsncmp(library.Buffer, g_config.dllpath, wcslen(g_config.dllpath))) {
 		if (g_config.file_of_interest && g_config.suspend_logging) {
-			wchar_t *absolutename = malloc(32768 * sizeof(wchar_t));
-			ensure_absolute_unicode_path(absolutename, library.Buffer);
-			if (!wcsicmp(absolutename, g_config.file_of_interest))
-				g_config.suspend_logging = FALSE;
-			free(absolutename);
+			scratch_mark_t mark = scratch_mark();
+			wchar_t *absolutename = scratch_alloc(32768 * sizeof(wchar_t));
+			if (absolutename != NULL) {
+				ensure_absolute_unicode_path(absolutename, library.Buffer);
+				if (!wcsicmp(absolutename, g_config.file_of_interest))
+					g_config.suspend_logging = FALSE;
+			}
+			scratch_release(mark);
 		}
 
 		if (!wcsncmp(library.Buffer, L"\\??\\", 4) || library.Buffer[1] == L':')
@@ -76,8 +81,6 @@ HOOKDEF2(NTSTATUS, WINAPI, LdrLoadDll,
     //
 
     if(NT_SUCCESS(ret)) {
-		PWCHAR end;
-
 		// inform the call below not to add this DLL to the list of system DLLs if it's
 		// the DLL of interest
 		if (g_config.file_of_interest && !wcsicmp(library.Buffer, g_config.file_of_interest))
@@ -86,11 +89,9 @@ HOOKDEF2(NTSTATUS, WINAPI, LdrLoadDll,
 		// unoptimized, but easy
 		add_all_dlls_to_dll_ranges();
 		// we ensure null termination via the COPY_UNICODE_STRING macro above, so we don't need a length
-		// first strip off the .dll
-		end = wcsrchr(library.Buffer, L'.');
-		if (end && !wcsicmp(end, L".dll"))
-			*end = L'\0';
+		// set_hooks_dll takes care of paths and the .dll extension
         set_hooks_dll(library.Buffer);
+		lazy_hooks_bind_imports((HMODULE)*ModuleHandle);
     }
 
 	set_lasterrors(&lasterror);
@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ntapi.h"
 #include "hooking.h"
 #include "log.h"
+#include "handles.h"
 
 
 HOOKDEF(NTSTATUS, WINAPI, NtCreateMutant,
@@ -33,6 +34,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateMutant,
     LOQ_ntstatus("synchronization", "Poi", "Handle", MutantHandle,
         "MutexName", unistr_from_objattr(ObjectAttributes),
         "InitialOwner", InitialOwner);
+	if (NT_SUCCESS(ret))
+		handle_track_objattr(*MutantHandle, HANDLE_TYPE_MUTANT, ObjectAttributes);
     return ret;
 }
 
@@ -45,6 +48,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenMutant,
         ObjectAttributes);
     LOQ_ntstatus("synchronization", "Po", "Handle", MutantHandle,
         "MutexName", unistr_from_objattr(ObjectAttributes));
+	if (NT_SUCCESS(ret))
+		handle_track_objattr(*MutantHandle, HANDLE_TYPE_MUTANT, ObjectAttributes);
     return ret;
 }
 
@@ -61,6 +66,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateEvent,
 	if (eventname && eventname->Length) {
 		LOQ_ntstatus("synchronization", "Poii", "Handle", EventHandle,
 			"EventName", eventname, "EventType", EventType, "InitialState", InitialState);
+		// anonymous events are far too common to be worth tracking
+		if (NT_SUCCESS(ret))
+			handle_track_objattr(*EventHandle, HANDLE_TYPE_EVENT, ObjectAttributes);
 	}
 	return ret;
 }
@@ -74,6 +82,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenEvent,
 		ObjectAttributes);
 	LOQ_ntstatus("synchronization", "Po", "Handle", EventHandle,
 		"EventName", unistr_from_objattr(ObjectAttributes));
+	if (NT_SUCCESS(ret))
+		handle_track_objattr(*EventHandle, HANDLE_TYPE_EVENT, ObjectAttributes);
 	return ret;
 
 }
@@ -23,6 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "pipe.h"
 #include "misc.h"
 #include "hook_sleep.h"
+#include "handles.h"
 
 HOOKDEF(NTSTATUS, WINAPI, NtQueueApcThread,
 	__in HANDLE ThreadHandle,
@@ -31,11 +32,11 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueueApcThread,
 	__in_opt PIO_STATUS_BLOCK ApcStatusBlock,
 	__in_opt ULONG ApcReserved
 ) {
-	DWORD PID = pid_from_thread_handle(ThreadHandle);
-	DWORD TID = tid_from_thread_handle(ThreadHandle);
+	DWORD PID = pid_from_thread_handle_verified(ThreadHandle);
+	DWORD TID = tid_from_thread_handle_verified(ThreadHandle);
 	NTSTATUS ret;
 
-	pipe("PROCESS:%d:%d,%d", is_suspended(PID, TID), PID, TID);
+	pipe("PROCESS:%d:%d,%d", is_thread_suspended(ThreadHandle, PID, TID), PID, TID);
 
 	ret = Old_NtQueueApcThread(ThreadHandle, ApcRoutine,
 		ApcRoutineContext, ApcStatusBlock, ApcReserved);
@@ -57,20 +58,25 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateThread,
 	__in      PINITIAL_TEB InitialTeb,
 	__in      BOOLEAN CreateSuspended
 	) {
-	DWORD pid = pid_from_process_handle(ProcessHandle);
+	DWORD pid = pid_from_process_handle_verified(ProcessHandle);
 
 	NTSTATUS ret = Old_NtCreateThread(ThreadHandle, DesiredAccess,
 		ObjectAttributes, ProcessHandle, ClientId, ThreadContext,
 		InitialTeb, TRUE);
 
 	if (NT_SUCCESS(ret)) {
-		pipe("PROCESS:%d:%d,%d", is_suspended(pid, (DWORD)ClientId->UniqueThread), pid, (DWORD)ClientId->UniqueThread);
+		handle_track_thread(*ThreadHandle, pid, (DWORD)ClientId->UniqueThread);
+		// we created it suspended, no need to ask
+		pipe("PROCESS:%d:%d,%d", 1, pid, (DWORD)ClientId->UniqueThread);
 		if (CreateSuspended == FALSE) {
 			lasterror_t lasterror;
 			get_lasterrors(&lasterror);
 			ResumeThread(*ThreadHandle);
 			set_lasterrors(&lasterror);
+			forget_suspended(pid, (DWORD)ClientId->UniqueThread);
 		}
+		else
+			remember_suspended(pid, (DWORD)ClientId->UniqueThread, FALSE);
 	}
 
 	LOQ_ntstatus("threading", "PpOi", "ThreadHandle", ThreadHandle, "ProcessHandle", ProcessHandle,
@@ -94,7 +100,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateThreadEx,
     IN      LONG SizeOfStackReserve,
     OUT     PVOID lpBytesBuffer
 ) {
-	DWORD pid = pid_from_process_handle(ProcessHandle);
+	DWORD pid = pid_from_process_handle_verified(ProcessHandle);
 	
 	NTSTATUS ret = Old_NtCreateThreadEx(hThread, DesiredAccess,
         ObjectAttributes, ProcessHandle, lpStartAddress, lpParameter,
@@ -102,14 +108,18 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateThreadEx,
         lpBytesBuffer);
 
 	if (NT_SUCCESS(ret)) {
-		DWORD tid = tid_from_thread_handle(*hThread);
-		pipe("PROCESS:%d:%d,%d", is_suspended(pid, tid), pid, tid);
+		DWORD tid = tid_from_thread_handle_verified(*hThread);
+		handle_track_thread(*hThread, pid, tid);
+		pipe("PROCESS:%d:%d,%d", 1, pid, tid);
 		if (CreateSuspended == FALSE) {
 			lasterror_t lasterror;
 			get_lasterrors(&lasterror);
 			ResumeThread(*hThread);
 			set_lasterrors(&lasterror);
+			forget_suspended(pid, tid);
 		}
+		else
+			remember_suspended(pid, tid, FALSE);
 	}
 	LOQ_ntstatus("threading", "Pppi", "ThreadHandle", hThread, "ProcessHandle", ProcessHandle,
         "StartAddress", lpStartAddress, "CreateSuspended", CreateSuspended);
@@ -134,6 +144,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtOpenThread,
 	if (NT_SUCCESS(ret) && ThreadHandle) {
 		PID = pid_from_thread_handle(*ThreadHandle);
 		TID = tid_from_thread_handle(*ThreadHandle);
+		handle_track_thread(*ThreadHandle, PID, TID);
 	}
 
 	if (ClientId) {
@@ -168,9 +179,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtSetContextThread,
     __in  const CONTEXT *Context
 ) {
 	NTSTATUS ret;
-	DWORD pid = pid_from_thread_handle(ThreadHandle);
-	DWORD tid = tid_from_thread_handle(ThreadHandle);
-	pipe("PROCESS:%d:%d,%d", is_suspended(pid, tid), pid, tid);
+	DWORD pid = pid_from_thread_handle_verified(ThreadHandle);
+	DWORD tid = tid_from_thread_handle_verified(ThreadHandle);
+	pipe("PROCESS:%d:%d,%d", is_thread_suspended(ThreadHandle, pid, tid), pid, tid);
 
 	ret = Old_NtSetContextThread(ThreadHandle, Context);
 	if (Context->ContextFlags & CONTEXT_CONTROL)
@@ -189,13 +200,16 @@ HOOKDEF(NTSTATUS, WINAPI, NtSuspendThread,
     __in        HANDLE ThreadHandle,
     __out_opt   ULONG *PreviousSuspendCount
 ) {
-	DWORD pid = pid_from_thread_handle(ThreadHandle);
-	DWORD tid = tid_from_thread_handle(ThreadHandle);
+	DWORD pid = pid_from_thread_handle_verified(ThreadHandle);
+	DWORD tid = tid_from_thread_handle_verified(ThreadHandle);
 	NTSTATUS ret;
 	ENSURE_ULONG(PreviousSuspendCount);
-	pipe("PROCESS:%d:%d,%d", is_suspended(pid, tid), pid, tid);
+	pipe("PROCESS:%d:%d,%d", is_thread_suspended(ThreadHandle, pid, tid), pid, tid);
 
 	ret = Old_NtSuspendThread(ThreadHandle, PreviousSuspendCount);
+	// whatever we remember about the process doesn't hold anymore
+	if (NT_SUCCESS(ret))
+		forget_suspended(pid, 0);
     LOQ_ntstatus("threading", "pL", "ThreadHandle", ThreadHandle,
         "SuspendCount", PreviousSuspendCount);
     return ret;
@@ -205,17 +219,21 @@ HOOKDEF(NTSTATUS, WINAPI, NtResumeThread,
     __in        HANDLE ThreadHandle,
     __out_opt   ULONG *SuspendCount
 ) {
-	DWORD pid = pid_from_thread_handle(ThreadHandle);
-	DWORD tid = tid_from_thread_handle(ThreadHandle);
+	DWORD pid = pid_from_thread_handle_verified(ThreadHandle);
+	DWORD tid = tid_from_thread_handle_verified(ThreadHandle);
 	NTSTATUS ret;
 	ENSURE_ULONG(SuspendCount);
 	pipe("RESUME:%d,%d", pid, tid);
 
     ret = Old_NtResumeThread(ThreadHandle, SuspendCount);
+	if (NT_SUCCESS(ret))
+		forget_suspended(pid, tid);
     LOQ_ntstatus("threading", "pI", "ThreadHandle", ThreadHandle, "SuspendCount", SuspendCount);
     return ret;
 }
 
+void thread_exit_cleanup(void);
+
 HOOKDEF(NTSTATUS, WINAPI, NtTerminateThread,
     __in  HANDLE ThreadHandle,
     __in  NTSTATUS ExitStatus
@@ -223,6 +241,12 @@ HOOKDEF(NTSTATUS, WINAPI, NtTerminateThread,
     // Thread will terminate. Default logging will not work. Be aware: return value not valid
     NTSTATUS ret = 0;
     LOQ_ntstatus("threading", "ph", "ThreadHandle", ThreadHandle, "ExitStatus", ExitStatus);
+	// RtlExitUserThread passes NULL.  if the call fails after all (the
+	// last thread can't end itself this way), scratch memory is simply
+	// taken again on the next use and small blocks come from the heap
+	if (ThreadHandle == NULL || ThreadHandle == GetCurrentThread() ||
+		tid_from_thread_handle(ThreadHandle) == GetCurrentThreadId())
+		thread_exit_cleanup();
     ret = Old_NtTerminateThread(ThreadHandle, ExitStatus);    
     return ret;
 }
@@ -260,19 +284,23 @@ HOOKDEF(HANDLE, WINAPI, CreateRemoteThread,
 	HANDLE ret;
 	ENSURE_DWORD(lpThreadId);
 
-	pid = pid_from_process_handle(hProcess);
+	pid = pid_from_process_handle_verified(hProcess);
 	ret = Old_CreateRemoteThread(hProcess, lpThreadAttributes,
         dwStackSize, lpStartAddress, lpParameter, dwCreationFlags | CREATE_SUSPENDED,
         lpThreadId);
 
 	if (ret != NULL) {
-		pipe("PROCESS:%d:%d,%d", is_suspended(pid, *lpThreadId), pid, *lpThreadId);
+		handle_track_thread(ret, pid, *lpThreadId);
+		pipe("PROCESS:%d:%d,%d", 1, pid, *lpThreadId);
 		if (!(dwCreationFlags & CREATE_SUSPENDED)) {
 			lasterror_t lasterror;
 			get_lasterrors(&lasterror);
 			ResumeThread(ret);
 			set_lasterrors(&lasterror);
+			forget_suspended(pid, *lpThreadId);
 		}
+		else
+			remember_suspended(pid, *lpThreadId, FALSE);
 	}
 
 	LOQ_nonnull("threading", "ppphI", "ProcessHandle", hProcess, "StartRoutine", lpStartAddress,
@@ -300,7 +328,7 @@ HOOKDEF(NTSTATUS, WINAPI, RtlCreateUserThread,
 	NTSTATUS ret;
 	ENSURE_CLIENT_ID(ClientId);
 
-	pid = pid_from_process_handle(ProcessHandle);
+	pid = pid_from_process_handle_verified(ProcessHandle);
 	
 	ret = Old_RtlCreateUserThread(ProcessHandle, SecurityDescriptor,
         TRUE, StackZeroBits, StackReserved, StackCommit,
@@ -311,13 +339,18 @@ HOOKDEF(NTSTATUS, WINAPI, RtlCreateUserThread,
         "ThreadIdentifier", ClientId->UniqueThread);
 
 	if (NT_SUCCESS(ret)) {
-		pipe("PROCESS:%d:%d,%d", is_suspended(pid, (DWORD)ClientId->UniqueThread), pid, (DWORD)ClientId->UniqueThread);
+		if (ThreadHandle)
+			handle_track_thread(*ThreadHandle, pid, (DWORD)ClientId->UniqueThread);
+		pipe("PROCESS:%d:%d,%d", 1, pid, (DWORD)ClientId->UniqueThread);
 		if (CreateSuspended == FALSE) {
 			lasterror_t lasterror;
 			get_lasterrors(&lasterror);
 			ResumeThread(ThreadHandle);
 			set_lasterrors(&lasterror);
+			forget_suspended(pid, (DWORD)ClientId->UniqueThread);
 		}
+		else
+			remember_suspended(pid, (DWORD)ClientId->UniqueThread, FALSE);
 	}
 
 	if (NT_SUCCESS(ret))
@@ -24,6 +24,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "unhook.h"
 #include "misc.h"
 #include "pipe.h"
+#include "config.h"
+#include "scratch.h"
 
 extern DWORD g_tls_hook_index;
 
@@ -47,12 +49,17 @@ static int set_caller_info(ULONG_PTR addr)
 {
 	hook_info_t *hookinfo = hook_info();
 
+	if (g_config.full_stacks && hookinfo->stack_depth < HOOK_BACKTRACE_DEPTH)
+		hookinfo->stack[hookinfo->stack_depth++] = addr;
+
 	if (!is_in_dll_range(addr)) {
 		if (hookinfo->main_caller_retaddr == 0)
 			hookinfo->main_caller_retaddr = addr;
-		else {
+		else if (hookinfo->parent_caller_retaddr == 0) {
 			hookinfo->parent_caller_retaddr = addr;
-			return 1;
+			// keep walking if we want the rest of the stack as well
+			if (!g_config.full_stacks)
+				return 1;
 		}
 	}
 	return 0;
@@ -80,10 +87,11 @@ int WINAPI enter_hook(uint8_t is_special_hook, ULONG_PTR _ebp, ULONG_PTR retaddr
 	hookinfo->return_address = retaddr;
 	hookinfo->frame_pointer = _ebp;
 
-	if ((hookinfo->disable_count < 1) && (!called_by_hook() || is_special_hook)) {
+	if ((hookinfo->disable_count < 1) && (is_special_hook || !called_by_hook())) {
 		/* set caller information */
 		hookinfo->main_caller_retaddr = 0;
 		hookinfo->parent_caller_retaddr = 0;
+		hookinfo->stack_depth = 0;
 
 		operate_on_backtrace(retaddr, _ebp, set_caller_info);
 		return 1;
@@ -92,6 +100,409 @@ int WINAPI enter_hook(uint8_t is_special_hook, ULONG_PTR _ebp, ULONG_PTR retaddr
 	return 0;
 }
 
+// executable pool for hook_data_t: trampolines and pre-trampolines are
+// packed into 64kb regions rather than getting a heap block (x86) or a whole
+// allocation granule (x64) each.  On x64 a region is only used for hooks
+// within 1gb of it, so the rel32 jump into hook_data always reaches.
+// Regions are writable only while someone is between hook_pool_begin_write()
+// and hook_pool_end_write(), and read/execute only otherwise
+#define HOOK_POOL_REGION_SIZE 0x10000
+#define HOOK_POOL_MAX_REGIONS 128
+#define HOOK_POOL_SLOT_SIZE ((sizeof(hook_data_t) + 15) & ~15)
+#define HOOK_POOL_RANGE (1024 * 1024 * 1024)
+
+static struct {
+	unsigned char *base;
+	unsigned int used;
+	int writable;
+} g_hook_pool[HOOK_POOL_MAX_REGIONS];
+static unsigned int g_hook_pool_count;
+static unsigned int g_hook_pool_writers;
+static volatile LONG g_hook_pool_lock;
+
+static void hook_pool_acquire(void)
+{
+	while (InterlockedCompareExchange(&g_hook_pool_lock, 1, 0) != 0)
+		YieldProcessor();
+}
+
+static void hook_pool_release(void)
+{
+	InterlockedExchange(&g_hook_pool_lock, 0);
+}
+
+static int hook_pool_in_range(unsigned char *base, void *addr)
+{
+#ifdef _WIN64
+	ULONG_PTR distance = (ULONG_PTR)base > (ULONG_PTR)addr ?
+		(ULONG_PTR)base + HOOK_POOL_REGION_SIZE - (ULONG_PTR)addr :
+		(ULONG_PTR)addr - (ULONG_PTR)base;
+	return distance < HOOK_POOL_RANGE;
+#else
+	return 1;
+#endif
+}
+
+static unsigned char *hook_pool_new_region(void *addr)
+{
+	PVOID BaseAddress = NULL;
+	SIZE_T RegionSize = HOOK_POOL_REGION_SIZE;
+#ifdef _WIN64
+	LONG_PTR offset = -HOOK_POOL_RANGE + HOOK_POOL_REGION_SIZE;
+	LONG status;
+
+	do {
+		if (offset < 0 && (ULONG_PTR)addr < (ULONG_PTR)-offset)
+			offset = 0x10000;
+		BaseAddress = (PCHAR)addr + offset;
+		RegionSize = HOOK_POOL_REGION_SIZE;
+		status = pNtAllocateVirtualMemory(GetCurrentProcess(), &BaseAddress, 0, &RegionSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		if (status >= 0)
+			return (unsigned char *)BaseAddress;
+		offset += 0x10000;
+	} while (offset <= HOOK_POOL_RANGE - HOOK_POOL_REGION_SIZE);
+
+	return NULL;
+#else
+	if (pNtAllocateVirtualMemory(GetCurrentProcess(), &BaseAddress, 0, &RegionSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE) < 0)
+		return NULL;
+	return (unsigned char *)BaseAddress;
+#endif
+}
+
+static void hook_pool_unseal_region(unsigned int i)
+{
+	DWORD old_protect;
+
+	if (!g_hook_pool[i].writable) {
+		VirtualProtect(g_hook_pool[i].base, HOOK_POOL_REGION_SIZE, PAGE_EXECUTE_READWRITE, &old_protect);
+		g_hook_pool[i].writable = 1;
+	}
+}
+
+static void hook_pool_free_region(unsigned char *base)
+{
+	PVOID BaseAddress = base;
+	SIZE_T RegionSize = 0;
+
+	pNtFreeVirtualMemory(GetCurrentProcess(), &BaseAddress, &RegionSize, MEM_RELEASE);
+}
+
+// only valid between hook_pool_begin_write() and hook_pool_end_write()
+hook_data_t *alloc_hookdata_near(void *addr)
+{
+	hook_data_t *ret = NULL;
+	unsigned char *base = NULL;
+	unsigned int i;
+
+	for (;;) {
+		hook_pool_acquire();
+
+		for (i = 0; i < g_hook_pool_count; i++) {
+			if (g_hook_pool[i].used + HOOK_POOL_SLOT_SIZE <= HOOK_POOL_REGION_SIZE &&
+				hook_pool_in_range(g_hook_pool[i].base, addr))
+				break;
+		}
+
+		// publish the region allocated on the previous pass
+		if (i == g_hook_pool_count && base != NULL && i < HOOK_POOL_MAX_REGIONS) {
+			g_hook_pool[i].base = base;
+			g_hook_pool[i].used = 0;
+			g_hook_pool[i].writable = 1;
+			g_hook_pool_count++;
+			base = NULL;
+		}
+
+		if (i < g_hook_pool_count) {
+			hook_pool_unseal_region(i);
+			ret = (hook_data_t *)(g_hook_pool[i].base + g_hook_pool[i].used);
+			g_hook_pool[i].used += HOOK_POOL_SLOT_SIZE;
+		}
+
+		hook_pool_release();
+
+		if (ret != NULL || i == HOOK_POOL_MAX_REGIONS || base != NULL)
+			break;
+
+		// on x64 finding a free spot in range can take thousands of
+		// allocation attempts, other threads mustn't spin on the lock
+		// for that long
+		base = hook_pool_new_region(addr);
+		if (base == NULL)
+			break;
+	}
+
+	// someone else added a region in range meanwhile, or the pool is full
+	if (base != NULL)
+		hook_pool_free_region(base);
+
+	return ret;
+}
+
+// makes the region holding p writable, only valid between
+// hook_pool_begin_write() and hook_pool_end_write()
+static void hook_pool_unseal(void *p)
+{
+	unsigned int i;
+
+	hook_pool_acquire();
+	for (i = 0; i < g_hook_pool_count; i++) {
+		if ((unsigned char *)p >= g_hook_pool[i].base &&
+			(unsigned char *)p < g_hook_pool[i].base + HOOK_POOL_REGION_SIZE) {
+			hook_pool_unseal_region(i);
+			break;
+		}
+	}
+	hook_pool_release();
+}
+
+void hook_pool_begin_write(void)
+{
+	hook_pool_acquire();
+	g_hook_pool_writers++;
+	hook_pool_release();
+}
+
+// the last writer makes all regions read/execute again
+void hook_pool_end_write(void)
+{
+	DWORD old_protect;
+	unsigned int i;
+
+	hook_pool_acquire();
+	if (--g_hook_pool_writers == 0) {
+		for (i = 0; i < g_hook_pool_count; i++) {
+			if (g_hook_pool[i].writable) {
+				VirtualProtect(g_hook_pool[i].base, HOOK_POOL_REGION_SIZE, PAGE_EXECUTE_READ, &old_protect);
+				g_hook_pool[i].writable = 0;
+			}
+		}
+	}
+	hook_pool_release();
+}
+
+// repoints an installed hook at the original function (or back at the
+// pre-trampoline) by swapping the pointer all indirect hook types jump
+// through, so threads executing the hook at the same time see either the
+// old or the new target.  returns 0 if changed, 1 if it was already in the
+// requested state and -1 if this hook can't be toggled
+int hook_set_enabled(hook_t *h, int enable)
+{
+	PVOID from, to, prev;
+
+	if (!h->is_hooked || h->hookdata == NULL)
+		return -1;
+
+	from = enable ? h->hookdata->tramp : h->hookdata->pre_tramp;
+	to = enable ? h->hookdata->pre_tramp : h->hookdata->tramp;
+
+	hook_pool_begin_write();
+	hook_pool_unseal(h->hookdata);
+	prev = InterlockedCompareExchangePointer((PVOID *)h->hookdata->hook_data, to, from);
+	hook_pool_end_write();
+	if (prev == from)
+		return 0;
+	else if (prev == to)
+		return 1;
+	// direct jump hook types don't go through hook_data
+	return -1;
+}
+
+// while a batch is open (see hook_batch_begin), every page a hook is
+// written into is made writable once and only restored when the batch is
+// closed (or runs out of slots), rather than two VirtualProtect calls per
+// hooked function
+#define HOOK_BATCH_MAX_PAGES 512
+#define HOOK_PAGE_SIZE 0x1000
+
+static struct {
+	ULONG_PTR page;
+	DWORD old_protect;
+} g_batch_pages[HOOK_BATCH_MAX_PAGES];
+static unsigned int g_batch_count;
+static DWORD g_batch_tid;
+
+void hook_batch_begin(void)
+{
+	g_batch_count = 0;
+	g_batch_tid = GetCurrentThreadId();
+}
+
+// puts the batched pages back the way they were
+static void hook_batch_restore(void)
+{
+	DWORD old_protect;
+	unsigned int i;
+
+	for (i = 0; i < g_batch_count; i++)
+		VirtualProtect((PVOID)g_batch_pages[i].page, HOOK_PAGE_SIZE,
+			g_batch_pages[i].old_protect, &old_protect);
+	g_batch_count = 0;
+}
+
+void hook_batch_end(void)
+{
+	g_batch_tid = 0;
+	hook_batch_restore();
+}
+
+static int hook_batch_has_page(ULONG_PTR page)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_batch_count; i++) {
+		if (g_batch_pages[i].page == page)
+			return 1;
+	}
+	return 0;
+}
+
+// the protection is taken per page, when the page first joins the batch
+static int hook_batch_unprotect_page(ULONG_PTR page)
+{
+	if (hook_batch_has_page(page))
+		return 1;
+	if (!VirtualProtect((PVOID)page, HOOK_PAGE_SIZE, PAGE_EXECUTE_READWRITE,
+		&g_batch_pages[g_batch_count].old_protect))
+		return 0;
+	g_batch_pages[g_batch_count++].page = page;
+	return 1;
+}
+
+// makes the bytes a hook is about to overwrite writable, returns zero on
+// failure.  old_protect is left zero if the batch takes care of restoring
+int hook_protect_begin(void *addr, unsigned int len, DWORD *old_protect)
+{
+	ULONG_PTR page, last;
+	unsigned int needed;
+
+	*old_protect = 0;
+	if (g_batch_tid == GetCurrentThreadId()) {
+		page = (ULONG_PTR)addr & ~(ULONG_PTR)(HOOK_PAGE_SIZE - 1);
+		last = ((ULONG_PTR)addr + len - 1) & ~(ULONG_PTR)(HOOK_PAGE_SIZE - 1);
+		// a hook can straddle two pages.  Make room for both up front: once
+		// one of them is in the batch it's writable, and protecting the hook
+		// on its own would take that for the protection to restore
+		needed = !hook_batch_has_page(page) + (last != page && !hook_batch_has_page(last));
+		if (g_batch_count + needed > HOOK_BATCH_MAX_PAGES)
+			hook_batch_restore();
+		return hook_batch_unprotect_page(page) &&
+			(last == page || hook_batch_unprotect_page(last));
+	}
+	return VirtualProtect(addr, len, PAGE_EXECUTE_READWRITE, old_protect);
+}
+
+void hook_protect_end(void *addr, unsigned int len, DWORD old_protect)
+{
+	DWORD tmp;
+
+	// pages covered by the batch keep their protection until hook_batch_end
+	if (old_protect != 0)
+		VirtualProtect(addr, len, old_protect, &tmp);
+}
+
+// while a stage is open (see hook_stage_begin), hook_api() builds the
+// trampolines as usual but only queues the bytes it would put over the
+// function.  hook_stage_commit() writes all of them in one go, so the other
+// threads only need to be suspended for the copies, not while we allocate,
+// register unwind information or write to the pipe
+#define HOOK_STAGE_MAX 1024
+
+typedef struct _staged_hook_t {
+	hook_t *h;
+	unsigned char *addr;
+	unsigned int len;
+	int written;
+	uint8_t orig[16];
+	uint8_t patch[16];
+} staged_hook_t;
+
+static staged_hook_t g_stage[HOOK_STAGE_MAX];
+static unsigned int g_stage_count;
+static DWORD g_stage_tid;
+
+// puts the first len bytes of patch over addr, or queues them while the
+// calling thread has a stage open.  orig and patch are the 16 bytes at addr
+// before and after hooking, for unhook detection
+int hook_write_patch(hook_t *h, unsigned char *addr, const uint8_t *orig,
+	const uint8_t *patch, unsigned int len)
+{
+	DWORD old_protect;
+	staged_hook_t *s;
+
+	if (g_stage_tid == GetCurrentThreadId() && g_stage_count < HOOK_STAGE_MAX) {
+		s = &g_stage[g_stage_count++];
+		s->h = h;
+		s->addr = addr;
+		s->len = len;
+		s->written = 0;
+		memcpy(s->orig, orig, sizeof(s->orig));
+		memcpy(s->patch, patch, sizeof(s->patch));
+		return 0;
+	}
+	// out of stage slots, write this hook right away
+
+	if (!hook_protect_begin(addr, len, &old_protect)) {
+		pipe("WARNING:Unable to change protection for hook on %z", h->funcname);
+		return -1;
+	}
+	memcpy(addr, patch, len);
+	hook_protect_end(addr, len, old_protect);
+
+	// Add unhook detection for our newly created hook.
+	// Ensure any changes behind our hook are also catched by
+	// making the buffersize 16.
+	unhook_detect_add_region(h->funcname, addr, orig, patch, 16);
+	return 0;
+}
+
+void hook_stage_begin(void)
+{
+	g_stage_count = 0;
+	g_stage_tid = GetCurrentThreadId();
+}
+
+// writes the queued hooks.  Only changes page protections and copies, so it
+// can be called with the other threads suspended
+void hook_stage_commit(void)
+{
+	DWORD old_protect;
+	staged_hook_t *s;
+	unsigned int i;
+
+	g_stage_tid = 0;
+	for (i = 0; i < g_stage_count; i++) {
+		s = &g_stage[i];
+		if (hook_protect_begin(s->addr, s->len, &old_protect)) {
+			memcpy(s->addr, s->patch, s->len);
+			hook_protect_end(s->addr, s->len, old_protect);
+			s->written = 1;
+		}
+	}
+}
+
+// finishes the bookkeeping of the committed hooks, called once the other
+// threads run again
+void hook_stage_end(void)
+{
+	staged_hook_t *s;
+	unsigned int i;
+
+	g_stage_tid = 0;
+	for (i = 0; i < g_stage_count; i++) {
+		s = &g_stage[i];
+		if (s->written) {
+			unhook_detect_add_region(s->h->funcname, s->addr, s->orig, s->patch, 16);
+		}
+		else {
+			// hook_api() already counted it as hooked
+			s->h->is_hooked = 0;
+			pipe("WARNING:Unable to change protection for hook on %z", s->h->funcname);
+		}
+	}
+	g_stage_count = 0;
+}
+
 hook_info_t *hook_info()
 {
 	hook_info_t *ptr;
@@ -126,6 +537,26 @@ hook_info_t *hook_info()
 	return ptr;
 }
 
+// frees what the exiting thread allocated for itself, hook_info_t itself
+// stays as hooks may still run on the thread
+void hook_info_thread_detach(void)
+{
+	hook_info_t *ptr = (hook_info_t *)TlsGetValue(g_tls_hook_index);
+	unsigned int i;
+
+	if (ptr == NULL)
+		return;
+
+	for (i = 0; i < ARRAYSIZE(ptr->keybufs); i++) {
+		if (ptr->keybufs[i] != NULL && !(ptr->keybufs_busy & (1 << i))) {
+			free(ptr->keybufs[i]);
+			ptr->keybufs[i] = NULL;
+		}
+	}
+
+	scratch_thread_detach();
+}
+
 void get_lasterrors(lasterror_t *errors)
 {
 	char *teb = (char *)NtCurrentTeb();
@@ -56,17 +56,31 @@ typedef struct _UNWIND_INFO {
 	UNWIND_CODE UnwindCode[10];
 } UNWIND_INFO;
 
+#define HOOK_BACKTRACE_DEPTH 40
+
 typedef struct _hook_info_t {
+	// must remain the first member, the pre-trampolines check it inline
 	int disable_count;
 	ULONG_PTR return_address;
 	ULONG_PTR frame_pointer;
 	ULONG_PTR main_caller_retaddr;
 	ULONG_PTR parent_caller_retaddr;
+	// only filled in when full-stacks is enabled in the config
+	unsigned int stack_depth;
+	ULONG_PTR stack[HOOK_BACKTRACE_DEPTH];
+	// registry key path buffers of this thread, see get_keybuf()
+	void *keybufs[2];
+	unsigned int keybufs_busy;
+	// scratch memory of this thread, see scratch.c
+	char *scratch;
+	unsigned int scratch_top;
+	unsigned int scratch_committed;
+	void *scratch_overflow;
 } hook_info_t;
 
 typedef struct _hook_data_t {
 	unsigned char tramp[128];
-	unsigned char pre_tramp[148];
+	unsigned char pre_tramp[176];
 	//unsigned char our_handler[128];
 	unsigned char hook_data[32];
 
@@ -77,6 +91,28 @@ typedef struct _addr_map_t {
 	ULONG_PTR map[32][2];
 } addr_map_t;
 
+// hook groups, as laid out in the hook table
+#define HOOK_CAT_CORE		0x0001
+#define HOOK_CAT_FILE		0x0002
+#define HOOK_CAT_REGISTRY	0x0004
+#define HOOK_CAT_WINDOW		0x0008
+#define HOOK_CAT_SYNC		0x0010
+#define HOOK_CAT_PROCESS	0x0020
+#define HOOK_CAT_THREAD		0x0040
+#define HOOK_CAT_MISC		0x0080
+#define HOOK_CAT_NETWORK	0x0100
+#define HOOK_CAT_SERVICE	0x0200
+#define HOOK_CAT_SLEEP		0x0400
+#define HOOK_CAT_SOCKET		0x0800
+#define HOOK_CAT_CRYPTO		0x1000
+
+// hook profiles, selected with hook-profile= in the config
+// minimal only follows the process tree (for noisy system children),
+// network adds everything needed for the network traffic
+#define HOOK_PROFILE_MINIMAL	(HOOK_CAT_CORE | HOOK_CAT_PROCESS | HOOK_CAT_THREAD | HOOK_CAT_SLEEP)
+#define HOOK_PROFILE_NETWORK	(HOOK_PROFILE_MINIMAL | HOOK_CAT_NETWORK | HOOK_CAT_SOCKET)
+#define HOOK_PROFILE_DEFAULT	0xffffffff
+
 typedef struct _hook_t {
     const wchar_t *library;
     const char *funcname;
@@ -96,6 +132,18 @@ typedef struct _hook_t {
     // (see comments @ hook_create_pre_trampoline)
     int allow_hook_recursion;
 
+    // the hook handler doesn't log, so it never needs the caller
+    // information collected in enter_hook (see hook_create_pre_tramp)
+    int no_caller_info;
+
+    // the hook handler has side effects besides logging, so it has to run
+    // even while logging is suspended (see hook_create_pre_tramp)
+    int run_while_suspended;
+
+    // HOOK_CAT_* group this hook belongs to, it is only installed if the
+    // active hook profile includes the group
+    unsigned int category;
+
     // this hook has been performed
     int is_hooked;
 
@@ -110,10 +158,23 @@ typedef struct _lasterror_t {
 int lde(void *addr);
 
 hook_data_t *alloc_hookdata_near(void *addr);
+void hook_pool_begin_write(void);
+void hook_pool_end_write(void);
 
 int hook_api(hook_t *h, int type);
+int hook_set_enabled(hook_t *h, int enable);
+void hook_batch_begin(void);
+void hook_batch_end(void);
+int hook_protect_begin(void *addr, unsigned int len, DWORD *old_protect);
+void hook_protect_end(void *addr, unsigned int len, DWORD old_protect);
+int hook_write_patch(hook_t *h, unsigned char *addr, const uint8_t *orig,
+	const uint8_t *patch, unsigned int len);
+void hook_stage_begin(void);
+void hook_stage_commit(void);
+void hook_stage_end(void);
 
 hook_info_t* hook_info();
+void hook_info_thread_detach(void);
 void hook_enable();
 void hook_disable();
 int called_by_hook(void);
@@ -123,11 +184,14 @@ void set_lasterrors(lasterror_t *errors);
 int WINAPI enter_hook(uint8_t is_special_hook, ULONG_PTR _ebp, ULONG_PTR retaddr);
 void emit_rel(unsigned char *buf, unsigned char *source, unsigned char *target);
 int operate_on_backtrace(ULONG_PTR retaddr, ULONG_PTR _ebp, int(*func)(ULONG_PTR));
+#ifdef _WIN64
+unsigned int pdata_stackwalk(CONTEXT *ctx, PVOID *backtrace, unsigned int count);
+void pdata_cache_unload_begin(void);
+void pdata_cache_unload_end(void);
+#endif
 
 extern LARGE_INTEGER time_skipped;
 
-#define HOOK_BACKTRACE_DEPTH 40
-
 #define HOOK_ENABLE_FPU 0
 
 #ifndef _WIN64
@@ -153,7 +217,8 @@ enum {
 #else
 enum {
 	HOOK_NATIVE_JMP_INDIRECT,
-	HOOK_JMP_INDIRECT
+	HOOK_JMP_INDIRECT,
+	HOOK_TECHNIQUE_MAXTYPE,
 };
 #endif
 
@@ -21,12 +21,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stddef.h>
 #include "ntapi.h"
-#include <distorm.h>
 #include "hooking.h"
 #include "ignore.h"
 #include "unhook.h"
 #include "misc.h"
 #include "pipe.h"
+#include "config.h"
+#include "exports.h"
+#include "decode.h"
 
 extern DWORD g_tls_hook_index;
 
@@ -34,17 +36,10 @@ extern DWORD g_tls_hook_index;
 #define TLS_LAST_ERROR 0x34
 
 // length disassembler engine
-static int lde(void *addr)
+int lde(void *addr)
 {
-	// the length of an instruction is 16 bytes max, but there can also be
-	// 16 instructions of length one, so.. we support "decomposing" 16
-	// instructions at once, max
-	unsigned int used_instruction_count; _DInst instructions[16];
-	_CodeInfo code_info = { 0, 0, addr, 16, Decode32Bits };
-	_DecodeResult ret = distorm_decompose(&code_info, instructions, 16,
-		&used_instruction_count);
-
-	return ret == DECRES_SUCCESS ? instructions[0].size : 0;
+	insn_t insn;
+	return insn_decode(addr, DECODE_32BIT, &insn);
 }
 
 // create a trampoline at the given address, that is, we are going to replace
@@ -59,6 +54,9 @@ static int hook_create_trampoline(unsigned char *addr, int len,
     unsigned char *tramp)
 {
     const unsigned char *base = tramp;
+    const unsigned char *origaddr = addr;
+    unsigned long targets[32];
+    unsigned int targetcount = 0, i;
 
     // our trampoline should contain at least enough bytes to fit the given
     // length
@@ -98,6 +96,7 @@ static int hook_create_trampoline(unsigned char *addr, int len,
             // (note that `addr' is already increased by one or two, so the
             // 4 represents the 32bit offset of this particular instruction)
             jmp_addr = *(int *) addr + 4 + (unsigned long) addr;
+            targets[targetcount++] = jmp_addr;
             addr += 4;
 
             // trampoline is already filled with the opcode itself (the jump
@@ -124,6 +123,7 @@ static int hook_create_trampoline(unsigned char *addr, int len,
             // as signed char) in order to calculate the correct address
             unsigned long jmp_addr = (unsigned long) addr + 2 +
                 *(signed char *)(addr + 1);
+            targets[targetcount++] = jmp_addr;
 
             // the chance is *fairly* high that we will not be able to perform
             // a jump from the trampoline to the original function, so instead
@@ -166,6 +166,12 @@ static int hook_create_trampoline(unsigned char *addr, int len,
         }
     }
 
+    // a branch into the stolen bytes would end up in the middle of our hook
+    for (i = 0; i < targetcount; i++) {
+        if (targets[i] >= (unsigned long) origaddr && targets[i] < (unsigned long) addr)
+            return 0;
+    }
+
     // append a jump from the trampoline to the original function
     *tramp++ = 0xe9;
 	emit_rel(tramp, tramp, addr);
@@ -175,6 +181,87 @@ static int hook_create_trampoline(unsigned char *addr, int len,
     return tramp - base;
 }
 
+// offset of TlsSlots in the TEB
+#define TEB_TLS_SLOTS 0xe10
+
+// emits an inline version of the disable_count check done by enter_hook, so
+// that threads with hooks disabled (our own threads, or code running inside
+// hook_disable()) get sent to the original function before anything is saved.
+// only possible if our TLS index is one of the slots stored inside the TEB.
+// only the arithmetic flags are modified, which aren't preserved across calls
+static unsigned char *emit_disable_check(hook_t *h, unsigned char *p)
+{
+	unsigned char check[] = {
+		// push eax
+		0x50,
+		// mov eax, dword ptr fs:[TlsSlots + g_tls_hook_index * 4]
+		0x64, 0xa1, 0x00, 0x00, 0x00, 0x00,
+		// test eax, eax
+		0x85, 0xc0,
+		// jz 0x3
+		0x74, 0x03,
+			// cmp dword ptr [eax], 0 (hook_info_t.disable_count)
+			0x83, 0x38, 0x00,
+		// pop eax
+		0x58,
+		// jg h->tramp (original function)
+		0x0f, 0x8f, 0x00, 0x00, 0x00, 0x00
+	};
+
+	*(DWORD *)(check + 3) = TEB_TLS_SLOTS + g_tls_hook_index * sizeof(PVOID);
+	emit_rel(check + sizeof(check) - 4, p + sizeof(check) - 4, h->hookdata->tramp);
+	memcpy(p, check, sizeof(check));
+
+	return p + sizeof(check);
+}
+
+// while logging is suspended (waiting for the file or URL of interest), all
+// hooks that do nothing but log go straight to the original function
+static unsigned char *emit_suspended_check(hook_t *h, unsigned char *p)
+{
+	unsigned char check[] = {
+		// cmp byte ptr [g_config.suspend_logging], 0
+		0x80, 0x3d, 0x00, 0x00, 0x00, 0x00, 0x00,
+		// jnz h->tramp (original function)
+		0x0f, 0x85, 0x00, 0x00, 0x00, 0x00
+	};
+
+	*(BOOLEAN **)(check + 2) = &g_config.suspend_logging;
+	emit_rel(check + sizeof(check) - 4, p + sizeof(check) - 4, h->hookdata->tramp);
+	memcpy(p, check, sizeof(check));
+
+	return p + sizeof(check);
+}
+
+// lean pre-trampoline for hooks that don't log and thus need no caller
+// information; instead of walking the stack in enter_hook, calls coming
+// directly from our DLL are sent to the original function. Calls reaching
+// the hook through a system DLL, or from inside another hook's Old_ call,
+// still run the handler, so this is only for handlers that hand back the
+// original results unchanged
+static void emit_lean_pre_tramp(hook_t *h, unsigned char *p)
+{
+	unsigned char lean[] = {
+		// cmp dword ptr [esp], g_our_dll_base
+		0x81, 0x3c, 0x24, 0x00, 0x00, 0x00, 0x00,
+		// jb h->new_func
+		0x0f, 0x82, 0x00, 0x00, 0x00, 0x00,
+		// cmp dword ptr [esp], g_our_dll_base + g_our_dll_size
+		0x81, 0x3c, 0x24, 0x00, 0x00, 0x00, 0x00,
+		// jb h->tramp (original function)
+		0x0f, 0x82, 0x00, 0x00, 0x00, 0x00,
+		// jmp h->new_func
+		0xe9, 0x00, 0x00, 0x00, 0x00
+	};
+
+	*(DWORD *)(lean + 3) = (DWORD)g_our_dll_base;
+	emit_rel(lean + 9, p + 9, h->new_func);
+	*(DWORD *)(lean + 16) = (DWORD)(g_our_dll_base + g_our_dll_size);
+	emit_rel(lean + 22, p + 22, h->hookdata->tramp);
+	emit_rel(lean + 27, p + 27, h->new_func);
+	memcpy(p, lean, sizeof(lean));
+}
+
 // this function constructs the so-called pre-trampoline, this pre-trampoline
 // determines if a hook should really be executed. An example will be the
 // easiest; imagine we have a hook on CreateProcessInternalW() and on
@@ -187,6 +274,10 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 // engine "once inside a hook, don't hook further API calls" by setting the
 // allow_hook_recursion flag to false. The example above is what happens when
 // the hook recursion is not allowed.
+// The pre-trampoline is specialized per hook: hooks that only log are
+// skipped while logging is suspended, the disable_count check is done
+// inline when possible, and hooks marked with no_caller_info skip
+// enter_hook entirely.
 static void hook_create_pre_tramp(hook_t *h)
 {
 	unsigned char *p;
@@ -235,6 +326,18 @@ static void hook_create_pre_tramp(hook_t *h)
 #endif
 
 	p = h->hookdata->pre_tramp;
+
+	if (!h->run_while_suspended)
+		p = emit_suspended_check(h, p);
+
+	if (g_tls_hook_index < TLS_MINIMUM_AVAILABLE) {
+		p = emit_disable_check(h, p);
+		if (h->no_caller_info) {
+			emit_lean_pre_tramp(h, p);
+			return;
+		}
+	}
+
 	off = sizeof(pre_tramp1) - sizeof(unsigned int);
 	emit_rel(pre_tramp1 + off, p + off, (unsigned char *)&enter_hook);
 	memcpy(p, pre_tramp1, sizeof(pre_tramp1));
@@ -250,169 +353,171 @@ static void hook_create_pre_tramp(hook_t *h)
 	memcpy(p, pre_tramp3, sizeof(pre_tramp3));
 }
 
-static int hook_api_jmp_direct(hook_t *h, unsigned char *from,
-    unsigned char *to)
+// the hook types below build the bytes a hook writes over the function in
+// buf, which is put at from once complete (see hook_write_patch)
+static int hook_api_jmp_direct(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // unconditional jump opcode
-    *from = 0xe9;
+    *buf = 0xe9;
 
     // store the relative address from this opcode to our hook function
-    *(unsigned long *)(from + 1) = (unsigned char *) to - from - 5;
+    *(unsigned long *)(buf + 1) = (unsigned char *) to - from - 5;
     return 0;
 }
 
-static int hook_api_nop_jmp_direct(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_nop_jmp_direct(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // nop
-    *from++ = 0x90;
+    *buf++ = 0x90;
 
-    return hook_api_jmp_direct(h, from, to);
+    return hook_api_jmp_direct(h, buf, from + 1, to);
 }
 
-static int hook_api_hotpatch_jmp_direct(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_hotpatch_jmp_direct(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // mov edi, edi
-    *from++ = 0x8b;
-    *from++ = 0xff;
+    *buf++ = 0x8b;
+    *buf++ = 0xff;
 
-    return hook_api_jmp_direct(h, from, to);
+    return hook_api_jmp_direct(h, buf, from + 2, to);
 }
 
-static int hook_api_push_retn(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_push_retn(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // push addr
-    *from++ = 0x68;
-    *(unsigned char **) from = to;
+    *buf++ = 0x68;
+    *(unsigned char **) buf = to;
 
     // retn
-    from[4] = 0xc3;
+    buf[4] = 0xc3;
 
     return 0;
 }
 
-static int hook_api_nop_push_retn(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_nop_push_retn(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // nop
-    *from++ = 0x90;
+    *buf++ = 0x90;
 
-    return hook_api_push_retn(h, from, to);
+    return hook_api_push_retn(h, buf, from + 1, to);
 }
 
-static int hook_api_jmp_indirect(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_jmp_indirect(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // jmp dword [hook_data]
-    *from++ = 0xff;
-    *from++ = 0x25;
+    *buf++ = 0xff;
+    *buf++ = 0x25;
 
-	*(unsigned char **)from = h->hookdata->hook_data;
+	*(unsigned char **)buf = h->hookdata->hook_data;
 
     // the real address is stored in hook_data
 	memcpy(h->hookdata->hook_data, &to, sizeof(to));
     return 0;
 }
 
-static int hook_api_hotpatch_jmp_indirect(hook_t *h, unsigned char *from,
-	unsigned char *to)
+static int hook_api_hotpatch_jmp_indirect(hook_t *h, unsigned char *buf,
+	unsigned char *from, unsigned char *to)
 {
 	// mov edi, edi
-	*from++ = 0x8b;
-	*from++ = 0xff;
+	*buf++ = 0x8b;
+	*buf++ = 0xff;
 
-	return hook_api_jmp_indirect(h, from, to);
+	return hook_api_jmp_indirect(h, buf, from + 2, to);
 }
 
-static int hook_api_mov_eax_jmp_eax(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_mov_eax_jmp_eax(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // mov eax, address
-    *from++ = 0xb8;
-    *(unsigned char **) from = to;
-    from += 4;
+    *buf++ = 0xb8;
+    *(unsigned char **) buf = to;
+    buf += 4;
 
     // jmp eax
-    *from++ = 0xff;
-    *from++ = 0xe0;
+    *buf++ = 0xff;
+    *buf++ = 0xe0;
     return 0;
 }
 
-static int hook_api_mov_eax_push_retn(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_mov_eax_push_retn(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // mov eax, address
-    *from++ = 0xb8;
-    *(unsigned char **) from = to;
-    from += 4;
+    *buf++ = 0xb8;
+    *(unsigned char **) buf = to;
+    buf += 4;
 
     // push eax
-    *from++ = 0x50;
+    *buf++ = 0x50;
 
     // retn
-    *from++ = 0xc3;
+    *buf++ = 0xc3;
     return 0;
 }
 
-static int hook_api_mov_eax_indirect_jmp_eax(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_mov_eax_indirect_jmp_eax(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // mov eax, [hook_data]
-    *from++ = 0xa1;
-	*(unsigned char **)from = h->hookdata->hook_data;
-    from += 4;
+    *buf++ = 0xa1;
+	*(unsigned char **)buf = h->hookdata->hook_data;
+    buf += 4;
 
     // store the address at hook_data
 	memcpy(h->hookdata->hook_data, &to, sizeof(to));
 
     // jmp eax
-    *from++ = 0xff;
-    *from++ = 0xe0;
+    *buf++ = 0xff;
+    *buf++ = 0xe0;
     return 0;
 }
 
-static int hook_api_mov_eax_indirect_push_retn(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_mov_eax_indirect_push_retn(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // mov eax, [hook_data]
-    *from++ = 0xa1;
-	*(unsigned char **)from = h->hookdata->hook_data;
-    from += 4;
+    *buf++ = 0xa1;
+	*(unsigned char **)buf = h->hookdata->hook_data;
+    buf += 4;
 
     // store the address at hook_data
 	memcpy(h->hookdata->hook_data, &to, sizeof(to));
 
     // push eax
-    *from++ = 0x50;
+    *buf++ = 0x50;
 
     // retn
-    *from++ = 0xc3;
+    *buf++ = 0xc3;
     return 0;
 }
 
 #if HOOK_ENABLE_FPU
-static int hook_api_push_fpu_retn(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_push_fpu_retn(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // push ebp
-    *from++ = 0x55;
+    *buf++ = 0x55;
 
     // fld qword [hook_data]
-    *from++ = 0xdd;
-    *from++ = 0x05;
+    *buf++ = 0xdd;
+    *buf++ = 0x05;
 
-    *(unsigned char **) from = h->hook_data;
-    from += 4;
+    *(unsigned char **) buf = h->hook_data;
+    buf += 4;
 
     // fistp dword [esp]
-    *from++ = 0xdb;
-    *from++ = 0x1c;
-    *from++ = 0xe4;
+    *buf++ = 0xdb;
+    *buf++ = 0x1c;
+    *buf++ = 0xe4;
 
     // retn
-    *from++ = 0xc3;
+    *buf++ = 0xc3;
 
     // store the address as double
     double addr = (double) (unsigned long) to;
@@ -421,34 +526,23 @@ static int hook_api_push_fpu_retn(hook_t *h, unsigned char *from,
 }
 #endif
 
-static int hook_api_special_jmp(hook_t *h, unsigned char *from,
-    unsigned char *to)
+static int hook_api_special_jmp(hook_t *h, unsigned char *buf,
+    unsigned char *from, unsigned char *to)
 {
     // our largest hook in use is currently 7 bytes. so we have to make sure
     // that this special hook (a hook that will be patched over again later)
     // is atleast seven bytes.
-    *from++ = 0x90;
-    *from++ = 0x90;
-    return hook_api_jmp_direct(h, from, to);
+    *buf++ = 0x90;
+    *buf++ = 0x90;
+    return hook_api_jmp_direct(h, buf, from + 2, to);
 }
 
-static int hook_api_native_jmp_indirect(hook_t *h, unsigned char *from,
-	unsigned char *to)
+static int hook_api_native_jmp_indirect(hook_t *h, unsigned char *buf,
+	unsigned char *from, unsigned char *to)
 {
 	// hook used for Native API functions where the first instruction specifies the syscall number
 	// we'll leave in that mov instruction and repeat it before calling the original function
-	from += 5;
-	return hook_api_jmp_indirect(h, from, to);
-}
-
-hook_data_t *alloc_hookdata_near(void *addr)
-{
-	DWORD oldprot;
-	hook_data_t *ret = calloc(1, sizeof(hook_data_t));
-
-	VirtualProtect(ret, sizeof(hook_data_t), PAGE_EXECUTE_READWRITE, &oldprot);
-
-	return ret;
+	return hook_api_jmp_indirect(h, buf + 5, from + 5, to);
 }
 
 static ULONG_PTR get_near_rel_target(unsigned char *buf)
@@ -466,11 +560,11 @@ int hook_api(hook_t *h, int type)
 {
 	unsigned char *addr;
 	int ret = -1;
-	DWORD old_protect;
 
     // table with all possible hooking types
     static struct {
-        int(*hook)(hook_t *h, unsigned char *from, unsigned char *to);
+        int(*hook)(hook_t *h, unsigned char *buf, unsigned char *from,
+            unsigned char *to);
         int len;
     } hook_types[] = {
         /* HOOK_JMP_DIRECT */ {&hook_api_jmp_direct, 5},
@@ -504,15 +598,24 @@ int hook_api(hook_t *h, int type)
     if(addr == NULL && h->library != NULL && h->funcname != NULL) {
 		if (!strcmp(h->funcname, "RtlDispatchException")) {
 			// RtlDispatchException is the first relative call in KiUserExceptionDispatcher
-			unsigned char *baseaddr = (unsigned char *)GetProcAddress(GetModuleHandleW(h->library), "KiUserExceptionDispatcher");
-			int instroff = 0;
-			while (baseaddr[instroff] != 0xe8) {
-				instroff += lde(&baseaddr[instroff]);
+			unsigned char *baseaddr = (unsigned char *)resolve_export(h->library, "KiUserExceptionDispatcher");
+			int instroff = 0, length = 1;
+			while (baseaddr != NULL && baseaddr[instroff] != 0xe8) {
+				// lde() returns 0 on bytes it can't decode, which would never
+				// move us forward
+				length = lde(&baseaddr[instroff]);
+				if (length == 0)
+					break;
+				instroff += length;
+			}
+			if (baseaddr == NULL || length == 0) {
+				pipe("WARNING:Unable to find %z in KiUserExceptionDispatcher", h->funcname);
+				return ret;
 			}
 			addr = (unsigned char *)get_near_rel_target(&baseaddr[instroff]);
 		}
 		else {
-			addr = (unsigned char *)GetProcAddress(GetModuleHandleW(h->library), h->funcname);
+			addr = (unsigned char *)resolve_export(h->library, h->funcname);
 		}
     }
     if(addr == NULL) {
@@ -574,46 +677,34 @@ int hook_api(hook_t *h, int type)
 		return ret;
 	}
 
-	// make the address writable
-	if (VirtualProtect(addr, hook_types[type].len, PAGE_EXECUTE_READWRITE,
-		&old_protect)) {
+	h->hookdata = alloc_hookdata_near(addr);
 
-		h->hookdata = alloc_hookdata_near(addr);
+	if (h->hookdata && hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
+		//hook_store_exception_info(h);
+		uint8_t orig[16], patch[16];
+		memcpy(orig, addr, 16);
+		memcpy(patch, orig, 16);
 
-		if (h->hookdata && hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
-			//hook_store_exception_info(h);
-			uint8_t orig[16];
-			memcpy(orig, addr, 16);
+		hook_create_pre_tramp(h);
 
-			hook_create_pre_tramp(h);
+		// build the hook (jump from the api to the pre-trampoline)
+		ret = hook_types[type].hook(h, patch, addr, h->hookdata->pre_tramp);
 
-			// insert the hook (jump from the api to the
-			// pre-trampoline)
-			ret = hook_types[type].hook(h, addr, h->hookdata->pre_tramp);
+		if (ret == 0) {
+			// assign the trampoline address to *old_func before the hook
+			// can be reached
+			*h->old_func = h->hookdata->tramp;
 
-			// Add unhook detection for our newly created hook.
-			// Ensure any changes behind our hook are also catched by
-			// making the buffersize 16.
-			unhook_detect_add_region(h->funcname, addr, orig, addr, 16);
+			// insert the hook, unhook detection is added along with it
+			ret = hook_write_patch(h, addr, orig, patch, hook_types[type].len);
 
-			// if successful, assign the trampoline address to *old_func
-			if (ret == 0) {
-				*h->old_func = h->hookdata->tramp;
-
-				// successful hook is successful
+			// successful hook is successful
+			if (ret == 0)
 				h->is_hooked = 1;
-			}
 		}
-		else {
-			pipe("WARNING:Unable to place hook on %z", h->funcname);
-		}
-
-		// restore the old protection
-		VirtualProtect(addr, hook_types[type].len, old_protect,
-			&old_protect);
 	}
 	else {
-		pipe("WARNING:Unable to change protection for hook on %z", h->funcname);
+		pipe("WARNING:Unable to place hook on %z", h->funcname);
 	}
 
     return ret;
@@ -20,12 +20,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stddef.h>
 #include "ntapi.h"
-#include <distorm.h>
 #include "hooking.h"
 #include "ignore.h"
 #include "unhook.h"
 #include "misc.h"
 #include "pipe.h"
+#include "config.h"
+#include "exports.h"
+#include "decode.h"
 
 extern DWORD g_tls_hook_index;
 
@@ -33,39 +35,13 @@ extern DWORD g_tls_hook_index;
 #define TLS_LAST_ERROR 0x34
 
 // length disassembler engine
-static int lde(void *addr)
+int lde(void *addr)
 {
-	// the length of an instruction is 16 bytes max, but there can also be
-	// 16 instructions of length one, so.. we support "decomposing" 16
-	// instructions at once, max
-	unsigned int used_instruction_count; _DInst instructions[16];
-	_CodeInfo code_info = { 0, 0, addr, 16, Decode64Bits };
-	_DecodeResult ret = distorm_decompose(&code_info, instructions, 16,
-		&used_instruction_count);
-
-	return ret == DECRES_SUCCESS ? instructions[0].size : 0;
+	insn_t insn;
+	return insn_decode(addr, DECODE_64BIT, &insn);
 }
 
 
-static _DInst *get_insn(void *addr)
-{
-	unsigned int used_instruction_count; _DInst instructions[16];
-	_CodeInfo code_info = { 0, 0, addr, 16, Decode64Bits };
-	_DecodeResult ret = distorm_decompose(&code_info, instructions, 16,
-		&used_instruction_count);
-	if (ret == DECRES_SUCCESS) {
-		_DInst *insn = malloc(sizeof(_DInst));
-		memcpy(insn, &instructions[0], sizeof(_DInst));
-		return insn;
-	}
-	return NULL;
-}
-
-static void put_insn(_DInst *insn)
-{
-	free(insn);
-}
-
 static unsigned char *emit_indirect_jmp(unsigned char *buf, ULONG_PTR addr)
 {
 	*buf++ = 0xff;
@@ -138,12 +114,20 @@ static ULONG_PTR get_indirect_target(unsigned char *buf)
 	return *(ULONG_PTR *)(buf + 6 + *(int *)&buf[2]);
 }
 
+// a relocated branch in the trampoline, see hook_create_trampoline()
+typedef struct _branch_fixup_t {
+	unsigned char *slot;	// rel32, or absolute target if next is NULL
+	unsigned char *next;	// end of the instruction holding the rel32
+	ULONG_PTR target;		// target in the original code
+} branch_fixup_t;
+
 static ULONG_PTR get_corresponding_tramp_target(addr_map_t *map, ULONG_PTR addr)
 {
 	unsigned int i = 0;
 	while (map->map[i][1]) {
 		if (map->map[i][1] == addr)
 			return map->map[i][0];
+		i++;
 	}
 	return 0;
 }
@@ -158,10 +142,10 @@ static int addr_is_in_range(ULONG_PTR addr, const unsigned char *buf, DWORD size
 	return 0;
 }
 
-static void retarget_rip_relative_displacement(unsigned char **tramp, unsigned char **addr, _DInst *insn)
+static void retarget_rip_relative_displacement(unsigned char **tramp, unsigned char **addr, const insn_t *insn)
 {
 	unsigned short length = insn->size;
-	unsigned char offset = (unsigned char)(length - insn->imm_encoded_size - sizeof(int));
+	unsigned char offset = (unsigned char)(length - insn->imm_size - sizeof(int));
 	unsigned char *newtramp = *tramp;
 	unsigned char *newaddr = *addr;
 	ULONG_PTR target;
@@ -173,7 +157,7 @@ static void retarget_rip_relative_displacement(unsigned char **tramp, unsigned c
 	}
 	// now replace the displacement
 	rel = (int)(target - (ULONG_PTR)newtramp);
-	*(int *)(newtramp - insn->imm_encoded_size - sizeof(int)) = rel;
+	*(int *)(newtramp - insn->imm_size - sizeof(int)) = rel;
 
 	*tramp = newtramp;
 	*addr = newaddr;
@@ -191,12 +175,15 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 	unsigned char *tramp)
 {
 	addr_map_t addrmap;
+	branch_fixup_t fixups[32];
 	ULONG_PTR target;
 	const unsigned char *base = tramp;
 	const unsigned char *origaddr = addr;
 	unsigned char insnidx = 0;
+	unsigned int fixupcount = 0;
+	unsigned int i;
 	int stoleninstrlen = 0;
-	_DInst *insn;
+	insn_t insn;
 
 	memset(&addrmap, 0, sizeof(addrmap));
 
@@ -205,10 +192,9 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 	while (len > 0) {
 		int length;
 
-		insn = get_insn(addr);
-		if (insn == NULL)
+		length = insn_decode(addr, DECODE_64BIT, &insn);
+		if (length == 0)
 			goto error;
-		length = insn->size;
 
 		// how many bytes left?
 		len -= length;
@@ -216,33 +202,41 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 
 		addrmap.map[insnidx][0] = (ULONG_PTR)tramp;
 		addrmap.map[insnidx][1] = (ULONG_PTR)addr;
+		insnidx++;
 
 		// check the type of instruction at this particular address, if it's
 		// a jump or a call instruction, then we have to calculate some fancy
 		// addresses, otherwise we can simply copy the instruction to our
 		// trampoline
 
-		if (addr[0] == 0xe8 || addr[0] == 0xe9 || (addr[0] == 0x0f && addr[1] >= 0x80 && addr[1] < 0x90) ||
-			(insn->flags & FLAG_RIP_RELATIVE)) {
-			retarget_rip_relative_displacement(&tramp, &addr, insn);
+		if (addr[0] == 0xe8 || addr[0] == 0xe9 || (addr[0] == 0x0f && addr[1] >= 0x80 && addr[1] < 0x90)) {
 			if (addr[0] == 0xe9 && len > 0)
 				goto error;
+			target = get_near_rel_target(addr);
+			retarget_rip_relative_displacement(&tramp, &addr, &insn);
+			fixups[fixupcount].slot = tramp - sizeof(int);
+			fixups[fixupcount].next = tramp;
+			fixups[fixupcount++].target = target;
+		}
+		else if (insn.rip_relative) {
+			retarget_rip_relative_displacement(&tramp, &addr, &insn);
 		}
-
 		else if (addr[0] == 0xeb) {
+			if (len > 0)
+				goto error;
 			target = get_short_rel_target(addr);
-			if (addr_is_in_range(target, origaddr, stoleninstrlen))
-				target = get_corresponding_tramp_target(&addrmap, target);
 			tramp = emit_indirect_jmp(tramp, target);
+			fixups[fixupcount].slot = tramp - sizeof(ULONG_PTR);
+			fixups[fixupcount].next = NULL;
+			fixups[fixupcount++].target = target;
 			addr += length;
-			if (len > 0)
-				goto error;
 		}
 		else if (addr[0] == 0xe3 || ((addr[0] & 0xf0) == 0x70)) {
 			target = get_short_rel_target(addr);
-			if (addr_is_in_range(target, origaddr, stoleninstrlen))
-				target = get_corresponding_tramp_target(&addrmap, target);
 			tramp = emit_indirect_jcc(addr[0], tramp, target);
+			fixups[fixupcount].slot = tramp - sizeof(ULONG_PTR);
+			fixups[fixupcount].next = NULL;
+			fixups[fixupcount++].target = target;
 			addr += length;
 		}
 		// return instruction, indicates end of basic block as well, so we
@@ -256,7 +250,22 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 				*tramp++ = *addr++;
 			}
 		}
-		put_insn(insn);
+	}
+
+	// branches into the stolen bytes, backwards or forwards, have to land on
+	// the copy of the instruction in the trampoline, as the original is about
+	// to be overwritten by our hook
+	for (i = 0; i < fixupcount; i++) {
+		if (!addr_is_in_range(fixups[i].target, origaddr, stoleninstrlen))
+			continue;
+		target = get_corresponding_tramp_target(&addrmap, fixups[i].target);
+		// into the middle of an instruction
+		if (target == 0)
+			goto error;
+		if (fixups[i].next)
+			*(int *)fixups[i].slot = (int)(target - (ULONG_PTR)fixups[i].next);
+		else
+			*(ULONG_PTR *)fixups[i].slot = target;
 	}
 
 	// append a jump from the trampoline to the original function
@@ -267,12 +276,95 @@ static int hook_create_trampoline(unsigned char *addr, int len,
 	// return the length of this trampoline
 	return (int)(tramp - base);
 error:
-	if (insn)
-		put_insn(insn);
 	return 0;
 }
 
 
+// offset of TlsSlots in the TEB
+#define TEB_TLS_SLOTS 0x1480
+
+// emits an inline version of the disable_count check done by enter_hook, so
+// that threads with hooks disabled (our own threads, or code running inside
+// hook_disable()) get sent to the original function before anything is saved.
+// only possible if our TLS index is one of the slots stored inside the TEB.
+// r11 is volatile and never carries an argument (syscall clobbers it too), and
+// as the stack isn't touched the code needs no unwind information
+static unsigned char *emit_disable_check(hook_t *h, unsigned char *p)
+{
+	unsigned char check[] = {
+		// mov r11, qword ptr gs:[TlsSlots + g_tls_hook_index * 8]
+		0x65, 0x4c, 0x8b, 0x1c, 0x25, 0x00, 0x00, 0x00, 0x00,
+		// test r11, r11
+		0x4d, 0x85, 0xdb,
+		// jz 0xa
+		0x74, 0x0a,
+			// cmp dword ptr [r11], 0 (hook_info_t.disable_count)
+			0x41, 0x83, 0x3b, 0x00,
+			// jg h->tramp (original function)
+			0x0f, 0x8f, 0x00, 0x00, 0x00, 0x00
+	};
+
+	*(DWORD *)(check + 5) = TEB_TLS_SLOTS + g_tls_hook_index * sizeof(PVOID);
+	// tramp lives in the same hook_data_t, so it's always in rel32 range
+	emit_rel(check + sizeof(check) - 4, p + sizeof(check) - 4, h->hookdata->tramp);
+	memcpy(p, check, sizeof(check));
+
+	return p + sizeof(check);
+}
+
+// while logging is suspended (waiting for the file or URL of interest), all
+// hooks that do nothing but log go straight to the original function
+static unsigned char *emit_suspended_check(hook_t *h, unsigned char *p)
+{
+	unsigned char check[] = {
+		// mov r11, &g_config.suspend_logging
+		0x49, 0xbb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		// cmp byte ptr [r11], 0
+		0x41, 0x80, 0x3b, 0x00,
+		// jnz h->tramp (original function)
+		0x0f, 0x85, 0x00, 0x00, 0x00, 0x00
+	};
+
+	*(BOOLEAN **)(check + 2) = &g_config.suspend_logging;
+	emit_rel(check + sizeof(check) - 4, p + sizeof(check) - 4, h->hookdata->tramp);
+	memcpy(p, check, sizeof(check));
+
+	return p + sizeof(check);
+}
+
+// lean pre-trampoline for hooks that don't log and thus need no caller
+// information; instead of walking the stack in enter_hook, calls coming
+// directly from our DLL are sent to the original function. Calls reaching
+// the hook through a system DLL, or from inside another hook's Old_ call,
+// still run the handler, so this is only for handlers that hand back the
+// original results unchanged
+static void emit_lean_pre_tramp(hook_t *h, unsigned char *p)
+{
+	unsigned char lean[] = {
+		// mov r11, g_our_dll_base
+		0x49, 0xbb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		// cmp qword ptr [rsp], r11
+		0x4c, 0x39, 0x1c, 0x24,
+		// jb 0x14
+		0x72, 0x14,
+		// mov r11, g_our_dll_base + g_our_dll_size
+		0x49, 0xbb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		// cmp qword ptr [rsp], r11
+		0x4c, 0x39, 0x1c, 0x24,
+		// jb h->tramp (original function)
+		0x0f, 0x82, 0x00, 0x00, 0x00, 0x00,
+		// jmp h->new_func (New_ func)
+		0xff, 0x25, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+	};
+
+	*(ULONG_PTR *)(lean + 2) = g_our_dll_base;
+	*(ULONG_PTR *)(lean + 18) = g_our_dll_base + g_our_dll_size;
+	emit_rel(lean + 32, p + 32, h->hookdata->tramp);
+	*(ULONG_PTR *)(lean + 42) = (ULONG_PTR)h->new_func;
+	memcpy(p, lean, sizeof(lean));
+}
+
 // this function constructs the so-called pre-trampoline, this pre-trampoline
 // determines if a hook should really be executed. An example will be the
 // easiest; imagine we have a hook on CreateProcessInternalW() and on
@@ -285,10 +377,15 @@ error:
 // engine "once inside a hook, don't hook further API calls" by setting the
 // allow_hook_recursion flag to false. The example above is what happens when
 // the hook recursion is not allowed.
+// The pre-trampoline is specialized per hook: hooks that only log are
+// skipped while logging is suspended, the disable_count check is done
+// inline when possible, and hooks marked with no_caller_info skip
+// enter_hook entirely.
 static void hook_create_pre_tramp(hook_t *h)
 {
 	unsigned char *p;
 	unsigned int off;
+	unsigned int prologue_start;
 	RUNTIME_FUNCTION *functable;
 	UNWIND_INFO *unwindinfo;
 	BYTE regs1[] = { 11, 10, 9, 8 };
@@ -357,6 +454,22 @@ static void hook_create_pre_tramp(hook_t *h)
 #endif
 
 	p = h->hookdata->pre_tramp;
+
+	if (!h->run_while_suspended)
+		p = emit_suspended_check(h, p);
+
+	if (g_tls_hook_index < TLS_MINIMUM_AVAILABLE) {
+		p = emit_disable_check(h, p);
+		if (h->no_caller_info) {
+			// never touches the stack, so no unwind information is needed
+			emit_lean_pre_tramp(h, p);
+			return;
+		}
+	}
+
+	// the unwind information below describes the code from here on
+	prologue_start = (unsigned int)(p - h->hookdata->pre_tramp);
+
 	off = sizeof(pre_tramp1) - sizeof(ULONG_PTR);
 	*(ULONG_PTR *)(pre_tramp1 + off) = (ULONG_PTR)&enter_hook;
 	memcpy(p, pre_tramp1, sizeof(pre_tramp1));
@@ -384,7 +497,7 @@ static void hook_create_pre_tramp(hook_t *h)
 	functable = malloc(sizeof(RUNTIME_FUNCTION));
 	unwindinfo = &h->hookdata->unwind_info;
 
-	functable->BeginAddress = offsetof(hook_data_t, pre_tramp);
+	functable->BeginAddress = offsetof(hook_data_t, pre_tramp) + prologue_start;
 	functable->EndAddress = offsetof(hook_data_t, pre_tramp) + sizeof(h->hookdata->pre_tramp);
 	functable->UnwindData = offsetof(hook_data_t, unwind_info);
 
@@ -414,58 +527,39 @@ static void hook_create_pre_tramp(hook_t *h)
 	RtlAddFunctionTable(functable, 1, (DWORD64)h->hookdata);
 }
 
-static int hook_api_jmp_indirect(hook_t *h, unsigned char *from,
-	unsigned char *to)
+// the hook types below build the bytes a hook writes over the function in
+// buf, which is put at from once complete (see hook_write_patch)
+static int hook_api_jmp_indirect(hook_t *h, unsigned char *buf,
+	unsigned char *from, unsigned char *to)
 {
 	// jmp dword [hook_data]
-	*from++ = 0xff;
-	*from++ = 0x25;
+	*buf++ = 0xff;
+	*buf++ = 0x25;
 
-	*(int *)from = (int)(h->hookdata->hook_data - ((ULONG_PTR)from + 4));
+	*(int *)buf = (int)((ULONG_PTR)h->hookdata->hook_data - ((ULONG_PTR)from + 6));
 
 	// the real address is stored in hook_data
 	memcpy(h->hookdata->hook_data, &to, sizeof(to));
 	return 0;
 }
 
-static int hook_api_native_jmp_indirect(hook_t *h, unsigned char *from,
-	unsigned char *to)
+static int hook_api_native_jmp_indirect(hook_t *h, unsigned char *buf,
+	unsigned char *from, unsigned char *to)
 {
 	// hook used for Native API functions where the second instruction specifies the syscall number
 	// we'll leave in that mov instruction and repeat it before calling the original function
-	from += 8;
-	return hook_api_jmp_indirect(h, from, to);
-}
-
-hook_data_t *alloc_hookdata_near(void *addr)
-{
-	PVOID BaseAddress;
-	int offset = -(1024 * 1024 * 1024);
-	SIZE_T RegionSize = sizeof(hook_data_t);
-	LONG status;
-
-	do {
-		if (offset < 0 && (ULONG_PTR)addr < (ULONG_PTR)-offset)
-			offset = 0x10000;
-		BaseAddress = (PCHAR)addr + offset;
-		status = pNtAllocateVirtualMemory(GetCurrentProcess(), &BaseAddress, 0, &RegionSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-		if (status >= 0)
-			return (hook_data_t *)BaseAddress;
-		offset += 0x10000;
-	} while (status < 0 && offset <= (1024 * 1024 * 1024));
-
-	return NULL;
+	return hook_api_jmp_indirect(h, buf + 8, from + 8, to);
 }
 
 int hook_api(hook_t *h, int type)
 {
-	DWORD old_protect;
 	int ret = -1;
 	unsigned char *addr;
 	OSVERSIONINFO os_info;
 	// table with all possible hooking types
 	static struct {
-		int(*hook)(hook_t *h, unsigned char *from, unsigned char *to);
+		int(*hook)(hook_t *h, unsigned char *buf, unsigned char *from,
+			unsigned char *to);
 		int len;
 	} hook_types[] = {
 		/* HOOK_NATIVE_JMP_INDIRECT */{ &hook_api_native_jmp_indirect, 14 },
@@ -483,15 +577,24 @@ int hook_api(hook_t *h, int type)
 	if (addr == NULL && h->library != NULL && h->funcname != NULL) {
 		if (!strcmp(h->funcname, "RtlDispatchException")) {
 			// RtlDispatchException is the first relative call in KiUserExceptionDispatcher
-			unsigned char *baseaddr = (unsigned char *)GetProcAddress(GetModuleHandleW(h->library), "KiUserExceptionDispatcher");
-			int instroff = 0;
-			while (baseaddr[instroff] != 0xe8) {
-				instroff += lde(&baseaddr[instroff]);
+			unsigned char *baseaddr = (unsigned char *)resolve_export(h->library, "KiUserExceptionDispatcher");
+			int instroff = 0, length = 1;
+			while (baseaddr != NULL && baseaddr[instroff] != 0xe8) {
+				// lde() returns 0 on bytes it can't decode, which would never
+				// move us forward
+				length = lde(&baseaddr[instroff]);
+				if (length == 0)
+					break;
+				instroff += length;
+			}
+			if (baseaddr == NULL || length == 0) {
+				pipe("WARNING:Unable to find %z in KiUserExceptionDispatcher", h->funcname);
+				return ret;
 			}
 			addr = (unsigned char *)get_near_rel_target(&baseaddr[instroff]);
 		}
 		else {
-			addr = (unsigned char *)GetProcAddress(GetModuleHandleW(h->library), h->funcname);
+			addr = (unsigned char *)resolve_export(h->library, h->funcname);
 		}
 	}
 	if (addr == NULL) {
@@ -538,86 +641,408 @@ int hook_api(hook_t *h, int type)
 		return ret;
 	}
 
-	// make the address writable
-	if (VirtualProtect(addr, hook_types[type].len, PAGE_EXECUTE_READWRITE,
-		&old_protect)) {
+	h->hookdata = alloc_hookdata_near(addr);
 
-		h->hookdata = alloc_hookdata_near(addr);
+	if (h->hookdata && hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
+		//hook_store_exception_info(h);
+		uint8_t orig[16], patch[16];
+		memcpy(orig, addr, 16);
+		memcpy(patch, orig, 16);
 
-		if (h->hookdata && hook_create_trampoline(addr, hook_types[type].len, h->hookdata->tramp)) {
-			//hook_store_exception_info(h);
-			uint8_t orig[16];
-			memcpy(orig, addr, 16);
+		hook_create_pre_tramp(h);
 
-			hook_create_pre_tramp(h);
+		// build the hook (jump from the api to the pre-trampoline)
+		ret = hook_types[type].hook(h, patch, addr, h->hookdata->pre_tramp);
 
-			// insert the hook (jump from the api to the
-			// pre-trampoline)
-			ret = hook_types[type].hook(h, addr, h->hookdata->pre_tramp);
+		if (ret == 0) {
+			// assign the trampoline address to *old_func before the hook
+			// can be reached
+			*h->old_func = h->hookdata->tramp;
 
-			// Add unhook detection for our newly created hook.
-			// Ensure any changes behind our hook are also catched by
-			// making the buffersize 16.
-			unhook_detect_add_region(h->funcname, addr, orig, addr, 16);
+			// insert the hook, unhook detection is added along with it
+			ret = hook_write_patch(h, addr, orig, patch, hook_types[type].len);
 
-			// if successful, assign the trampoline address to *old_func
-			if (ret == 0) {
-				*h->old_func = h->hookdata->tramp;
-
-				// successful hook is successful
+			// successful hook is successful
+			if (ret == 0)
 				h->is_hooked = 1;
-			}
 		}
-		else {
-			pipe("WARNING:Unable to place hook on %z", h->funcname);
-		}
-
-		// restore the old protection
-		VirtualProtect(addr, hook_types[type].len, old_protect,
-			&old_protect);
 	}
 	else {
-		pipe("WARNING:Unable to change protection for hook on %z", h->funcname);
+		pipe("WARNING:Unable to place hook on %z", h->funcname);
 	}
 
 	return ret;
 }
 
-static unsigned int our_stackwalk(ULONG_PTR retaddr, ULONG_PTR sp, PVOID *backtrace, unsigned int count)
+/* .pdata based stack walking
+ * RtlLookupFunctionEntry/RtlVirtualUnwind take the loader lock-free paths
+ * but still search the module list and decode epilogues for every frame,
+ * which is too slow to do on every hook entry.  Instead we keep a small
+ * address-sorted cache of the exception directories of loaded images
+ * (whose RUNTIME_FUNCTION tables are already sorted by the linker) and
+ * interpret the unwind codes ourselves.  Code outside of any image
+ * (our pre-trampolines, JIT code) still goes through RtlLookupFunctionEntry
+ * so dynamic function tables keep working.
+ */
+#define PDATA_MAX_MODULES 256
+#define PDATA_MAX_CHAIN 32
+
+typedef struct _pdata_module_t {
+	ULONG_PTR base;
+	ULONG_PTR end;
+	PRUNTIME_FUNCTION funcs;
+	DWORD count;
+} pdata_module_t;
+
+static pdata_module_t g_pdata_modules[PDATA_MAX_MODULES];
+static volatile unsigned int g_pdata_module_count;
+// even: cache is stable, odd: a writer is updating it
+static volatile LONG g_pdata_seq;
+// bumped around unloads without taking the cache, the contents are
+// only good while it matches the count they were inserted under
+static volatile LONG g_pdata_flushes;
+static LONG g_pdata_cache_flushes;
+// number of LdrUnloadDll calls in progress, the cache is bypassed meanwhile
+static volatile LONG g_pdata_unloading;
+
+// how often a reader retries while a writer is in the cache
+#define PDATA_READ_RETRIES 64
+
+// returns 1 and the cached module, 0 if it isn't cached, and -1 if a writer
+// kept the cache busy.  Readers never wait for a writer, which may be a
+// thread suspended in the middle of an update
+static int pdata_cache_find(ULONG_PTR addr, pdata_module_t *out)
 {
-	/* derived from http://www.nynaeve.net/Code/StackWalk64.cpp */
-	CONTEXT ctx;
-	DWORD64 imgbase;
-	PRUNTIME_FUNCTION runfunc;
-	KNONVOLATILE_CONTEXT_POINTERS nvctx;
-	PVOID handlerdata;
-	ULONG_PTR establisherframe;
-	unsigned int frame;
+	unsigned int lo, hi, mid;
+	unsigned int tries;
+	LONG seq, flushes;
+	int found;
+
+	for (tries = 0; tries < PDATA_READ_RETRIES; tries++) {
+		seq = g_pdata_seq;
+		if (seq & 1) {
+			YieldProcessor();
+			continue;
+		}
+		MemoryBarrier();
+		flushes = g_pdata_flushes;
+
+		found = 0;
+		lo = 0;
+		hi = g_pdata_cache_flushes == flushes && !g_pdata_unloading ? g_pdata_module_count : 0;
+		if (hi > PDATA_MAX_MODULES)
+			hi = PDATA_MAX_MODULES;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (addr < g_pdata_modules[mid].base)
+				hi = mid;
+			else if (addr >= g_pdata_modules[mid].end)
+				lo = mid + 1;
+			else {
+				*out = g_pdata_modules[mid];
+				found = 1;
+				break;
+			}
+		}
 
-	RtlCaptureContext(&ctx);
+		MemoryBarrier();
+		// only trust what we copied out if no writer got in between
+		if (seq == g_pdata_seq && flushes == g_pdata_flushes)
+			return found;
+	}
+
+	return -1;
+}
+
+// writers don't wait for each other either, a busy cache just isn't updated
+static int pdata_cache_trylock(void)
+{
+	LONG seq = g_pdata_seq;
 
-	for (frame = 0; frame < count; frame++) {
+	return !(seq & 1) && InterlockedCompareExchange(&g_pdata_seq, seq + 1, seq) == seq;
+}
+
+static void pdata_cache_unlock(void)
+{
+	MemoryBarrier();
+	InterlockedIncrement(&g_pdata_seq);
+}
+
+// flushes is g_pdata_flushes from before mod was resolved, a module that
+// may have been unloaded since isn't cached
+static void pdata_cache_insert(const pdata_module_t *mod, LONG flushes)
+{
+	unsigned int i, j, count;
+
+	if (!pdata_cache_trylock())
+		return;
+
+	if (flushes != g_pdata_flushes || g_pdata_unloading)
+		goto out;
+	if (g_pdata_cache_flushes != flushes) {
+		g_pdata_module_count = 0;
+		g_pdata_cache_flushes = flushes;
+	}
+
+	count = g_pdata_module_count;
+
+	// drop stale entries of unloaded modules that overlap the new one
+	for (i = 0, j = 0; i < count; i++) {
+		if (g_pdata_modules[i].base < mod->end && mod->base < g_pdata_modules[i].end)
+			continue;
+		g_pdata_modules[j++] = g_pdata_modules[i];
+	}
+	count = j;
+
+	if (count < PDATA_MAX_MODULES) {
+		for (i = count; i > 0 && g_pdata_modules[i - 1].base > mod->base; i--)
+			g_pdata_modules[i] = g_pdata_modules[i - 1];
+		g_pdata_modules[i] = *mod;
+		count++;
+	}
+
+	g_pdata_module_count = count;
+out:
+	pdata_cache_unlock();
+}
+
+// called by the LdrUnloadDll hook around the original function.  Unloading
+// one DLL can take its dependencies along, so rather than working out which
+// images went away the cache is dropped, and while the unload is under way
+// nothing is looked up in or added to it.  It fills up again on the next
+// stack walks
+void pdata_cache_unload_begin(void)
+{
+	InterlockedIncrement(&g_pdata_unloading);
+	InterlockedIncrement(&g_pdata_flushes);
+}
+
+void pdata_cache_unload_end(void)
+{
+	InterlockedIncrement(&g_pdata_flushes);
+	InterlockedDecrement(&g_pdata_unloading);
+}
+
+static int pdata_resolve_module(ULONG_PTR addr, pdata_module_t *mod)
+{
+	PIMAGE_DOS_HEADER doshdr;
+	PIMAGE_NT_HEADERS64 nthdr;
+	PIMAGE_DATA_DIRECTORY dir;
+	PVOID base = NULL;
+
+	if (RtlPcToFileHeader((PVOID)addr, &base) == NULL || base == NULL)
+		return 0;
 
-		backtrace[frame] = (PVOID)ctx.Rip;
-		runfunc = RtlLookupFunctionEntry(ctx.Rip, &imgbase, NULL);
-		memset(&nvctx, 0, sizeof(nvctx));
-		if (runfunc == NULL) {
-			ctx.Rip = (ULONG_PTR)(*(ULONG_PTR *)ctx.Rsp);
-			ctx.Rsp += 8;
+	doshdr = (PIMAGE_DOS_HEADER)base;
+	if (doshdr->e_magic != IMAGE_DOS_SIGNATURE)
+		return 0;
+	nthdr = (PIMAGE_NT_HEADERS64)((PUCHAR)base + doshdr->e_lfanew);
+	if (nthdr->Signature != IMAGE_NT_SIGNATURE || nthdr->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+		return 0;
+
+	mod->base = (ULONG_PTR)base;
+	mod->end = mod->base + nthdr->OptionalHeader.SizeOfImage;
+	mod->funcs = NULL;
+	mod->count = 0;
+
+	// an image without .pdata only contains leaf functions
+	if (nthdr->OptionalHeader.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_EXCEPTION) {
+		dir = &nthdr->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+		if (dir->VirtualAddress && dir->Size >= sizeof(RUNTIME_FUNCTION)) {
+			mod->funcs = (PRUNTIME_FUNCTION)(mod->base + dir->VirtualAddress);
+			mod->count = dir->Size / sizeof(RUNTIME_FUNCTION);
 		}
-		else {
-			RtlVirtualUnwind(UNW_FLAG_NHANDLER, imgbase, ctx.Rip, runfunc, &ctx, &handlerdata, &establisherframe, &nvctx);
+	}
+
+	return 1;
+}
+
+static PRUNTIME_FUNCTION pdata_lookup_function(ULONG_PTR addr, ULONG_PTR *imgbase)
+{
+	pdata_module_t mod;
+	DWORD rva;
+	DWORD lo, hi, mid;
+	LONG flushes = g_pdata_flushes;
+	int found;
+
+	found = pdata_cache_find(addr, &mod);
+	if (found != 1) {
+		if (!pdata_resolve_module(addr, &mod))
+			return RtlLookupFunctionEntry(addr, (PDWORD64)imgbase, NULL);
+		// with a writer busy, use the module uncached rather than wait
+		if (found == 0)
+			pdata_cache_insert(&mod, flushes);
+	}
+
+	*imgbase = mod.base;
+	rva = (DWORD)(addr - mod.base);
+
+	lo = 0;
+	hi = mod.count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rva < mod.funcs[mid].BeginAddress)
+			hi = mid;
+		else if (rva >= mod.funcs[mid].EndAddress)
+			lo = mid + 1;
+		else
+			return &mod.funcs[mid];
+	}
+
+	return NULL;
+}
+
+static unsigned int pdata_code_slots(const UNWIND_CODE *code)
+{
+	switch (code->UnwindOp) {
+	case UWOP_ALLOC_LARGE:
+		return code->OpInfo ? 3 : 2;
+	case UWOP_SAVE_NONVOL:
+	case UWOP_SAVE_XMM:
+	case UWOP_SAVE_XMM128:
+		return 2;
+	case UWOP_SAVE_NONVOL_FAR:
+	case UWOP_SAVE_XMM_FAR:
+	case UWOP_SAVE_XMM128_FAR:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+#define PDATA_STACK_OK(_addr, _bottom, _top) ((_addr) >= (_bottom) && (_addr) + sizeof(DWORD64) <= (_top))
+
+/* minimal RtlVirtualUnwind: no epilogue detection and no handler lookup.
+ * Every frame past the first one is a return address following a call, so
+ * it can't sit in an epilogue, and the first frame is inside our own DLL.
+ */
+static int pdata_virtual_unwind(ULONG_PTR imgbase, PRUNTIME_FUNCTION func, CONTEXT *ctx, ULONG_PTR bottom, ULONG_PTR top)
+{
+	// Rax..R15 are laid out in CONTEXT in unwind register number order
+	DWORD64 *regs = &ctx->Rax;
+	UNWIND_INFO *info;
+	UNWIND_CODE *codes;
+	ULONG_PTR frame_base;
+	ULONG_PTR slot;
+	DWORD prolog_offset;
+	unsigned int i, chain;
+	int in_prolog;
+
+	prolog_offset = (DWORD)(ctx->Rip - imgbase - func->BeginAddress);
+
+	for (chain = 0; chain < PDATA_MAX_CHAIN; chain++) {
+		info = (UNWIND_INFO *)(imgbase + func->UnwindData);
+		codes = info->UnwindCode;
+		// chained entries describe a prologue that has already completed
+		in_prolog = chain == 0 && prolog_offset < info->SizeOfProlog;
+
+		frame_base = ctx->Rsp;
+		if (info->FrameRegister) {
+			for (i = 0; i < info->CountOfCodes; i += pdata_code_slots(&codes[i])) {
+				if (codes[i].UnwindOp == UWOP_SET_FPREG) {
+					if (!in_prolog || codes[i].CodeOffset <= prolog_offset)
+						frame_base = regs[info->FrameRegister] - info->FrameOffset * 16;
+					break;
+				}
+			}
+		}
+		ctx->Rsp = frame_base;
+
+		for (i = 0; i < info->CountOfCodes; i += pdata_code_slots(&codes[i])) {
+			if (in_prolog && codes[i].CodeOffset > prolog_offset)
+				continue;
+
+			switch (codes[i].UnwindOp) {
+			case UWOP_PUSH_NONVOL:
+				if (!PDATA_STACK_OK(ctx->Rsp, bottom, top))
+					return 0;
+				regs[codes[i].OpInfo] = *(DWORD64 *)ctx->Rsp;
+				ctx->Rsp += 8;
+				break;
+			case UWOP_ALLOC_LARGE:
+				if (codes[i].OpInfo)
+					ctx->Rsp += codes[i + 1].FrameOffset | ((DWORD)codes[i + 2].FrameOffset << 16);
+				else
+					ctx->Rsp += codes[i + 1].FrameOffset * 8;
+				break;
+			case UWOP_ALLOC_SMALL:
+				ctx->Rsp += codes[i].OpInfo * 8 + 8;
+				break;
+			case UWOP_SAVE_NONVOL:
+			case UWOP_SAVE_NONVOL_FAR:
+				if (codes[i].UnwindOp == UWOP_SAVE_NONVOL)
+					slot = frame_base + codes[i + 1].FrameOffset * 8;
+				else
+					slot = frame_base + (codes[i + 1].FrameOffset | ((DWORD)codes[i + 2].FrameOffset << 16));
+				if (!PDATA_STACK_OK(slot, bottom, top))
+					return 0;
+				regs[codes[i].OpInfo] = *(DWORD64 *)slot;
+				break;
+			case UWOP_PUSH_MACHFRAME:
+				if (codes[i].OpInfo)
+					ctx->Rsp += 8;
+				if (!PDATA_STACK_OK(ctx->Rsp + 24, bottom, top))
+					return 0;
+				ctx->Rip = *(DWORD64 *)ctx->Rsp;
+				ctx->Rsp = *(DWORD64 *)(ctx->Rsp + 24);
+				return 1;
+			default:
+				// SET_FPREG was handled above, XMM saves don't matter to us
+				break;
+			}
 		}
-		if (!ctx.Rip)
+
+		if (!(info->Flags & UNW_FLAG_CHAININFO))
 			break;
+		func = (PRUNTIME_FUNCTION)&codes[(info->CountOfCodes + 1) & ~1];
 	}
 
-	return frame + 1;
+	if (!PDATA_STACK_OK(ctx->Rsp, bottom, top))
+		return 0;
+	ctx->Rip = *(DWORD64 *)ctx->Rsp;
+	ctx->Rsp += 8;
+	return 1;
+}
+
+unsigned int pdata_stackwalk(CONTEXT *ctx, PVOID *backtrace, unsigned int count)
+{
+	ULONG_PTR top = get_stack_top();
+	ULONG_PTR bottom = get_stack_bottom();
+	ULONG_PTR imgbase;
+	PRUNTIME_FUNCTION func;
+	unsigned int frame = 0;
+
+	while (frame < count && ctx->Rip) {
+		backtrace[frame++] = (PVOID)ctx->Rip;
+
+		func = pdata_lookup_function(ctx->Rip, &imgbase);
+		if (func == NULL) {
+			// leaf function, the return address is right at rsp
+			if (!PDATA_STACK_OK(ctx->Rsp, bottom, top))
+				break;
+			ctx->Rip = *(DWORD64 *)ctx->Rsp;
+			ctx->Rsp += 8;
+		}
+		else if (!pdata_virtual_unwind(imgbase, func, ctx, bottom, top)) {
+			break;
+		}
+	}
+
+	return frame;
+}
+
+static unsigned int our_stackwalk(ULONG_PTR retaddr, ULONG_PTR sp, PVOID *backtrace, unsigned int count)
+{
+	CONTEXT ctx;
+
+	RtlCaptureContext(&ctx);
+
+	return pdata_stackwalk(&ctx, backtrace, count);
 }
 
 int operate_on_backtrace(ULONG_PTR retaddr, ULONG_PTR sp, int(*func)(ULONG_PTR))
 {
-	int ret;
+	int ret = 0;
 	PVOID backtrace[HOOK_BACKTRACE_DEPTH];
 	lasterror_t lasterror;
 	WORD frames;
@@ -634,7 +1059,7 @@ int operate_on_backtrace(ULONG_PTR retaddr, ULONG_PTR sp, int(*func)(ULONG_PTR))
 			break;
 	}
 
-	if (((PUCHAR)backtrace[i])[0] == 0xeb && ((PUCHAR)backtrace[i])[1] == 0x08)
+	if (i < frames && ((PUCHAR)backtrace[i])[0] == 0xeb && ((PUCHAR)backtrace[i])[1] == 0x08)
 		i++;
 
 	for (; i < frames; i++) {
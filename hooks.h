@@ -1154,6 +1154,19 @@ extern HOOKDEF(NTSTATUS, WINAPI, LdrGetProcedureAddress,
     __out       PVOID *FunctionAddress
 );
 
+extern HOOKDEF(NTSTATUS, WINAPI, LdrGetProcedureAddressForCaller,
+    __in        HMODULE ModuleHandle,
+    __in_opt    PANSI_STRING FunctionName,
+    __in_opt    WORD Ordinal,
+    __out       PVOID *FunctionAddress,
+    __in        BOOL bValue,
+    __in        PVOID CallbackAddress
+);
+
+extern HOOKDEF(NTSTATUS, WINAPI, LdrUnloadDll,
+    __in        PVOID DllImageBase
+);
+
 extern HOOKDEF(BOOL, WINAPI, DeviceIoControl,
     __in         HANDLE hDevice,
     __in         DWORD dwIoControlCode,
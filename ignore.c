@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <stdio.h>
+#include <wctype.h>
 #include "ntapi.h"
 #include "ignore.h"
 #include "misc.h"
@@ -47,67 +48,229 @@ int is_protected_pid(DWORD pid)
 }
 
 //
-// Blacklist for Dumping Files
+// Ignore Lists
 //
 
-#define S(s, f) {L##s, sizeof(s)-1, f}
-
-#define FLAG_NONE           0
-#define FLAG_BEGINS_WITH    1
-
-static struct _ignored_file_t {
-    const wchar_t   *unicode;
-    unsigned int    length;
-    unsigned int    flags;
-} g_ignored_files[] = {
-    S("\\??\\PIPE\\lsarpc", FLAG_NONE),
-    S("\\??\\IDE#", FLAG_BEGINS_WITH),
-    S("\\??\\STORAGE#", FLAG_BEGINS_WITH),
-    S("\\??\\MountPointManager", FLAG_NONE),
-    S("\\??\\root#", FLAG_BEGINS_WITH),
-    S("\\Device\\", FLAG_BEGINS_WITH),
+// Every list is compiled into two case insensitive tries, one of the exact
+// and prefix rules as they're written and one of the suffix rules spelled
+// backwards.  A name is walked forward through the one and backward through
+// the other, so matching costs the same for the handful of built-in rules
+// as for the thousands the analyzer may hand us.
+
+#define RULE_EXACT      1
+#define RULE_PREFIX     2
+#define RULE_SUFFIX     4
+
+typedef struct _ignore_node_t {
+	// lowercased
+	wchar_t c;
+	unsigned short flags;
+	// node indices, 0 for none as the root is nobody's child or sibling
+	unsigned int child;
+	unsigned int sibling;
+} ignore_node_t;
+
+typedef struct _ignore_trie_t {
+	ignore_node_t *nodes;
+	unsigned int count;
+	unsigned int capacity;
+} ignore_trie_t;
+
+typedef struct _ignore_list_t {
+	ignore_trie_t forward;
+	ignore_trie_t backward;
+} ignore_list_t;
+
+static ignore_list_t g_ignore_lists[IGNORE_LIST_MAX];
+
+static const wchar_t *g_ignored_files[] = {
+	L"\\??\\PIPE\\lsarpc",
+	L"\\??\\IDE#*",
+	L"\\??\\STORAGE#*",
+	L"\\??\\MountPointManager",
+	L"\\??\\root#*",
+	L"\\Device\\*",
 };
 
-int is_ignored_file_unicode(const wchar_t *fname, unsigned int length)
+static const wchar_t *g_ignored_processpaths[] = {
+	L"C:\\WINDOWS\\system32\\dwwin.exe",
+	L"C:\\WINDOWS\\system32\\dumprep.exe",
+	L"C:\\WINDOWS\\system32\\drwtsn32.exe",
+	L"C:\\WINDOWS\\system32\\WerFault.exe",
+	L"C:\\WINDOWS\\syswow64\\WerFault.exe",
+};
+
+static __inline wchar_t fold(wchar_t c)
+{
+	if (c >= L'A' && c <= L'Z')
+		return c + (L'a' - L'A');
+	if (c < 0x80)
+		return c;
+	return (wchar_t)towlower(c);
+}
+
+static unsigned int find_child(const ignore_trie_t *t, unsigned int node, wchar_t c)
 {
-    struct _ignored_file_t *f = g_ignored_files;
 	unsigned int i;
-    for (i = 0; i < ARRAYSIZE(g_ignored_files); i++, f++) {
-        if(f->flags == FLAG_NONE && length == f->length &&
-                !wcsnicmp(fname, f->unicode, length)) {
-            return 1;
-        }
-        else if(f->flags == FLAG_BEGINS_WITH && length >= f->length &&
-                !wcsnicmp(fname, f->unicode, f->length)) {
-            return 1;
-        }
-    }
-    return 0;
+
+	for (i = t->nodes[node].child; i != 0; i = t->nodes[i].sibling) {
+		if (t->nodes[i].c == c)
+			return i;
+	}
+	return 0;
 }
 
-int is_ignored_file_objattr(const OBJECT_ATTRIBUTES *obj)
+// returns the node the rule ends at, 0 when out of memory
+static unsigned int trie_insert(ignore_trie_t *t, const wchar_t *s,
+	unsigned int len, int backward)
 {
-    return is_ignored_file_unicode(obj->ObjectName->Buffer,
-        obj->ObjectName->Length / sizeof(wchar_t));
+	ignore_node_t *nodes;
+	unsigned int node = 0, child, capacity, i;
+	wchar_t c;
+
+	for (i = 0; i < len; i++) {
+		// the extra node being the root
+		if (t->count + 2 > t->capacity) {
+			capacity = t->capacity ? t->capacity * 2 : 256;
+			nodes = (ignore_node_t *)realloc(t->nodes, capacity * sizeof(ignore_node_t));
+			if (nodes == NULL)
+				return 0;
+			t->nodes = nodes;
+			t->capacity = capacity;
+		}
+		if (t->count == 0) {
+			memset(&t->nodes[0], 0, sizeof(ignore_node_t));
+			t->count = 1;
+		}
+
+		c = fold(backward ? s[len - 1 - i] : s[i]);
+		child = find_child(t, node, c);
+		if (child == 0) {
+			child = t->count++;
+			t->nodes[child].c = c;
+			t->nodes[child].flags = 0;
+			t->nodes[child].child = 0;
+			t->nodes[child].sibling = t->nodes[node].child;
+			t->nodes[node].child = child;
+		}
+		node = child;
+	}
+	return node;
 }
 
-static wchar_t *g_ignored_processpaths[] = {
-    L"C:\\WINDOWS\\system32\\dwwin.exe",
-    L"C:\\WINDOWS\\system32\\dumprep.exe",
-    L"C:\\WINDOWS\\system32\\drwtsn32.exe",
-	L"C:\\WINDOWS\\system32\\WerFault.exe",
-	L"C:\\WINDOWS\\syswow64\\WerFault.exe"
-};
+int add_ignore_rule(unsigned int list, const wchar_t *rule, unsigned int length)
+{
+	ignore_list_t *l;
+	unsigned int flags = RULE_EXACT, node;
+	ignore_trie_t *t;
+
+	if (list >= IGNORE_LIST_MAX)
+		return 0;
+	l = &g_ignore_lists[list];
+
+	if (length != 0 && rule[length - 1] == L'*') {
+		flags = RULE_PREFIX;
+		length--;
+	}
+	else if (length != 0 && rule[0] == L'*') {
+		flags = RULE_SUFFIX;
+		rule++;
+		length--;
+	}
+	// nothing but a wildcard, or one at both ends
+	if (length == 0 || rule[0] == L'*' || rule[length - 1] == L'*')
+		return 0;
+
+	t = flags == RULE_SUFFIX ? &l->backward : &l->forward;
+	node = trie_insert(t, rule, length, flags == RULE_SUFFIX);
+	if (node == 0)
+		return 0;
+	t->nodes[node].flags |= flags;
+	return 1;
+}
+
+int add_ignore_ruleA(unsigned int list, const char *rule)
+{
+	wchar_t wrule[MAX_PATH];
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(wrule) - 1 && rule[i] != '\0'; i++)
+		wrule[i] = (wchar_t)(unsigned char)rule[i];
+	if (rule[i] != '\0')
+		return 0;
+	return add_ignore_rule(list, wrule, i);
+}
+
+int is_ignored(unsigned int list, const wchar_t *name, unsigned int length)
+{
+	const ignore_list_t *l;
+	const ignore_trie_t *t;
+	unsigned int node, i;
+
+	if (list >= IGNORE_LIST_MAX)
+		return 0;
+	l = &g_ignore_lists[list];
+
+	t = &l->forward;
+	if (t->count != 0) {
+		for (i = 0, node = 0; i < length; i++) {
+			if (t->nodes[node].flags & RULE_PREFIX)
+				return 1;
+			node = find_child(t, node, fold(name[i]));
+			if (node == 0)
+				break;
+		}
+		if (i == length && (t->nodes[node].flags & (RULE_EXACT | RULE_PREFIX)))
+			return 1;
+	}
+
+	t = &l->backward;
+	if (t->count != 0) {
+		for (i = length, node = 0; i != 0; i--) {
+			if (t->nodes[node].flags & RULE_SUFFIX)
+				return 1;
+			node = find_child(t, node, fold(name[i - 1]));
+			if (node == 0)
+				break;
+		}
+		if (i == 0 && (t->nodes[node].flags & RULE_SUFFIX))
+			return 1;
+	}
+	return 0;
+}
+
+void ignore_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(g_ignored_files); i++)
+		add_ignore_rule(IGNORE_LIST_FILE, g_ignored_files[i],
+			lstrlenW(g_ignored_files[i]));
+	for (i = 0; i < ARRAYSIZE(g_ignored_processpaths); i++)
+		add_ignore_rule(IGNORE_LIST_PROCESS, g_ignored_processpaths[i],
+			lstrlenW(g_ignored_processpaths[i]));
+}
+
+int is_ignored_file_unicode(const wchar_t *fname, unsigned int length)
+{
+	return is_ignored(IGNORE_LIST_FILE, fname, length);
+}
+
+int is_ignored_file_objattr(const OBJECT_ATTRIBUTES *obj)
+{
+	return is_ignored_file_unicode(obj->ObjectName->Buffer,
+		obj->ObjectName->Length / sizeof(wchar_t));
+}
 
 int is_ignored_process()
 {
-	int i;
-    for (i = 0; i < ARRAYSIZE(g_ignored_processpaths); i++) {
-        if(!wcsicmp(g_ignored_processpaths[i], our_process_path)) {
-            return 1;
-        }
-    }
-    return 0;
+	return is_ignored(IGNORE_LIST_PROCESS, our_process_path,
+		lstrlenW(our_process_path));
+}
+
+int is_ignored_key_unicode(const wchar_t *keypath, unsigned int length)
+{
+	return is_ignored(IGNORE_LIST_KEY, keypath, length);
 }
 
 //
@@ -23,6 +23,30 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 void add_protected_pid(DWORD pid);
 int is_protected_pid(DWORD pid);
 
+enum {
+	// absolute paths of files not to dump
+	IGNORE_LIST_FILE = 0,
+	// processes not to inject, by path
+	IGNORE_LIST_PROCESS,
+	// registry keys and values not to log, as in the FullName arguments
+	IGNORE_LIST_KEY,
+	IGNORE_LIST_MAX
+};
+
+// adds the built-in rules, the analyzer config adds its own through
+// add_ignore_ruleA() later on
+void ignore_init(void);
+
+// matching is case insensitive.  A rule ending in * ignores everything
+// starting with the rest of it, one starting with * everything ending in
+// it, anything else has to match the whole name.  Rules are only added
+// during initialization.  Returns 0 for an invalid rule or when out of
+// memory
+int add_ignore_rule(unsigned int list, const wchar_t *rule, unsigned int length);
+int add_ignore_ruleA(unsigned int list, const char *rule);
+
+int is_ignored(unsigned int list, const wchar_t *name, unsigned int length);
+
 int is_ignored_file_ascii(const char *fname, unsigned int length);
 int is_ignored_file_unicode(const wchar_t *fname, unsigned int length);
 int is_ignored_file_objattr(const OBJECT_ATTRIBUTES *obj);
@@ -32,4 +56,6 @@ void ignore_file_prepend_stuff(const OBJECT_ATTRIBUTES *obj,
 
 int is_ignored_process();
 
+int is_ignored_key_unicode(const wchar_t *keypath, unsigned int length);
+
 int is_ignored_retaddr(ULONG_PTR addr);
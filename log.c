@@ -27,6 +27,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bson.h"
 #include "pipe.h"
 #include "config.h"
+#include "scratch.h"
+#include "ignore.h"
 
 // the size of the logging buffer
 #define BUFFERSIZE 16 * 1024 * 1024
@@ -46,7 +48,12 @@ static volatile int g_idx;
 static bson g_bson[1];
 static char g_istr[4];
 
-static char logtbl_explained[256] = {0};
+static char logtbl_explained[LOG_MAX_INDEX] = {0};
+
+// how many times each API has been logged, used for the rates reported
+// on the control pipe
+static volatile unsigned int g_log_counts[LOG_MAX_INDEX];
+static const char *g_log_names[LOG_MAX_INDEX];
 
 #define LOG_ID_PROCESS 0
 #define LOG_ID_THREAD 1
@@ -261,6 +268,13 @@ static void log_wstring(const wchar_t *str, int length)
     free(utf8s);
 }
 
+// a full key path, returns 1 if the event is to be dropped for it
+static int log_keypath(const wchar_t *keypath)
+{
+	log_wstring(keypath, -1);
+	return keypath != NULL && is_ignored_key_unicode(keypath, lstrlenW(keypath));
+}
+
 static void log_argv(int argc, const char ** argv) {
 	int i;
 
@@ -308,6 +322,85 @@ static void log_large_buffer(const char *buf, size_t length) {
 
 static lastlog_t lastlog;
 
+// unique call stacks seen so far when full-stacks is enabled, each one is
+// sent once as a "stack" record and then referred to by its id
+#define STACK_TABLE_BUCKETS 4096
+#define STACK_TABLE_DEFAULT_MAX (4 * 1024 * 1024)
+
+typedef struct _stack_entry_t {
+	struct _stack_entry_t *next;
+	unsigned int hash;
+	unsigned int id;
+	unsigned int depth;
+	ULONG_PTR frames[0];
+} stack_entry_t;
+
+static stack_entry_t *g_stack_table[STACK_TABLE_BUCKETS];
+static unsigned int g_stack_table_bytes;
+static unsigned int g_stack_count;
+
+static unsigned int hash_stack(const ULONG_PTR *frames, unsigned int depth)
+{
+	const unsigned char *p = (const unsigned char *)frames;
+	unsigned int hash = 2166136261;
+	unsigned int i;
+
+	for (i = 0; i < depth * sizeof(ULONG_PTR); i++) {
+		hash ^= p[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+// must be called with g_mutex held, returns 0 once the table is full
+static unsigned int log_stack(const ULONG_PTR *frames, unsigned int depth)
+{
+	unsigned int hash = hash_stack(frames, depth);
+	unsigned int limit = g_config.stack_table_max ? g_config.stack_table_max : STACK_TABLE_DEFAULT_MAX;
+	unsigned int size = sizeof(stack_entry_t) + depth * sizeof(ULONG_PTR);
+	stack_entry_t **bucket = &g_stack_table[hash % STACK_TABLE_BUCKETS];
+	stack_entry_t *entry;
+	char idx[4];
+	unsigned int i;
+	bson b[1];
+
+	for (entry = *bucket; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && entry->depth == depth &&
+			!memcmp(entry->frames, frames, depth * sizeof(ULONG_PTR)))
+			return entry->id;
+	}
+
+	if (g_stack_table_bytes + size > limit)
+		return 0;
+
+	entry = malloc(size);
+	if (entry == NULL)
+		return 0;
+
+	entry->hash = hash;
+	entry->id = ++g_stack_count;
+	entry->depth = depth;
+	memcpy(entry->frames, frames, depth * sizeof(ULONG_PTR));
+	entry->next = *bucket;
+	*bucket = entry;
+	g_stack_table_bytes += size;
+
+	bson_init(b);
+	bson_append_string(b, "type", "stack");
+	bson_append_int(b, "S", entry->id);
+	bson_append_start_array(b, "frames");
+	for (i = 0; i < depth; i++) {
+		num_to_string(idx, sizeof(idx), i);
+		bson_append_ptr(b, idx, frames[i]);
+	}
+	bson_append_finish_array(b);
+	bson_finish(b);
+	log_raw_direct(bson_data(b), bson_size(b));
+	bson_destroy(b);
+
+	return entry->id;
+}
+
 void loq(int index, const char *category, const char *name,
     int is_success, ULONG_PTR return_value, const char *fmt, ...)
 {
@@ -319,6 +412,9 @@ void loq(int index, const char *category, const char *name,
 	unsigned int compare_offset = 0;
 	lasterror_t lasterror;
 	hook_info_t *hookinfo;
+	unsigned int stack_id = 0;
+	// set for events about ignored registry keys
+	int ignored = 0;
 
 	if (index >= LOG_ID_ANOMALY && g_config.suspend_logging)
 		return;
@@ -327,11 +423,14 @@ void loq(int index, const char *category, const char *name,
 
 	EnterCriticalSection(&g_mutex);
 
+	g_log_counts[index]++;
+
 	if(logtbl_explained[index] == 0) {
         const char * pname;
         bson b[1];
 
 		logtbl_explained[index] = 1;
+		g_log_names[index] = name;
 
 		va_start(args, fmt);
 
@@ -464,6 +563,8 @@ void loq(int index, const char *category, const char *name,
     bson_init( g_bson );
     bson_append_int( g_bson, "I", index );
 	hookinfo = hook_info();
+	if (g_config.full_stacks && hookinfo->stack_depth)
+		stack_id = log_stack(hookinfo->stack, hookinfo->stack_depth);
 	bson_append_ptr(g_bson, "C", hookinfo->return_address);
 	// return location of malware callsite
 	bson_append_ptr(g_bson, "R", hookinfo->main_caller_retaddr);
@@ -478,6 +579,10 @@ void loq(int index, const char *category, const char *name,
 	// the repeated value is encoded immediately before the stream we want to compare
 	repeat_offset = compare_offset - 4;
 
+	// id of the "stack" record describing the full call stack, 0 if unknown
+	if (g_config.full_stacks)
+		bson_append_int(g_bson, "S", stack_id);
+
 	bson_append_start_array(g_bson, "args");
     bson_append_int( g_bson, "0", is_success );
     bson_append_ptr( g_bson, "1", return_value );
@@ -528,16 +633,17 @@ void loq(int index, const char *category, const char *name,
         }
 		else if (key == 'F') {
 			const wchar_t *s = va_arg(args, const wchar_t *);
-			wchar_t *absolutepath = malloc(32768 * sizeof(wchar_t));
+			scratch_mark_t mark = scratch_mark();
+			wchar_t *absolutepath = scratch_alloc(32768 * sizeof(wchar_t));
 			if (s == NULL) s = L"";
 			if (absolutepath) {
 				ensure_absolute_unicode_path(absolutepath, s);
 				log_wstring(absolutepath, -1);
-				free(absolutepath);
 			}
 			else {
 				log_wstring(L"", -1);
 			}
+			scratch_release(mark);
 		}
 		else if (key == 'U') {
             int len = va_arg(args, int);
@@ -584,55 +690,49 @@ void loq(int index, const char *category, const char *name,
 		else if (key == 'e') {
 			HKEY reg = va_arg(args, HKEY);
 			const char *s = va_arg(args, const char *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf = get_keybuf();
 
-			log_wstring(get_full_key_pathA(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ignored |= log_keypath(get_full_key_pathA(reg, s, keybuf, KEYBUF_SIZE));
+			release_keybuf(keybuf);
 		}
 		else if (key == 'E') {
 			HKEY reg = va_arg(args, HKEY);
 			const wchar_t *s = va_arg(args, const wchar_t *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf = get_keybuf();
 
-			log_wstring(get_full_key_pathW(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ignored |= log_keypath(get_full_key_pathW(reg, s, keybuf, KEYBUF_SIZE));
+			release_keybuf(keybuf);
 		}
 		else if (key == 'K') {
 			OBJECT_ATTRIBUTES *obj = va_arg(args, OBJECT_ATTRIBUTES *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf = get_keybuf();
 
-			log_wstring(get_key_path(obj, keybuf, allocsize), -1);
-			free(keybuf);
+			ignored |= log_keypath(get_key_path(obj, keybuf, KEYBUF_SIZE));
+			release_keybuf(keybuf);
 		}
 		else if (key == 'k') {
 			HKEY reg = va_arg(args, HKEY);
 			const PUNICODE_STRING s = va_arg(args, const PUNICODE_STRING);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf = get_keybuf();
 
-			log_wstring(get_full_keyvalue_pathUS(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ignored |= log_keypath(get_full_keyvalue_pathUS(reg, s, keybuf, KEYBUF_SIZE));
+			release_keybuf(keybuf);
 		}
 		else if (key == 'v') {
 			HKEY reg = va_arg(args, HKEY);
 			const char *s = va_arg(args, const char *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf = get_keybuf();
 
-			log_wstring(get_full_keyvalue_pathA(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ignored |= log_keypath(get_full_keyvalue_pathA(reg, s, keybuf, KEYBUF_SIZE));
+			release_keybuf(keybuf);
 		}
 		else if (key == 'V') {
 			HKEY reg = va_arg(args, HKEY);
 			const wchar_t *s = va_arg(args, const wchar_t *);
-			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf = get_keybuf();
 
-			log_wstring(get_full_keyvalue_pathW(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ignored |= log_keypath(get_full_keyvalue_pathW(reg, s, keybuf, KEYBUF_SIZE));
+			release_keybuf(keybuf);
 		}
 		else if (key == 'o') {
             UNICODE_STRING *str = va_arg(args, UNICODE_STRING *);
@@ -650,17 +750,18 @@ void loq(int index, const char *category, const char *name,
             }
 			else {
 				wchar_t path[MAX_PATH_PLUS_TOLERANCE];
-				wchar_t *absolutepath = malloc(32768 * sizeof(wchar_t));
+				scratch_mark_t mark = scratch_mark();
+				wchar_t *absolutepath = scratch_alloc(32768 * sizeof(wchar_t));
 				if (absolutepath) {
 					path_from_object_attributes(obj, path, MAX_PATH_PLUS_TOLERANCE);
 
 					ensure_absolute_unicode_path(absolutepath, path);
 					log_wstring(absolutepath, -1);
-					free(absolutepath);
 				}
 				else {
 					log_wstring(L"", -1);
 				}
+				scratch_release(mark);
             }
         }
         else if(key == 'a') {
@@ -735,6 +836,9 @@ void loq(int index, const char *category, const char *name,
     bson_append_finish_array( g_bson );
     bson_finish( g_bson );
 
+	if (ignored)
+		goto out;
+
 	if (lastlog.buf) {
 		unsigned int our_len = bson_size(g_bson) - compare_offset;
 		if (lastlog.compare_len == our_len && !memcmp(lastlog.compare_ptr, bson_data(g_bson) + compare_offset, our_len)) {
@@ -756,6 +860,7 @@ void loq(int index, const char *category, const char *name,
 		lastlog.repeated_ptr = (int *)(lastlog.buf + repeat_offset);
 	}
 
+out:
     bson_destroy( g_bson );
     LeaveCriticalSection(&g_mutex);
 
@@ -764,6 +869,32 @@ void loq(int index, const char *category, const char *name,
 	set_lasterrors(&lasterror);
 }
 
+unsigned int log_event_count(int index)
+{
+	if (index < 0 || index >= LOG_MAX_INDEX)
+		return 0;
+	return g_log_counts[index];
+}
+
+const char *log_event_name(int index)
+{
+	if (index < 0 || index >= LOG_MAX_INDEX)
+		return NULL;
+	return g_log_names[index];
+}
+
+// returns the _LOQ index of the given API, or -1 if it hasn't logged yet
+int log_index_from_name(const char *funcname)
+{
+	int i;
+
+	for (i = LOG_ID_ANOMALY_EXTRA + 1; i < LOG_MAX_INDEX; i++) {
+		if (g_log_names[i] && !strcmp(g_log_names[i], funcname))
+			return i;
+	}
+	return -1;
+}
+
 void announce_netlog()
 {
     char protoname[32];
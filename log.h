@@ -81,6 +81,11 @@ void debug_message(const char *msg);
 #define DEBUG_SOCKET 0xfffffffe
 
 int log_resolve_index(const char *funcname, int index);
+unsigned int log_event_count(int index);
+const char *log_event_name(int index);
+int log_index_from_name(const char *funcname);
+
+#define LOG_MAX_INDEX 256
 extern const char *logtbl[][2];
 extern int g_log_index;
 
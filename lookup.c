@@ -24,80 +24,310 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "lookup.h"
 #include "pipe.h"
 
-#define ENTER() EnterCriticalSection(&d->cs)
-#define LEAVE() LeaveCriticalSection(&d->cs)
+#define ENTER(s) EnterCriticalSection(&(s)->cs)
+#define LEAVE(s) LeaveCriticalSection(&(s)->cs)
 
-typedef struct _entry_t {
-    struct _entry_t *next;
-    unsigned int id;
-    unsigned int size;
-    unsigned char data[0];
-} entry_t;
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+
+#define LOOKUP_MIN_CAPACITY 16
+
+static ULONG_PTR lookup_hash(ULONG_PTR id)
+{
+	// handles are multiples of four
+#ifdef _WIN64
+	id = (id >> 2) * 0x9e3779b97f4a7c15ULL;
+	return id ^ (id >> 32);
+#else
+	id = (id >> 2) * 0x9e3779b9;
+	return id ^ (id >> 16);
+#endif
+}
+
+static lookup_stripe_t *lookup_stripe(lookup_t *d, ULONG_PTR hash)
+{
+	return &d->stripes[hash & (LOOKUP_STRIPES - 1)];
+}
+
+static unsigned int home_slot(lookup_stripe_t *s, ULONG_PTR hash)
+{
+	return (unsigned int)(hash / LOOKUP_STRIPES) & (s->capacity - 1);
+}
+
+// returns the slot holding id, or the empty slot it should be stored in
+static lookup_slot_t *find_slot(lookup_stripe_t *s, ULONG_PTR id, ULONG_PTR hash)
+{
+	unsigned int mask = s->capacity - 1;
+	unsigned int idx = home_slot(s, hash);
+
+	while (s->slots[idx].state == SLOT_USED && s->slots[idx].id != id)
+		idx = (idx + 1) & mask;
+	return &s->slots[idx];
+}
+
+// keeps at least half of the slots empty, so that probing terminates quickly
+static int grow_stripe(lookup_stripe_t *s)
+{
+	lookup_slot_t *old = s->slots, *slot;
+	unsigned int oldcap = s->capacity, newcap, i;
+
+	if (s->count + 1 <= s->capacity / 2)
+		return 1;
+
+	newcap = oldcap ? oldcap * 2 : LOOKUP_MIN_CAPACITY;
+	s->slots = (lookup_slot_t *)calloc(newcap, sizeof(lookup_slot_t));
+	if (s->slots == NULL) {
+		s->slots = old;
+		return 0;
+	}
+	s->capacity = newcap;
+
+	for (i = 0; i < oldcap; i++) {
+		if (old[i].state != SLOT_USED)
+			continue;
+		slot = find_slot(s, old[i].id, lookup_hash(old[i].id));
+		*slot = old[i];
+	}
+	free(old);
+	return 1;
+}
+
+// empties the slot and moves later entries of the same probe sequence back
+// into the gap, so that lookups never need to skip deleted slots
+static void release_slot(lookup_stripe_t *s, lookup_slot_t *slot)
+{
+	unsigned int mask = s->capacity - 1;
+	unsigned int gap = (unsigned int)(slot - s->slots), idx = gap, home;
+
+	if (slot->size != 0)
+		free((void *)slot->value);
+	s->count--;
+
+	while (1) {
+		idx = (idx + 1) & mask;
+		if (s->slots[idx].state != SLOT_USED)
+			break;
+		home = home_slot(s, lookup_hash(s->slots[idx].id));
+		// the entry can only move back if its home isn't within (gap, idx]
+		if (((idx - home) & mask) >= ((idx - gap) & mask)) {
+			s->slots[gap] = s->slots[idx];
+			gap = idx;
+		}
+	}
+	memset(&s->slots[gap], 0, sizeof(lookup_slot_t));
+}
+
+// returns the slot for id with any previous value released, or NULL
+static lookup_slot_t *insert_slot(lookup_stripe_t *s, ULONG_PTR id, ULONG_PTR hash)
+{
+	lookup_slot_t *slot;
+
+	if (!grow_stripe(s))
+		return NULL;
+
+	slot = find_slot(s, id, hash);
+	if (slot->state == SLOT_USED) {
+		if (slot->size != 0)
+			free((void *)slot->value);
+	}
+	else
+		s->count++;
+
+	slot->id = id;
+	slot->state = SLOT_USED;
+	slot->value = 0;
+	slot->size = 0;
+	return slot;
+}
 
 void lookup_init(lookup_t *d)
 {
-    d->root = NULL;
-    InitializeCriticalSection(&d->cs);
+	unsigned int i;
+
+	memset(d, 0, sizeof(*d));
+	for (i = 0; i < LOOKUP_STRIPES; i++)
+		InitializeCriticalSection(&d->stripes[i].cs);
 }
 
 void lookup_free(lookup_t *d)
 {
-    // TODO
-}
-
-void *lookup_add(lookup_t *d, unsigned int id, unsigned int size)
-{
-    entry_t *t = (entry_t *) malloc(sizeof(entry_t) + size);
-    ENTER();
-	memset(t, 0, sizeof(*t));
-	t->next = d->root;
-	t->id = id;
-	t->size = size;
-    d->root = t;
-    LEAVE();
-    return t->data;
-}
-
-void *lookup_get(lookup_t *d, unsigned int id, unsigned int *size)
-{
-	entry_t *p;
-    ENTER();
-    for (p = d->root; p != NULL; p = p->next) {
-        if(p->id == id) {
-			void *data;
-            if(size != NULL) {
-                *size = p->size;
-            }
-            data = p->data;
-            LEAVE();
-            return data;
-        }
-    }
-    LEAVE();
-    return NULL;
-}
-
-void lookup_del(lookup_t *d, unsigned int id)
-{
-	entry_t *p;
-	entry_t *last;
-
-    ENTER();
-    p = d->root;
-    // edge case; we want to delete the first entry
-    if(p != NULL && p->id == id) {
-        entry_t *t = p->next;
-        free(d->root);
-        d->root = t;
-        LEAVE();
-        return;
-    }
-    for (last = NULL; p != NULL; last = p, p = p->next) {
-        if(p->id == id) {
-            last->next = p->next;
-            free(p);
-            break;
-        }
-    }
-    LEAVE();
+	unsigned int i, j;
+
+	for (i = 0; i < LOOKUP_STRIPES; i++) {
+		lookup_stripe_t *s = &d->stripes[i];
+		for (j = 0; j < s->capacity; j++) {
+			if (s->slots[j].state == SLOT_USED && s->slots[j].size != 0)
+				free((void *)s->slots[j].value);
+		}
+		free(s->slots);
+		DeleteCriticalSection(&s->cs);
+	}
+	memset(d, 0, sizeof(*d));
+}
+
+// returns size bytes of zeroed data owned by the table, replacing any
+// previous value of id.  the data stays valid until id is deleted or replaced
+void *lookup_add(lookup_t *d, ULONG_PTR id, unsigned int size)
+{
+	ULONG_PTR hash = lookup_hash(id);
+	lookup_stripe_t *s = lookup_stripe(d, hash);
+	lookup_slot_t *slot;
+	void *data;
+
+	// a size of 0 marks inline values
+	data = calloc(1, size ? size : 1);
+	if (data == NULL)
+		return NULL;
+
+	ENTER(s);
+	slot = insert_slot(s, id, hash);
+	if (slot == NULL) {
+		LEAVE(s);
+		free(data);
+		return NULL;
+	}
+	slot->value = (ULONG_PTR)data;
+	slot->size = size ? size : 1;
+	LEAVE(s);
+	return data;
+}
+
+// stores a copy of headsize bytes of head followed by tailsize bytes of tail
+// as the data of id, replacing any previous value.  unlike with lookup_add()
+// the data is complete before other threads can see it.  returns 0 if out of
+// memory
+int lookup_put(lookup_t *d, ULONG_PTR id, const void *head, unsigned int headsize,
+	const void *tail, unsigned int tailsize)
+{
+	ULONG_PTR hash = lookup_hash(id);
+	lookup_stripe_t *s = lookup_stripe(d, hash);
+	unsigned int size = headsize + tailsize;
+	lookup_slot_t *slot;
+	char *data;
+
+	// a size of 0 marks inline values
+	data = (char *)malloc(size ? size : 1);
+	if (data == NULL)
+		return 0;
+	if (headsize != 0)
+		memcpy(data, head, headsize);
+	if (tailsize != 0)
+		memcpy(data + headsize, tail, tailsize);
+
+	ENTER(s);
+	slot = insert_slot(s, id, hash);
+	if (slot != NULL) {
+		slot->value = (ULONG_PTR)data;
+		slot->size = size ? size : 1;
+	}
+	LEAVE(s);
+
+	if (slot == NULL)
+		free(data);
+	return slot != NULL;
+}
+
+void *lookup_get(lookup_t *d, ULONG_PTR id, unsigned int *size)
+{
+	ULONG_PTR hash = lookup_hash(id);
+	lookup_stripe_t *s = lookup_stripe(d, hash);
+	lookup_slot_t *slot;
+	void *data = NULL;
+
+	ENTER(s);
+	if (s->count != 0) {
+		slot = find_slot(s, id, hash);
+		if (slot->state == SLOT_USED && slot->size != 0) {
+			data = (void *)slot->value;
+			if (size != NULL)
+				*size = slot->size;
+		}
+	}
+	LEAVE(s);
+	return data;
+}
+
+// copies up to size bytes of the data of id into buf while holding the lock,
+// so that the copy can't race with a concurrent lookup_del().  returns the
+// full size of the data, or 0 if there is none
+unsigned int lookup_copy(lookup_t *d, ULONG_PTR id, void *buf, unsigned int size)
+{
+	return lookup_copy_split(d, id, buf, size, NULL, 0);
+}
+
+// like lookup_copy(), but the data past the first headsize bytes goes to
+// tail, so that a variable sized part can be copied straight to where the
+// caller wants it
+unsigned int lookup_copy_split(lookup_t *d, ULONG_PTR id, void *head,
+	unsigned int headsize, void *tail, unsigned int tailsize)
+{
+	ULONG_PTR hash = lookup_hash(id);
+	lookup_stripe_t *s = lookup_stripe(d, hash);
+	lookup_slot_t *slot;
+	unsigned int ret = 0;
+
+	ENTER(s);
+	if (s->count != 0) {
+		slot = find_slot(s, id, hash);
+		if (slot->state == SLOT_USED && slot->size != 0) {
+			ret = slot->size;
+			if (headsize != 0)
+				memcpy(head, (void *)slot->value, headsize < ret ? headsize : ret);
+			if (tailsize != 0 && ret > headsize)
+				memcpy(tail, (char *)slot->value + headsize,
+					tailsize < ret - headsize ? tailsize : ret - headsize);
+		}
+	}
+	LEAVE(s);
+	return ret;
+}
+
+// stores a pointer sized value for id, returns 0 if out of memory
+int lookup_set(lookup_t *d, ULONG_PTR id, ULONG_PTR value)
+{
+	ULONG_PTR hash = lookup_hash(id);
+	lookup_stripe_t *s = lookup_stripe(d, hash);
+	lookup_slot_t *slot;
+
+	ENTER(s);
+	slot = insert_slot(s, id, hash);
+	if (slot != NULL)
+		slot->value = value;
+	LEAVE(s);
+	return slot != NULL;
+}
+
+// returns 1 and the value stored by lookup_set(), or 0 if there is none
+int lookup_get_value(lookup_t *d, ULONG_PTR id, ULONG_PTR *value)
+{
+	ULONG_PTR hash = lookup_hash(id);
+	lookup_stripe_t *s = lookup_stripe(d, hash);
+	lookup_slot_t *slot;
+	int ret = 0;
+
+	ENTER(s);
+	if (s->count != 0) {
+		slot = find_slot(s, id, hash);
+		if (slot->state == SLOT_USED && slot->size == 0) {
+			*value = slot->value;
+			ret = 1;
+		}
+	}
+	LEAVE(s);
+	return ret;
+}
+
+void lookup_del(lookup_t *d, ULONG_PTR id)
+{
+	ULONG_PTR hash = lookup_hash(id);
+	lookup_stripe_t *s = lookup_stripe(d, hash);
+	lookup_slot_t *slot;
+
+	ENTER(s);
+	if (s->count != 0) {
+		slot = find_slot(s, id, hash);
+		if (slot->state == SLOT_USED)
+			release_slot(s, slot);
+	}
+	LEAVE(s);
 }
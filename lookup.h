@@ -18,12 +18,43 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <windows.h>
 
+// Open addressing hash table keyed by pointer sized ids (handles mostly).
+// The table is split into stripes with a lock each, so that threads working
+// on different handles rarely wait for each other.  Values are either a
+// block of data owned by the table (lookup_put/lookup_add/lookup_get), or a
+// pointer sized value stored inline (lookup_set/lookup_get_value).
+
+#define LOOKUP_STRIPES 16
+
+typedef struct _lookup_slot_t {
+	ULONG_PTR id;
+	// inline value, or the data allocated by lookup_add()
+	ULONG_PTR value;
+	unsigned int size;
+	unsigned int state;
+} lookup_slot_t;
+
+typedef struct _lookup_stripe_t {
+	CRITICAL_SECTION cs;
+	lookup_slot_t *slots;
+	// always a power of two
+	unsigned int capacity;
+	unsigned int count;
+} lookup_stripe_t;
+
 typedef struct _lookup_internal_t {
-    CRITICAL_SECTION cs;
-    void *root;
+	lookup_stripe_t stripes[LOOKUP_STRIPES];
 } lookup_t;
 
 void lookup_init(lookup_t *d);
-void *lookup_add(lookup_t *d, unsigned int id, unsigned int size);
-void *lookup_get(lookup_t *d, unsigned int id, unsigned int *size);
-void lookup_del(lookup_t *d, unsigned int id);
+void lookup_free(lookup_t *d);
+void *lookup_add(lookup_t *d, ULONG_PTR id, unsigned int size);
+int lookup_put(lookup_t *d, ULONG_PTR id, const void *head, unsigned int headsize,
+	const void *tail, unsigned int tailsize);
+void *lookup_get(lookup_t *d, ULONG_PTR id, unsigned int *size);
+unsigned int lookup_copy(lookup_t *d, ULONG_PTR id, void *buf, unsigned int size);
+unsigned int lookup_copy_split(lookup_t *d, ULONG_PTR id, void *head,
+	unsigned int headsize, void *tail, unsigned int tailsize);
+int lookup_set(lookup_t *d, ULONG_PTR id, ULONG_PTR value);
+int lookup_get_value(lookup_t *d, ULONG_PTR id, ULONG_PTR *value);
+void lookup_del(lookup_t *d, ULONG_PTR id);
@@ -26,6 +26,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "log.h"
 #include "pipe.h"
 #include "config.h"
+#include "handles.h"
+#include "lookup.h"
+#include "pathcache.h"
+#include "scratch.h"
+#include "prefixmap.h"
 
 static _NtQueryInformationProcess pNtQueryInformationProcess;
 static _NtQueryInformationThread pNtQueryInformationThread;
@@ -125,21 +130,13 @@ ULONG_PTR parent_process_id() // By Napalm @ NetCore2K (rohitab.com)
 	return 0;
 }
 
-DWORD pid_from_process_handle(HANDLE process_handle)
+static DWORD query_process_id(HANDLE process_handle)
 {
 	PROCESS_BASIC_INFORMATION pbi;
 	ULONG ulSize;
 	HANDLE dup_handle = process_handle;
 	DWORD PID = 0;
 	BOOL duped;
-	lasterror_t lasterror;
-
-	get_lasterrors(&lasterror);
-
-	if (process_handle == GetCurrentProcess()) {
-		PID = GetCurrentProcessId();
-		goto out;
-	}
 
 	memset(&pbi, 0, sizeof(pbi));
 	
@@ -151,23 +148,80 @@ DWORD pid_from_process_handle(HANDLE process_handle)
 	if (duped)
 		CloseHandle(dup_handle);
 
+	// forgotten again by the NtClose hook
+	if (PID)
+		handle_track(process_handle, HANDLE_TYPE_PROCESS, PID, NULL, 0);
+
+	return PID;
+}
+
+DWORD pid_from_process_handle(HANDLE process_handle)
+{
+	DWORD PID = 0;
+	lasterror_t lasterror;
+
+	get_lasterrors(&lasterror);
+
+	if (process_handle == GetCurrentProcess()) {
+		PID = GetCurrentProcessId();
+		goto out;
+	}
+
+	// remembered from the hook that opened it, or from an earlier query
+	if (handle_client_id(process_handle, HANDLE_TYPE_PROCESS, &PID, NULL))
+		goto out;
+
+	PID = query_process_id(process_handle);
+
 out:
 	set_lasterrors(&lasterror);
 
 	return PID;
 }
 
-static BOOL cid_from_thread_handle(HANDLE thread_handle, PCLIENT_ID cid)
+// for decisions that mustn't be fooled by a handle whose close we missed
+// (a close while our hooks were off, or a handle value reused through a
+// path we don't hook): always asks the kernel and refreshes the registry
+DWORD pid_from_process_handle_verified(HANDLE process_handle)
+{
+	DWORD PID;
+	lasterror_t lasterror;
+
+	if (process_handle == GetCurrentProcess())
+		return GetCurrentProcessId();
+
+	get_lasterrors(&lasterror);
+	PID = query_process_id(process_handle);
+	set_lasterrors(&lasterror);
+
+	return PID;
+}
+
+static BOOL cid_from_thread_handle(HANDLE thread_handle, PCLIENT_ID cid, BOOL verified)
 {
 	THREAD_BASIC_INFORMATION tbi;
 	ULONG ulSize;
 	HANDLE dup_handle = thread_handle;
+	DWORD pid, tid;
 	BOOL duped;
 	BOOL ret = FALSE;
 	lasterror_t lasterror;
 
+	if (thread_handle == GetCurrentThread()) {
+		cid->UniqueProcess = (HANDLE)(ULONG_PTR)GetCurrentProcessId();
+		cid->UniqueThread = (HANDLE)(ULONG_PTR)GetCurrentThreadId();
+		return TRUE;
+	}
+
 	get_lasterrors(&lasterror);
 
+	if (!verified && handle_client_id(thread_handle, HANDLE_TYPE_THREAD, &pid, &tid) && tid != 0) {
+		cid->UniqueProcess = (HANDLE)(ULONG_PTR)pid;
+		cid->UniqueThread = (HANDLE)(ULONG_PTR)tid;
+		ret = TRUE;
+		goto out;
+	}
+
 	memset(&tbi, 0, sizeof(tbi));
 
 	duped = DuplicateHandle(GetCurrentProcess(), thread_handle, GetCurrentProcess(), &dup_handle, THREAD_QUERY_INFORMATION, FALSE, 0);
@@ -180,6 +234,11 @@ static BOOL cid_from_thread_handle(HANDLE thread_handle, PCLIENT_ID cid)
 	if (duped)
 		CloseHandle(dup_handle);
 
+	if (ret)
+		handle_track_thread(thread_handle, (DWORD)(ULONG_PTR)cid->UniqueProcess,
+			(DWORD)(ULONG_PTR)cid->UniqueThread);
+
+out:
 	set_lasterrors(&lasterror);
 
 	return ret;
@@ -192,7 +251,7 @@ DWORD pid_from_thread_handle(HANDLE thread_handle)
 
 	memset(&cid, 0, sizeof(cid));
 
-	ret = cid_from_thread_handle(thread_handle, &cid);
+	ret = cid_from_thread_handle(thread_handle, &cid, FALSE);
 	return (DWORD)cid.UniqueProcess;
 }
 
@@ -203,7 +262,30 @@ DWORD tid_from_thread_handle(HANDLE thread_handle)
 
 	memset(&cid, 0, sizeof(cid));
 
-	ret = cid_from_thread_handle(thread_handle, &cid);
+	ret = cid_from_thread_handle(thread_handle, &cid, FALSE);
+	return (DWORD)cid.UniqueThread;
+}
+
+// thread counterparts of pid_from_process_handle_verified
+DWORD pid_from_thread_handle_verified(HANDLE thread_handle)
+{
+	CLIENT_ID cid;
+	BOOL ret;
+
+	memset(&cid, 0, sizeof(cid));
+
+	ret = cid_from_thread_handle(thread_handle, &cid, TRUE);
+	return (DWORD)cid.UniqueProcess;
+}
+
+DWORD tid_from_thread_handle_verified(HANDLE thread_handle)
+{
+	CLIENT_ID cid;
+	BOOL ret;
+
+	memset(&cid, 0, sizeof(cid));
+
+	ret = cid_from_thread_handle(thread_handle, &cid, TRUE);
 	return (DWORD)cid.UniqueThread;
 }
 
@@ -354,18 +436,17 @@ uint32_t path_from_handle(HANDLE handle,
 {
 	POBJECT_NAME_INFORMATION resolvedName;
 	ULONG returnLength;
-	NTSTATUS status;
 	uint32_t length = 0;
+	scratch_mark_t mark;
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
 
-	resolvedName = (POBJECT_NAME_INFORMATION)calloc(1, OBJECT_NAME_INFORMATION_REQUIRED_SIZE);
+	mark = scratch_mark();
+	resolvedName = (POBJECT_NAME_INFORMATION)scratch_alloc(OBJECT_NAME_INFORMATION_REQUIRED_SIZE);
 
-	status = pNtQueryObject(handle, ObjectNameInformation,
-		resolvedName, OBJECT_NAME_INFORMATION_REQUIRED_SIZE, &returnLength);
-
-	if (NT_SUCCESS(status)) {
+	if (resolvedName != NULL && NT_SUCCESS(pNtQueryObject(handle, ObjectNameInformation,
+		resolvedName, OBJECT_NAME_INFORMATION_REQUIRED_SIZE, &returnLength))) {
 		length = min(resolvedName->Name.Length / sizeof(wchar_t), path_buffer_len - 1);
 		// NtQueryInformationFile omits the "C:" part in a
 		// filename, apparently
@@ -374,7 +455,7 @@ uint32_t path_from_handle(HANDLE handle,
 	if (path_buffer_len)
 		path[length] = L'\0';
 
-	free(resolvedName);
+	scratch_release(mark);
 
 	set_lasterrors(&lasterror);
 
@@ -416,12 +497,13 @@ uint32_t path_from_object_attributes(const OBJECT_ATTRIBUTES *obj,
     return length + copylen;
 }
 
-static char *system32dir_a;
-static char *sysnativedir_a;
-static wchar_t *system32dir_w;
-static wchar_t *sysnativedir_w;
-static unsigned int system32dir_len;
-static unsigned int sysnativedir_len;
+// the prefixes file and registry paths get rewritten from, see
+// specialname_map_init() and hkcu_init()
+#define PREFIX_DEVICES		1
+#define PREFIX_SYSNATIVE	2
+#define PREFIX_REGISTRY		4
+
+static prefix_map_t g_prefixes;
 
 char *ensure_absolute_ascii_path(char *out, const char *in)
 {
@@ -461,11 +543,9 @@ char *ensure_absolute_ascii_path(char *out, const char *in)
 normal_copy:
 	strncpy(out, in, MAX_PATH);
 out:
-	if (is_wow64_fs_redirection_disabled() && !strnicmp(out, system32dir_a, system32dir_len)) {
-		memmove(out + system32dir_len + 1, out + system32dir_len, strlen(out + system32dir_len) + 1);
-		memcpy(out, sysnativedir_a, sysnativedir_len);
-	}
 	out[MAX_PATH - 1] = '\0';
+	if (is_wow64_fs_redirection_disabled())
+		prefix_map_rewriteA(&g_prefixes, PREFIX_SYSNATIVE, out, (unsigned int)strlen(out), MAX_PATH);
 	if (out[1] == ':' && out[2] == '\\')
 		out[0] = toupper(out[0]);
 
@@ -484,12 +564,23 @@ wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in)
 	unsigned int pathcomponentlen;
 	const wchar_t *inadj;
 	unsigned int inlen;
+	const wchar_t *retstr;
+	unsigned int matchlen;
 	int is_globalroot = 0;
+	// a failed allocation says nothing about the path
+	BOOLEAN cacheable = TRUE;
+	path_cache_key_t cachekey;
+	scratch_mark_t mark;
 
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
 
+	if (path_cache_get(in, out, &cachekey)) {
+		set_lasterrors(&lasterror);
+		return out;
+	}
+
 	if (!wcsncmp(in, L"\\??\\", 4)) {
 		inadj = in + 4;
 		is_globalroot = 1;
@@ -503,47 +594,49 @@ wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in)
 
 	inlen = lstrlenW(inadj);
 
-	tmpout = malloc(32768 * sizeof(wchar_t));
-	nonexistent = malloc(32768 * sizeof(wchar_t));
+	mark = scratch_mark();
+	tmpout = scratch_alloc(32768 * sizeof(wchar_t));
+	nonexistent = scratch_alloc(32768 * sizeof(wchar_t));
 
-	if (tmpout == NULL || nonexistent == NULL)
+	if (tmpout == NULL || nonexistent == NULL) {
+		cacheable = FALSE;
 		goto normal_copy;
+	}
 
-	if (!wcsnicmp(inadj, L"\\device\\", 8) || !wcsnicmp(inadj, L"\\systemroot", 11)) {
-		// handle \\Device\\* and \\systemroot\\*
-		unsigned int matchlen;
-		wchar_t *tmpout2;
-		wchar_t *retstr = get_matching_unicode_specialname(inadj, &matchlen);
-		if (retstr == NULL)
-			goto normal_copy;
+	retstr = get_matching_unicode_specialname(inadj, &matchlen);
+	if (retstr != NULL) {
 		// rewrite \\Device\\HarddiskVolumeX etc to the appropriate drive letter
-		tmpout2 = malloc(32768 * sizeof(wchar_t));
-		if (tmpout2 == NULL)
+		wchar_t *tmpout2;
+
+		tmpout2 = scratch_alloc(32768 * sizeof(wchar_t));
+		if (tmpout2 == NULL) {
+			cacheable = FALSE;
 			goto normal_copy;
+		}
 
 		wcscpy(tmpout2, L"\\\\?\\");
 		wcscat(tmpout2, retstr);
 		wcsncat(tmpout2, inadj + matchlen, 32768 - 4 - 3);
-		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL)) {
-			free(tmpout2);
+		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL))
 			goto normal_copy;
-		}
-		free(tmpout2);
+	}
+	else if (!wcsnicmp(inadj, L"\\device\\", 8)) {
+		// a device without a drive letter
+		goto normal_copy;
 	}
 	else if (inlen > 1 && inadj[1] == L':') {
 		wchar_t *tmpout2;
 
-		tmpout2 = malloc(32768 * sizeof(wchar_t));
-		if (tmpout2 == NULL)
+		tmpout2 = scratch_alloc(32768 * sizeof(wchar_t));
+		if (tmpout2 == NULL) {
+			cacheable = FALSE;
 			goto normal_copy;
+		}
 
 		wcscpy(tmpout2, L"\\\\?\\");
 		wcsncat(tmpout2, inadj, 32768 - 4);
-		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL)) {
-			free(tmpout2);
+		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL))
 			goto normal_copy;
-		}
-		free(tmpout2);
 	}
 	else if (is_globalroot) {
 		// handle \\??\\*\\*
@@ -576,10 +669,8 @@ wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in)
 	if (!wcsncmp(out, L"\\\\?\\", 4))
 		memmove(out, out + 4, (lstrlenW(out) + 1 - 4) * sizeof(wchar_t));
 
-	if (is_wow64_fs_redirection_disabled() && !wcsnicmp(out, system32dir_w, system32dir_len)) {
-		memmove(out + system32dir_len + 1, out + system32dir_len, (lstrlenW(out + system32dir_len) + 1) * sizeof(wchar_t));
-		memcpy(out, sysnativedir_w, sysnativedir_len * sizeof(wchar_t));
-	}
+	if (is_wow64_fs_redirection_disabled())
+		prefix_map_rewriteW(&g_prefixes, PREFIX_SYSNATIVE, out, lstrlenW(out), 32768);
 
 	goto out;
 
@@ -594,13 +685,12 @@ normal_copy:
 		memmove(out, out + 4, (lstrlenW(out) + 1 - 4) * sizeof(wchar_t));
 out:
 	out[32767] = L'\0';
-	if (tmpout)
-		free(tmpout);
-	if (nonexistent)
-		free(nonexistent);
+	scratch_release(mark);
 	if (out[1] == L':' && out[2] == L'\\')
 		out[0] = toupper(out[0]);
 
+	path_cache_done(&cachekey, in, out, cacheable);
+
 	set_lasterrors(&lasterror);
 
 	return out;
@@ -636,6 +726,46 @@ static void copy_encoded_unicode_string(wchar_t *out, const wchar_t *in, unsigne
 	out[newlen / sizeof(wchar_t)] = L'\0';
 }
 
+// every registry argument we log needs one of these, and they're too large
+// to go to the heap each time.  a thread rarely holds more than two at once
+// (the result, and the subkey copy of get_full_key_pathW)
+PKEY_NAME_INFORMATION get_keybuf(void)
+{
+	hook_info_t *hookinfo = hook_info();
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(hookinfo->keybufs); i++) {
+		if (hookinfo->keybufs_busy & (1 << i))
+			continue;
+		if (hookinfo->keybufs[i] == NULL) {
+			hookinfo->keybufs[i] = malloc(KEYBUF_SIZE);
+			if (hookinfo->keybufs[i] == NULL)
+				break;
+		}
+		hookinfo->keybufs_busy |= 1 << i;
+		return (PKEY_NAME_INFORMATION)hookinfo->keybufs[i];
+	}
+
+	return (PKEY_NAME_INFORMATION)malloc(KEYBUF_SIZE);
+}
+
+void release_keybuf(PKEY_NAME_INFORMATION keybuf)
+{
+	hook_info_t *hookinfo = hook_info();
+	unsigned int i;
+
+	if (keybuf == NULL)
+		return;
+
+	for (i = 0; i < ARRAYSIZE(hookinfo->keybufs); i++) {
+		if (hookinfo->keybufs[i] == keybuf) {
+			hookinfo->keybufs_busy &= ~(1 << i);
+			return;
+		}
+	}
+	free(keybuf);
+}
+
 wchar_t *get_full_keyvalue_pathA(HKEY registry, const char *in, PKEY_NAME_INFORMATION keybuf, unsigned int len)
 {
 	if (in && in[0] != '\0')
@@ -693,6 +823,7 @@ wchar_t *get_full_key_pathW(HKEY registry, const wchar_t *in, PKEY_NAME_INFORMAT
 {
 	OBJECT_ATTRIBUTES objattr;
 	UNICODE_STRING keystr;
+	PKEY_NAME_INFORMATION scratch;
 	const wchar_t *p;
 	wchar_t *u;
 	wchar_t *ret;
@@ -700,7 +831,13 @@ wchar_t *get_full_key_pathW(HKEY registry, const wchar_t *in, PKEY_NAME_INFORMAT
 
 	memset(&objattr, 0, sizeof(objattr));
 
-	keystr.Buffer = calloc(1, MAX_KEY_BUFLEN);
+	scratch = get_keybuf();
+	if (scratch == NULL) {
+		keybuf->KeyName[0] = L'\0';
+		keybuf->KeyNameLength = 0;
+		return keybuf->KeyName;
+	}
+	keystr.Buffer = scratch->KeyName;
 	keystr.MaximumLength = MAX_KEY_BUFLEN;
 	objattr.ObjectName = &keystr;
 
@@ -723,14 +860,39 @@ wchar_t *get_full_key_pathW(HKEY registry, const wchar_t *in, PKEY_NAME_INFORMAT
 	objattr.RootDirectory = registry;
 
 	ret = get_key_path(&objattr, keybuf, len);
-	free(keystr.Buffer);
+	release_keybuf(scratch);
 	return ret;
 }
 
-wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION keybuf, unsigned int len)
+// rewrites the \REGISTRY\... native prefixes of keybuf (with room for
+// maxchars characters) in place
+static void canonicalize_key_path(PKEY_NAME_INFORMATION keybuf, unsigned int maxchars)
+{
+	keybuf->KeyNameLength = prefix_map_rewriteW(&g_prefixes, PREFIX_REGISTRY, keybuf->KeyName,
+		keybuf->KeyNameLength / sizeof(WCHAR), maxchars) * sizeof(WCHAR);
+}
+
+// the canonical path of an open key as the kernel resolved it, i.e. after
+// following registry links (CurrentControlSet) and wow64 redirection
+// (Wow6432Node).  Returns NULL if the handle can't be queried
+wchar_t *get_key_handle_path(HANDLE key, PKEY_NAME_INFORMATION keybuf, unsigned int len)
 {
-	NTSTATUS status;
 	ULONG reslen;
+	lasterror_t lasterror;
+	wchar_t *ret = NULL;
+
+	get_lasterrors(&lasterror);
+	if (pNtQueryKey(key, KeyNameInformation, keybuf, len - sizeof(WCHAR), &reslen) >= 0) {
+		keybuf->KeyName[keybuf->KeyNameLength / sizeof(WCHAR)] = 0;
+		canonicalize_key_path(keybuf, (len - sizeof(KEY_NAME_INFORMATION)) / sizeof(WCHAR));
+		ret = keybuf->KeyName;
+	}
+	set_lasterrors(&lasterror);
+	return ret;
+}
+
+wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION keybuf, unsigned int len)
+{
 	unsigned int maxlen = len - sizeof(KEY_NAME_INFORMATION);
 	unsigned int maxlen_chars = maxlen / sizeof(WCHAR);
 	unsigned int remaining;
@@ -747,7 +909,8 @@ wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION
 		unsigned int newlen = get_encoded_unicode_string_len(ObjectAttributes->ObjectName->Buffer, copylen);
 		copy_encoded_unicode_string(keybuf->KeyName, ObjectAttributes->ObjectName->Buffer, copylen, newlen);
 		keybuf->KeyNameLength = newlen;
-		goto normal;
+		canonicalize_key_path(keybuf, maxlen_chars);
+		goto out;
 	}
 
 	keybuf->KeyName[0] = L'\0';
@@ -775,18 +938,21 @@ wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION
 		wcscpy(keybuf->KeyName, L"HKEY_DYN_DATA");
 	else if (rootkey == HKEY_CURRENT_USER_LOCAL_SETTINGS)
 		wcscpy(keybuf->KeyName, L"HKEY_CURRENT_USER_LOCAL_SETTINGS");
+	// the create/open hooks remember the canonical path of the keys they open
+	else if (handle_info(ObjectAttributes->RootDirectory, HANDLE_TYPE_KEY, NULL, keybuf->KeyName, maxlen_chars) != HANDLE_TYPE_KEY)
+		keybuf->KeyName[0] = L'\0';
 
 	keybuf->KeyNameLength = lstrlenW(keybuf->KeyName) * sizeof(wchar_t);
 	if (!keybuf->KeyNameLength) {
-		status = pNtQueryKey(ObjectAttributes->RootDirectory, KeyNameInformation, keybuf, len, &reslen);
-		if (status < 0)
+		if (!get_key_handle_path(ObjectAttributes->RootDirectory, keybuf, len))
 			goto error;
+		// a key handle we didn't see the open of, don't ask again next time
+		handle_track(ObjectAttributes->RootDirectory, HANDLE_TYPE_KEY, GetCurrentProcessId(),
+			keybuf->KeyName, keybuf->KeyNameLength / sizeof(WCHAR));
 	}
 
-	keybuf->KeyName[keybuf->KeyNameLength / sizeof(WCHAR)] = 0;
-
-	curlen = (unsigned int)wcslen(keybuf->KeyName);
-	remaining = maxlen_chars - (unsigned int)wcslen(keybuf->KeyName) - 1;
+	curlen = keybuf->KeyNameLength / sizeof(WCHAR);
+	remaining = maxlen_chars - curlen - 1;
 
 	if (ObjectAttributes->ObjectName == NULL) {
 		if (remaining < 10)
@@ -805,32 +971,9 @@ wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION
 		keybuf->KeyNameLength = curlen * sizeof(WCHAR) + newlen;
 	}
 
-normal:
-	if (!wcsnicmp(keybuf->KeyName, g_hkcu.hkcu_string, g_hkcu.len) && (keybuf->KeyName[g_hkcu.len] == L'\\' || keybuf->KeyName[g_hkcu.len] == L'\0')) {
-		unsigned int ourlen = lstrlenW(L"HKEY_CURRENT_USER");
-		memcpy(keybuf->KeyName, L"HKEY_CURRENT_USER", ourlen * sizeof(WCHAR));
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + g_hkcu.len, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - ((g_hkcu.len) * sizeof(WCHAR)));
-		keybuf->KeyNameLength -= (g_hkcu.len - ourlen) * sizeof(WCHAR);
-	}
-	else if (!wcsnicmp(keybuf->KeyName, g_hkcu.hkcu_string, g_hkcu.len) && !wcsnicmp(&keybuf->KeyName[g_hkcu.len], L"_Classes", 8)) {
-		unsigned int ourlen = lstrlenW(L"HKEY_CURRENT_USER\\Software\\Classes");
-		unsigned int existlen = g_hkcu.len + 8;
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + existlen, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - (existlen * sizeof(WCHAR)));
-		memcpy(keybuf->KeyName, L"HKEY_CURRENT_USER\\Software\\Classes", ourlen * sizeof(WCHAR));
-		keybuf->KeyNameLength -= (existlen - ourlen) * sizeof(WCHAR);
-	}
-	else if (!wcsnicmp(keybuf->KeyName, L"\\REGISTRY\\MACHINE", 17) && (keybuf->KeyName[17] == L'\\' || keybuf->KeyName[17] == L'\0')) {
-		unsigned int ourlen = 18;
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + 17, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - (17 * sizeof(WCHAR)));
-		memcpy(keybuf->KeyName, L"HKEY_LOCAL_MACHINE", ourlen * sizeof(WCHAR));
-		keybuf->KeyNameLength += (ourlen - 17) * sizeof(WCHAR);
-	}
-	else if (!wcsnicmp(keybuf->KeyName, L"\\REGISTRY\\USER", 14) && (keybuf->KeyName[14] == L'\\' || keybuf->KeyName[14] == L'\0')) {
-		unsigned int ourlen = 10;
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + 14, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - (14 * sizeof(WCHAR)));
-		memcpy(keybuf->KeyName, L"HKEY_USERS", ourlen * sizeof(WCHAR));
-		keybuf->KeyNameLength -= (14 - ourlen) * sizeof(WCHAR);
-	}
+	// the root alone can be too short to match, \REGISTRY plus Machine\...
+	// or HKEY_USERS plus <SID>\... only match once the subkey is appended
+	canonicalize_key_path(keybuf, maxlen_chars);
 
 	goto out;
 
@@ -871,6 +1014,8 @@ void hkcu_init(void)
 {
 	PSID sid = GetSID();
 	LPWSTR sidstr;
+	wchar_t *classes;
+	wchar_t *hkusers;
 
 	ConvertSidToStringSidW(sid, &sidstr);
 
@@ -879,6 +1024,28 @@ void hkcu_init(void)
 	wcscpy(g_hkcu.hkcu_string, L"\\REGISTRY\\USER\\");
 	wcscat(g_hkcu.hkcu_string, sidstr);
 	LocalFree(sidstr);
+
+	// the rules canonicalize_key_path() applies, the longest one wins
+	prefix_map_add(&g_prefixes, PREFIX_REGISTRY, g_hkcu.hkcu_string, L"HKEY_CURRENT_USER");
+	classes = malloc((g_hkcu.len + 9) * sizeof(wchar_t));
+	if (classes != NULL) {
+		wcscpy(classes, g_hkcu.hkcu_string);
+		wcscat(classes, L"_Classes");
+		prefix_map_add(&g_prefixes, PREFIX_REGISTRY, classes, L"HKEY_CURRENT_USER\\Software\\Classes");
+		free(classes);
+	}
+	// the same for paths composed from an already canonical HKEY_USERS root
+	hkusers = malloc((g_hkcu.len + 9) * sizeof(wchar_t));
+	if (hkusers != NULL) {
+		wcscpy(hkusers, L"HKEY_USERS");
+		wcscat(hkusers, g_hkcu.hkcu_string + lstrlenW(L"\\REGISTRY\\USER"));
+		prefix_map_add(&g_prefixes, PREFIX_REGISTRY, hkusers, L"HKEY_CURRENT_USER");
+		wcscat(hkusers, L"_Classes");
+		prefix_map_add(&g_prefixes, PREFIX_REGISTRY, hkusers, L"HKEY_CURRENT_USER\\Software\\Classes");
+		free(hkusers);
+	}
+	prefix_map_add(&g_prefixes, PREFIX_REGISTRY, L"\\REGISTRY\\MACHINE", L"HKEY_LOCAL_MACHINE");
+	prefix_map_add(&g_prefixes, PREFIX_REGISTRY, L"\\REGISTRY\\USER", L"HKEY_USERS");
 }
 
 extern int process_shutting_down;
@@ -906,82 +1073,53 @@ int is_shutting_down()
     return ret;
 }
 
-static char *g_specialnames_a[27];
-static char *g_targetnames_a[27];
+const wchar_t *get_matching_unicode_specialname(const wchar_t *path, unsigned int *matchlen)
+{
+	const prefix_rule_t *rule = prefix_map_matchW(&g_prefixes, PREFIX_DEVICES, path, lstrlenW(path));
 
-static wchar_t *g_specialnames_w[27];
-static wchar_t *g_targetnames_w[27];
-static unsigned int g_num_specialnames;
+	if (rule == NULL)
+		return NULL;
+	*matchlen = rule->prefixlen;
+	return rule->replacement;
+}
 
-wchar_t *get_matching_unicode_specialname(const wchar_t *path, unsigned int *matchlen)
+static void add_prefix_ascii(unsigned int group, const char *prefix, const char *replacement)
 {
+	wchar_t wprefix[MAX_PATH + 16], wreplacement[MAX_PATH + 16];
 	unsigned int i;
-	for (i = 0; i < g_num_specialnames; i++) {
-		if (!wcsnicmp(path, g_targetnames_w[i], wcslen(g_targetnames_w[i]))) {
-			*matchlen = lstrlenW(g_targetnames_w[i]);
-			return g_specialnames_w[i];
-		}
-	}
-	return NULL;
+
+	for (i = 0; i < ARRAYSIZE(wprefix) - 1 && prefix[i]; i++)
+		wprefix[i] = (wchar_t)(unsigned char)prefix[i];
+	wprefix[i] = L'\0';
+	for (i = 0; i < ARRAYSIZE(wreplacement) - 1 && replacement[i]; i++)
+		wreplacement[i] = (wchar_t)(unsigned char)replacement[i];
+	wreplacement[i] = L'\0';
+
+	prefix_map_add(&g_prefixes, group, wprefix, wreplacement);
 }
 
 void specialname_map_init(void)
 {
 	char letter[3];
 	char buf[MAX_PATH];
+	char system32[MAX_PATH + 16], sysnative[MAX_PATH + 16];
 	char c;
-	unsigned int idx = 0;
-	unsigned int i, x;
-	size_t len;
+
 	letter[1] = ':';
 	letter[2] = '\0';
+	// only devices, the targets of SUBST'ed drives are paths themselves
 	for (c = 'A'; c <= 'Z'; c++) {
 		letter[0] = c;
-		if (QueryDosDeviceA(letter, buf, MAX_PATH)) {
-			g_specialnames_a[idx] = strdup(letter);
-			g_targetnames_a[idx] = strdup(buf);
-			idx++;
-		}
+		if (QueryDosDeviceA(letter, buf, MAX_PATH) && !strnicmp(buf, "\\device\\", 8))
+			add_prefix_ascii(PREFIX_DEVICES, buf, letter);
 	}
 
 	GetWindowsDirectoryA(buf, MAX_PATH);
-	g_targetnames_a[idx] = strdup("\\systemroot");
-	g_specialnames_a[idx] = strdup(buf);
-	idx++;
-
-	len = strlen(buf) + strlen("\\system32");
-	system32dir_a = calloc(1, len + 1);
-	system32dir_w = calloc(1, (len + 1) * sizeof(wchar_t));
-	strcpy(system32dir_a, buf);
-	strcat(system32dir_a, "\\system32");
-	for (x = 0; x < len - strlen("\\system32"); x++)
-		system32dir_w[x] = (wchar_t)buf[x];
-	wcscat(system32dir_w, L"\\system32");
-	system32dir_len = (unsigned int)len;
-
-	len = strlen(buf) + strlen("\\sysnative");
-	sysnativedir_a = calloc(1, len + 1);
-	sysnativedir_w = calloc(1, (len + 1) * sizeof(wchar_t));
-	strcpy(sysnativedir_a, buf);
-	strcat(sysnativedir_a, "\\sysnative");
-	for (x = 0; x < len - strlen("\\sysnative"); x++)
-		sysnativedir_w[x] = (wchar_t)buf[x];
-	wcscat(sysnativedir_w, L"\\sysnative");
-	sysnativedir_len = (unsigned int)len;
-
-	for (i = 0; i < idx; i++) {
-		len = strlen(g_specialnames_a[i]) + 1;
-		g_specialnames_w[i] = (wchar_t *)malloc(len * sizeof(wchar_t));
-		for (x = 0; x < len; x++)
-			g_specialnames_w[i][x] = (wchar_t)g_specialnames_a[i][x];
-		len = strlen(g_targetnames_a[i]) + 1;
-		g_targetnames_w[i] = (wchar_t *)malloc(len * sizeof(wchar_t));
-		for (x = 0; x < len; x++)
-			g_targetnames_w[i][x] = (wchar_t)g_targetnames_a[i][x];
-	}
-
-	g_num_specialnames = idx;
+	add_prefix_ascii(PREFIX_DEVICES, "\\systemroot", buf);
 
+	sprintf(system32, "%s\\system32", buf);
+	sprintf(sysnative, "%s\\sysnative", buf);
+	add_prefix_ascii(PREFIX_SYSNATIVE, system32, sysnative);
 }
 
 int is_wow64_fs_redirection_disabled(void)
@@ -1006,27 +1144,104 @@ int is_wow64_fs_redirection_disabled(void)
 #endif
 }
 
-BOOLEAN is_suspended(DWORD pid, DWORD tid)
+// threads we created suspended ourselves and haven't seen resumed since
+// (tid -> suspended_thread_t), and processes we created without any running
+// thread (pid -> 1).  the analyzer asks about these all the time while the
+// sample prepares them for injection
+typedef struct _suspended_thread_t {
+	DWORD pid;
+	// NtResumeProcess and friends resume threads we can't enumerate, they
+	// invalidate all remembered threads by bumping g_suspended_epoch
+	LONG epoch;
+} suspended_thread_t;
+
+static lookup_t g_suspended_threads;
+static lookup_t g_suspended_processes;
+static volatile LONG g_suspended_epoch;
+
+// pid -> GetTickCount() << 1 | result of the last full snapshot
+static lookup_t g_suspended_cache;
+#define SUSPENDED_CACHE_MS 200
+
+// the last size the process snapshot needed, so that we don't start over at
+// 16kb every time on a busy system
+static ULONG g_snapshot_len = 16384;
+
+#ifndef ThreadSuspendCount
+#define ThreadSuspendCount 35
+#endif
+
+void suspended_init(void)
+{
+	lookup_init(&g_suspended_threads);
+	lookup_init(&g_suspended_processes);
+	lookup_init(&g_suspended_cache);
+}
+
+void remember_suspended(DWORD pid, DWORD tid, BOOLEAN whole_process)
+{
+	suspended_thread_t t;
+
+	if (tid) {
+		t.pid = pid;
+		t.epoch = g_suspended_epoch;
+		lookup_put(&g_suspended_threads, tid, &t, sizeof(t), NULL, 0);
+	}
+	if (whole_process)
+		lookup_set(&g_suspended_processes, pid, 1);
+	lookup_del(&g_suspended_cache, pid);
+}
+
+// a thread of pid was resumed (or suspended) by somebody, tid may be 0
+void forget_suspended(DWORD pid, DWORD tid)
+{
+	if (tid)
+		lookup_del(&g_suspended_threads, tid);
+	lookup_del(&g_suspended_processes, pid);
+	lookup_del(&g_suspended_cache, pid);
+}
+
+// all threads of pid were resumed or terminated at once
+void forget_suspended_process(DWORD pid)
+{
+	InterlockedIncrement(&g_suspended_epoch);
+	forget_suspended(pid, 0);
+}
+
+static BOOLEAN remembered_suspended(DWORD pid, DWORD tid)
+{
+	suspended_thread_t t;
+
+	if (lookup_copy(&g_suspended_threads, tid, &t, sizeof(t)) != sizeof(t))
+		return FALSE;
+	return t.pid == pid && t.epoch == g_suspended_epoch;
+}
+
+static BOOLEAN snapshot_is_suspended(DWORD pid, DWORD tid)
 {
 	ULONG length;
 	PSYSTEM_PROCESS_INFORMATION pspi, proc;
-	ULONG requestedlen = 16384;
-	lasterror_t lasterror;
-	BOOLEAN ret = FALSE;
-
-	get_lasterrors(&lasterror);
+	ULONG requestedlen = g_snapshot_len;
+	BOOLEAN ret = TRUE;
+	NTSTATUS status;
 
 	pspi = malloc(requestedlen);
 	if (pspi == NULL)
-		goto out;
+		return FALSE;
 
-	while (pNtQuerySystemInformation(SystemProcessInformation, pspi, requestedlen, &length) == STATUS_INFO_LENGTH_MISMATCH) {
+	while ((status = pNtQuerySystemInformation(SystemProcessInformation, pspi, requestedlen, &length)) == STATUS_INFO_LENGTH_MISMATCH) {
 		free(pspi);
 		requestedlen <<= 1;
 		pspi = malloc(requestedlen);
 		if (pspi == NULL)
-			goto out;
+			return FALSE;
 	}
+	if (!NT_SUCCESS(status)) {
+		free(pspi);
+		return FALSE;
+	}
+	g_snapshot_len = requestedlen;
+
 	// now we have a valid list of process information
 	for (proc = pspi; proc->NextEntryOffset; proc = (PSYSTEM_PROCESS_INFORMATION)((PCHAR)proc + proc->NextEntryOffset)) {
 		ULONG i;
@@ -1036,14 +1251,82 @@ BOOLEAN is_suspended(DWORD pid, DWORD tid)
 			PSYSTEM_THREAD thread = &proc->Threads[i];
 			if (tid && thread->ClientId.UniqueThread != (HANDLE)tid)
 				continue;
-			if (thread->WaitReason != Suspended)
-				goto out;
+			if (thread->WaitReason != Suspended) {
+				ret = FALSE;
+				break;
+			}
 		}
+		break;
 	}
 	free(pspi);
-	ret = TRUE;
+	return ret;
+}
+
+BOOLEAN is_suspended(DWORD pid, DWORD tid)
+{
+	ULONG_PTR value;
+	DWORD now;
+	lasterror_t lasterror;
+	BOOLEAN ret;
+
+	if (tid && remembered_suspended(pid, tid))
+		return TRUE;
+	if (!tid && lookup_get_value(&g_suspended_processes, pid, &value))
+		return TRUE;
+
+	get_lasterrors(&lasterror);
+
+	now = GetTickCount();
+	if (!tid && lookup_get_value(&g_suspended_cache, pid, &value) &&
+		(DWORD)((now << 1) - (value & ~1)) < (SUSPENDED_CACHE_MS << 1)) {
+		ret = (BOOLEAN)(value & 1);
+		goto out;
+	}
+
+	ret = snapshot_is_suspended(pid, tid);
+	if (!tid)
+		lookup_set(&g_suspended_cache, pid, (ULONG_PTR)(now << 1) | ret);
+
 out:
 	set_lasterrors(&lasterror);
+	return ret;
+}
+
+// asks about just the one thread, rather than taking a snapshot of every
+// thread on the system
+BOOLEAN is_thread_suspended(HANDLE thread_handle, DWORD pid, DWORD tid)
+{
+	ULONG count = 0;
+	DWORD prev;
+	lasterror_t lasterror;
+	BOOLEAN ret = FALSE;
 
+	if (tid == GetCurrentThreadId())
+		return FALSE;
+	if (tid && remembered_suspended(pid, tid))
+		return TRUE;
+
+	get_lasterrors(&lasterror);
+
+	// windows 8.1 and up
+	if (NT_SUCCESS(pNtQueryInformationThread(thread_handle, ThreadSuspendCount, &count, sizeof(count), NULL))) {
+		ret = count != 0;
+		goto out;
+	}
+
+	// otherwise the previous suspend count is only handed out by suspending
+	// the thread, so do that for a moment
+	prev = SuspendThread(thread_handle);
+	if (prev != (DWORD)-1) {
+		ResumeThread(thread_handle);
+		ret = prev != 0;
+		goto out;
+	}
+
+	// no THREAD_SUSPEND_RESUME access
+	ret = snapshot_is_suspended(pid, tid);
+
+out:
+	set_lasterrors(&lasterror);
 	return ret;
 }
@@ -53,14 +53,22 @@ void resolve_runtime_apis(void);
 
 ULONG_PTR parent_process_id(); // By Napalm @ NetCore2K (rohitab.com)
 DWORD pid_from_process_handle(HANDLE process_handle);
+DWORD pid_from_process_handle_verified(HANDLE process_handle);
 DWORD pid_from_thread_handle(HANDLE thread_handle);
 DWORD tid_from_thread_handle(HANDLE thread_handle);
+DWORD pid_from_thread_handle_verified(HANDLE thread_handle);
+DWORD tid_from_thread_handle_verified(HANDLE thread_handle);
 DWORD random();
 void raw_sleep(int msecs);
 DWORD randint(DWORD min, DWORD max);
 BOOL is_directory_objattr(const OBJECT_ATTRIBUTES *obj);
 void hide_module_from_peb(HMODULE module_handle);
+void suspended_init(void);
+void remember_suspended(DWORD pid, DWORD tid, BOOLEAN whole_process);
+void forget_suspended(DWORD pid, DWORD tid);
+void forget_suspended_process(DWORD pid);
 BOOLEAN is_suspended(DWORD pid, DWORD tid);
+BOOLEAN is_thread_suspended(HANDLE thread_handle, DWORD pid, DWORD tid);
 
 uint32_t path_from_handle(HANDLE handle,
     wchar_t *path, uint32_t path_buffer_len);
@@ -79,6 +87,7 @@ char *ensure_absolute_ascii_path(char *out, const char *in);
 wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in);
 
 wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION keybuf, unsigned int len);
+wchar_t *get_key_handle_path(HANDLE key, PKEY_NAME_INFORMATION keybuf, unsigned int len);
 wchar_t *get_full_key_pathA(HKEY registry, const char *in, PKEY_NAME_INFORMATION keybuf, unsigned int len);
 wchar_t *get_full_key_pathW(HKEY registry, const wchar_t *in, PKEY_NAME_INFORMATION keybuf, unsigned int len);
 wchar_t *get_full_keyvalue_pathA(HKEY registry, const char *in, PKEY_NAME_INFORMATION keybuf, unsigned int len);
@@ -95,6 +104,12 @@ int is_shutting_down();
 #define MAX_PATH_PLUS_TOLERANCE MAX_PATH + 64
 
 #define MAX_KEY_BUFLEN ((16384 + 256) * sizeof(WCHAR))
+#define KEYBUF_SIZE (sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN)
+
+// returns a KEYBUF_SIZE buffer for building a key path, one of the thread's
+// own if available, and the heap otherwise.  give it back with release_keybuf
+PKEY_NAME_INFORMATION get_keybuf(void);
+void release_keybuf(PKEY_NAME_INFORMATION keybuf);
 
 struct dll_range {
 	ULONG_PTR start;
@@ -105,7 +120,7 @@ struct dll_range {
 BOOL is_in_dll_range(ULONG_PTR addr);
 void add_all_dlls_to_dll_ranges(void);
 
-wchar_t *get_matching_unicode_specialname(const wchar_t *path, unsigned int *matchlen);
+const wchar_t *get_matching_unicode_specialname(const wchar_t *path, unsigned int *matchlen);
 void specialname_map_init(void);
 
 char *convert_address_to_dll_name_and_offset(ULONG_PTR addr, unsigned int *offset);
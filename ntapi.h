@@ -591,7 +591,12 @@ static inline void __writefsdword(unsigned int index, unsigned int value)
 #endif
 
 #ifndef HKEY_CURRENT_USER_LOCAL_SETTINGS
-(( HKEY ) (ULONG_PTR)((LONG)0x80000007) )
+#define HKEY_CURRENT_USER_LOCAL_SETTINGS (( HKEY ) (ULONG_PTR)((LONG)0x80000007) )
+#endif
+
+// IO_STATUS_BLOCK.Information of NtCreateFile
+#ifndef FILE_CREATED
+#define FILE_CREATED 0x00000002
 #endif
 
 typedef struct _SECTION_IMAGE_INFORMATION {
@@ -0,0 +1,255 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "ntapi.h"
+#include "hooking.h"
+#include "misc.h"
+#include "pipe.h"
+#include "pathcache.h"
+
+// direct mapped, a new entry simply replaces whatever was in its slot
+#define PATH_CACHE_SLOTS 512
+#define PATH_CACHE_STRIPES 16
+// longer paths are rare enough not to be worth the memory
+#define PATH_CACHE_MAX_CHARS 1024
+
+typedef struct _path_cache_entry_t {
+	unsigned int hash;
+	unsigned int context;
+	unsigned int generation;
+	DWORD tick;
+	unsigned int inlen;
+	unsigned int outlen;
+	// the input and the result, both zero-terminated
+	wchar_t str[0];
+} path_cache_entry_t;
+
+static path_cache_entry_t *g_slots[PATH_CACHE_SLOTS];
+static CRITICAL_SECTION g_stripes[PATH_CACHE_STRIPES];
+static BOOLEAN g_ready;
+
+static volatile LONG g_generation;
+
+// performance counter ticks.  A miss is timed from the lookup to the
+// result being handed to path_cache_done(), overhead is what the lookups
+// that missed and storing their results cost on top of the normalization
+static volatile LONG g_hits;
+static volatile LONG g_misses;
+static volatile LONG g_uncacheable;
+static volatile LONGLONG g_hit_ticks;
+static volatile LONGLONG g_miss_ticks;
+static volatile LONGLONG g_overhead_ticks;
+
+void path_cache_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < PATH_CACHE_STRIPES; i++)
+		InitializeCriticalSection(&g_stripes[i]);
+	g_ready = TRUE;
+}
+
+void path_cache_invalidate(void)
+{
+	InterlockedIncrement(&g_generation);
+}
+
+static unsigned int hash_chars(unsigned int hash, const wchar_t *s, unsigned int len)
+{
+	unsigned int i;
+
+	// FNV-1a
+	for (i = 0; i < len; i++) {
+		hash ^= s[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+// returns FALSE for paths we can't tell the outcome of from the path alone,
+// otherwise what else the outcome depends on in *context
+static BOOLEAN path_context(const wchar_t *in, unsigned int inlen, unsigned int *context)
+{
+	UNICODE_STRING *cwd;
+	PEB *peb;
+
+	*context = is_wow64_fs_redirection_disabled() ? 1 : 0;
+
+	// C:\..., \\server\share, \\?\..., \??\..., \Device\..., \SystemRoot\...
+	if (inlen > 2 && in[1] == L':' && in[2] == L'\\')
+		return TRUE;
+	if (inlen > 1 && in[0] == L'\\' && in[1] == L'\\')
+		return TRUE;
+	if (!wcsncmp(in, L"\\??\\", 4) || !wcsnicmp(in, L"\\device\\", 8) ||
+		!wcsnicmp(in, L"\\systemroot", 11))
+		return TRUE;
+
+	// C:foo is relative to the current directory of that drive, which we
+	// don't follow
+	if (inlen > 1 && in[1] == L':')
+		return FALSE;
+
+	// relative to the current directory (or its drive)
+	peb = (PEB *)get_peb();
+	if (peb == NULL || peb->ProcessParameters == NULL)
+		return FALSE;
+	cwd = &peb->ProcessParameters->CurrentDirectoryPath;
+	if (cwd->Buffer == NULL)
+		return FALSE;
+	*context |= hash_chars(2166136261, cwd->Buffer, cwd->Length / sizeof(wchar_t)) & ~1;
+	return TRUE;
+}
+
+BOOLEAN path_cache_get(const wchar_t *in, wchar_t *out, path_cache_key_t *key)
+{
+	path_cache_entry_t *e;
+	LARGE_INTEGER end;
+	unsigned int inlen, idx;
+	BOOLEAN ret = FALSE;
+
+	QueryPerformanceCounter(&key->start);
+	key->cacheable = FALSE;
+
+	if (!g_ready || in == NULL)
+		return FALSE;
+
+	inlen = lstrlenW(in);
+	if (inlen == 0 || inlen > PATH_CACHE_MAX_CHARS ||
+		!path_context(in, inlen, &key->context)) {
+		InterlockedIncrement(&g_uncacheable);
+		return FALSE;
+	}
+
+	key->hash = hash_chars(2166136261, in, inlen) ^ key->context;
+	key->generation = g_generation;
+	key->cacheable = TRUE;
+
+	idx = key->hash & (PATH_CACHE_SLOTS - 1);
+	EnterCriticalSection(&g_stripes[idx & (PATH_CACHE_STRIPES - 1)]);
+	e = g_slots[idx];
+	if (e != NULL && e->hash == key->hash && e->context == key->context &&
+		e->generation == key->generation && e->inlen == inlen &&
+		GetTickCount() - e->tick < PATH_CACHE_MS &&
+		!memcmp(e->str, in, inlen * sizeof(wchar_t))) {
+		memcpy(out, e->str + inlen + 1, (e->outlen + 1) * sizeof(wchar_t));
+		ret = TRUE;
+	}
+	LeaveCriticalSection(&g_stripes[idx & (PATH_CACHE_STRIPES - 1)]);
+
+	QueryPerformanceCounter(&end);
+	if (ret) {
+		InterlockedIncrement(&g_hits);
+		InterlockedExchangeAdd64(&g_hit_ticks, end.QuadPart - key->start.QuadPart);
+	}
+	else {
+		InterlockedExchangeAdd64(&g_overhead_ticks, end.QuadPart - key->start.QuadPart);
+	}
+	return ret;
+}
+
+void path_cache_done(path_cache_key_t *key, const wchar_t *in,
+	const wchar_t *out, BOOLEAN store)
+{
+	path_cache_entry_t *e, *old;
+	LARGE_INTEGER end, stored;
+	unsigned int inlen, outlen, idx;
+
+	if (!key->cacheable)
+		return;
+
+	QueryPerformanceCounter(&end);
+	InterlockedIncrement(&g_misses);
+	InterlockedExchangeAdd64(&g_miss_ticks, end.QuadPart - key->start.QuadPart);
+
+	// something changed while we were at it
+	if (!store || key->generation != (unsigned int)g_generation)
+		return;
+
+	inlen = lstrlenW(in);
+	outlen = lstrlenW(out);
+	if (outlen > PATH_CACHE_MAX_CHARS)
+		return;
+
+	e = (path_cache_entry_t *)malloc(sizeof(path_cache_entry_t) +
+		(inlen + outlen + 2) * sizeof(wchar_t));
+	if (e == NULL)
+		return;
+	e->hash = key->hash;
+	e->context = key->context;
+	e->generation = key->generation;
+	e->tick = GetTickCount();
+	e->inlen = inlen;
+	e->outlen = outlen;
+	memcpy(e->str, in, (inlen + 1) * sizeof(wchar_t));
+	memcpy(e->str + inlen + 1, out, (outlen + 1) * sizeof(wchar_t));
+
+	idx = key->hash & (PATH_CACHE_SLOTS - 1);
+	EnterCriticalSection(&g_stripes[idx & (PATH_CACHE_STRIPES - 1)]);
+	old = g_slots[idx];
+	g_slots[idx] = e;
+	LeaveCriticalSection(&g_stripes[idx & (PATH_CACHE_STRIPES - 1)]);
+
+	if (old != NULL)
+		free(old);
+
+	QueryPerformanceCounter(&stored);
+	InterlockedExchangeAdd64(&g_miss_ticks, stored.QuadPart - end.QuadPart);
+	InterlockedExchangeAdd64(&g_overhead_ticks, stored.QuadPart - end.QuadPart);
+}
+
+static LONGLONG ticks_to_ns(LONGLONG ticks, LONGLONG freq)
+{
+	return (LONGLONG)((double)ticks * 1e9 / freq);
+}
+
+void path_cache_report(void)
+{
+	LARGE_INTEGER freq;
+	LONGLONG hits = g_hits, misses = g_misses, lookups;
+	LONGLONG normalize_ticks, saved_ticks;
+	LONGLONG normalize_ns = 0, hit_ns = 0;
+
+	if (!g_ready || !QueryPerformanceFrequency(&freq) || freq.QuadPart == 0)
+		return;
+
+	lookups = hits + misses + g_uncacheable;
+	if (lookups == 0)
+		return;
+
+	// what a miss cost without the cache's part in it, i.e. what each hit
+	// would have cost without the cache
+	normalize_ticks = g_miss_ticks - g_overhead_ticks;
+	if (misses)
+		normalize_ns = ticks_to_ns(normalize_ticks, freq.QuadPart) / misses;
+	if (hits)
+		hit_ns = ticks_to_ns(g_hit_ticks, freq.QuadPart) / hits;
+
+	// negative when the cache costs more than it saves
+	saved_ticks = misses ? normalize_ticks * hits / misses : 0;
+	saved_ticks -= g_hit_ticks + g_overhead_ticks;
+
+	// pipe() has neither %% nor signed numbers
+	pipe("INFO:Path cache: %d percent hit rate, %d hits, %d misses, %d uncacheable, "
+		"%d ns per normalization, %d ns per hit, %d ms overhead, %d ms %z",
+		(int)(hits * 100 / lookups), (int)hits, (int)misses, (int)g_uncacheable,
+		(int)normalize_ns, (int)hit_ns,
+		(int)(ticks_to_ns(g_overhead_ticks, freq.QuadPart) / 1000000),
+		(int)(ticks_to_ns(saved_ticks < 0 ? -saved_ticks : saved_ticks, freq.QuadPart) / 1000000),
+		saved_ticks < 0 ? "lost" : "saved");
+}
@@ -0,0 +1,54 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//
+// Path normalization cache
+//
+// Remembers what ensure_absolute_unicode_path() made of a path, as the same
+// path gets normalized several times for a single hooked call (arguments,
+// pipe messages, handle tracking).  Entries are keyed on the path as given,
+// the wow64 redirection state and, for relative paths, the current
+// directory.  The result of GetLongPathNameW depends on which files exist,
+// so the file hooks call path_cache_invalidate() when they create, rename
+// or delete something, and entries expire after PATH_CACHE_MS to catch up
+// with changes made by other processes.
+//
+
+#define PATH_CACHE_MS 1000
+
+typedef struct _path_cache_key_t {
+	unsigned int hash;
+	unsigned int context;
+	unsigned int generation;
+	BOOLEAN cacheable;
+	LARGE_INTEGER start;
+} path_cache_key_t;
+
+void path_cache_init(void);
+
+// returns TRUE and the cached result in out (of 32768 characters), or FALSE
+// and a key to hand to path_cache_done() along with the computed result
+BOOLEAN path_cache_get(const wchar_t *in, wchar_t *out, path_cache_key_t *key);
+void path_cache_done(path_cache_key_t *key, const wchar_t *in,
+	const wchar_t *out, BOOLEAN store);
+
+void path_cache_invalidate(void);
+
+// sends the hit rate and the time it saved (net of its own overhead) to the
+// analyzer, see process_exit_report()
+void path_cache_report(void);
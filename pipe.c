@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "misc.h"
 #include "config.h"
 #include "log.h"
+#include "scratch.h"
 
 static int _pipe_utf8x(char **out, unsigned short x)
 {
@@ -82,16 +83,18 @@ static int _pipe_sprintf(char *out, const char *fmt, va_list args)
         }
 		else if (*fmt == 'F') {
 			const wchar_t *s = va_arg(args, const wchar_t *);
-			wchar_t *absolutepath = malloc(32768 * sizeof(wchar_t));
+			scratch_mark_t mark;
+			wchar_t *absolutepath;
 			if (s == NULL) return -1;
-			if (absolutepath) {
-				ensure_absolute_unicode_path(absolutepath, s);
-				ret += _pipe_unicode(&out, absolutepath, lstrlenW(absolutepath));
-				free(absolutepath);
-			}
-			else {
+			mark = scratch_mark();
+			absolutepath = scratch_alloc(32768 * sizeof(wchar_t));
+			if (absolutepath == NULL) {
+				scratch_release(mark);
 				return -1;
 			}
+			ensure_absolute_unicode_path(absolutepath, s);
+			ret += _pipe_unicode(&out, absolutepath, lstrlenW(absolutepath));
+			scratch_release(mark);
 		}
 		else if (*fmt == 's') {
             int len = va_arg(args, int);
@@ -118,21 +121,23 @@ static int _pipe_sprintf(char *out, const char *fmt, va_list args)
             OBJECT_ATTRIBUTES *obj = va_arg(args, OBJECT_ATTRIBUTES *);
 			wchar_t path[MAX_PATH_PLUS_TOLERANCE];
 			wchar_t *absolutepath;
+			scratch_mark_t mark;
 
             if(obj == NULL || obj->ObjectName == NULL) return -1;
 
-			absolutepath = malloc(32768 * sizeof(wchar_t));
+			mark = scratch_mark();
+			absolutepath = scratch_alloc(32768 * sizeof(wchar_t));
 			if (absolutepath) {
 				path_from_object_attributes(obj, path, (unsigned int)MAX_PATH_PLUS_TOLERANCE);
 
 				ensure_absolute_unicode_path(absolutepath, path);
 
 				ret += _pipe_unicode(&out, absolutepath, lstrlenW(absolutepath));
-				free(absolutepath);
 			}
 			else {
 				ret += _pipe_unicode(&out, L"", 0);
 			}
+			scratch_release(mark);
         }
         else if(*fmt == 'd') {
             char s[32];
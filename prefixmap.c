@@ -0,0 +1,227 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <wctype.h>
+#include "ntapi.h"
+#include <windows.h>
+#include "prefixmap.h"
+
+static __inline wchar_t fold(wchar_t c)
+{
+	if (c >= L'A' && c <= L'Z')
+		return c + (L'a' - L'A');
+	if (c < 0x80)
+		return c;
+	return (wchar_t)towlower(c);
+}
+
+static unsigned int find_child(const prefix_map_t *m, unsigned int node, wchar_t c)
+{
+	unsigned int i;
+
+	for (i = m->nodes[node].child; i != 0; i = m->nodes[i].sibling) {
+		if (m->nodes[i].c == c)
+			return i;
+	}
+	return 0;
+}
+
+static unsigned int new_node(prefix_map_t *m, wchar_t c)
+{
+	prefix_node_t *nodes;
+	unsigned int capacity;
+
+	if (m->node_count == m->node_capacity) {
+		capacity = m->node_capacity ? m->node_capacity * 2 : 256;
+		nodes = (prefix_node_t *)realloc(m->nodes, capacity * sizeof(prefix_node_t));
+		if (nodes == NULL)
+			return 0;
+		m->nodes = nodes;
+		m->node_capacity = capacity;
+	}
+	memset(&m->nodes[m->node_count], 0, sizeof(prefix_node_t));
+	m->nodes[m->node_count].c = c;
+	return m->node_count++;
+}
+
+int prefix_map_add(prefix_map_t *m, unsigned int group, const wchar_t *prefix,
+	const wchar_t *replacement)
+{
+	prefix_rule_t *r, *rules;
+	wchar_t *rep;
+	char *rep_a;
+	unsigned int node = 0, child, i, capacity;
+	unsigned int prefixlen = lstrlenW(prefix), replen = lstrlenW(replacement);
+
+	if (prefixlen == 0)
+		return 0;
+
+	// the root
+	if (m->node_count == 0) {
+		new_node(m, 0);
+		if (m->node_count == 0)
+			return 0;
+	}
+
+	for (i = 0; i < prefixlen; i++) {
+		child = find_child(m, node, fold(prefix[i]));
+		if (child == 0) {
+			child = new_node(m, fold(prefix[i]));
+			if (child == 0)
+				return 0;
+			m->nodes[child].sibling = m->nodes[node].child;
+			m->nodes[node].child = child;
+		}
+		node = child;
+	}
+
+	for (i = m->nodes[node].rule; i != 0; i = m->rules[i - 1].next) {
+		if (m->rules[i - 1].group == group)
+			return 1;
+	}
+
+	if (m->rule_count == m->rule_capacity) {
+		capacity = m->rule_capacity ? m->rule_capacity * 2 : 16;
+		rules = (prefix_rule_t *)realloc(m->rules, capacity * sizeof(prefix_rule_t));
+		if (rules == NULL)
+			return 0;
+		m->rules = rules;
+		m->rule_capacity = capacity;
+	}
+
+	rep = (wchar_t *)malloc((replen + 1) * sizeof(wchar_t));
+	rep_a = (char *)malloc(replen + 1);
+	if (rep == NULL || rep_a == NULL) {
+		free(rep);
+		free(rep_a);
+		return 0;
+	}
+	memcpy(rep, replacement, (replen + 1) * sizeof(wchar_t));
+	for (i = 0; i <= replen; i++)
+		rep_a[i] = (char)replacement[i];
+
+	r = &m->rules[m->rule_count++];
+	r->replacement = rep;
+	r->replacement_a = rep_a;
+	r->prefixlen = prefixlen;
+	r->replen = replen;
+	r->group = group;
+	r->next = m->nodes[node].rule;
+	m->nodes[node].rule = m->rule_count;
+	return 1;
+}
+
+static const prefix_rule_t *node_rule(const prefix_map_t *m, unsigned int node,
+	unsigned int groups)
+{
+	unsigned int i;
+
+	for (i = m->nodes[node].rule; i != 0; i = m->rules[i - 1].next) {
+		if (m->rules[i - 1].group & groups)
+			return &m->rules[i - 1];
+	}
+	return NULL;
+}
+
+const prefix_rule_t *prefix_map_matchW(const prefix_map_t *m,
+	unsigned int groups, const wchar_t *s, unsigned int len)
+{
+	const prefix_rule_t *best = NULL, *r;
+	unsigned int node = 0, i;
+
+	if (m->node_count == 0)
+		return NULL;
+
+	for (i = 0; i < len; i++) {
+		node = find_child(m, node, fold(s[i]));
+		if (node == 0)
+			break;
+		if (m->nodes[node].rule == 0)
+			continue;
+		// only whole components
+		if (s[i] != L'\\' && i + 1 < len && s[i + 1] != L'\\' && s[i + 1] != L'\0')
+			continue;
+		r = node_rule(m, node, groups);
+		if (r != NULL)
+			best = r;
+	}
+	return best;
+}
+
+const prefix_rule_t *prefix_map_matchA(const prefix_map_t *m,
+	unsigned int groups, const char *s, unsigned int len)
+{
+	const prefix_rule_t *best = NULL, *r;
+	unsigned int node = 0, i;
+
+	if (m->node_count == 0)
+		return NULL;
+
+	for (i = 0; i < len; i++) {
+		node = find_child(m, node, fold((unsigned char)s[i]));
+		if (node == 0)
+			break;
+		if (m->nodes[node].rule == 0)
+			continue;
+		if (s[i] != '\\' && i + 1 < len && s[i + 1] != '\\' && s[i + 1] != '\0')
+			continue;
+		r = node_rule(m, node, groups);
+		if (r != NULL)
+			best = r;
+	}
+	return best;
+}
+
+unsigned int prefix_map_rewriteW(const prefix_map_t *m, unsigned int groups,
+	wchar_t *buf, unsigned int len, unsigned int size)
+{
+	const prefix_rule_t *r = prefix_map_matchW(m, groups, buf, len);
+	unsigned int newlen;
+
+	if (r == NULL)
+		return len;
+	newlen = len - r->prefixlen + r->replen;
+	if (newlen >= size)
+		return len;
+
+	memmove(buf + r->replen, buf + r->prefixlen, (len - r->prefixlen) * sizeof(wchar_t));
+	memcpy(buf, r->replacement, r->replen * sizeof(wchar_t));
+	buf[newlen] = L'\0';
+	return newlen;
+}
+
+unsigned int prefix_map_rewriteA(const prefix_map_t *m, unsigned int groups,
+	char *buf, unsigned int len, unsigned int size)
+{
+	const prefix_rule_t *r = prefix_map_matchA(m, groups, buf, len);
+	unsigned int newlen;
+
+	if (r == NULL)
+		return len;
+	newlen = len - r->prefixlen + r->replen;
+	if (newlen >= size)
+		return len;
+
+	memmove(buf + r->replen, buf + r->prefixlen, len - r->prefixlen);
+	memcpy(buf, r->replacement_a, r->replen);
+	buf[newlen] = '\0';
+	return newlen;
+}
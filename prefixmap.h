@@ -0,0 +1,79 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <windows.h>
+
+// Case insensitive prefix rewriting, e.g. \Device\HarddiskVolume1 to C: or
+// \REGISTRY\MACHINE to HKEY_LOCAL_MACHINE.  Rules are compiled into a trie
+// as they're added, so a lookup walks the string once and finds the
+// longest matching prefix no matter how many rules there are.  A prefix
+// only matches whole path components: it has to be followed by a
+// backslash or the end of the string (or end in a backslash itself).
+//
+// Every rule belongs to a group, lookups say which groups they're after.
+// A zeroed prefix_map_t is empty.  Rules are added during initialization,
+// lookups don't take a lock.
+
+typedef struct _prefix_rule_t {
+	const wchar_t *replacement;
+	// the same, for the ANSI lookups
+	const char *replacement_a;
+	unsigned int prefixlen;
+	unsigned int replen;
+	unsigned int group;
+	// the next rule with the same prefix, index + 1
+	unsigned int next;
+} prefix_rule_t;
+
+typedef struct _prefix_node_t {
+	// lowercased
+	wchar_t c;
+	// node indices, 0 for none as the root is nobody's child or sibling
+	unsigned int child;
+	unsigned int sibling;
+	// the first rule for the prefix ending here, index + 1
+	unsigned int rule;
+} prefix_node_t;
+
+typedef struct _prefix_map_t {
+	prefix_node_t *nodes;
+	unsigned int node_count;
+	unsigned int node_capacity;
+	prefix_rule_t *rules;
+	unsigned int rule_count;
+	unsigned int rule_capacity;
+} prefix_map_t;
+
+// the first rule added for a prefix and group wins, returns 0 when out of
+// memory
+int prefix_map_add(prefix_map_t *m, unsigned int group, const wchar_t *prefix,
+	const wchar_t *replacement);
+
+// the longest prefix of s (of len characters) with a rule in groups
+const prefix_rule_t *prefix_map_matchW(const prefix_map_t *m,
+	unsigned int groups, const wchar_t *s, unsigned int len);
+const prefix_rule_t *prefix_map_matchA(const prefix_map_t *m,
+	unsigned int groups, const char *s, unsigned int len);
+
+// rewrite the longest matching prefix of buf (of len characters, with room
+// for size including the terminator) in place, returns the new length.
+// buf is left alone if the result wouldn't fit.
+unsigned int prefix_map_rewriteW(const prefix_map_t *m, unsigned int groups,
+	wchar_t *buf, unsigned int len, unsigned int size);
+unsigned int prefix_map_rewriteA(const prefix_map_t *m, unsigned int groups,
+	char *buf, unsigned int len, unsigned int size);
@@ -0,0 +1,148 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "ntapi.h"
+#include "hooking.h"
+#include "scratch.h"
+
+#define SCRATCH_ALIGN 16
+#define SCRATCH_COMMIT_STEP (64 * 1024)
+
+// heading the heap blocks handed out once the arena is full, the data
+// follows SCRATCH_ALIGN bytes in
+typedef struct _scratch_overflow_t {
+	struct _scratch_overflow_t *next;
+	// the top of the stack when the block was allocated
+	scratch_mark_t top;
+} scratch_overflow_t;
+
+extern DWORD g_tls_hook_index;
+
+// makes sure the arena is committed up to end, returns 0 if it can't be
+static int scratch_commit(hook_info_t *hookinfo, unsigned int end)
+{
+	unsigned int newcommit;
+	lasterror_t lasterror;
+	int ret = 1;
+
+	if (end <= hookinfo->scratch_committed)
+		return 1;
+	if (end > SCRATCH_RESERVE)
+		return 0;
+
+	get_lasterrors(&lasterror);
+	// keeps our own allocations out of the memory hooks
+	hookinfo->disable_count++;
+
+	if (hookinfo->scratch == NULL) {
+		hookinfo->scratch = VirtualAlloc(NULL, SCRATCH_RESERVE, MEM_RESERVE, PAGE_NOACCESS);
+		if (hookinfo->scratch == NULL) {
+			ret = 0;
+			goto out;
+		}
+	}
+
+	newcommit = hookinfo->scratch_committed ? hookinfo->scratch_committed : SCRATCH_INITIAL_COMMIT;
+	while (newcommit < end)
+		newcommit += SCRATCH_COMMIT_STEP;
+	if (newcommit > SCRATCH_RESERVE)
+		newcommit = SCRATCH_RESERVE;
+
+	if (VirtualAlloc(hookinfo->scratch + hookinfo->scratch_committed,
+		newcommit - hookinfo->scratch_committed, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+		ret = 0;
+		goto out;
+	}
+	hookinfo->scratch_committed = newcommit;
+
+out:
+	hookinfo->disable_count--;
+	set_lasterrors(&lasterror);
+	return ret;
+}
+
+scratch_mark_t scratch_mark(void)
+{
+	return hook_info()->scratch_top;
+}
+
+void scratch_release(scratch_mark_t mark)
+{
+	hook_info_t *hookinfo = hook_info();
+	scratch_overflow_t *block;
+
+	while (hookinfo->scratch_overflow != NULL) {
+		block = (scratch_overflow_t *)hookinfo->scratch_overflow;
+		if (block->top < mark)
+			break;
+		hookinfo->scratch_overflow = block->next;
+		free(block);
+	}
+	hookinfo->scratch_top = mark;
+}
+
+void *scratch_alloc(unsigned int size)
+{
+	hook_info_t *hookinfo = hook_info();
+	scratch_overflow_t *block;
+	unsigned int start, end;
+
+	start = (hookinfo->scratch_top + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+	end = start + size;
+	if (end >= start && scratch_commit(hookinfo, end)) {
+		hookinfo->scratch_top = end;
+		return hookinfo->scratch + start;
+	}
+
+	if (size + SCRATCH_ALIGN < size)
+		return NULL;
+	block = (scratch_overflow_t *)malloc(SCRATCH_ALIGN + size);
+	if (block == NULL)
+		return NULL;
+	block->top = hookinfo->scratch_top;
+	block->next = (scratch_overflow_t *)hookinfo->scratch_overflow;
+	hookinfo->scratch_overflow = block;
+	// so that a mark taken from here on doesn't free the block
+	hookinfo->scratch_top++;
+	return (char *)block + SCRATCH_ALIGN;
+}
+
+void *scratch_calloc(unsigned int size)
+{
+	void *ret = scratch_alloc(size);
+
+	if (ret != NULL)
+		memset(ret, 0, size);
+	return ret;
+}
+
+void scratch_thread_detach(void)
+{
+	hook_info_t *hookinfo = (hook_info_t *)TlsGetValue(g_tls_hook_index);
+
+	// hooks running during the detach may still allocate, nothing's in
+	// use once the stack is back at the bottom
+	if (hookinfo == NULL || hookinfo->scratch_top != 0)
+		return;
+
+	if (hookinfo->scratch != NULL)
+		VirtualFree(hookinfo->scratch, 0, MEM_RELEASE);
+	hookinfo->scratch = NULL;
+	hookinfo->scratch_committed = 0;
+}
@@ -0,0 +1,52 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//
+// Per-thread scratch memory
+//
+// Temporaries such as the 32k character path buffers are taken off a stack
+// of memory owned by the calling thread, rather than from the (shared,
+// locked) heap.  Take a mark, allocate as much as needed, and release the
+// mark to give back everything allocated since:
+//
+//     scratch_mark_t mark = scratch_mark();
+//     wchar_t *path = scratch_alloc(32768 * sizeof(wchar_t));
+//     ...
+//     scratch_release(mark);
+//
+// Marks have to be released in the reverse order they were taken.  When
+// the thread's arena is exhausted, allocations fall back to the heap and
+// are freed by the release all the same.
+//
+
+// address space reserved per thread, and how much of it is committed the
+// first time the thread needs scratch memory
+#define SCRATCH_RESERVE (512 * 1024)
+#define SCRATCH_INITIAL_COMMIT (128 * 1024)
+
+typedef unsigned int scratch_mark_t;
+
+scratch_mark_t scratch_mark(void);
+void scratch_release(scratch_mark_t mark);
+
+// memory isn't zeroed unless scratch_calloc is used
+void *scratch_alloc(unsigned int size);
+void *scratch_calloc(unsigned int size);
+
+// called when the thread exits
+void scratch_thread_detach(void);
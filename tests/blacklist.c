@@ -4,15 +4,100 @@
 #include "ignore.h"
 #include "ntapi.h"
 
+typedef struct _ignore_test_t {
+    unsigned int list;
+    const wchar_t *name;
+    int expected;
+} ignore_test_t;
+
+static const ignore_test_t g_tests[] = {
+    // built-in exact rule, case insensitive, but only the whole name
+    {IGNORE_LIST_FILE, L"\\??\\PIPE\\lsarpc", 1},
+    {IGNORE_LIST_FILE, L"\\??\\pipe\\LSARPC", 1},
+    {IGNORE_LIST_FILE, L"\\??\\PIPE\\lsarp", 0},
+    {IGNORE_LIST_FILE, L"\\??\\PIPE\\lsarpc2", 0},
+
+    // built-in prefix rules
+    {IGNORE_LIST_FILE, L"\\??\\IDE#what's up bro?", 1},
+    {IGNORE_LIST_FILE, L"\\??\\ide#", 1},
+    {IGNORE_LIST_FILE, L"\\??\\IDE", 0},
+    {IGNORE_LIST_FILE, L"\\??\\IDEA", 0},
+    {IGNORE_LIST_FILE, L"\\Device\\HarddiskVolume1\\foo.txt", 1},
+    {IGNORE_LIST_FILE, L"\\Devic", 0},
+    {IGNORE_LIST_FILE, L"abcd", 0},
+    {IGNORE_LIST_FILE, L"", 0},
+
+    // added below, as the analyzer config would
+    {IGNORE_LIST_FILE, L"C:\\Users\\bob\\Desktop\\DESKTOP.INI", 1},
+    {IGNORE_LIST_FILE, L"desktop.ini", 0},
+    {IGNORE_LIST_FILE, L"C:\\desktop.ini.bak", 0},
+    {IGNORE_LIST_FILE, L"C:\\mydesktop.ini", 0},
+    {IGNORE_LIST_FILE, L"C:\\pagefile.sys", 1},
+    {IGNORE_LIST_FILE, L"C:\\pagefile.sys:stream", 0},
+
+    // built-in process paths
+    {IGNORE_LIST_PROCESS, L"c:\\windows\\SYSTEM32\\werfault.exe", 1},
+    {IGNORE_LIST_PROCESS, L"C:\\WINDOWS\\syswow64\\WerFault.exe", 1},
+    {IGNORE_LIST_PROCESS, L"C:\\WINDOWS\\system32\\notepad.exe", 0},
+    {IGNORE_LIST_PROCESS, L"C:\\WINDOWS\\system32\\WerFault.exe.exe", 0},
+
+    // the key list has no built-in rules
+    {IGNORE_LIST_KEY, L"HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Cryptography\\RNG\\Seed", 1},
+    {IGNORE_LIST_KEY, L"HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Cryptograph", 0},
+    {IGNORE_LIST_KEY, L"HKEY_CURRENT_USER\\Software\\Microsoft\\Windows\\CurrentVersion\\Internet Settings\\ProxyEnable", 1},
+    {IGNORE_LIST_KEY, L"HKEY_CURRENT_USER\\Software\\ProxyEnabled", 0},
+
+    // not a list
+    {IGNORE_LIST_MAX, L"\\??\\PIPE\\lsarpc", 0},
+};
+
+static unsigned int g_failures;
+
+static void check(const char *what, int ret, int expected)
+{
+    if (ret != expected)
+        g_failures++;
+    printf("%s %d <= %s\n", ret == expected ? "ok" : "FAIL", ret, what);
+}
+
 int main()
 {
-    const wchar_t *unicode[] = {
-        L"abcd",
-        L"\\??\\IDE#what's up bro?",
-    };
-    for (int i = 0; i < ARRAYSIZE(unicode); i++) {
-        printf("%d <= %S\n",
-            is_ignored_file_unicode(unicode[i], wcslen(unicode[i])),
-            unicode[i]);
+    const wchar_t *s;
+    unsigned int i;
+    int ret;
+
+    ignore_init();
+
+    // nothing but wildcards makes no rule
+    check("rule *", add_ignore_ruleA(IGNORE_LIST_FILE, "*"), 0);
+    check("rule *abc*", add_ignore_ruleA(IGNORE_LIST_FILE, "*abc*"), 0);
+
+    check("rule *\\desktop.ini",
+        add_ignore_ruleA(IGNORE_LIST_FILE, "*\\desktop.ini"), 1);
+    s = L"C:\\pagefile.sys";
+    check("rule C:\\pagefile.sys",
+        add_ignore_rule(IGNORE_LIST_FILE, s, wcslen(s)), 1);
+    check("rule HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Cryptography\\*",
+        add_ignore_ruleA(IGNORE_LIST_KEY,
+            "HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Cryptography\\*"), 1);
+    check("rule *\\ProxyEnable",
+        add_ignore_ruleA(IGNORE_LIST_KEY, "*\\ProxyEnable"), 1);
+
+    for (i = 0; i < ARRAYSIZE(g_tests); i++) {
+        ret = is_ignored(g_tests[i].list, g_tests[i].name,
+            wcslen(g_tests[i].name));
+        if (ret != g_tests[i].expected)
+            g_failures++;
+        printf("%s %d <= %d:%S\n", ret == g_tests[i].expected ? "ok" : "FAIL",
+            ret, g_tests[i].list, g_tests[i].name);
     }
+
+    // the wrappers the hooks use
+    s = L"\\??\\STORAGE#Volume";
+    check("is_ignored_file_unicode", is_ignored_file_unicode(s, wcslen(s)), 1);
+    s = L"HKEY_CURRENT_USER\\Software";
+    check("is_ignored_key_unicode", is_ignored_key_unicode(s, wcslen(s)), 0);
+
+    printf("%u failure(s)\n", g_failures);
+    return g_failures != 0;
 }
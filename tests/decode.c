@@ -0,0 +1,186 @@
+/*
+ * single instruction decoder throughput:
+ *
+ *   cc -O2 -I.. -I../distorm3.2-package/include decode.c ../decode.c
+ *       plus every source file in ../distorm3.2-package/src
+ *
+ * it decodes the instructions a trampoline would steal (the first 16 bytes)
+ * from a corpus of ntdll/kernel32/kernelbase prologues.  On Windows the
+ * corpus is taken from every export of the loaded ntdll and kernel32,
+ * elsewhere a built-in set of common prologues is used, which also checks
+ * the decoded lengths
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include "../exports.h"
+#endif
+#include "../decode.h"
+
+#define ITERATIONS 20000
+#define STOLEN_BYTES 16
+
+typedef struct _prologue_t {
+    const char *name;
+    int mode;
+    unsigned char code[32];
+    // lengths of the instructions covering the first STOLEN_BYTES bytes
+    unsigned char lengths[12];
+    // bit n set if instruction n is rip relative, and their immediate size
+    unsigned char rip_mask, rip_imm;
+} prologue_t;
+
+static prologue_t g_builtin[] = {
+    // x86 ntdll system call stubs (xp/7, then 8/10 wow64)
+    {"ntdll!NtCreateFile (7)", DECODE_32BIT,
+        {0xb8, 0x42, 0x00, 0x00, 0x00, 0xba, 0x00, 0x03, 0xfe, 0x7f, 0xff, 0x12, 0xc2, 0x2c, 0x00, 0x90, 0x90},
+        {5, 5, 2, 3, 1}},
+    {"ntdll!NtClose (10 wow64)", DECODE_32BIT,
+        {0xb8, 0x0f, 0x00, 0x03, 0x00, 0xba, 0x60, 0x8d, 0x2e, 0x77, 0xff, 0xd2, 0xc2, 0x04, 0x00, 0x90, 0x90},
+        {5, 5, 2, 3, 1}},
+    // x86 hotpatchable prologues
+    {"kernel32!CreateFileW", DECODE_32BIT,
+        {0x8b, 0xff, 0x55, 0x8b, 0xec, 0x51, 0x51, 0x8b, 0x45, 0x08, 0x53, 0x56, 0x57, 0x83, 0x65, 0xf8, 0x00},
+        {2, 1, 2, 1, 1, 3, 1, 1, 1, 4}},
+    {"kernel32!ReadProcessMemory (stub)", DECODE_32BIT,
+        {0x8b, 0xff, 0x55, 0x8b, 0xec, 0x5d, 0xeb, 0x05, 0x90, 0x90, 0x90, 0x90, 0x90, 0xff, 0x25, 0x10, 0x19, 0x80, 0x7c},
+        {2, 1, 2, 1, 2, 1, 1, 1, 1, 1, 6}},
+    {"kernelbase!LoadLibraryExW", DECODE_32BIT,
+        {0x6a, 0x34, 0x68, 0x60, 0x2f, 0x81, 0x75, 0xe8, 0x1e, 0x4b, 0xff, 0xff, 0x33, 0xdb, 0x89, 0x5d, 0xe4},
+        {2, 5, 5, 2, 3}},
+    // x64 ntdll system call stubs (7, then 10)
+    {"ntdll!NtCreateFile (7 x64)", DECODE_64BIT,
+        {0x4c, 0x8b, 0xd1, 0xb8, 0x52, 0x00, 0x00, 0x00, 0x0f, 0x05, 0xc3, 0x0f, 0x1f, 0x44, 0x00, 0x00, 0x4c},
+        {3, 5, 2, 1, 5}},
+    {"ntdll!NtCreateFile (10 x64)", DECODE_64BIT,
+        {0x4c, 0x8b, 0xd1, 0xb8, 0x55, 0x00, 0x00, 0x00, 0xf6, 0x04, 0x25, 0x08, 0x03, 0xfe, 0x7f, 0x01, 0x75, 0x03, 0x0f, 0x05, 0xc3},
+        {3, 5, 8}},
+    // x64 prologues
+    {"kernelbase!CreateFileW", DECODE_64BIT,
+        {0x48, 0x8b, 0xc4, 0x48, 0x89, 0x58, 0x08, 0x48, 0x89, 0x68, 0x10, 0x48, 0x89, 0x70, 0x18, 0x57, 0x48},
+        {3, 4, 4, 4, 1}},
+    {"kernel32!GetTickCount", DECODE_64BIT,
+        {0x8b, 0x0c, 0x25, 0x04, 0x00, 0xfe, 0x7f, 0x8b, 0x04, 0x25, 0x20, 0x03, 0xfe, 0x7f, 0x48, 0x0f, 0xaf, 0xc1},
+        {7, 7, 4}},
+    {"kernelbase!Sleep", DECODE_64BIT,
+        {0x33, 0xd2, 0xe9, 0x09, 0x00, 0x00, 0x00, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc},
+        {2, 5, 1, 1, 1, 1, 1, 1, 1, 1}},
+    {"kernel32!ReadProcessMemory (import thunk)", DECODE_64BIT,
+        {0x48, 0xff, 0x25, 0x51, 0x0e, 0x06, 0x00, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc},
+        {7, 1, 1, 1, 1, 1, 1, 1, 1, 1}, 1, 0},
+    {"kernelbase!IsDebuggerPresent", DECODE_64BIT,
+        {0x65, 0x48, 0x8b, 0x04, 0x25, 0x60, 0x00, 0x00, 0x00, 0x0f, 0xb6, 0x40, 0x02, 0xc3, 0xcc, 0xcc, 0xcc},
+        {9, 4, 1, 1, 1, 1}},
+    {"kernelbase!SetErrorMode", DECODE_64BIT,
+        {0x83, 0x3d, 0x59, 0x8d, 0x16, 0x00, 0x00, 0x53, 0x48, 0x83, 0xec, 0x20, 0x8b, 0xd9, 0x74, 0x05, 0x90},
+        {7, 1, 4, 2, 2}, 1, 1},
+    {"kernelbase!SetUnhandledExceptionFilter", DECODE_64BIT,
+        {0x48, 0x8b, 0x05, 0xc1, 0x65, 0x17, 0x00, 0x48, 0x89, 0x0d, 0xba, 0x65, 0x17, 0x00, 0x48, 0x8b, 0xc8},
+        {7, 7, 3}, 3, 0},
+    {"ntdll!RtlDispatchException", DECODE_64BIT,
+        {0x40, 0x55, 0x56, 0x57, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x48, 0x8d, 0x6c, 0x24, 0xd1},
+        {2, 1, 1, 2, 2, 2, 2, 5}},
+};
+
+static unsigned char *g_corpus;
+static int *g_corpus_modes;
+static unsigned int g_corpus_count;
+
+static int check_builtin(void)
+{
+    unsigned int i, j, off;
+    int errors = 0;
+    insn_t insn;
+
+    for (i = 0; i < sizeof(g_builtin) / sizeof(g_builtin[0]); i++) {
+        prologue_t *p = &g_builtin[i];
+        for (j = 0, off = 0; off < STOLEN_BYTES && p->lengths[j] != 0; j++) {
+            if (insn_decode(p->code + off, p->mode, &insn) != p->lengths[j]) {
+                printf("%s: instruction %u decoded as %u bytes, expected %u\n",
+                    p->name, j, insn.size, p->lengths[j]);
+                errors++;
+                break;
+            }
+            if (insn.rip_relative != ((p->rip_mask >> j) & 1) ||
+                    (insn.rip_relative && insn.imm_size != p->rip_imm)) {
+                printf("%s: instruction %u rip relative %d imm %u\n",
+                    p->name, j, insn.rip_relative, insn.imm_size);
+                errors++;
+            }
+            off += insn.size;
+        }
+    }
+    return errors;
+}
+
+static void add_corpus(const unsigned char *code, int mode)
+{
+    if ((g_corpus_count & 1023) == 0) {
+        g_corpus = realloc(g_corpus, (g_corpus_count + 1024) * 32);
+        g_corpus_modes = realloc(g_corpus_modes, (g_corpus_count + 1024) * sizeof(int));
+    }
+    memcpy(g_corpus + g_corpus_count * 32, code, 32);
+    g_corpus_modes[g_corpus_count++] = mode;
+}
+
+#ifdef _WIN32
+static void add_module(const wchar_t *library)
+{
+    const unsigned char *base = (const unsigned char *) GetModuleHandleW(library);
+    export_table_t *table = exports_parse(base, 0, 1);
+    MEMORY_BASIC_INFORMATION mbi;
+    unsigned int i;
+
+    if (table == NULL)
+        return;
+    for (i = 0; i < table->count; i++) {
+        const unsigned char *code = base + table->entries[i].rva;
+        // skip forwarders and exported data
+        if (table->entries[i].forwarder != NULL ||
+                !VirtualQuery(code, &mbi, sizeof(mbi)) ||
+                !(mbi.Protect & (PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE)))
+            continue;
+        add_corpus(code, sizeof(void *) == 8 ? DECODE_64BIT : DECODE_32BIT);
+    }
+    exports_free(table);
+}
+#endif
+
+int main()
+{
+    unsigned int i, j, off, decoded = 0, checksum = 0;
+    int errors = check_builtin();
+    clock_t start;
+    double elapsed;
+    insn_t insn;
+
+#ifdef _WIN32
+    add_module(L"ntdll");
+    add_module(L"kernel32");
+    add_module(L"kernelbase");
+#endif
+    if (g_corpus_count == 0) {
+        for (i = 0; i < sizeof(g_builtin) / sizeof(g_builtin[0]); i++)
+            add_corpus(g_builtin[i].code, g_builtin[i].mode);
+    }
+
+    start = clock();
+    for (j = 0; j < ITERATIONS; j++) {
+        for (i = 0; i < g_corpus_count; i++) {
+            for (off = 0; off < STOLEN_BYTES; off += insn.size) {
+                if (insn_decode(g_corpus + i * 32 + off, g_corpus_modes[i], &insn) == 0)
+                    break;
+                checksum += insn.size;
+                decoded++;
+            }
+        }
+    }
+    elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%u prologues, %u instructions in %.3fs, %.1f M insn/s (checksum %u), %d errors\n",
+        g_corpus_count, decoded, elapsed, decoded / elapsed / 1e6, checksum, errors);
+    return errors != 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * checks the export directory resolver against a plain linear scan of the
+ * export name table.  Builds on Linux as well, and can be fed any PE from
+ * disk:
+ *
+ *   cc -I.. -o exports exports.c ../exports.c && ./exports kernel32.dll [name...]
+ *
+ * on Windows, without arguments it compares resolve_export() against
+ * GetProcAddress() for every export of the loaded kernel32 and ntdll
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "../exports.h"
+
+static int check_table(const export_table_t *table)
+{
+    unsigned int i;
+    int errors = 0;
+
+    for (i = 0; i < table->count; i++) {
+        const export_entry_t *e = exports_lookup(table, table->entries[i].name);
+        if (e == NULL || e->rva != table->entries[i].rva) {
+            printf("mismatch for %s\n", table->entries[i].name);
+            errors++;
+        }
+    }
+    if (exports_lookup(table, "ThisFunctionDoesNotExist") != NULL) {
+        printf("found a function that doesn't exist\n");
+        errors++;
+    }
+    return errors;
+}
+
+static int check_file(const char *path, int argc, char **argv)
+{
+    unsigned char *buf;
+    export_table_t *table;
+    long size;
+    int errors, i;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        printf("unable to open %s\n", path);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = malloc(size);
+    if (buf == NULL || fread(buf, 1, size, fp) != (size_t) size) {
+        printf("unable to read %s\n", path);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+
+    table = exports_parse(buf, size, 0);
+    if (table == NULL) {
+        printf("%s: no export directory\n", path);
+        free(buf);
+        return 1;
+    }
+
+    errors = check_table(table);
+    printf("%s: %u named exports, %d errors\n", path, table->count, errors);
+
+    for (i = 0; i < argc; i++) {
+        const export_entry_t *e = exports_lookup(table, argv[i]);
+        if (e == NULL)
+            printf("  %s: not found\n", argv[i]);
+        else if (e->forwarder != NULL)
+            printf("  %s: forwarded to %s\n", argv[i], e->forwarder);
+        else
+            printf("  %s: rva 0x%x\n", argv[i], e->rva);
+    }
+
+    exports_free(table);
+    free(buf);
+    return errors != 0;
+}
+
+#ifdef _WIN32
+static int check_module(const wchar_t *library)
+{
+    HMODULE mod = GetModuleHandleW(library);
+    export_table_t *table = exports_parse((const unsigned char *) mod, 0, 1);
+    unsigned int i;
+    int errors = 0;
+
+    if (table == NULL) {
+        printf("%S: no export directory\n", library);
+        return 1;
+    }
+    for (i = 0; i < table->count; i++) {
+        const char *name = table->entries[i].name;
+        if (resolve_export(library, name) != (void *) GetProcAddress(mod, name)) {
+            printf("%S!%s differs from GetProcAddress\n", library, name);
+            errors++;
+        }
+    }
+    printf("%S: %u named exports, %d errors\n", library, table->count, errors);
+    exports_free(table);
+    return errors != 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return check_file(argv[1], argc - 2, argv + 2);
+    }
+#ifdef _WIN32
+    exports_init();
+    return check_module(L"kernel32") | check_module(L"ntdll");
+#else
+    printf("usage: %s <pe file> [name...]\n", argv[0]);
+    return 1;
+#endif
+}
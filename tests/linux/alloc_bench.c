@@ -0,0 +1,368 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Microbenchmark for the slab allocator in alloc.c, against the private
+// heap it sits in front of.
+//
+// The private heap is modelled as malloc behind a single lock, which is
+// what a heap created without HEAP_NO_SERIALIZE amounts to for threads
+// hooking calls at the same time.  The workload is that of a logged call:
+// a handful of small blocks (lookup entries, a BSON buffer that grows, UTF-8
+// temporaries) and the odd larger one, freed again before the call returns.
+// Before timing anything, blocks are passed around between threads at
+// random and checked for overlaps.
+//
+//   alloc_bench [threads]
+//
+// Built with STATS=1, the counters of the statistics mode are printed at
+// the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "ntapi.h"
+#include "hooking.h"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+//
+// what alloc.c needs from Windows
+//
+
+HANDLE g_heap = (HANDLE)1;
+static pthread_mutex_t g_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+PVOID HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size)
+{
+	void *ret;
+
+	pthread_mutex_lock(&g_heap_lock);
+	ret = (flags & HEAP_ZERO_MEMORY) ? calloc(1, size) : malloc(size);
+	pthread_mutex_unlock(&g_heap_lock);
+	return ret;
+}
+
+PVOID HeapReAlloc(HANDLE heap, DWORD flags, PVOID ptr, SIZE_T size)
+{
+	void *ret;
+
+	pthread_mutex_lock(&g_heap_lock);
+	ret = realloc(ptr, size);
+	pthread_mutex_unlock(&g_heap_lock);
+	return ret;
+}
+
+BOOL HeapFree(HANDLE heap, DWORD flags, PVOID ptr)
+{
+	pthread_mutex_lock(&g_heap_lock);
+	free(ptr);
+	pthread_mutex_unlock(&g_heap_lock);
+	return TRUE;
+}
+
+// room for the TLS slots at either bitness' offset
+static __thread ULONG_PTR g_teb[0x2000 / sizeof(ULONG_PTR)];
+static volatile LONG g_tls_next;
+
+PVOID NtCurrentTeb(void)
+{
+	return g_teb;
+}
+
+HANDLE GetCurrentProcess(void)
+{
+	return (HANDLE)-1;
+}
+
+DWORD TlsAlloc(void)
+{
+	return InterlockedIncrement(&g_tls_next);
+}
+
+static NTSTATUS WINAPI bench_NtAllocateVirtualMemory(HANDLE ProcessHandle,
+	PVOID *BaseAddress, ULONG_PTR ZeroBits, PSIZE_T RegionSize,
+	ULONG AllocationType, ULONG Protect)
+{
+	int prot = Protect == PAGE_READWRITE ? PROT_READ | PROT_WRITE : PROT_NONE;
+	void *p;
+
+	if (AllocationType & MEM_RESERVE) {
+		p = mmap(NULL, *RegionSize, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		*BaseAddress = p;
+		return 0;
+	}
+	return mprotect(*BaseAddress, *RegionSize, prot) ? -1 : 0;
+}
+
+_NtAllocateVirtualMemory pNtAllocateVirtualMemory = &bench_NtAllocateVirtualMemory;
+
+//
+// the private heap on its own, as cm_alloc/cm_free were before
+//
+
+static void *heap_alloc(size_t size)
+{
+	void *ret;
+	lasterror_t lasterror;
+
+	get_lasterrors(&lasterror);
+	ret = HeapAlloc(g_heap, 0, size);
+	set_lasterrors(&lasterror);
+	return ret;
+}
+
+static void *heap_realloc(void *ptr, size_t size)
+{
+	void *ret;
+	lasterror_t lasterror;
+
+	get_lasterrors(&lasterror);
+	ret = HeapReAlloc(g_heap, 0, ptr, size);
+	set_lasterrors(&lasterror);
+	return ret;
+}
+
+static void heap_free(void *ptr)
+{
+	lasterror_t lasterror;
+
+	get_lasterrors(&lasterror);
+	HeapFree(g_heap, 0, ptr);
+	set_lasterrors(&lasterror);
+}
+
+//
+// checks
+//
+
+#define CHECK_SLOTS 4096
+#define CHECK_OPS 1000000
+#define CHECK_THREADS 4
+
+static void *volatile g_slots[CHECK_SLOTS];
+static volatile LONG g_errors;
+
+static unsigned int rnd(unsigned int *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+// a block starts with its size and is filled with a byte derived from its
+// address, so that two live blocks sharing memory show up
+static void *check_fill(void *p, unsigned int size)
+{
+	unsigned char c = (unsigned char)((ULONG_PTR)p >> 4);
+
+	if (p == NULL)
+		return NULL;
+	memset((char *)p + sizeof(unsigned int), c, size - sizeof(unsigned int));
+	*(unsigned int *)p = size;
+	return p;
+}
+
+static int is_zeroed(const void *p, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		if (((const unsigned char *)p)[i] != 0)
+			return 0;
+	return 1;
+}
+
+static void check_block(void *p, ULONG_PTR fill_of)
+{
+	unsigned int size = *(unsigned int *)p, i;
+	unsigned char c = (unsigned char)(fill_of >> 4);
+
+	for (i = sizeof(unsigned int); i < size; i++) {
+		if (((unsigned char *)p)[i] != c) {
+			InterlockedIncrement(&g_errors);
+			return;
+		}
+	}
+}
+
+static void *check_worker(void *param)
+{
+	unsigned int state = (unsigned int)(ULONG_PTR)param + 1;
+	unsigned int op, i, size;
+	void *p, *q;
+
+	for (op = 0; op < CHECK_OPS; op++) {
+		i = rnd(&state) % CHECK_SLOTS;
+		p = __sync_lock_test_and_set(&g_slots[i], NULL);
+		if (p != NULL) {
+			check_block(p, (ULONG_PTR)p);
+			if (rnd(&state) % 8 == 0) {
+				// grow it, the contents have to follow
+				size = *(unsigned int *)p;
+				q = cm_realloc(p, size + rnd(&state) % 3000);
+				if (q == NULL) {
+					InterlockedIncrement(&g_errors);
+					continue;
+				}
+				check_block(q, (ULONG_PTR)p);
+				cm_free(q);
+			}
+			else
+				cm_free(p);
+			continue;
+		}
+
+		// mostly small ones, now and then one for the heap
+		size = sizeof(unsigned int) + rnd(&state) % (rnd(&state) % 16 ? 512 : 8192);
+		if (rnd(&state) % 4 == 0) {
+			p = cm_calloc(1, size);
+			if (p != NULL && !is_zeroed(p, size))
+				InterlockedIncrement(&g_errors);
+		}
+		else
+			p = cm_alloc(size);
+		if (check_fill(p, size) == NULL) {
+			InterlockedIncrement(&g_errors);
+			continue;
+		}
+		if (!__sync_bool_compare_and_swap(&g_slots[i], NULL, p))
+			cm_free(p);
+	}
+	// as on DLL_THREAD_DETACH
+	cm_alloc_thread_detach();
+	return NULL;
+}
+
+static int check_allocator(void)
+{
+	pthread_t tids[CHECK_THREADS];
+	unsigned int i;
+
+	for (i = 0; i < CHECK_THREADS; i++)
+		pthread_create(&tids[i], NULL, check_worker, (void *)(ULONG_PTR)i);
+	for (i = 0; i < CHECK_THREADS; i++)
+		pthread_join(tids[i], NULL);
+	for (i = 0; i < CHECK_SLOTS; i++) {
+		if (g_slots[i] != NULL) {
+			check_block(g_slots[i], (ULONG_PTR)g_slots[i]);
+			cm_free(g_slots[i]);
+			g_slots[i] = NULL;
+		}
+	}
+
+	printf("blocks passed between %u threads: %d error(s)\n", CHECK_THREADS, g_errors);
+	return g_errors;
+}
+
+//
+// benchmark
+//
+
+#define CYCLES 500000
+
+typedef struct _allocator_t {
+	void *(*alloc)(size_t size);
+	void *(*realloc)(void *ptr, size_t size);
+	void (*free)(void *ptr);
+} allocator_t;
+
+static const allocator_t g_heap_allocator = { heap_alloc, heap_realloc, heap_free };
+static const allocator_t g_slab_allocator = { cm_alloc, cm_realloc, cm_free };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one logged call: the handle lookup entry, a UTF-8 copy of an argument,
+// the BSON buffer growing while the arguments get added to it and, for
+// every 16th call, a buffer too large for the slabs
+static void *bench_worker(void *param)
+{
+	const allocator_t *a = (const allocator_t *)param;
+	void *entry, *utf8, *bson, *large;
+	unsigned int i;
+
+	for (i = 0; i < CYCLES; i++) {
+		entry = a->alloc(40);
+		utf8 = a->alloc(24 + i % 200);
+		bson = a->alloc(128);
+		bson = a->realloc(bson, 256);
+		bson = a->realloc(bson, 512 + i % 512);
+		large = i % 16 ? NULL : a->alloc(4096 + i % 4096);
+		*(char *)entry = *(char *)utf8 = *(char *)bson = 0;
+		if (large != NULL)
+			a->free(large);
+		a->free(utf8);
+		a->free(bson);
+		a->free(entry);
+	}
+	cm_alloc_thread_detach();
+	return NULL;
+}
+
+static double run(const allocator_t *a, unsigned int threads)
+{
+	pthread_t tids[64];
+	unsigned int i;
+	double start = now();
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, bench_worker, (void *)a);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	// nanoseconds per logged call, over all threads
+	return (now() - start) * 1e9 / ((double)CYCLES * threads);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int thread_counts[] = { 1, 4, 8 };
+	unsigned int i;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	if (argc > 1) {
+		thread_counts[0] = atoi(argv[1]);
+		thread_counts[1] = thread_counts[2] = 0;
+	}
+
+	cm_alloc_init();
+
+	if (check_allocator() != 0)
+		return 1;
+
+	printf("ns per logged call        heap   slab\n");
+	for (i = 0; i < 3 && thread_counts[i]; i++) {
+		double heap_ns = run(&g_heap_allocator, thread_counts[i]);
+		double slab_ns = run(&g_slab_allocator, thread_counts[i]);
+		printf("%2u thread(s)          %7.1f %6.1f\n", thread_counts[i],
+			heap_ns, slab_ns);
+	}
+
+	cm_alloc_report();
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// exposes the x86 trampoline builder to prologues.c, which links it next to
+// the x64 one (see builder_64.c), so the exported names get a suffix
+
+#define lde lde32
+#define hook_api hook_api32
+#define operate_on_backtrace operate_on_backtrace32
+#define g_hkcu g_hkcu32
+
+#include "../../hooking_32.c"
+
+int build_trampoline32(unsigned char *addr, int len, unsigned char *tramp)
+{
+	return hook_create_trampoline(addr, len, tramp);
+}
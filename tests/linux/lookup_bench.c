@@ -0,0 +1,289 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Microbenchmark for lookup.c, against the linked list it replaced.
+//
+// The workload is the one hook_file.c puts on g_files: a number of files
+// kept open while other handles get opened, written to (a lookup) and
+// closed (a delete), from one or more threads.  Before timing anything the
+// table is checked against a plain array with random operations.
+//
+//   lookup_bench [open handles] [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ntapi.h"
+#include "lookup.h"
+
+//
+// the previous lookup_t, a list behind one lock
+//
+
+typedef struct _entry_t {
+	struct _entry_t *next;
+	unsigned int id;
+	unsigned int size;
+	unsigned char data[0];
+} entry_t;
+
+typedef struct _list_t {
+	CRITICAL_SECTION cs;
+	entry_t *root;
+} list_t;
+
+static void list_init(list_t *d)
+{
+	d->root = NULL;
+	InitializeCriticalSection(&d->cs);
+}
+
+static void *list_add(list_t *d, unsigned int id, unsigned int size)
+{
+	entry_t *t = (entry_t *)malloc(sizeof(entry_t) + size);
+	EnterCriticalSection(&d->cs);
+	memset(t, 0, sizeof(*t));
+	t->next = d->root;
+	t->id = id;
+	t->size = size;
+	d->root = t;
+	LeaveCriticalSection(&d->cs);
+	return t->data;
+}
+
+static void *list_get(list_t *d, unsigned int id, unsigned int *size)
+{
+	entry_t *p;
+	EnterCriticalSection(&d->cs);
+	for (p = d->root; p != NULL; p = p->next) {
+		if (p->id == id) {
+			if (size != NULL)
+				*size = p->size;
+			LeaveCriticalSection(&d->cs);
+			return p->data;
+		}
+	}
+	LeaveCriticalSection(&d->cs);
+	return NULL;
+}
+
+static void list_del(list_t *d, unsigned int id)
+{
+	entry_t *p, *last;
+
+	EnterCriticalSection(&d->cs);
+	p = d->root;
+	if (p != NULL && p->id == id) {
+		d->root = p->next;
+		free(p);
+		LeaveCriticalSection(&d->cs);
+		return;
+	}
+	for (last = NULL; p != NULL; last = p, p = p->next) {
+		if (p->id == id) {
+			last->next = p->next;
+			free(p);
+			break;
+		}
+	}
+	LeaveCriticalSection(&d->cs);
+}
+
+//
+// checks
+//
+
+#define CHECK_IDS 4096
+
+static unsigned int g_rand_state = 1;
+
+static unsigned int rnd(void)
+{
+	g_rand_state = g_rand_state * 1103515245 + 12345;
+	return g_rand_state >> 8;
+}
+
+static ULONG_PTR check_id(unsigned int i)
+{
+	// handle like values, half of them beyond 32 bits
+	return ((ULONG_PTR)(i & 1) << 40) + (i / 2) * 4 + 4;
+}
+
+static int check_table(void)
+{
+	static ULONG_PTR ref[CHECK_IDS];
+	static unsigned char present[CHECK_IDS], inline_value[CHECK_IDS];
+	lookup_t d;
+	unsigned int i, op, size, errors = 0;
+	ULONG_PTR value;
+	void *data;
+
+	lookup_init(&d);
+	for (op = 0; op < 2000000; op++) {
+		i = rnd() % CHECK_IDS;
+		switch (rnd() % 4) {
+		case 0:
+			ref[i] = rnd();
+			if (op & 1) {
+				data = lookup_add(&d, check_id(i), 8 + i % 16);
+				*(ULONG_PTR *)data = ref[i];
+			}
+			else {
+				static const unsigned char zero[16];
+				lookup_put(&d, check_id(i), &ref[i], 8, zero, i % 16);
+			}
+			present[i] = 1;
+			inline_value[i] = 0;
+			break;
+		case 1:
+			lookup_set(&d, check_id(i), ref[i] = rnd());
+			present[i] = 1;
+			inline_value[i] = 1;
+			break;
+		case 2:
+			lookup_del(&d, check_id(i));
+			present[i] = 0;
+			break;
+		default:
+			data = lookup_get(&d, check_id(i), &size);
+			if (present[i] && !inline_value[i]) {
+				if (data == NULL || size != 8 + i % 16 || *(ULONG_PTR *)data != ref[i])
+					errors++;
+			}
+			else if (data != NULL)
+				errors++;
+			if (lookup_get_value(&d, check_id(i), &value) != (present[i] && inline_value[i]) ||
+				(present[i] && inline_value[i] && value != ref[i]))
+				errors++;
+			break;
+		}
+	}
+	lookup_free(&d);
+
+	printf("random operations against a plain array: %u error(s)\n", errors);
+	return errors;
+}
+
+//
+// benchmark
+//
+
+#define CYCLES 200000
+
+static lookup_t g_table;
+static list_t g_list;
+static unsigned int g_open_handles;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// every cycle opens a file (add), writes to it (get) and closes it (del),
+// next to the files every thread keeps open
+static void *table_worker(void *param)
+{
+	ULONG_PTR base = 0x100000 * ((ULONG_PTR)param + 1), h;
+	unsigned int i;
+
+	for (i = 0; i < CYCLES; i++) {
+		h = base + (i % 64) * 4;
+		lookup_add(&g_table, h, 64);
+		lookup_get(&g_table, h, NULL);
+		lookup_del(&g_table, h);
+		// a close of a handle that isn't a file
+		lookup_del(&g_table, h + 0x80000);
+	}
+	return NULL;
+}
+
+static void *list_worker(void *param)
+{
+	unsigned int base = 0x100000 * ((unsigned int)(ULONG_PTR)param + 1), h;
+	unsigned int i;
+
+	for (i = 0; i < CYCLES / 10; i++) {
+		h = base + (i % 64) * 4;
+		list_add(&g_list, h, 64);
+		list_get(&g_list, h, NULL);
+		list_del(&g_list, h);
+		list_del(&g_list, h + 0x80000);
+	}
+	return NULL;
+}
+
+static double run(void *(*worker)(void *), unsigned int threads, unsigned int cycles)
+{
+	pthread_t tids[64];
+	unsigned int i;
+	double start = now();
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, worker, (void *)(ULONG_PTR)i);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	// nanoseconds per open/write/close cycle, over all threads
+	return (now() - start) * 1e9 / ((double)cycles * threads);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int open_counts[] = { 16, 1000, 10000 };
+	unsigned int thread_counts[] = { 1, 4 };
+	unsigned int i, j, k;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	if (argc > 1) {
+		open_counts[0] = atoi(argv[1]);
+		open_counts[1] = open_counts[2] = 0;
+	}
+	if (argc > 2) {
+		thread_counts[0] = atoi(argv[2]);
+		thread_counts[1] = 0;
+	}
+
+	if (check_table() != 0)
+		return 1;
+
+	printf("ns per open/write/close cycle   list  table\n");
+	for (i = 0; i < 3 && open_counts[i]; i++) {
+		for (j = 0; j < 2 && thread_counts[j]; j++) {
+			double list_ns, table_ns;
+
+			g_open_handles = open_counts[i];
+			lookup_init(&g_table);
+			list_init(&g_list);
+			for (k = 0; k < g_open_handles; k++) {
+				lookup_add(&g_table, 0x10000000 + k * 4, 64);
+				list_add(&g_list, 0x10000000 + k * 4, 64);
+			}
+
+			list_ns = run(&list_worker, thread_counts[j], CYCLES / 10);
+			table_ns = run(&table_worker, thread_counts[j], CYCLES);
+			printf("%6u open, %u thread(s)  %9.1f %6.1f\n", g_open_handles,
+				thread_counts[j], list_ns, table_ns);
+
+			lookup_free(&g_table);
+		}
+	}
+	return 0;
+}
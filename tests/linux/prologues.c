@@ -0,0 +1,771 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Prologue corpus and fuzzer for hook_create_trampoline().
+//
+// Corpus mode loads every PE image given on the command line (directories
+// are walked), and runs the x86 or x64 trampoline builder on each of its
+// exports and its entry point for every length the hook types steal.  It reports how many
+// prologues can't be hooked and why, along with the sizes of the
+// trampolines and the instructions that had to be relocated.
+//
+//   prologues [-v] [-p] <file or directory>...
+//     -v  list every prologue that can't be hooked
+//     -p  use the function starts from .pdata (x64) instead of the exports
+//         and the entry point
+//
+// Fuzz mode generates random prologues out of simple instructions (including
+// rip relative operands, calls and forward jumps), and runs the relocated
+// copy built by the x64 builder against the original, with the stolen bytes
+// of the original overwritten by int3's as a real hook would.  Only x64 code
+// can be run here, the x86 builder is covered by corpus mode only.
+//
+//   prologues -f [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "decode.h"
+
+// builder_32.c and builder_64.c
+int build_trampoline32(unsigned char *addr, int len, unsigned char *tramp);
+int build_trampoline64(unsigned char *addr, int len, unsigned char *tramp);
+
+// what the trampoline code needs beyond stubs.c, none of it is used here
+unsigned int g_tls_hook_index = 64;
+struct _hook_data_t *alloc_hookdata_near(void *addr) { return NULL; }
+#ifdef __x86_64__
+__attribute__((ms_abi))
+#else
+__attribute__((stdcall))
+#endif
+int enter_hook(unsigned char is_special_hook, unsigned long _ebp, unsigned long retaddr) { return 0; }
+
+// size of hook_data_t.tramp
+#define TRAMP_SIZE 128
+
+// how many bytes hook_types[] steal in hooking_32.c/hooking_64.c, the first
+// entry is the one set_hooks() uses (HOOKTYPE in cuckoomon.c)
+static const int g_steal32[] = { 8, 5, 6, 7, 11 };
+static const int g_steal64[] = { 6, 14 };
+#define MAX_STEALS 5
+
+enum {
+	REASON_UNDECODABLE,
+	REASON_RET,
+	REASON_JMP_REL32,
+	REASON_JMP_REL8,
+	REASON_BRANCH_INTO,
+	REASON_OTHER,
+	REASON_MAX
+};
+
+static const char *g_reasons[] = {
+	"undecodable instruction",
+	"ret inside the stolen bytes",
+	"jmp rel32 inside the stolen bytes",
+	"jmp rel8 inside the stolen bytes",
+	"branch into the stolen bytes",
+	"rejected for another reason",
+};
+
+enum {
+	RELOC_RIP,
+	RELOC_CALL,
+	RELOC_REL32,
+	RELOC_JCC8,
+	RELOC_JMP8,
+	RELOC_MAX
+};
+
+typedef struct _steal_stats_t {
+	unsigned int hooked;
+	unsigned int failed;
+	unsigned int reasons[REASON_MAX];
+	unsigned long long tramp_bytes;
+	unsigned int tramp_max;
+	unsigned int relocs[RELOC_MAX];
+} steal_stats_t;
+
+typedef struct _arch_stats_t {
+	const char *name;
+	int mode;
+	const int *steals;
+	unsigned int steal_count;
+	int (*build)(unsigned char *addr, int len, unsigned char *tramp);
+	unsigned int images;
+	unsigned int prologues;
+	unsigned int skipped;
+	steal_stats_t steal[MAX_STEALS];
+} arch_stats_t;
+
+static arch_stats_t g_x86 = { "x86", DECODE_32BIT, g_steal32, 5, &build_trampoline32 };
+static arch_stats_t g_x64 = { "x64", DECODE_64BIT, g_steal64, 2, &build_trampoline64 };
+
+static int g_verbose;
+static int g_use_pdata;
+
+static unsigned int rd16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int rd32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// walks the instructions hook_create_trampoline() steals, the same way it
+// does, to find out why it gave up or what it had to relocate.  returns
+// the reason or -1
+static int walk_prologue(const unsigned char *addr, int len, int mode, unsigned int *relocs)
+{
+	const unsigned char *start = addr, *targets[32];
+	unsigned int count = 0, i;
+	insn_t insn;
+	int length;
+
+	while (len > 0) {
+		length = insn_decode(addr, mode, &insn);
+		if (length == 0)
+			return REASON_UNDECODABLE;
+		len -= length;
+
+		if (addr[0] == 0xe8 || addr[0] == 0xe9 || (addr[0] == 0x0f && addr[1] >= 0x80 && addr[1] < 0x90)) {
+			if (addr[0] == 0xe9 && len > 0)
+				return REASON_JMP_REL32;
+			relocs[addr[0] == 0xe8 ? RELOC_CALL : RELOC_REL32]++;
+			targets[count++] = addr + length + *(int *)(addr + length - 4);
+		}
+		else if (addr[0] == 0xeb) {
+			if (len > 0)
+				return REASON_JMP_REL8;
+			relocs[RELOC_JMP8]++;
+			targets[count++] = addr + 2 + (signed char)addr[1];
+		}
+		else if (addr[0] == 0xe3 || (addr[0] & 0xf0) == 0x70) {
+			relocs[RELOC_JCC8]++;
+			targets[count++] = addr + 2 + (signed char)addr[1];
+		}
+		else if ((addr[0] == 0xc3 || addr[0] == 0xc2) && len > 0)
+			return REASON_RET;
+		else if (insn.rip_relative)
+			relocs[RELOC_RIP]++;
+
+		addr += length;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (targets[i] >= start && targets[i] < addr)
+			return REASON_BRANCH_INTO;
+	}
+	return -1;
+}
+
+static void dump_bytes(const unsigned char *p, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		printf(" %02x", p[i]);
+	printf("\n");
+}
+
+static void check_prologue(arch_stats_t *arch, const char *file, const char *name,
+	unsigned char *addr, unsigned char *tramp)
+{
+	unsigned int relocs[RELOC_MAX];
+	unsigned int i, j;
+	int size, reason;
+
+	arch->prologues++;
+	for (i = 0; i < arch->steal_count; i++) {
+		steal_stats_t *s = &arch->steal[i];
+
+		memset(relocs, 0, sizeof(relocs));
+		reason = walk_prologue(addr, arch->steals[i], arch->mode, relocs);
+		size = arch->build(addr, arch->steals[i], tramp);
+
+		if (size == 0) {
+			if (reason < 0)
+				reason = REASON_OTHER;
+			s->failed++;
+			s->reasons[reason]++;
+			if (g_verbose) {
+				printf("  %s!%s steal %d: %s,", file, name, arch->steals[i], g_reasons[reason]);
+				dump_bytes(addr, 16);
+			}
+			continue;
+		}
+
+		// the x64 builder redirects those to the trampoline
+		if (reason == REASON_BRANCH_INTO && arch->mode == DECODE_64BIT)
+			reason = -1;
+		if (reason >= 0 && g_verbose) {
+			printf("  %s!%s steal %d: hooked despite %s,", file, name,
+				arch->steals[i], g_reasons[reason]);
+			dump_bytes(addr, 16);
+		}
+		s->hooked++;
+		s->tramp_bytes += size;
+		if ((unsigned int)size > s->tramp_max)
+			s->tramp_max = size;
+		for (j = 0; j < RELOC_MAX; j++)
+			s->relocs[j] += relocs[j];
+	}
+}
+
+static const unsigned char *section_of(const unsigned char *sections, unsigned int count, unsigned int rva)
+{
+	unsigned int i, va, vsize;
+
+	for (i = 0; i < count; i++) {
+		const unsigned char *sec = sections + i * 40;
+		va = rd32(sec + 12);
+		vsize = rd32(sec + 8);
+		if (vsize < rd32(sec + 16))
+			vsize = rd32(sec + 16);
+		if (rva >= va && rva - va < vsize)
+			return sec;
+	}
+	return NULL;
+}
+
+// returns 1 if rva is code we can read a whole prologue from
+static int is_code(const unsigned char *sections, unsigned int count,
+	unsigned int image_size, unsigned int rva)
+{
+	const unsigned char *sec = section_of(sections, count, rva);
+
+	// IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE
+	if (sec == NULL || !(rd32(sec + 36) & 0x20000020))
+		return 0;
+	return rva + 32 <= image_size;
+}
+
+static void check_image(const char *file, const unsigned char *raw, size_t size)
+{
+	const unsigned char *nt, *opt, *sections;
+	unsigned int lfanew, machine, num_sections, image_size, headers_size, i;
+	unsigned char *image, *tramp;
+	arch_stats_t *arch;
+	size_t map_size;
+	char name[32];
+
+	if (size < 0x40 || raw[0] != 'M' || raw[1] != 'Z')
+		return;
+	lfanew = rd32(raw + 0x3c);
+	if (lfanew > size || size - lfanew < 24 + 112 || rd32(raw + lfanew) != 0x00004550)
+		return;
+
+	nt = raw + lfanew;
+	machine = rd16(nt + 4);
+	num_sections = rd16(nt + 6);
+	opt = nt + 24;
+	sections = opt + rd16(nt + 20);
+	if ((size_t)(sections - raw) + num_sections * 40 > size)
+		return;
+	image_size = rd32(opt + 56);
+	headers_size = rd32(opt + 60);
+
+	if (machine == 0x14c && rd16(opt) == 0x10b)
+		arch = &g_x86;
+	else if (machine == 0x8664 && rd16(opt) == 0x20b)
+		arch = &g_x64;
+	else
+		return;
+	if (image_size == 0 || image_size > 512 * 1024 * 1024 || headers_size > size)
+		return;
+
+	// the trampoline goes right behind the image, so that x64 rip relative
+	// operands stay within range
+	map_size = ((size_t)image_size + 0xfff) & ~(size_t)0xfff;
+	image = mmap(NULL, map_size + 0x1000, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (image == MAP_FAILED)
+		return;
+	tramp = image + map_size;
+
+	// map the sections where the loader would put them
+	memcpy(image, raw, headers_size < image_size ? headers_size : image_size);
+	for (i = 0; i < num_sections; i++) {
+		const unsigned char *sec = sections + i * 40;
+		unsigned int va = rd32(sec + 12), rawsize = rd32(sec + 16), rawptr = rd32(sec + 20);
+		if (rawptr > size || va > image_size)
+			continue;
+		if (rawsize > size - rawptr)
+			rawsize = (unsigned int)(size - rawptr);
+		if (rawsize > image_size - va)
+			rawsize = image_size - va;
+		memcpy(image + va, raw + rawptr, rawsize);
+	}
+	sections = image + (sections - raw);
+	opt = image + (opt - raw);
+
+	arch->images++;
+
+	if (g_use_pdata) {
+		// RUNTIME_FUNCTION { BeginAddress, EndAddress, UnwindData }
+		unsigned int dir_rva = 0, dir_size = 0;
+		if (arch == &g_x64 && rd32(opt + 108) > 3) {
+			dir_rva = rd32(opt + 112 + 3 * 8);
+			dir_size = rd32(opt + 112 + 3 * 8 + 4);
+		}
+		if (dir_rva > image_size || dir_size > image_size - dir_rva)
+			dir_size = 0;
+		for (i = 0; i + 12 <= dir_size; i += 12) {
+			unsigned int rva = rd32(image + dir_rva + i);
+			if (!is_code(sections, num_sections, image_size, rva)) {
+				arch->skipped++;
+				continue;
+			}
+			snprintf(name, sizeof(name), "sub_%x", rva);
+			check_prologue(arch, file, name, image + rva, tramp);
+		}
+	}
+	else {
+		// IMAGE_EXPORT_DIRECTORY, forwarders point back into the directory
+		unsigned int dir_rva = rd32(opt + (arch == &g_x64 ? 112 : 96));
+		unsigned int dir_size = rd32(opt + (arch == &g_x64 ? 116 : 100));
+		unsigned int names, funcs, ordinals, count;
+		if (dir_rva == 0 || dir_rva > image_size || 40 > image_size - dir_rva)
+			count = 0;
+		else {
+			count = rd32(image + dir_rva + 24);
+			funcs = rd32(image + dir_rva + 28);
+			names = rd32(image + dir_rva + 32);
+			ordinals = rd32(image + dir_rva + 36);
+			if (names > image_size || ordinals > image_size || funcs > image_size ||
+				count > (image_size - names) / 4 || count > (image_size - ordinals) / 2)
+				count = 0;
+		}
+		for (i = 0; i < count; i++) {
+			unsigned int ordinal = rd16(image + ordinals + i * 2);
+			unsigned int name_rva = rd32(image + names + i * 4);
+			unsigned int rva;
+			if (funcs + ordinal * 4 + 4 > image_size || name_rva >= image_size)
+				continue;
+			rva = rd32(image + funcs + ordinal * 4);
+			if ((rva >= dir_rva && rva - dir_rva < dir_size) ||
+				!is_code(sections, num_sections, image_size, rva)) {
+				arch->skipped++;
+				continue;
+			}
+			snprintf(name, sizeof(name), "%.*s", (int)(image_size - name_rva), image + name_rva);
+			check_prologue(arch, file, name, image + rva, tramp);
+		}
+		// executables rarely export anything
+		if (is_code(sections, num_sections, image_size, rd32(opt + 16)))
+			check_prologue(arch, file, "<entry>", image + rd32(opt + 16), tramp);
+	}
+
+	munmap(image, map_size + 0x1000);
+}
+
+static void check_path(const char *path)
+{
+	struct stat st;
+	unsigned char *raw;
+	FILE *fp;
+
+	if (stat(path, &st) != 0)
+		return;
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(path);
+		struct dirent *ent;
+		char child[4096];
+
+		if (dir == NULL)
+			return;
+		while ((ent = readdir(dir)) != NULL) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;
+			snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+			check_path(child);
+		}
+		closedir(dir);
+		return;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size < 0x40 || st.st_size > 512 * 1024 * 1024)
+		return;
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return;
+	raw = malloc(st.st_size);
+	if (raw != NULL && fread(raw, 1, st.st_size, fp) == (size_t)st.st_size)
+		check_image(path, raw, st.st_size);
+	free(raw);
+	fclose(fp);
+}
+
+static void report(const arch_stats_t *arch)
+{
+	unsigned int i, j;
+
+	if (arch->prologues == 0)
+		return;
+
+	printf("%s: %u images, %u prologues (%u skipped: forwarded or not code)\n",
+		arch->name, arch->images, arch->prologues, arch->skipped);
+	printf("  steal  hooked  failed  tramp avg/max   relocated: rip call rel32 jcc8 jmp8\n");
+	for (i = 0; i < arch->steal_count; i++) {
+		const steal_stats_t *s = &arch->steal[i];
+		printf("  %5d %7u %7u  %6.1f / %-4u  %14u %4u %5u %4u %4u%s\n",
+			arch->steals[i], s->hooked, s->failed,
+			s->hooked ? (double)s->tramp_bytes / s->hooked : 0.0, s->tramp_max,
+			s->relocs[RELOC_RIP], s->relocs[RELOC_CALL], s->relocs[RELOC_REL32],
+			s->relocs[RELOC_JCC8], s->relocs[RELOC_JMP8],
+			i == 0 ? "  (default hook type)" : "");
+	}
+	for (i = 0; i < arch->steal_count; i++) {
+		const steal_stats_t *s = &arch->steal[i];
+		if (s->failed == 0)
+			continue;
+		printf("  failures stealing %d bytes:\n", arch->steals[i]);
+		for (j = 0; j < REASON_MAX; j++) {
+			if (s->reasons[j])
+				printf("    %-36s %u\n", g_reasons[j], s->reasons[j]);
+		}
+	}
+}
+
+#ifdef __x86_64__
+
+//
+// differential fuzzing of the x64 builder
+//
+
+#define FUZZ_FUNC_OFF 0x100
+#define FUZZ_HELPER_OFF 0x800
+#define FUZZ_DATA_OFF 0x900
+#define FUZZ_TRAMP_OFF 0x1000
+#define FUZZ_MAX_INSNS 6
+#define FUZZ_RUNS 4
+
+typedef long (*fuzz_func_t)(long a, long b, long c, long d, long e, long f);
+
+// rax and the argument registers, so that every register the prologue
+// touches starts out the same in both runs
+static const int g_fuzz_regs[] = { 0, 1, 2, 6, 7, 8, 9 };
+
+static unsigned char *g_fuzz_arena;
+static sigjmp_buf g_fuzz_env;
+static unsigned long long g_fuzz_state;
+
+static unsigned int fuzz_rand(void)
+{
+	// xorshift64*
+	g_fuzz_state ^= g_fuzz_state >> 12;
+	g_fuzz_state ^= g_fuzz_state << 25;
+	g_fuzz_state ^= g_fuzz_state >> 27;
+	return (unsigned int)((g_fuzz_state * 2685821657736338717ull) >> 32);
+}
+
+static int fuzz_reg(void)
+{
+	return g_fuzz_regs[fuzz_rand() % (sizeof(g_fuzz_regs) / sizeof(g_fuzz_regs[0]))];
+}
+
+static unsigned char rex(int r, int x, int b)
+{
+	return 0x48 | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+}
+
+// sets the disp32 at p, of the instruction ending at next, to point at one
+// of the data qwords
+static void fuzz_riprel(unsigned char *p, unsigned char *next)
+{
+	unsigned char *target = g_fuzz_arena + FUZZ_DATA_OFF + (fuzz_rand() % 8) * 8;
+	*(int *)p = (int)(target - next);
+}
+
+// emits one instruction without any control flow, returns its length
+static int fuzz_simple_insn(unsigned char *p)
+{
+	static const unsigned char alu[] = { 0x01, 0x29, 0x31, 0x21, 0x09 };
+	int dst = fuzz_reg(), src = fuzz_reg();
+
+	switch (fuzz_rand() % 9) {
+	case 0: // add/sub/xor/and/or dst, src
+		p[0] = rex(src, 0, dst);
+		p[1] = alu[fuzz_rand() % sizeof(alu)];
+		p[2] = 0xc0 | ((src & 7) << 3) | (dst & 7);
+		return 3;
+	case 1: // add dst, imm8
+		p[0] = rex(0, 0, dst);
+		p[1] = 0x83;
+		p[2] = 0xc0 | (dst & 7);
+		p[3] = fuzz_rand();
+		return 4;
+	case 2: // imul dst, src
+		p[0] = rex(dst, 0, src);
+		p[1] = 0x0f;
+		p[2] = 0xaf;
+		p[3] = 0xc0 | ((dst & 7) << 3) | (src & 7);
+		return 4;
+	case 3: // mov dst, imm32
+		p[0] = rex(0, 0, dst);
+		p[1] = 0xc7;
+		p[2] = 0xc0 | (dst & 7);
+		*(int *)(p + 3) = fuzz_rand();
+		return 7;
+	case 4: // lea dst, [src + index + disp8]
+		p[0] = rex(dst, src, dst);
+		p[1] = 0x8d;
+		p[2] = 0x44 | ((dst & 7) << 3);
+		p[3] = ((src & 7) << 3) | (dst & 7);
+		p[4] = fuzz_rand();
+		return 5;
+	case 5: // mov/add dst, qword ptr [rip+data]
+		p[0] = rex(dst, 0, 0);
+		p[1] = (fuzz_rand() & 1) ? 0x8b : 0x03;
+		p[2] = 0x05 | ((dst & 7) << 3);
+		fuzz_riprel(p + 3, p + 7);
+		return 7;
+	case 6: // lea dst, [rip+data]
+		p[0] = rex(dst, 0, 0);
+		p[1] = 0x8d;
+		p[2] = 0x05 | ((dst & 7) << 3);
+		fuzz_riprel(p + 3, p + 7);
+		return 7;
+	case 7: // cmp qword ptr [rip+data], imm8 ; sbb dst, dst
+		p[0] = 0x48;
+		p[1] = 0x83;
+		p[2] = 0x3d;
+		p[7] = fuzz_rand();
+		fuzz_riprel(p + 3, p + 8);
+		p[8] = rex(dst, 0, dst);
+		p[9] = 0x19;
+		p[10] = 0xc0 | ((dst & 7) << 3) | (dst & 7);
+		return 11;
+	default: // multi-byte nop
+		memcpy(p, "\x0f\x1f\x44\x00\x00", 5);
+		return 5;
+	}
+}
+
+// emits one instruction, possibly a call or a forward jump over the next
+// one, returns the length of everything emitted
+static int fuzz_insn(unsigned char *p)
+{
+	int len = 0, skip, r1 = fuzz_reg(), r2 = fuzz_reg();
+
+	switch (fuzz_rand() % 8) {
+	case 0: // call helper
+		p[0] = 0xe8;
+		*(int *)(p + 1) = (int)(g_fuzz_arena + FUZZ_HELPER_OFF - (p + 5));
+		return 5;
+	case 1: // test r1, r2 ; jcc rel8 over the next instruction
+		p[len++] = rex(r2, 0, r1);
+		p[len++] = 0x85;
+		p[len++] = 0xc0 | ((r2 & 7) << 3) | (r1 & 7);
+		p[len++] = 0x70 | (fuzz_rand() & 0xf);
+		skip = fuzz_simple_insn(p + len + 1);
+		p[len++] = skip;
+		return len + skip;
+	case 2: // test r1, r2 ; jcc rel32 over the next instruction
+		p[len++] = rex(r2, 0, r1);
+		p[len++] = 0x85;
+		p[len++] = 0xc0 | ((r2 & 7) << 3) | (r1 & 7);
+		p[len++] = 0x0f;
+		p[len++] = 0x80 | (fuzz_rand() & 0xf);
+		skip = fuzz_simple_insn(p + len + 4);
+		*(int *)(p + len) = skip;
+		return len + 4 + skip;
+	case 3: // jmp rel8 over the next instruction
+		p[0] = 0xeb;
+		skip = fuzz_simple_insn(p + 2);
+		p[1] = skip;
+		return 2 + skip;
+	default:
+		return fuzz_simple_insn(p);
+	}
+}
+
+// mov rax, rdi ; <random instructions> ; fold all registers into rax ; ret
+static int fuzz_generate(unsigned char *func)
+{
+	static const unsigned char fold[] = {
+		0x48, 0x01, 0xc8,	// add rax, rcx
+		0x48, 0x31, 0xd0,	// xor rax, rdx
+		0x48, 0x01, 0xf0,	// add rax, rsi
+		0x48, 0x31, 0xf8,	// xor rax, rdi
+		0x4c, 0x01, 0xc0,	// add rax, r8
+		0x4c, 0x31, 0xc8,	// xor rax, r9
+		0xc3
+	};
+	unsigned char *p = func;
+	int i, count = 1 + fuzz_rand() % FUZZ_MAX_INSNS;
+
+	// short, so that forward jumps may land inside the stolen bytes
+	memcpy(p, "\x48\x89\xf8", 3);
+	p += 3;
+	for (i = 0; i < count; i++)
+		p += fuzz_insn(p);
+	memcpy(p, fold, sizeof(fold));
+	p += sizeof(fold);
+	return (int)(p - func);
+}
+
+static void fuzz_signal(int sig)
+{
+	siglongjmp(g_fuzz_env, sig);
+}
+
+static long fuzz_call(void *code, const long *args, int *sig)
+{
+	fuzz_func_t f = (fuzz_func_t)code;
+
+	*sig = sigsetjmp(g_fuzz_env, 1);
+	if (*sig != 0)
+		return 0;
+	return f(args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+static int fuzz(unsigned int iterations, unsigned int seed)
+{
+	static const int steals[] = { 6, 14 };
+	unsigned char code[256];
+	unsigned char *func, *tramp;
+	unsigned int i, j, k, run, rejected = 0, passed = 0, failed = 0;
+	long args[FUZZ_RUNS][6], expect[FUZZ_RUNS], ret;
+	struct sigaction sa;
+	int size, sig;
+
+	g_fuzz_arena = mmap(NULL, 0x2000, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (g_fuzz_arena == MAP_FAILED) {
+		printf("Unable to map RWX memory\n");
+		return 1;
+	}
+	func = g_fuzz_arena + FUZZ_FUNC_OFF;
+	tramp = g_fuzz_arena + FUZZ_TRAMP_OFF;
+
+	// helper: lea rax, [rax+rax*2] ; add rax, 7 ; ret
+	memcpy(g_fuzz_arena + FUZZ_HELPER_OFF, "\x48\x8d\x04\x40\x48\x83\xc0\x07\xc3", 9);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &fuzz_signal;
+	sigaction(SIGTRAP, &sa, NULL);
+	sigaction(SIGSEGV, &sa, NULL);
+	sigaction(SIGILL, &sa, NULL);
+	sigaction(SIGBUS, &sa, NULL);
+
+	g_fuzz_state = seed ? seed : 1;
+	printf("fuzzing the x64 builder, %u prologues, seed %u\n", iterations, seed);
+
+	for (i = 0; i < iterations; i++) {
+		for (k = 0; k < 8; k++)
+			((unsigned int *)(g_fuzz_arena + FUZZ_DATA_OFF))[k * 2] = fuzz_rand() % 256;
+		memset(func, 0xcc, FUZZ_HELPER_OFF - FUZZ_FUNC_OFF);
+		size = fuzz_generate(func);
+		memcpy(code, func, size);
+
+		for (run = 0; run < FUZZ_RUNS; run++) {
+			for (k = 0; k < 6; k++)
+				args[run][k] = ((long)fuzz_rand() << 32) | fuzz_rand();
+			expect[run] = fuzz_call(func, args[run], &sig);
+			if (sig != 0) {
+				printf("  original prologue crashed (signal %d), generator bug:", sig);
+				dump_bytes(code, size);
+				return 1;
+			}
+		}
+
+		for (j = 0; j < sizeof(steals) / sizeof(steals[0]); j++) {
+			memcpy(func, code, size);
+			memset(tramp, 0xcc, TRAMP_SIZE);
+			if (build_trampoline64(func, steals[j], tramp) == 0) {
+				rejected++;
+				continue;
+			}
+			// what the hook overwrites must never be executed again
+			memset(func, 0xcc, steals[j]);
+
+			for (run = 0; run < FUZZ_RUNS; run++) {
+				ret = fuzz_call(tramp, args[run], &sig);
+				if (sig != 0 || ret != expect[run])
+					break;
+			}
+			if (run == FUZZ_RUNS) {
+				passed++;
+				continue;
+			}
+
+			failed++;
+			if (failed <= 10) {
+				if (sig != 0)
+					printf("  steal %d: trampoline crashed (signal %d):", steals[j], sig);
+				else
+					printf("  steal %d: trampoline returned %lx, expected %lx:",
+						steals[j], (unsigned long)ret, (unsigned long)expect[run]);
+				dump_bytes(code, size);
+			}
+		}
+	}
+
+	printf("%u trampolines matched, %u mismatched, %u prologues rejected\n",
+		passed, failed, rejected);
+	return failed != 0;
+}
+
+#endif
+
+int main(int argc, char *argv[])
+{
+	int i, paths = 0;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	if (argc > 1 && !strcmp(argv[1], "-f")) {
+#ifdef __x86_64__
+		return fuzz(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 1);
+#else
+		printf("fuzz mode runs x64 code, build the x86-64 version\n");
+		return 1;
+#endif
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-v"))
+			g_verbose = 1;
+		else if (!strcmp(argv[i], "-p"))
+			g_use_pdata = 1;
+		else {
+			check_path(argv[i]);
+			paths++;
+		}
+	}
+
+	if (paths == 0) {
+		printf("usage: %s [-v] [-p] <dll or directory>...\n"
+			"       %s -f [iterations] [seed]\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	report(&g_x86);
+	report(&g_x64);
+	return 0;
+}
@@ -0,0 +1,111 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Stubs for the parts of cuckoomon that hooking_32.c/hooking_64.c call into,
+// shared by the Linux test programs in this directory.  Whatever depends on
+// the program (enter_hook, alloc_hookdata_near, g_tls_hook_index) is left
+// to the program itself.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "ntapi.h"
+#include "hooking.h"
+#include "config.h"
+#include "unhook.h"
+#include "pipe.h"
+#include "exports.h"
+
+struct _g_config g_config;
+ULONG_PTR g_our_dll_base;
+DWORD g_our_dll_size;
+
+void emit_rel(unsigned char *buf, unsigned char *source, unsigned char *target)
+{
+	*(DWORD *)buf = (DWORD)(target - (source + 4));
+}
+
+// the whole arena is RWX already
+// the harness maps its test functions writable
+int hook_write_patch(hook_t *h, unsigned char *addr, const uint8_t *orig,
+	const uint8_t *patch, unsigned int len)
+{
+	memcpy(addr, patch, len);
+	return 0;
+}
+
+void unhook_detect_add_region(const char *funcname, const uint8_t *addr,
+	const uint8_t *orig, const uint8_t *our, uint32_t length)
+{
+}
+
+void *resolve_export(const wchar_t *library, const char *funcname)
+{
+	return NULL;
+}
+
+int pipe(const char *fmt, ...)
+{
+	char buf[256];
+	unsigned int i, j;
+	va_list args;
+
+	// %z and %Z are the only specifiers the trampoline code uses
+	for (i = 0, j = 0; fmt[i] != 0 && j < sizeof(buf) - 3; i++) {
+		buf[j++] = fmt[i];
+		if (fmt[i] == '%' && fmt[i + 1] == 'z')
+			buf[j++] = 's', i++;
+		else if (fmt[i] == '%' && fmt[i + 1] == 'Z')
+			buf[j++] = 'l', buf[j++] = 's', i++;
+	}
+	buf[j] = 0;
+
+	printf("    pipe: ");
+	va_start(args, fmt);
+	vprintf(buf, args);
+	va_end(args);
+	printf("\n");
+	return 0;
+}
+
+// never reached, only referenced by the stack walking code
+BOOL GetVersionEx(OSVERSIONINFO *info) { return FALSE; }
+void hook_enable() {}
+void hook_disable() {}
+void get_lasterrors(lasterror_t *errors) {}
+void set_lasterrors(lasterror_t *errors) {}
+int addr_in_our_dll_range(ULONG_PTR addr) { return 0; }
+#ifdef __x86_64__
+BOOLEAN RtlAddFunctionTable(PRUNTIME_FUNCTION table, DWORD count, DWORD64 base) { return TRUE; }
+PVOID RtlPcToFileHeader(PVOID pc, PVOID *base) { return NULL; }
+PRUNTIME_FUNCTION RtlLookupFunctionEntry(DWORD64 pc, PDWORD64 base, PVOID history) { return NULL; }
+void RtlCaptureContext(CONTEXT *ctx) { memset(ctx, 0, sizeof(*ctx)); }
+#endif
+
+// alloc_bench links the real ones
+#ifndef HARNESS_ALLOC
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+void *cm_alloc(size_t size) { return malloc(size); }
+void *cm_calloc(size_t count, size_t size) { return calloc(count, size); }
+void *cm_realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+void cm_free(void *ptr) { free(ptr); }
+#endif
@@ -0,0 +1,526 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Linux harness for the trampoline engine.
+//
+// Links against the unmodified hooking_32.c/hooking_64.c and places every
+// entry of their hook_types[] table on synthetic functions in an RWX
+// mapping.  The synthetic prologues exercise the relocations done by
+// hook_create_trampoline() (rip relative operands, rel32 calls and jumps,
+// short jumps that have to be widened), the hooked functions are checked to
+// still return the right results through the pre-trampoline, and the cost
+// of each hook type is measured in nanoseconds per call.
+//
+// Everything the trampoline code needs from the rest of cuckoomon is stubbed
+// in stubs.c; enter_hook() only counts.  See the Makefile for how to build.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __x86_64__
+#include <asm/prctl.h>
+#else
+#include <asm/ldt.h>
+#endif
+#include "ntapi.h"
+#include "hooking.h"
+
+#define BENCH_CALLS 2000000
+
+// code and hook_data_t's share one mapping, so everything is in rel32 range
+#define ARENA_SIZE (4 * 1024 * 1024)
+#define CODE_SLOT_SIZE 0x80
+#define HOOKDATA_SLOT_SIZE ((sizeof(hook_data_t) + 15) & ~15)
+
+// offsets relative to the start of a synthetic function body
+#define HELPER_OFF 0x30
+#define DATA_OFF 0x38
+#define DATA_VALUE 1000
+
+static unsigned char *g_arena;
+static unsigned int g_code_used;
+static unsigned int g_hookdata_used;
+
+DWORD g_tls_hook_index = TLS_MINIMUM_AVAILABLE;
+
+static hook_info_t g_hookinfo;
+static volatile unsigned int g_enter_calls;
+static int g_enter_result = 1;
+
+int WINAPI enter_hook(uint8_t is_special_hook, ULONG_PTR _ebp, ULONG_PTR retaddr)
+{
+	g_enter_calls++;
+	return g_enter_result;
+}
+
+hook_data_t *alloc_hookdata_near(void *addr)
+{
+	hook_data_t *ret;
+
+	if (g_hookdata_used + HOOKDATA_SLOT_SIZE > ARENA_SIZE / 2)
+		return NULL;
+	ret = (hook_data_t *)(g_arena + ARENA_SIZE / 2 + g_hookdata_used);
+	g_hookdata_used += HOOKDATA_SLOT_SIZE;
+	memset(ret, 0xcc, sizeof(*ret));
+	return ret;
+}
+
+// the pre-trampolines read our TLS slot straight out of the TEB, so give
+// them one: fs (x86) and gs (x64) are unused by the Linux ABI.  the offset
+// matches TEB_TLS_SLOTS in hooking_32.c/hooking_64.c
+#ifdef __x86_64__
+#define TEB_TLS_SLOTS_OFFSET 0x1480
+#else
+#define TEB_TLS_SLOTS_OFFSET 0xe10
+#endif
+static void *g_teb[(TEB_TLS_SLOTS_OFFSET + TLS_MINIMUM_AVAILABLE * sizeof(void *)) / sizeof(void *)];
+
+static int setup_fake_teb(void)
+{
+	g_teb[TEB_TLS_SLOTS_OFFSET / sizeof(void *) + 1] = &g_hookinfo;
+#ifdef __x86_64__
+	if (syscall(SYS_arch_prctl, ARCH_SET_GS, (unsigned long)g_teb) != 0)
+		return 0;
+#else
+	{
+		struct user_desc desc;
+		unsigned short selector;
+
+		memset(&desc, 0, sizeof(desc));
+		desc.entry_number = -1;
+		desc.base_addr = (unsigned int)g_teb;
+		desc.limit = 0xfffff;
+		desc.seg_32bit = 1;
+		desc.limit_in_pages = 1;
+		desc.useable = 1;
+		if (syscall(SYS_set_thread_area, &desc) != 0)
+			return 0;
+		selector = (desc.entry_number << 3) | 3;
+		__asm__ __volatile__("movw %w0, %%fs" :: "q" (selector));
+	}
+#endif
+	// slot 1, as TLS index 0 is often taken on Windows
+	g_tls_hook_index = 1;
+	return 1;
+}
+
+//
+// synthetic functions, int f(int a, int b)
+//
+
+typedef int (*synth_func_t)(int a, int b);
+
+typedef struct _synth_t {
+	const char *name;
+	unsigned char code[32];
+	unsigned int size;
+	// called with rel32 from code, placed at HELPER_OFF
+	unsigned char helper[8];
+	unsigned int helper_size;
+	// offset of a rip relative displacement that should point at DATA_OFF,
+	// and of the end of that instruction
+	unsigned int riprel_at, riprel_next;
+	// the prologue ends a basic block early, so the longer hook types can't
+	// be placed on it
+	int may_reject;
+	int (*expect)(int a, int b);
+} synth_t;
+
+static int expect_arith(int a, int b) { return (a + b + 5) * 3 - 1; }
+static int expect_sum(int a, int b) { return a + b; }
+static int expect_call(int a, int b) { return 2 * a + b; }
+
+#ifdef __x86_64__
+
+static int expect_data(int a, int b) { return DATA_VALUE + a + b; }
+static int expect_near_jcc(int a, int b) { return b ? a + b : a - 1; }
+static int expect_short_jcc(int a, int b) { return b ? a + 2 * b : a - 1; }
+static int expect_short_jmp(int a, int b) { return a + b + 1; }
+
+// mov r10, rcx ; mov eax, 0 (what HOOK_NATIVE_JMP_INDIRECT expects)
+static const unsigned char g_native_prefix[] = {
+	0x4c, 0x8b, 0xd1, 0xb8, 0x00, 0x00, 0x00, 0x00
+};
+
+static const synth_t g_synth[] = {
+	{ "arith", {
+		0x48, 0x8d, 0x04, 0x37,			// lea rax, [rdi+rsi]
+		0x48, 0x83, 0xc0, 0x05,			// add rax, 5
+		0x48, 0x6b, 0xc0, 0x03,			// imul rax, rax, 3
+		0x48, 0x83, 0xe8, 0x01,			// sub rax, 1
+		0xc3 }, 17, { 0 }, 0, 0, 0, 0, &expect_arith },
+	{ "rip-relative", {
+		0x48, 0x8b, 0x05, 0, 0, 0, 0,	// mov rax, [rip+data]
+		0x48, 0x01, 0xf8,				// add rax, rdi
+		0x48, 0x01, 0xf0,				// add rax, rsi
+		0xc3 }, 14, { 0 }, 0, 3, 7, 0, &expect_data },
+	{ "rip-relative-imm", {
+		0x48, 0x81, 0x3d, 0, 0, 0, 0,	// cmp qword ptr [rip+data], DATA_VALUE
+		0xe8, 0x03, 0x00, 0x00,
+		0x0f, 0x85, 0x05, 0, 0, 0,		// jne fail
+		0x48, 0x8d, 0x04, 0x37,			// lea rax, [rdi+rsi]
+		0xc3,
+		0xb8, 0xff, 0xff, 0xff, 0xff,	// fail: mov eax, -1
+		0xc3 }, 28, { 0 }, 0, 3, 11, 0, &expect_sum },
+	{ "call-rel32", {
+		0xe8, HELPER_OFF - 5, 0, 0, 0,	// call helper
+		0x01, 0xf0,						// add eax, esi
+		0xc3 }, 8, {
+		0x8d, 0x04, 0x3f,				// helper: lea eax, [rdi+rdi]
+		0xc3 }, 4, 0, 0, 0, &expect_call },
+	{ "jcc-rel32", {
+		0x89, 0xf8,						// mov eax, edi
+		0x85, 0xf6,						// test esi, esi
+		0x0f, 0x84, 0x03, 0, 0, 0,		// jz zero
+		0x01, 0xf0,						// add eax, esi
+		0xc3,
+		0xff, 0xc8,						// zero: dec eax
+		0xc3 }, 16, { 0 }, 0, 0, 0, 0, &expect_near_jcc },
+	{ "jcc-rel8", {
+		0x89, 0xf8,						// mov eax, edi
+		0x85, 0xf6,						// test esi, esi
+		0x74, 0x05,						// jz zero
+		0x01, 0xf0,						// add eax, esi
+		0x01, 0xf0,						// add eax, esi
+		0xc3,
+		0xff, 0xc8,						// zero: dec eax
+		0xc3 }, 14, { 0 }, 0, 0, 0, 0, &expect_short_jcc },
+	{ "jmp-rel8", {
+		0x89, 0xf8,						// mov eax, edi
+		0x01, 0xf0,						// add eax, esi
+		0xeb, 0x01,						// jmp over
+		0xcc,
+		0xff, 0xc0,						// over: inc eax
+		0xc3 }, 10, { 0 }, 0, 0, 0, 1, &expect_short_jmp },
+};
+
+static const char *g_hook_type_names[] = {
+	"HOOK_NATIVE_JMP_INDIRECT",
+	"HOOK_JMP_INDIRECT",
+};
+
+#else
+
+static int expect_nonzero(int a, int b) { return a ? a + b : -1; }
+static int expect_parity(int a, int b) { return (a & 1) ? a - b : a + b; }
+
+// mov eax, 0 (what HOOK_NATIVE_JMP_INDIRECT expects)
+static const unsigned char g_native_prefix[] = {
+	0xb8, 0x00, 0x00, 0x00, 0x00
+};
+
+static const synth_t g_synth[] = {
+	{ "arith", {
+		0x8b, 0x44, 0x24, 0x04,			// mov eax, [esp+4]
+		0x03, 0x44, 0x24, 0x08,			// add eax, [esp+8]
+		0x83, 0xc0, 0x05,				// add eax, 5
+		0x6b, 0xc0, 0x03,				// imul eax, eax, 3
+		0x48,							// dec eax
+		0xc3 }, 16, { 0 }, 0, 0, 0, 0, &expect_arith },
+	{ "call-rel32", {
+		0xe8, HELPER_OFF - 5, 0, 0, 0,	// call helper
+		0x03, 0x44, 0x24, 0x08,			// add eax, [esp+8]
+		0xc3 }, 10, {
+		0x8b, 0x44, 0x24, 0x08,			// helper: mov eax, [esp+8]
+		0x01, 0xc0,						// add eax, eax
+		0xc3 }, 7, 0, 0, 0, &expect_call },
+	{ "jcc-rel32", {
+		0x8b, 0x44, 0x24, 0x04,			// mov eax, [esp+4]
+		0x85, 0xc0,						// test eax, eax
+		0x0f, 0x84, 0x05, 0, 0, 0,		// jz zero
+		0x03, 0x44, 0x24, 0x08,			// add eax, [esp+8]
+		0xc3,
+		0x83, 0xc8, 0xff,				// zero: or eax, -1
+		0xc3 }, 21, { 0 }, 0, 0, 0, 0, &expect_nonzero },
+	{ "jcc-rel8", {
+		0x8b, 0x44, 0x24, 0x04,			// mov eax, [esp+4]
+		0xa8, 0x01,						// test al, 1
+		0x75, 0x06,						// jnz odd
+		0x03, 0x44, 0x24, 0x08,			// add eax, [esp+8]
+		0xc3,
+		0x90,
+		0x2b, 0x44, 0x24, 0x08,			// odd: sub eax, [esp+8]
+		0xc3 }, 19, { 0 }, 0, 0, 0, 0, &expect_parity },
+	{ "jmp-rel8", {
+		0x8b, 0x44, 0x24, 0x04,			// mov eax, [esp+4]
+		0xeb, 0x01,						// jmp over
+		0xcc,
+		0x03, 0x44, 0x24, 0x08,			// over: add eax, [esp+8]
+		0xc3 }, 12, { 0 }, 0, 0, 0, 1, &expect_sum },
+};
+
+static const char *g_hook_type_names[] = {
+	"HOOK_JMP_DIRECT",
+	"HOOK_NOP_JMP_DIRECT",
+	"HOOK_HOTPATCH_JMP_DIRECT",
+	"HOOK_PUSH_RETN",
+	"HOOK_NOP_PUSH_RETN",
+	"HOOK_JMP_INDIRECT",
+	"HOOK_MOV_EAX_JMP_EAX",
+	"HOOK_MOV_EAX_PUSH_RETN",
+	"HOOK_MOV_EAX_INDIRECT_JMP_EAX",
+	"HOOK_MOV_EAX_INDIRECT_PUSH_RETN",
+#if HOOK_ENABLE_FPU
+	"HOOK_PUSH_FPU_RETN",
+#endif
+	"HOOK_SPECIAL_JMP",
+	"HOOK_NATIVE_JMP_INDIRECT",
+	"HOOK_HOTPATCH_JMP_INDIRECT",
+};
+
+#endif
+
+static const int g_inputs[][2] = {
+	{ 1, 2 }, { 7, 0 }, { -3, 5 }, { 100, 23 }, { 0, 9 }, { 42, -42 },
+};
+
+//
+// hooking and measuring
+//
+
+static synth_func_t Old_synthetic;
+static volatile unsigned int g_new_calls;
+
+// the current result line still has to be finished
+static int g_line_open;
+
+static void end_line(void)
+{
+	if (g_line_open)
+		printf("\n");
+	g_line_open = 0;
+}
+
+static int New_synthetic(int a, int b)
+{
+	g_new_calls++;
+	return Old_synthetic(a, b);
+}
+
+// copies a synthetic function into a fresh code slot
+static unsigned char *place_synth(const synth_t *s, int type)
+{
+	unsigned char *slot, *body;
+
+	if (g_code_used + CODE_SLOT_SIZE > ARENA_SIZE / 2)
+		return NULL;
+	slot = g_arena + g_code_used;
+	g_code_used += CODE_SLOT_SIZE;
+
+	memset(slot, 0xcc, CODE_SLOT_SIZE);
+	// leave some padding in front, hook_api looks at the bytes before
+	// the function on x86
+	body = slot + 16;
+	if (type == HOOK_NATIVE_JMP_INDIRECT) {
+		memcpy(body, g_native_prefix, sizeof(g_native_prefix));
+		body += sizeof(g_native_prefix);
+	}
+
+	memcpy(body, s->code, s->size);
+	memcpy(body + HELPER_OFF, s->helper, s->helper_size);
+	*(int *)(body + DATA_OFF) = DATA_VALUE;
+	*(int *)(body + DATA_OFF + 4) = 0;
+	if (s->riprel_next != 0)
+		*(int *)(body + s->riprel_at) = DATA_OFF - s->riprel_next;
+
+	return slot + 16;
+}
+
+typedef struct _hooked_t {
+	hook_t hook;
+	synth_func_t func;
+	synth_func_t old;
+} hooked_t;
+
+static int install(hooked_t *t, const synth_t *s, int type, int lean)
+{
+	memset(t, 0, sizeof(*t));
+	t->func = (synth_func_t)place_synth(s, type);
+	if (t->func == NULL)
+		return -1;
+
+	t->hook.library = L"harness";
+	t->hook.funcname = s->name;
+	t->hook.addr = (void *)t->func;
+	t->hook.new_func = (void *)&New_synthetic;
+	t->hook.old_func = (void **)&t->old;
+	// the lean pre-trampoline is used for hooks that don't log
+	t->hook.no_caller_info = lean;
+	t->hook.run_while_suspended = lean;
+
+	if (hook_api(&t->hook, type) != 0 || !t->hook.is_hooked)
+		return -1;
+	return 0;
+}
+
+// calls the hooked function with every input, checking that the hook was
+// (or wasn't, with expect_new == 0) taken
+static int verify(hooked_t *t, const synth_t *s, int expect_new)
+{
+	unsigned int i, new_calls;
+	int ret, failed = 0;
+
+	Old_synthetic = t->old;
+	for (i = 0; i < ARRAYSIZE(g_inputs); i++) {
+		new_calls = g_new_calls;
+		ret = t->func(g_inputs[i][0], g_inputs[i][1]);
+		if (ret != s->expect(g_inputs[i][0], g_inputs[i][1])) {
+			end_line();
+			printf("    %s(%d, %d) returned %d, expected %d\n", s->name,
+				g_inputs[i][0], g_inputs[i][1], ret,
+				s->expect(g_inputs[i][0], g_inputs[i][1]));
+			failed = 1;
+		}
+		if (g_new_calls - new_calls != (unsigned int)expect_new) {
+			end_line();
+			printf("    %s(%d, %d) %s the hook handler\n", s->name,
+				g_inputs[i][0], g_inputs[i][1],
+				expect_new ? "skipped" : "went through");
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+static double ns_per_call(synth_func_t func)
+{
+	struct timespec start, end;
+	volatile int sink = 0;
+	int i;
+
+	// warm up
+	for (i = 0; i < BENCH_CALLS / 10; i++)
+		sink += func(i, 3);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_CALLS; i++)
+		sink += func(i, 3);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 +
+		(end.tv_nsec - start.tv_nsec)) / BENCH_CALLS;
+}
+
+int main(void)
+{
+	hooked_t full, lean;
+	synth_func_t direct;
+	unsigned int i, errors = 0;
+	int type, inline_check;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	g_arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (g_arena == MAP_FAILED) {
+		printf("Unable to map RWX memory\n");
+		return 1;
+	}
+
+	inline_check = setup_fake_teb();
+	printf("Hooking engine: %d-bit, hook_data_t %u bytes, inline disable "
+		"check %s\n", (int)sizeof(void *) * 8, (unsigned int)sizeof(hook_data_t),
+		inline_check ? "enabled" : "unavailable (no fake TEB)");
+
+	// correctness, every hook type on every synthetic prologue, with both
+	// the full and the lean pre-trampoline
+	printf("\nverifying %d hook types x %d prologues\n",
+		HOOK_TECHNIQUE_MAXTYPE, (int)ARRAYSIZE(g_synth));
+	for (type = 0; type < HOOK_TECHNIQUE_MAXTYPE; type++) {
+		for (i = 0; i < ARRAYSIZE(g_synth); i++) {
+			const synth_t *s = &g_synth[i];
+			int failed = 0;
+
+			// printed up front, so a crash shows which hook it was
+			printf("  %-32s %-18s ", g_hook_type_names[type], s->name);
+			g_line_open = 1;
+			if (install(&full, s, type, 0) != 0) {
+				end_line();
+				printf("    %s\n", s->may_reject ? "rejected (prologue too short)" : "FAILED to hook");
+				if (!s->may_reject)
+					errors++;
+				continue;
+			}
+			failed |= verify(&full, s, 1);
+
+			// enter_hook says no, straight to the original function
+			g_enter_result = 0;
+			failed |= verify(&full, s, 0);
+			g_enter_result = 1;
+
+			if (inline_check) {
+				g_hookinfo.disable_count = 1;
+				failed |= verify(&full, s, 0);
+				g_hookinfo.disable_count = 0;
+
+				if (install(&lean, s, type, 1) != 0) {
+					end_line();
+					printf("    lean hook failed\n");
+					failed = 1;
+				}
+				else {
+					failed |= verify(&lean, s, 1);
+				}
+			}
+
+			if (g_line_open)
+				printf("%s\n", failed ? "FAILED" : "ok");
+			else
+				printf("    FAILED\n");
+			g_line_open = 0;
+			errors += failed;
+		}
+	}
+
+	// per-call overhead of each hook type on the simplest prologue
+	printf("\nns/call (%d calls)          original   hooked  passthru  "
+		"disabled  lean\n", BENCH_CALLS);
+	direct = (synth_func_t)place_synth(&g_synth[0], -1);
+	for (type = 0; type < HOOK_TECHNIQUE_MAXTYPE; type++) {
+		double t_direct, t_hooked, t_pass, t_disabled = 0, t_lean = 0;
+
+		if (install(&full, &g_synth[0], type, 0) != 0)
+			continue;
+		if (inline_check && install(&lean, &g_synth[0], type, 1) != 0)
+			continue;
+
+		t_direct = ns_per_call(direct);
+		Old_synthetic = full.old;
+		t_hooked = ns_per_call(full.func);
+		g_enter_result = 0;
+		t_pass = ns_per_call(full.func);
+		g_enter_result = 1;
+		if (inline_check) {
+			g_hookinfo.disable_count = 1;
+			t_disabled = ns_per_call(full.func);
+			g_hookinfo.disable_count = 0;
+			Old_synthetic = lean.old;
+			t_lean = ns_per_call(lean.func);
+		}
+
+		printf("%-32s %7.2f  %7.2f  %7.2f  %7.2f  %6.2f\n",
+			g_hook_type_names[type], t_direct, t_hooked, t_pass,
+			t_disabled, t_lean);
+	}
+
+	printf("\n%u failure(s)\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1 @@
+// nothing from wincrypt.h is needed by the trampoline code
@@ -0,0 +1,205 @@
+/*
+Cuckoo Sandbox - Automated Malware Analysis
+Copyright (C) 2010-2015 Cuckoo Sandbox Developers
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//
+// Minimal windows.h for the Linux harnesses
+//
+// Just enough of the Win32 types for ntapi.h, hooking.h and the headers
+// hooking_32.c/hooking_64.c (and lookup.c, alloc.c) pull in to compile with
+// a Linux gcc.  Nothing in here is meant to behave like Windows, stubs.c
+// provides the few functions the trampoline code actually calls.
+//
+
+#ifndef __HARNESS_WINDOWS_H
+#define __HARNESS_WINDOWS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifdef __x86_64__
+#define WINAPI __attribute__((ms_abi))
+#else
+#define WINAPI __attribute__((stdcall))
+#endif
+#define CALLBACK WINAPI
+
+#define VOID void
+typedef unsigned char BYTE, UCHAR, BOOLEAN, *PUCHAR, *PBOOLEAN;
+typedef char CHAR, *PCHAR, *LPSTR;
+typedef const char *LPCSTR;
+typedef short SHORT;
+typedef unsigned short USHORT, WORD;
+typedef wchar_t WCHAR, *PWSTR, *LPWSTR;
+typedef const wchar_t *LPCWSTR;
+typedef int BOOL, *PBOOL;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG, DWORD, *PDWORD, *LPDWORD;
+typedef int64_t LONG64, LONGLONG;
+typedef uint64_t ULONG64, DWORD64, *PDWORD64, ULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR, SIZE_T, *PSIZE_T, DWORD_PTR;
+typedef void *PVOID, *LPVOID, *HANDLE, *PHANDLE, *HMODULE, *HKEY;
+
+typedef union _LARGE_INTEGER {
+	struct {
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _LIST_ENTRY {
+	struct _LIST_ENTRY *Flink;
+	struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _EXCEPTION_RECORD {
+	DWORD ExceptionCode;
+	DWORD ExceptionFlags;
+	struct _EXCEPTION_RECORD *ExceptionRecord;
+	PVOID ExceptionAddress;
+	DWORD NumberParameters;
+	ULONG_PTR ExceptionInformation[15];
+} EXCEPTION_RECORD;
+
+// only ever embedded in STARTUPINFOEX by ntapi.h
+typedef struct _STARTUPINFOA { DWORD cb; } STARTUPINFOA;
+typedef struct _STARTUPINFOW { DWORD cb; } STARTUPINFOW;
+
+typedef struct _OSVERSIONINFO {
+	DWORD dwOSVersionInfoSize;
+	DWORD dwMajorVersion;
+	DWORD dwMinorVersion;
+	DWORD dwBuildNumber;
+	DWORD dwPlatformId;
+	CHAR szCSDVersion[128];
+} OSVERSIONINFO;
+
+#ifdef __x86_64__
+// Rax..R15 have to stay in unwind register number order, see
+// pdata_virtual_unwind()
+typedef struct _CONTEXT {
+	DWORD64 Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi;
+	DWORD64 R8, R9, R10, R11, R12, R13, R14, R15;
+	DWORD64 Rip;
+} CONTEXT;
+
+typedef struct _RUNTIME_FUNCTION {
+	DWORD BeginAddress;
+	DWORD EndAddress;
+	DWORD UnwindData;
+} RUNTIME_FUNCTION, *PRUNTIME_FUNCTION;
+#endif
+
+typedef struct _IMAGE_DOS_HEADER {
+	WORD e_magic;
+	WORD e_res[29];
+	LONG e_lfanew;
+} IMAGE_DOS_HEADER, *PIMAGE_DOS_HEADER;
+
+typedef struct _IMAGE_DATA_DIRECTORY {
+	DWORD VirtualAddress;
+	DWORD Size;
+} IMAGE_DATA_DIRECTORY, *PIMAGE_DATA_DIRECTORY;
+
+typedef struct _IMAGE_OPTIONAL_HEADER64 {
+	WORD Magic;
+	BYTE Unused[54];
+	DWORD SizeOfImage;
+	BYTE Unused2[48];
+	DWORD NumberOfRvaAndSizes;
+	IMAGE_DATA_DIRECTORY DataDirectory[16];
+} IMAGE_OPTIONAL_HEADER64;
+
+typedef struct _IMAGE_NT_HEADERS64 {
+	DWORD Signature;
+	BYTE FileHeader[20];
+	IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+} IMAGE_NT_HEADERS64, *PIMAGE_NT_HEADERS64;
+
+#define IMAGE_DOS_SIGNATURE 0x5a4d
+#define IMAGE_NT_SIGNATURE 0x00004550
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC 0x20b
+#define IMAGE_DIRECTORY_ENTRY_EXCEPTION 3
+
+#define UNW_FLAG_NHANDLER 0
+#define UNW_FLAG_CHAININFO 4
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define TLS_MINIMUM_AVAILABLE 64
+#define TLS_OUT_OF_INDEXES 0xffffffff
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+#define PAGE_NOACCESS 0x01
+#define PAGE_READWRITE 0x04
+#define HEAP_ZERO_MEMORY 0x08
+#define ERROR_SUCCESS 0
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define InitializeCriticalSection(cs) pthread_mutex_init((cs), NULL)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+
+#define MemoryBarrier() __sync_synchronize()
+#define YieldProcessor() __builtin_ia32_pause()
+#define InterlockedCompareExchange(dst, exchange, comparand) \
+	__sync_val_compare_and_swap((dst), (comparand), (exchange))
+#define InterlockedIncrement(dst) __sync_add_and_fetch((dst), 1)
+#define InterlockedDecrement(dst) __sync_sub_and_fetch((dst), 1)
+
+#ifdef __x86_64__
+static inline DWORD64 __readgsqword(DWORD offset)
+{
+	DWORD64 ret;
+	__asm__ __volatile__("movq %%gs:(%1), %0" : "=r" (ret) : "r" ((ULONG_PTR)offset));
+	return ret;
+}
+#endif
+
+// also needed on x86-64, where the prologue tool builds hooking_32.c
+static inline DWORD __readfsdword(DWORD offset)
+{
+	DWORD ret;
+	__asm__ __volatile__("movl %%fs:(%1), %0" : "=r" (ret) : "r" ((ULONG_PTR)offset));
+	return ret;
+}
+
+// provided by stubs.c
+BOOL GetVersionEx(OSVERSIONINFO *info);
+// provided by alloc_bench.c, for alloc.c
+PVOID NtCurrentTeb(void);
+HANDLE GetCurrentProcess(void);
+DWORD TlsAlloc(void);
+PVOID HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size);
+PVOID HeapReAlloc(HANDLE heap, DWORD flags, PVOID ptr, SIZE_T size);
+BOOL HeapFree(HANDLE heap, DWORD flags, PVOID ptr);
+#ifdef __x86_64__
+BOOLEAN RtlAddFunctionTable(PRUNTIME_FUNCTION table, DWORD count, DWORD64 base);
+PVOID RtlPcToFileHeader(PVOID pc, PVOID *base);
+PRUNTIME_FUNCTION RtlLookupFunctionEntry(DWORD64 pc, PDWORD64 base, PVOID history);
+void RtlCaptureContext(CONTEXT *ctx);
+#endif
+
+#endif
@@ -2,13 +2,6 @@
 #include <string.h>
 #include "lookup.h"
 
-typedef struct _entry_t {
-    struct _entry_t *next;
-    unsigned int id;
-    unsigned int size;
-    unsigned char data[0];
-} entry_t;
-
 int main()
 {
     lookup_t a;
@@ -22,10 +15,18 @@ int main()
     lookup_del(&a, 4);
 
     for (int i = 0; i < 5; i++) {
-        printf("%d -> %p\n", i, lookup_get(&a, i, NULL));
+        unsigned int size = 0;
+        char *data = lookup_get(&a, i, &size);
+        printf("%d -> %p %s %d\n", i, data, data ? data : "", size);
     }
 
-    for (entry_t *p = a.root; p != NULL; p = p->next) {
-        printf("%p %d %d\n", p, p->id, p->size);
-    }
+    // pointer sized values are stored inline
+    lookup_set(&a, 0x1234, 1);
+    lookup_set(&a, 0x1234, 2);
+
+    ULONG_PTR value = 0;
+    printf("0x1234 -> %d %d\n", lookup_get_value(&a, 0x1234, &value), (int) value);
+    printf("0x1238 -> %d\n", lookup_get_value(&a, 0x1238, &value));
+
+    lookup_free(&a);
 }
@@ -0,0 +1,100 @@
+/*
+ * compares the cost of our .pdata stack walker against the
+ * RtlLookupFunctionEntry/RtlVirtualUnwind pair it replaced (x64 only)
+ */
+#include <stdio.h>
+#include <windows.h>
+#include "../hooking.h"
+
+#define ITERATIONS 100000
+
+static volatile int g_sink;
+
+#ifdef _WIN64
+static unsigned int walk_rtl(CONTEXT *ctx, PVOID *backtrace, unsigned int count)
+{
+    KNONVOLATILE_CONTEXT_POINTERS nvctx;
+    PRUNTIME_FUNCTION runfunc;
+    DWORD64 imgbase;
+    PVOID handlerdata;
+    ULONG_PTR establisherframe;
+    unsigned int frame = 0;
+
+    while (frame < count && ctx->Rip) {
+        backtrace[frame++] = (PVOID) ctx->Rip;
+        runfunc = RtlLookupFunctionEntry(ctx->Rip, &imgbase, NULL);
+        memset(&nvctx, 0, sizeof(nvctx));
+        if(runfunc == NULL) {
+            ctx->Rip = *(ULONG_PTR *) ctx->Rsp;
+            ctx->Rsp += 8;
+        }
+        else {
+            RtlVirtualUnwind(UNW_FLAG_NHANDLER, imgbase, ctx->Rip, runfunc,
+                ctx, &handlerdata, &establisherframe, &nvctx);
+        }
+    }
+    return frame;
+}
+
+static void bench(void)
+{
+    PVOID bt1[HOOK_BACKTRACE_DEPTH], bt2[HOOK_BACKTRACE_DEPTH];
+    LARGE_INTEGER freq, t0, t1, t2;
+    unsigned int n1 = 0, n2 = 0, i;
+    CONTEXT base, ctx;
+
+    RtlCaptureContext(&base);
+
+    // make sure both walkers agree before timing them
+    ctx = base;
+    n1 = walk_rtl(&ctx, bt1, HOOK_BACKTRACE_DEPTH);
+    ctx = base;
+    n2 = pdata_stackwalk(&ctx, bt2, HOOK_BACKTRACE_DEPTH);
+    printf("frames: rtl %u, pdata %u\n", n1, n2);
+    for (i = 0; i < n1 && i < n2; i++) {
+        printf("%2u %p %p%s\n", i, bt1[i], bt2[i],
+            bt1[i] == bt2[i] ? "" : " MISMATCH");
+    }
+
+    QueryPerformanceFrequency(&freq);
+
+    QueryPerformanceCounter(&t0);
+    for (i = 0; i < ITERATIONS; i++) {
+        ctx = base;
+        walk_rtl(&ctx, bt1, HOOK_BACKTRACE_DEPTH);
+    }
+    QueryPerformanceCounter(&t1);
+    for (i = 0; i < ITERATIONS; i++) {
+        ctx = base;
+        pdata_stackwalk(&ctx, bt2, HOOK_BACKTRACE_DEPTH);
+    }
+    QueryPerformanceCounter(&t2);
+
+    printf("RtlVirtualUnwind: %.1f ns/frame\n",
+        (t1.QuadPart - t0.QuadPart) * 1e9 / freq.QuadPart /
+        ((double) ITERATIONS * n1));
+    printf("pdata walker:     %.1f ns/frame\n",
+        (t2.QuadPart - t1.QuadPart) * 1e9 / freq.QuadPart /
+        ((double) ITERATIONS * n2));
+}
+
+static __declspec(noinline) void recurse(int depth)
+{
+    if(depth == 0) {
+        bench();
+        return;
+    }
+    recurse(depth - 1);
+    g_sink++;
+}
+#endif
+
+int main()
+{
+#ifdef _WIN64
+    recurse(16);
+#else
+    printf("the .pdata stack walker only exists on x64\n");
+#endif
+    return 0;
+}
@@ -25,66 +25,189 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "config.h"
 #include <Sddl.h>
 
-#define UNHOOK_MAXCOUNT 2048
-#define UNHOOK_BUFSIZE 256
-
 static HANDLE g_unhook_thread_handle, g_watcher_thread_handle;
 
-// Index for adding new hooks and iterating all existing hooks.
-static uint32_t g_index = 0;
-
-// Length of this region.
-static uint32_t g_length[UNHOOK_MAXCOUNT];
-
-// Address of the region.
-static uint8_t *g_addr[UNHOOK_MAXCOUNT];
+// Regions are kept sorted by address, so that the regions on one page are
+// adjacent and ranges can be found with a binary search.  Their original
+// contents and the contents after we modified them live back to back in
+// g_region_bytes.
+typedef struct _unhook_region_t {
+	uint8_t *addr;
+	const char *funcname;
+	uint32_t bytes;
+	uint16_t length;
+	// If the region has been modified, did we report this already?
+	uint8_t reported;
+} unhook_region_t;
+
+// A page with hooked regions, the detector only looks at the regions of a
+// page once the hash of their contents changed.
+typedef struct _unhook_page_t {
+	ULONG_PTR base;
+	uint32_t first;
+	uint32_t count;
+	uint32_t hash;
+} unhook_page_t;
+
+#define UNHOOK_PAGE_SIZE 0x1000
+
+// Poll intervals in milliseconds: back off while nothing changes, and poll
+// quickly again once a hooked page was touched.
+#define UNHOOK_POLL_MIN 50
+#define UNHOOK_POLL_MAX 4000
+
+static CRITICAL_SECTION g_unhook_lock;
+static unhook_region_t *g_regions;
+static uint32_t g_region_count, g_region_capacity;
+static uint8_t *g_region_bytes;
+static uint32_t g_region_bytes_used, g_region_bytes_capacity;
+
+// Rebuilt by the detector whenever regions were added.
+static unhook_page_t *g_pages;
+static uint32_t g_page_count;
+static int g_pages_dirty;
+
+static volatile LONG g_poll_interval = 500;
+static HANDLE g_unhook_wake_event;
+
+static void unhook_init_lock(void)
+{
+	static volatile LONG initialized;
 
-// Function name of the region.
-static char g_funcname[UNHOOK_MAXCOUNT][64];
+	// regions are added before unhook_init_detection() runs
+	if (InterlockedCompareExchange(&initialized, 1, 0) == 0) {
+		InitializeCriticalSection(&g_unhook_lock);
+		initialized = 2;
+	}
+	while (initialized != 2)
+		YieldProcessor();
+}
 
-// The original contents of this region, before we modified it.
-static uint8_t g_orig[UNHOOK_MAXCOUNT][UNHOOK_BUFSIZE];
+static uint32_t hash_bytes(uint32_t hash, const uint8_t *p, uint32_t length)
+{
+	while (length--)
+		hash = (hash ^ *p++) * 16777619;
+	return hash;
+}
 
-// The contents of this region after we modified it.
-static uint8_t g_our[UNHOOK_BUFSIZE][UNHOOK_BUFSIZE];
+// index of the first region at or above addr
+static uint32_t find_region(ULONG_PTR addr)
+{
+	uint32_t lo = 0, hi = g_region_count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((ULONG_PTR)g_regions[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-// If the region has been modified, did we report this already?
-static uint8_t g_hook_reported[UNHOOK_MAXCOUNT];
+static int grow(void **buf, uint32_t *capacity, uint32_t needed, uint32_t elemsize, uint32_t initial)
+{
+	uint32_t newcap = *capacity ? *capacity : initial;
+	void *tmp;
+
+	if (needed <= *capacity)
+		return 1;
+	while (newcap < needed)
+		newcap *= 2;
+	tmp = realloc(*buf, newcap * elemsize);
+	if (tmp == NULL)
+		return 0;
+	*buf = tmp;
+	*capacity = newcap;
+	return 1;
+}
 
 void unhook_detect_add_region(const char *funcname, uint8_t *addr,
     const uint8_t *orig, const uint8_t *our, uint32_t length)
 {
-    if(g_index == UNHOOK_MAXCOUNT) {
-        pipe("CRITICAL:Reached maximum number of unhook detection entries!");
-        return;
-    }
+	uint32_t idx;
 
-    g_length[g_index] = length;
-    g_addr[g_index] = addr;
+	unhook_init_lock();
+	EnterCriticalSection(&g_unhook_lock);
 
-    if(funcname != NULL) {
-        strcpy(g_funcname[g_index], funcname);
-    }
+	if (length > 0xffff || !grow((void **)&g_regions, &g_region_capacity, g_region_count + 1, sizeof(unhook_region_t), 256) ||
+		!grow((void **)&g_region_bytes, &g_region_bytes_capacity, g_region_bytes_used + 2 * length, 1, 16384)) {
+		pipe("CRITICAL:Unable to add unhook detection entry for %z!", funcname);
+		LeaveCriticalSection(&g_unhook_lock);
+		return;
+	}
+
+	idx = find_region((ULONG_PTR)addr);
+	memmove(&g_regions[idx + 1], &g_regions[idx], (g_region_count - idx) * sizeof(unhook_region_t));
+	g_region_count++;
+
+	g_regions[idx].addr = addr;
+	g_regions[idx].funcname = funcname != NULL ? funcname : "";
+	g_regions[idx].length = (uint16_t)length;
+	g_regions[idx].reported = 0;
+	g_regions[idx].bytes = g_region_bytes_used;
+	memcpy(g_region_bytes + g_region_bytes_used, orig, length);
+	memcpy(g_region_bytes + g_region_bytes_used + length, our, length);
+	g_region_bytes_used += 2 * length;
+
+	g_pages_dirty = 1;
+
+	LeaveCriticalSection(&g_unhook_lock);
+}
+
+#define REGION_ORIG(r) (g_region_bytes + (r)->bytes)
+#define REGION_OUR(r) (g_region_bytes + (r)->bytes + (r)->length)
 
-    memcpy(g_orig[g_index], orig, MIN(length, UNHOOK_BUFSIZE));
-    memcpy(g_our[g_index], our, MIN(length, UNHOOK_BUFSIZE));
-    g_index++;
+// groups the regions by page, the hashes start out as our own contents
+static void rebuild_pages(void)
+{
+	unhook_page_t *page = NULL;
+	uint32_t idx, count = 0;
+	ULONG_PTR base;
+
+	free(g_pages);
+	g_page_count = 0;
+	g_pages_dirty = 0;
+	g_pages = malloc(g_region_count * sizeof(unhook_page_t));
+	if (g_pages == NULL)
+		return;
+
+	for (idx = 0; idx < g_region_count; idx++) {
+		base = (ULONG_PTR)g_regions[idx].addr & ~(ULONG_PTR)(UNHOOK_PAGE_SIZE - 1);
+		if (page == NULL || page->base != base) {
+			page = &g_pages[count++];
+			page->base = base;
+			page->first = idx;
+			page->count = 0;
+			page->hash = 2166136261;
+		}
+		page->count++;
+		page->hash = hash_bytes(page->hash, REGION_OUR(&g_regions[idx]), g_regions[idx].length);
+	}
+	g_page_count = count;
 }
 
 void restore_hooks_on_range(ULONG_PTR start, ULONG_PTR end)
 {
 	lasterror_t lasterror;
+	unhook_region_t *r;
 	uint32_t idx;
 
 	get_lasterrors(&lasterror);
 
+	unhook_init_lock();
+	EnterCriticalSection(&g_unhook_lock);
+
 	__try {
-		for (idx = 0; idx < g_index; idx++) {
-			if ((ULONG_PTR)g_addr[idx] < start || ((ULONG_PTR)g_addr[idx] + g_length[idx]) > end)
+		for (idx = find_region(start); idx < g_region_count; idx++) {
+			r = &g_regions[idx];
+			if ((ULONG_PTR)r->addr >= end)
+				break;
+			if ((ULONG_PTR)r->addr + r->length > end)
 				continue;
-			if (!memcmp(g_orig[idx], g_addr[idx], g_length[idx])) {
-				memcpy(g_addr[idx], g_our[idx], g_length[idx]);
-				log_hook_restoration(g_funcname[idx]);
+			if (!memcmp(REGION_ORIG(r), r->addr, r->length)) {
+				memcpy(r->addr, REGION_OUR(r), r->length);
+				log_hook_restoration(r->funcname);
 			}
 		}
 	}
@@ -92,20 +215,126 @@ void restore_hooks_on_range(ULONG_PTR start, ULONG_PTR end)
 		;
 	}
 
+	LeaveCriticalSection(&g_unhook_lock);
+
 	set_lasterrors(&lasterror);
 }
 
+// called on protection changes of our own memory, if a hooked page is
+// involved someone may be about to modify our hooks
+void unhook_detect_protect(ULONG_PTR start, ULONG_PTR end)
+{
+	uint32_t idx;
+	int hooked;
+
+	unhook_init_lock();
+	EnterCriticalSection(&g_unhook_lock);
+	idx = find_region(start & ~(ULONG_PTR)(UNHOOK_PAGE_SIZE - 1));
+	hooked = idx < g_region_count && (ULONG_PTR)g_regions[idx].addr < end;
+	LeaveCriticalSection(&g_unhook_lock);
+
+	if (hooked) {
+		InterlockedExchange(&g_poll_interval, UNHOOK_POLL_MIN);
+		if (g_unhook_wake_event != NULL)
+			SetEvent(g_unhook_wake_event);
+	}
+}
+
+// compares the regions of a page whose hash changed, returns 1 if any of
+// them differs from what we made it
+static int check_page_regions(unhook_page_t *page)
+{
+	unhook_region_t *r;
+	uint32_t idx;
+	int changed = 0;
+
+	for (idx = page->first; idx < page->first + page->count; idx++) {
+		r = &g_regions[idx];
+		if (r->reported != 0)
+			continue;
+
+		// Check whether this memory region still equals what we made it.
+		if (!memcmp(r->addr, REGION_OUR(r), r->length))
+			continue;
+
+		changed = 1;
+		if (is_shutting_down() == 0) {
+			// If the memory region matches the original contents, then it
+			// has been restored to its original state.
+			if (!memcmp(REGION_ORIG(r), r->addr, r->length))
+				log_hook_removal(r->funcname);
+			else {
+				char *tmpbuf = malloc(r->length);
+				if (tmpbuf != NULL) {
+					memcpy(tmpbuf, r->addr, r->length);
+					log_hook_modification(r->funcname, REGION_OUR(r), tmpbuf, r->length);
+					free(tmpbuf);
+				}
+			}
+		}
+		r->reported = 1;
+	}
+	return changed;
+}
+
+// returns 1 if any hooked region changed since the last poll
+static int poll_pages(void)
+{
+	unhook_page_t *page;
+	unhook_region_t *last;
+	uint32_t idx, i, hash;
+	int changed = 0;
+
+	EnterCriticalSection(&g_unhook_lock);
+
+	if (g_pages_dirty)
+		rebuild_pages();
+
+	for (i = 0; i < g_page_count; i++) {
+		page = &g_pages[i];
+		last = &g_regions[page->first + page->count - 1];
+		// one query for all regions of the page, the last one may cross
+		// into the next page
+		if (!is_valid_address_range((ULONG_PTR)g_regions[page->first].addr,
+			(DWORD)((ULONG_PTR)last->addr + last->length - (ULONG_PTR)g_regions[page->first].addr)))
+			continue;
+
+		__try {
+			hash = 2166136261;
+			for (idx = page->first; idx < page->first + page->count; idx++)
+				hash = hash_bytes(hash, g_regions[idx].addr, g_regions[idx].length);
+			if (hash != page->hash) {
+				page->hash = hash;
+				changed |= check_page_regions(page);
+			}
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			// cuckoo currently has no handling for FreeLibrary, so if a hooked DLL ends up
+			// being unloaded we would crash in the code above
+			;
+		}
+	}
+
+	LeaveCriticalSection(&g_unhook_lock);
+	return changed;
+}
 
 static DWORD WINAPI _unhook_detect_thread(LPVOID param)
 {
     static int watcher_first = 1;
-	uint32_t idx;
+	HANDLE handles[2];
+	DWORD wait;
+	LONG interval, before;
 
     hook_disable();
 
+	handles[0] = g_watcher_thread_handle;
+	handles[1] = g_unhook_wake_event;
+
     while (1) {
-        if(WaitForSingleObject(g_watcher_thread_handle,
-                500) != WAIT_TIMEOUT) {
+		wait = WaitForMultipleObjects(g_unhook_wake_event != NULL ? 2 : 1, handles, FALSE,
+			g_poll_interval);
+        if(wait == WAIT_OBJECT_0 || wait == WAIT_FAILED) {
             if(watcher_first != 0) {
                 if(is_shutting_down() == 0) {
                     log_anomaly("unhook", 1, NULL,
@@ -116,46 +345,14 @@ static DWORD WINAPI _unhook_detect_thread(LPVOID param)
             raw_sleep(100);
         }
 
-		for (idx = 0; idx < g_index; idx++) {
-			if (g_hook_reported[idx] == 0) {
-				char *tmpbuf = NULL;
-				if (!is_valid_address_range((ULONG_PTR)g_addr[idx], g_length[idx])) {
-					continue;
-				}
-				__try {
-					int is_modification = 1;
-					// Check whether this memory region still equals what we made it.
-					if (!memcmp(g_addr[idx], g_our[idx], g_length[idx])) {
-						continue;
-					}
-
-					// If the memory region matches the original contents, then it
-					// has been restored to its original state.
-					if (!memcmp(g_orig[idx], g_addr[idx], g_length[idx]))
-						is_modification = 0;
-
-					if (is_shutting_down() == 0) {
-						if (is_modification) {
-							char *tmpbuf2;
-							tmpbuf2 = tmpbuf = malloc(g_length[idx]);
-							memcpy(tmpbuf, g_addr[idx], g_length[idx]);
-							log_hook_modification(g_funcname[idx], g_our[idx], tmpbuf, g_length[idx]);
-							tmpbuf = NULL;
-							free(tmpbuf2);
-						} 
-						else
-							log_hook_removal(g_funcname[idx]);
-					}
-					g_hook_reported[idx] = 1;
-				}
-				__except (EXCEPTION_EXECUTE_HANDLER) {
-					// cuckoo currently has no handling for FreeLibrary, so if a hooked DLL ends up
-					// being unloaded we would crash in the code above
-					if (tmpbuf)
-						free(tmpbuf);
-				}
-			}
-		}
+		// back off while nothing changes, unless unhook_detect_protect()
+		// asked for a quick poll in the meantime
+		before = interval = g_poll_interval;
+		if (poll_pages())
+			interval = UNHOOK_POLL_MIN;
+		else
+			interval = MIN(interval * 2, UNHOOK_POLL_MAX);
+		InterlockedCompareExchange(&g_poll_interval, interval, before);
 	}
 
     return 0;
@@ -176,6 +373,9 @@ static DWORD WINAPI _unhook_watch_thread(LPVOID param)
 
 int unhook_init_detection()
 {
+	unhook_init_lock();
+	g_unhook_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
     g_unhook_thread_handle =
         CreateThread(NULL, 0, &_unhook_detect_thread, NULL, 0, NULL);
 